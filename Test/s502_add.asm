@@ -2,7 +2,7 @@
 
 start:
     clc
-    lda   #$10000                  ; LOAD 0 into Accumulator
+    lda   #$00                     ; LOAD 0 into Accumulator
     ; This is also a commented line
     adc   $0360
     adc   $0361
@@ -0,0 +1,35 @@
+; Interval timer regression ROM for mosconform, needs a timer mapped at $D000
+;
+; Restarts the timer and reads its count back a known number of cycles later,
+; 256 times so the cache and the recompiler take the loop over. Device reads
+; and stores made from a cached or native block must see the cycle count of
+; their own instruction, not the one the block started at. The timer counts
+; down from the latch once the high byte is stored, a read sees the cycles
+; left after its own instruction.
+; Traps at `pass` ($0800) when every read matches, at `fail` otherwise.
+;
+; Conformance manifest line: build/s502_timer.bin 400 400 800 1000000 D000
+
+.org $0400
+start:  cld
+        ldx #0
+loop:   lda #$FF
+        sta $D000                       ; latch low byte
+        sta $D001                       ; latch high byte, count $FFFF from here
+        nop
+        lda $D000                       ; 6 cycles in
+        cmp #$F9
+        bne fail
+        nop
+        nop
+        nop
+        lda $D000                       ; 20 cycles in
+        cmp #$EB
+        bne fail
+        inx
+        bne loop
+        jmp pass
+fail:   jmp fail
+
+.org $0800
+pass:   jmp pass
@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "./mos.h"
 
 void mos_uint16_t_to_bytes(uint16_t sixteen_bit, uint8_t *high_byte, uint8_t *low_byte)
@@ -12,16 +14,41 @@ uint16_t mos_bytes_to_uint16_t(uint8_t a, uint8_t b)
     return (a << 8) | b;
 }
 
+static void mos_cpu_select_variant(MOS_Cpu *cpu, MOS_Variant variant);
+
 // DEBUG:
 MOS_Cpu mos_cpu_init(void)
+{
+    return mos_cpu_init_variant(MOS_VARIANT_NMOS);
+}
+
+MOS_Cpu mos_cpu_init_variant(MOS_Variant variant)
 {
     MOS_Cpu cpu = {0};
     cpu.regx = 0; cpu.regy = 0; cpu.racc = 0;
-    cpu.pc = 0;   cpu.psr = U_BIT_FLAG; cpu.sp = 0xFF;
+    cpu.pc = 0;   cpu.sp = 0xFF;
+    mos_cpu_set_psr(&cpu, U_BIT_FLAG);
+    cpu.next_event = UINT64_MAX;
+    mos_cpu_select_variant(&cpu, variant);
     array_new(&cpu.entries);
     return cpu;
 }
 
+void mos_cpu_free(MOS_Cpu *cpu)
+{
+    mos_trace_close(cpu);
+    mos_replay_close(cpu);
+    array_delete(&cpu->entries);
+    free(cpu->cache);
+    cpu->cache = NULL;
+    mos_jit_free(cpu->jit);
+    cpu->jit = NULL;
+    mos_profile_free(cpu->profile);
+    cpu->profile = NULL;
+    mos_cow_free(cpu);
+    mos_scheduler_free(cpu);
+}
+
 uint8_t mos_read_memory(void *device, uint16_t location)
 {
     uint8_t *ram = (uint8_t*)device;
@@ -34,38 +61,144 @@ void mos_write_memory(void *device, uint16_t location, uint8_t data)
     ram[location] = data;
 }
 
-uint8_t mos_cpu_read(MOS_Cpu *cpu, uint16_t addr)
+// Host memory backing `page` of `entry`, NULL when the entry is not plain memory
+static uint8_t *mos_mmap_page_memory(const MOS_MMap *entry, uint8_t page)
 {
-    for (uint8_t i = 0; i < cpu->entries.count; ++i) {
+    if (entry->read == mos_mapper_read) return mos_mapper_page_memory(entry->device, page);
+    if (entry->read != mos_read_memory) return NULL;
+    // mos_read_memory indexes the device with the full 16-bit address
+    return (uint8_t*)entry->device + page*MOS_PAGE_SIZE;
+}
+
+static bool mos_block_cache_holds(const MOS_Cpu *cpu, uint8_t page);
+
+// Rebuilds one page table slot from `entries`, the first entry matching an address wins
+void mos_cpu_map_page(MOS_Cpu *cpu, uint8_t page)
+{
+    MOS_Page *slot = &cpu->pages[page];
+    memset(slot, 0, sizeof(*slot));
+
+    uint16_t first = page*MOS_PAGE_SIZE;
+    uint16_t last  = first + (MOS_PAGE_SIZE - 1);
+    for (uint32_t i = 0; i < cpu->entries.count; ++i) {
         MOS_MMap *entry = &cpu->entries.items[i];
+        if (entry->end_addr < first || entry->start_addr > last) continue;
+
+        // Only an entry covering the whole page owns it, otherwise leave
+        // the page to the scan in the slow path
+        if (entry->start_addr <= first && entry->end_addr >= last) {
+            slot->entry = entry;
+            slot->read  = mos_mmap_page_memory(entry, page);
+            bool plain = entry->write == mos_write_memory || entry->write == mos_mapper_write;
+            if (!entry->readonly && plain) {
+                slot->write = slot->read;
+            }
+        }
+        break;
+    }
+
+    // cached code, pages shared with a snapshot and the trace recorder need to see every store
+    if (cpu->cache != NULL && mos_block_cache_holds(cpu, page)) slot->write = NULL;
+    if (cpu->trace != NULL) slot->write = NULL;
+    if (cpu->cow != NULL) mos_cow_map_page(cpu, page, slot);
+}
+
+// Rebuilds the page table from `entries`
+void mos_cpu_map_pages(MOS_Cpu *cpu)
+{
+    // cached code and snapshot pages may now sit behind different memory
+    if (cpu->cache != NULL) mos_block_cache_flush(cpu);
+    if (cpu->cow != NULL) mos_cow_forget(cpu);
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        mos_cpu_map_page(cpu, page);
+    }
+}
+
+// Registers a memory map and refreshes the page table
+void mos_cpu_map(MOS_Cpu *cpu, MOS_MMap map)
+{
+    assert(map.start_addr <= map.end_addr);
+    array_append(&cpu->entries, map);
+    mos_cpu_map_pages(cpu); // the append may have moved the entries
+}
+
+MOS_MMap *mos_cpu_find_entry(MOS_Cpu *cpu, uint16_t addr)
+{
+    MOS_MMap *entry = cpu->pages[addr >> 8].entry;
+    if (entry != NULL) return entry;
+
+    for (uint32_t i = 0; i < cpu->entries.count; ++i) {
+        entry = &cpu->entries.items[i];
         if (addr >= entry->start_addr && addr <= entry->end_addr) {
-            return entry->read(entry->device, addr);
+            return entry;
         }
     }
+    return NULL;
+}
+
+#ifdef MOS_PROFILE
+static void mos_cpu_profile_access(MOS_Cpu *cpu, uint16_t addr, bool write)
+{
+    if (cpu->profile == NULL) return;
+    MOS_MMap *entry = mos_cpu_find_entry(cpu, addr);
+    mos_profile_access(cpu->profile, entry != NULL ? (uint32_t)(entry - cpu->entries.items) : UINT32_MAX, write);
+}
+#define MOS_PROFILE_ACCESS(cpu, addr, write) mos_cpu_profile_access((cpu), (addr), (write))
+#else
+#define MOS_PROFILE_ACCESS(cpu, addr, write) ((void) 0)
+#endif
+
+uint8_t mos_cpu_read(MOS_Cpu *cpu, uint16_t addr)
+{
+    MOS_PROFILE_ACCESS(cpu, addr, false);
+    const MOS_Page *page = &cpu->pages[addr >> 8];
+    if (page->read != NULL) return page->read[addr & 0xFF];
+
+    MOS_MMap *entry = mos_cpu_find_entry(cpu, addr);
+    if (entry != NULL) {
+        if (cpu->replay != NULL && mos_mmap_is_device(entry)) return mos_replay_read(cpu, entry, addr);
+        return entry->read(entry->device, addr);
+    }
 
     fprintf(stderr, "ERROR: Address Read From Unmapped Memory: 0x%04x\n", addr);
     return 0;
 }
 
+// Records the first fault, the access is dropped and mos_cpu_run stops
+void mos_cpu_fault(MOS_Cpu *cpu, MOS_Fault fault, uint16_t addr)
+{
+    if (cpu->fault != MOS_FAULT_NONE) return;
+    cpu->fault = fault;
+    cpu->fault_addr = addr;
+}
+
 void mos_cpu_write(MOS_Cpu *cpu, uint16_t addr, uint8_t data)
 {
-    for (uint8_t i = 0; i < cpu->entries.count; ++i) {
-        MOS_MMap *entry = &cpu->entries.items[i];
-        if (!entry->readonly) {
-            if (addr >= entry->start_addr && addr <= entry->end_addr) {
-                entry->write(entry->device, addr, data);
-                return; // successful write, return early
-            } else {
-                fprintf(stderr, "ERROR: Address Written to Unmapped Memory: 0x%04x\n", addr);
-                exit(1);
-            }
-        } else {
-            fprintf(stderr, "MOS_Cpu FAULT: Memory Readonly\n");
-            exit(1);
-        }
+    MOS_PROFILE_ACCESS(cpu, addr, true);
+    const MOS_Page *page = &cpu->pages[addr >> 8];
+    if (page->write != NULL) {
+        page->write[addr & 0xFF] = data;
+        return;
+    }
+
+    // pages holding cached blocks or shared with a snapshot have no write
+    // pointer so their writes end up here
+    if (cpu->cow != NULL) mos_cow_touch(cpu, addr >> 8);
+    if (cpu->cache != NULL) mos_block_cache_invalidate(cpu, addr >> 8);
+
+    MOS_MMap *entry = mos_cpu_find_entry(cpu, addr);
+    if (entry == NULL) {
+        mos_cpu_fault(cpu, MOS_FAULT_UNMAPPED_WRITE, addr);
+        return;
     }
-    fprintf(stderr, "ERROR: Address Written to Unmapped Memory: 0x%04x\n", addr);
-    exit(1);
+
+    if (entry->readonly) {
+        mos_cpu_fault(cpu, MOS_FAULT_READONLY_WRITE, addr);
+        return;
+    }
+    if (cpu->trace != NULL) mos_trace_write(cpu->trace, addr, data);
+    if (cpu->replay != NULL && mos_mmap_is_device(entry) && !mos_replay_write(cpu)) return;
+    entry->write(entry->device, addr, data);
 }
 
 void mos_push_stack(MOS_Cpu *cpu, uint8_t value)
@@ -81,16 +214,37 @@ uint8_t mos_pull_stack(MOS_Cpu *cpu)
     return mos_cpu_read(cpu, mos_bytes_to_uint16_t(MOS_STACK_PAGE, cpu->sp));
 }
 
+// NOTE: Build the PSR from the lazily recorded N, Z, C and V
+uint8_t mos_cpu_get_psr(const MOS_Cpu *cpu)
+{
+    uint8_t psr = cpu->psr & ~(N_BIT_FLAG | V_BIT_FLAG | Z_BIT_FLAG | C_BIT_FLAG);
+    psr |= cpu->flag_n & N_BIT_FLAG;
+    psr |= (cpu->flag_v >> 1) & V_BIT_FLAG;
+    if (cpu->flag_z == 0) psr |= Z_BIT_FLAG;
+    psr |= cpu->flag_c & C_BIT_FLAG;
+    return psr;
+}
+
+// NOTE: Load the whole PSR, as PLP and RTI do
+void mos_cpu_set_psr(MOS_Cpu *cpu, uint8_t psr)
+{
+    cpu->psr = psr;
+    cpu->flag_n = psr;
+    cpu->flag_v = psr << 1;
+    cpu->flag_z = !(psr & Z_BIT_FLAG);
+    cpu->flag_c = psr & C_BIT_FLAG;
+}
+
 // NOTE: Set PSR FLAGS
 void mos_set_psr_flags(MOS_Cpu *cpu, MOS_StatusFlags flags)
 {
-    cpu->psr |= flags;
+    mos_cpu_set_psr(cpu, mos_cpu_get_psr(cpu) | flags);
 }
 
 // NOTE: Clear PSR FLAGS
 void mos_clear_psr_flags(MOS_Cpu *cpu, MOS_StatusFlags flags)
 {
-    cpu->psr &= (~flags);
+    mos_cpu_set_psr(cpu, mos_cpu_get_psr(cpu) & ~flags);
 }
 
 uint16_t mos_zero_page(uint16_t location)
@@ -109,14 +263,43 @@ uint16_t mos_zero_page_x(MOS_Cpu *cpu, uint16_t location)
     return mos_bytes_to_uint16_t(high_byte, low_byte + cpu->regx);
 }
 
-uint16_t mos_absolute_x(MOS_Cpu *cpu, uint16_t location)
+// LDX and STX index page zero with Y instead
+uint16_t mos_zero_page_y(MOS_Cpu *cpu, uint16_t location)
 {
-    return location + cpu->regx;
+    uint8_t high_byte, low_byte;
+    mos_uint16_t_to_bytes(location, &high_byte, &low_byte);
+    MOS_ASSERT(high_byte == 0x00 , "Invalid Page Zero Address");
+    return mos_bytes_to_uint16_t(high_byte, low_byte + cpu->regy);
+}
+
+// JMP ($xxFF) fetches the high-byte from $xx00, the page never carries
+uint16_t mos_indirect(MOS_Cpu *cpu, uint16_t location)
+{
+    uint8_t high_byte, low_byte;
+    mos_uint16_t_to_bytes(location, &high_byte, &low_byte);
+    uint16_t next = mos_bytes_to_uint16_t(high_byte, low_byte + 1);
+    return mos_bytes_to_uint16_t(mos_cpu_read(cpu, next), mos_cpu_read(cpu, location));
+}
+
+// Extra cycle when indexing carries the address into the next page
+static inline uint8_t mos_page_crossed(uint16_t base, uint16_t addr)
+{
+    return (base ^ addr) > 0xFF;
 }
 
-uint16_t mos_absolute_y(MOS_Cpu *cpu, uint16_t location)
+// `penalty` is set for reads, stores and read-modify-write always pay the fix-up cycle
+uint16_t mos_absolute_x(MOS_Cpu *cpu, uint16_t location, bool penalty)
 {
-    return location + cpu->regy;
+    uint16_t addr = location + cpu->regx;
+    if (penalty) cpu->cycles += mos_page_crossed(location, addr);
+    return addr;
+}
+
+uint16_t mos_absolute_y(MOS_Cpu *cpu, uint16_t location, bool penalty)
+{
+    uint16_t addr = location + cpu->regy;
+    if (penalty) cpu->cycles += mos_page_crossed(location, addr);
+    return addr;
 }
 
 uint16_t mos_indirect_x(MOS_Cpu *cpu, uint16_t location)
@@ -131,7 +314,7 @@ uint16_t mos_indirect_x(MOS_Cpu *cpu, uint16_t location)
     return mos_bytes_to_uint16_t(mos_cpu_read(cpu, new_loc_i), mos_cpu_read(cpu, new_loc));
 }
 
-uint16_t mos_indirect_y(MOS_Cpu *cpu, uint16_t location)
+uint16_t mos_indirect_y(MOS_Cpu *cpu, uint16_t location, bool penalty)
 {
     uint8_t high_byte, low_byte;
     mos_uint16_t_to_bytes(location, &high_byte, &low_byte);
@@ -140,7 +323,9 @@ uint16_t mos_indirect_y(MOS_Cpu *cpu, uint16_t location)
     uint8_t offset = mos_cpu_read(cpu, location);   // fetch low-byte from location
     uint8_t page =   mos_cpu_read(cpu, new_loc); // fetch high-byte from location + 1
     uint16_t base_addr = mos_bytes_to_uint16_t(page, offset);
-    return base_addr + cpu->regy; // final address
+    uint16_t addr = base_addr + cpu->regy; // final address
+    if (penalty) cpu->cycles += mos_page_crossed(base_addr, addr);
+    return addr;
 }
 
 // Returns data for read opcodes
@@ -183,6 +368,18 @@ uint8_t mos_fetch_operand_data(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_Opera
         }
     } break;
 
+    case ZPY: {
+        // same as zero page X with the Y reg, only LDX uses it
+        switch (operand.type) {
+        case OPERAND_ADDRESS: {
+            uint16_t new_loc = mos_zero_page_y(cpu, operand.data.address);
+            return mos_cpu_read(cpu, new_loc);
+        }
+        case OPERAND_DATA:
+        default: MOS_ILLEGAL_ACCESS(mode, operand.type);
+        }
+    } break;
+
     case ABS: {
         // uses the absolute location in operand to load access memory into accumulator
         switch (operand.type) {
@@ -198,7 +395,7 @@ uint8_t mos_fetch_operand_data(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_Opera
         // absolute but += X reg
         switch (operand.type) {
         case OPERAND_ADDRESS: {
-            uint16_t index = mos_absolute_x(cpu, operand.data.address);
+            uint16_t index = mos_absolute_x(cpu, operand.data.address, true);
             return mos_cpu_read(cpu, index);
         }
         case OPERAND_DATA:
@@ -210,7 +407,7 @@ uint8_t mos_fetch_operand_data(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_Opera
         // absolute but += Y reg
         switch (operand.type) {
         case OPERAND_ADDRESS: {
-            uint16_t index = mos_absolute_y(cpu, operand.data.address);
+            uint16_t index = mos_absolute_y(cpu, operand.data.address, true);
             return mos_cpu_read(cpu, index);
         }
         case OPERAND_DATA:
@@ -237,7 +434,7 @@ uint8_t mos_fetch_operand_data(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_Opera
         // same as index indirect but the addition of the Y reg occurs in the final address
         switch (operand.type) {
         case OPERAND_ADDRESS: {
-            uint16_t final_location = mos_indirect_y(cpu, operand.data.address);
+            uint16_t final_location = mos_indirect_y(cpu, operand.data.address, true);
             return mos_cpu_read(cpu, final_location);
         }
         case OPERAND_DATA:
@@ -268,8 +465,9 @@ uint8_t mos_fetch_operand_data(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_Opera
     } break;
 
     case IMPL:
-    case ZPY:
     case IND:
+    case ZPI:
+    case ABXI:
     default:
         MOS_ILLEGAL_ADDRESSING(mode, ERROR_FETCH_DATA);
     }
@@ -303,6 +501,17 @@ uint16_t mos_fetch_operand_location(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_
         }
     } break;
 
+    case ZPY: {
+        // same as zero page X with the Y reg, only STX uses it
+        switch (operand.type) {
+        case OPERAND_ADDRESS: {
+            return mos_zero_page_y(cpu, operand.data.address);
+        }
+        case OPERAND_DATA:
+        default: MOS_ILLEGAL_ACCESS(mode, operand.type);
+        }
+    } break;
+
     case ABS: {
         // uses the absolute location in operand to load memory into accumulator
         switch (operand.type) {
@@ -318,7 +527,7 @@ uint16_t mos_fetch_operand_location(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_
         // absolute but += X reg
         switch (operand.type) {
         case OPERAND_ADDRESS: {
-            return mos_absolute_x(cpu, operand.data.address);
+            return mos_absolute_x(cpu, operand.data.address, false);
         }
         case OPERAND_DATA:
         default: MOS_ILLEGAL_ACCESS(mode, operand.type);
@@ -329,7 +538,7 @@ uint16_t mos_fetch_operand_location(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_
         // absolute but += Y reg
         switch (operand.type) {
         case OPERAND_ADDRESS: {
-            return mos_absolute_y(cpu, operand.data.address);
+            return mos_absolute_y(cpu, operand.data.address, false);
         }
         case OPERAND_DATA:
         default: MOS_ILLEGAL_ACCESS(mode, operand.type);
@@ -355,7 +564,18 @@ uint16_t mos_fetch_operand_location(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_
         switch (operand.type) {
         case OPERAND_ADDRESS: {
             uint16_t location = operand.data.address;
-            return mos_indirect_y(cpu, location);
+            return mos_indirect_y(cpu, location, false);
+        }
+        case OPERAND_DATA:
+        default: MOS_ILLEGAL_ACCESS(mode, operand.type);
+        }
+    } break;
+
+    case IND: {
+        // only JMP uses it, the location read from the operand is the jump target
+        switch (operand.type) {
+        case OPERAND_ADDRESS: {
+            return mos_indirect(cpu, operand.data.address);
         }
         case OPERAND_DATA:
         default: MOS_ILLEGAL_ACCESS(mode, operand.type);
@@ -366,20 +586,206 @@ uint16_t mos_fetch_operand_location(MOS_Cpu *cpu, MOS_AddressingModes mode, MOS_
     case IMME:
     case IMPL:
     case ACCU:
-    case ZPY:
-    case IND:
+    case ZPI:
+    case ABXI:
     default: MOS_ILLEGAL_ADDRESSING(mode, ERROR_FETCH_LOCATION);
     }
     MOS_UNREACHABLE("mos_fetch_operand_location");
 }
 
+// NOTE: ALU primitives shared by mos_decode and the dispatch table handlers.
+// They work on an already fetched value, so addressing stays with the caller.
+
+// Z , N = value, only the result is recorded and psr is built when read
+static inline uint8_t mos_update_nz(MOS_Cpu *cpu, uint8_t value)
+{
+    cpu->flag_n = cpu->flag_z = value;
+    return value;
+}
+
+// Current value of one status flag without building the whole psr
+static inline bool mos_test_flag(const MOS_Cpu *cpu, MOS_StatusFlags flag)
+{
+    if (flag == N_BIT_FLAG) return cpu->flag_n & N_BIT_FLAG;
+    if (flag == V_BIT_FLAG) return cpu->flag_v & N_BIT_FLAG;
+    if (flag == Z_BIT_FLAG) return cpu->flag_z == 0;
+    if (flag == C_BIT_FLAG) return cpu->flag_c;
+    return cpu->psr & flag;
+}
+
+// NOTE: Decimal mode
+//
+// With D set ADC and SBC work on packed BCD. Every (carry, A, M) is looked up
+// in a table built once by mos_decimal_build, an entry holds the result in
+// its low byte and N, V, Z and C in their psr positions in the high byte.
+// The NMOS chip only fixes up the result: Z still comes from the binary sum,
+// N and V from the sum before the high nibble is adjusted, SBC flags are the
+// binary ones. The 65C02 sets N and Z from the result and takes a cycle more.
+// Invalid BCD digits give what the chips give, following Bruce Clark's notes.
+#define MOS_DECIMAL_ENTRIES 0x20000 // carry:1 A:8 M:8
+
+typedef enum _mos_decimal_table {
+    MOS_DECIMAL_NMOS_ADC,
+    MOS_DECIMAL_NMOS_SBC,
+    MOS_DECIMAL_65C02_ADC,
+    MOS_DECIMAL_65C02_SBC,
+    MOS_DECIMAL_TABLES,
+} MOS_DecimalTable;
+
+static uint16_t mos_decimal_tables[MOS_DECIMAL_TABLES][MOS_DECIMAL_ENTRIES];
+static pthread_once_t mos_decimal_once = PTHREAD_ONCE_INIT;
+
+static uint16_t mos_decimal_entry(uint8_t result, bool n, bool v, bool z, bool c)
+{
+    uint8_t flags = (n ? N_BIT_FLAG : 0) | (v ? V_BIT_FLAG : 0) | (z ? Z_BIT_FLAG : 0) | (c ? C_BIT_FLAG : 0);
+    return flags << 8 | result;
+}
+
+static void mos_decimal_build(void)
+{
+    for (uint32_t index = 0; index < MOS_DECIMAL_ENTRIES; ++index) {
+        int32_t c = index >> 16, a = (index >> 8) & 0xFF, m = index & 0xFF;
+
+        // ADC fixes the low nibble, N and V see the sum before the high one is fixed
+        int32_t low = (a & 0x0F) + (m & 0x0F) + c;
+        if (low >= 0x0A) low = ((low + 0x06) & 0x0F) + 0x10;
+        int32_t sum = (a & 0xF0) + (m & 0xF0) + low;
+        int32_t signed_sum = (int8_t)(a & 0xF0) + (int8_t)(m & 0xF0) + low;
+        bool v = signed_sum < -128 || signed_sum > 127;
+        if (sum >= 0xA0) sum += 0x60;
+        uint8_t result = sum;
+        mos_decimal_tables[MOS_DECIMAL_NMOS_ADC][index] =
+            mos_decimal_entry(result, signed_sum & 0x80, v, ((a + m + c) & 0xFF) == 0, sum >= 0x100);
+        mos_decimal_tables[MOS_DECIMAL_65C02_ADC][index] =
+            mos_decimal_entry(result, result & 0x80, v, result == 0, sum >= 0x100);
+
+        // SBC flags are the binary ones, only A is adjusted
+        int32_t binary = a - m - (1 - c);
+        uint8_t difference = binary;
+        bool borrow = binary < 0;
+        v = ((a ^ m) & (a ^ difference)) & 0x80;
+
+        low = (a & 0x0F) - (m & 0x0F) - (1 - c);
+        int32_t nmos = low < 0 ? (((low - 0x06) & 0x0F) - 0x10) : low;
+        nmos += (a & 0xF0) - (m & 0xF0);
+        if (nmos < 0) nmos -= 0x60;
+        mos_decimal_tables[MOS_DECIMAL_NMOS_SBC][index] =
+            mos_decimal_entry(nmos, difference & 0x80, v, difference == 0, !borrow);
+
+        int32_t cmos = binary;
+        if (cmos < 0) cmos -= 0x60;
+        if (low < 0) cmos -= 0x06;
+        result = cmos;
+        mos_decimal_tables[MOS_DECIMAL_65C02_SBC][index] =
+            mos_decimal_entry(result, result & 0x80, v, result == 0, !borrow);
+    }
+}
+
+static inline void mos_alu_decimal(MOS_Cpu *cpu, MOS_DecimalTable table, uint8_t data)
+{
+    if (cpu->variant == MOS_VARIANT_65C02) {
+        table += MOS_DECIMAL_65C02_ADC;
+        cpu->cycles++;
+    }
+    uint16_t entry = mos_decimal_tables[table][cpu->flag_c << 16 | cpu->racc << 8 | data];
+    uint8_t flags = entry >> 8;
+    cpu->racc = entry & 0xFF;
+    cpu->flag_n = flags;
+    cpu->flag_z = !(flags & Z_BIT_FLAG);
+    cpu->flag_c = flags & C_BIT_FLAG;
+    cpu->flag_v = flags << 1;
+}
+
+static inline void mos_alu_adc(MOS_Cpu *cpu, uint8_t data)
+{
+    if (cpu->psr & D_BIT_FLAG) {
+        mos_alu_decimal(cpu, MOS_DECIMAL_NMOS_ADC, data);
+        return;
+    }
+    uint16_t raw = data + cpu->racc + cpu->flag_c;
+    uint8_t result = (uint8_t) raw;
+
+    cpu->flag_c = raw >> 8;
+    cpu->flag_v = ~(cpu->racc ^ data) & (cpu->racc ^ result); // bit 7 set on signed overflow
+    cpu->racc = mos_update_nz(cpu, result);
+}
+
+// A - M - !C is A + ~M + C, borrow is the inverted carry
+static inline void mos_alu_sbc(MOS_Cpu *cpu, uint8_t data)
+{
+    if (cpu->psr & D_BIT_FLAG) {
+        mos_alu_decimal(cpu, MOS_DECIMAL_NMOS_SBC, data);
+        return;
+    }
+    mos_alu_adc(cpu, (uint8_t) ~data);
+}
+
+static inline void mos_alu_compare(MOS_Cpu *cpu, uint8_t reg_type, uint8_t data)
+{
+    cpu->flag_c = reg_type >= data;
+    mos_update_nz(cpu, reg_type - data);
+}
+
+// N and V are bits 7 and 6 of memory, Z comes from A & M
+static inline void mos_alu_bit(MOS_Cpu *cpu, uint8_t data)
+{
+    cpu->flag_n = data;
+    cpu->flag_v = data << 1;
+    cpu->flag_z = cpu->racc & data;
+}
+
+static inline uint8_t mos_alu_asl(MOS_Cpu *cpu, uint8_t data)
+{
+    cpu->flag_c = data >> 7; // Set to the contents of old bit 7 (neg bit)
+    return mos_update_nz(cpu, data << 1); // mult
+}
+
+static inline uint8_t mos_alu_lsr(MOS_Cpu *cpu, uint8_t data)
+{
+    cpu->flag_c = data & C_BIT_FLAG; // Set to the contents of old bit 0
+    return mos_update_nz(cpu, data >> 1); // div
+}
+
+// the old carry rotates into bit 0
+static inline uint8_t mos_alu_rol(MOS_Cpu *cpu, uint8_t data)
+{
+    uint8_t carry = cpu->flag_c;
+    cpu->flag_c = data >> 7; // Set to the contents of old bit 7 (neg bit)
+    return mos_update_nz(cpu, (data << 1) | carry);
+}
+
+// the old carry rotates into bit 7
+static inline uint8_t mos_alu_ror(MOS_Cpu *cpu, uint8_t data)
+{
+    uint8_t carry = cpu->flag_c;
+    cpu->flag_c = data & C_BIT_FLAG; // Set to the contents of old bit 0 (carry bit)
+    return mos_update_nz(cpu, (data >> 1) | (carry << 7));
+}
+
+static inline uint8_t mos_alu_inc(MOS_Cpu *cpu, uint8_t data)
+{
+    return mos_update_nz(cpu, data + 1);
+}
+
+static inline uint8_t mos_alu_dec(MOS_Cpu *cpu, uint8_t data)
+{
+    return mos_update_nz(cpu, data - 1);
+}
+
+// the offset is a signed displacement from the next instruction,
+// a taken branch costs one cycle more and another one across a page
+static inline void mos_branch(MOS_Cpu *cpu, bool taken, uint8_t offset)
+{
+    if (!taken) return;
+    uint16_t target = cpu->pc + (int8_t) offset;
+    cpu->cycles += 1 + mos_page_crossed(cpu->pc, target);
+    cpu->pc = target;
+}
+
 // Reg , Z , N = M, memory into Reg
 void mos_load_reg(MOS_Cpu *cpu, MOS_Instruction instruction, uint8_t *reg_type)
 {
-    *reg_type = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (*reg_type == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (*reg_type & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    *reg_type = mos_update_nz(cpu, mos_fetch_operand_data(cpu, instruction.mode, instruction.operand));
 }
 
 // M = A | X | Y, store A | X | Y into memory
@@ -392,78 +798,34 @@ void mos_store_reg(MOS_Cpu *cpu, MOS_Instruction instruction, uint8_t data)
 // A = X | Y, transfer X | Y to A, TXA | TYA
 void mos_transfer_reg_to_accumulator(MOS_Cpu *cpu, uint8_t data)
 {
-    cpu->racc = data;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->racc == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (cpu->racc & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    cpu->racc = mos_update_nz(cpu, data);
 }
 
 // X | Y = A, transfer Accumulator to X | Y, TAX | TAY
 void mos_transfer_accumulator_to_reg(MOS_Cpu *cpu, uint8_t *reg_type)
 {
-    *reg_type = cpu->racc;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (*reg_type == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (*reg_type & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    *reg_type = mos_update_nz(cpu, cpu->racc);
 }
 
 void mos_add_with_carry(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint16_t raw = data + cpu->racc + (cpu->psr & C_BIT_FLAG);
-    uint8_t result = (uint8_t) raw;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG | C_BIT_FLAG | V_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    if (raw > UINT8_MAX) mos_set_psr_flags(cpu, C_BIT_FLAG);
-    if (~(cpu->racc ^ data) & (cpu->racc ^ result) & 0x80) {
-        mos_set_psr_flags(cpu, V_BIT_FLAG);
-    }
-    cpu->racc = result;
+    mos_alu_adc(cpu, mos_fetch_operand_data(cpu, instruction.mode, instruction.operand));
 }
 
 void mos_sub_with_carry(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint16_t raw = cpu->racc + (~data) + (cpu->psr & C_BIT_FLAG);
-    uint8_t result = (uint8_t) raw;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG | C_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    if (raw > UINT8_MAX) mos_set_psr_flags(cpu, C_BIT_FLAG);
-
-    // NOTE: N_BIT_FLAG = 0x80
-    uint8_t sign_a = cpu->racc & N_BIT_FLAG;
-    uint8_t sign_data_inverted = (~data) & N_BIT_FLAG;
-    uint8_t sign_result = result & N_BIT_FLAG;
-
-    if ((sign_a == sign_data_inverted) & (sign_a != sign_result)) {
-        mos_set_psr_flags(cpu, V_BIT_FLAG);
-    } else {
-        mos_clear_psr_flags(cpu, V_BIT_FLAG);
-    }
-    cpu->racc = result;
+    mos_alu_sbc(cpu, mos_fetch_operand_data(cpu, instruction.mode, instruction.operand));
 }
 
 void mos_compare_reg_with_data(MOS_Cpu *cpu, MOS_Instruction instruction, uint8_t reg_type)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint16_t result = reg_type - data;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | C_BIT_FLAG | N_BIT_FLAG);
-    if (reg_type == data) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (reg_type >= data) mos_set_psr_flags(cpu, C_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    mos_alu_compare(cpu, reg_type, mos_fetch_operand_data(cpu, instruction.mode, instruction.operand));
 }
 
+// X = SP, TSX copies the stack pointer itself
 void mos_transfer_stack_to_reg(MOS_Cpu *cpu, uint8_t *data)
 {
-    *data = mos_cpu_read(cpu, mos_bytes_to_uint16_t(MOS_STACK_PAGE, cpu->sp));
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (*data == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (*data & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    *data = mos_update_nz(cpu, cpu->sp);
 }
 
 // A | SR
@@ -472,226 +834,266 @@ void mos_push_reg_to_stack(MOS_Cpu *cpu, uint8_t reg_type)
     mos_push_stack(cpu, reg_type);
 }
 
-// A or SR
+// A, Z , N = pulled value, PLP goes through mos_pull_status
 void mos_pull_reg_from_stack(MOS_Cpu *cpu, uint8_t *reg_type)
 {
-    *reg_type = mos_pull_stack(cpu);
+    *reg_type = mos_update_nz(cpu, mos_pull_stack(cpu));
+}
+
+// PHP always pushes the break and unused bits set
+void mos_push_status(MOS_Cpu *cpu)
+{
+    mos_push_stack(cpu, mos_cpu_get_psr(cpu) | B_BIT_FLAG | U_BIT_FLAG);
+}
+
+// PLP never loads the break bit
+void mos_pull_status(MOS_Cpu *cpu)
+{
+    mos_cpu_set_psr(cpu, (mos_pull_stack(cpu) & ~B_BIT_FLAG) | U_BIT_FLAG);
 }
 
 void mos_logical_and(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
     uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = cpu->racc & data;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_update_nz(cpu, cpu->racc & data);
 }
 
 void mos_logical_xor(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
     uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = cpu->racc ^ data;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_update_nz(cpu, cpu->racc ^ data);
 }
 
 void mos_logical_or(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
     uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = cpu->racc | data;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_update_nz(cpu, cpu->racc | data);
 }
 
 void mos_bit_test(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = cpu->racc & data;
-
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG | V_BIT_FLAG);
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (data & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    if (data & V_BIT_FLAG) mos_set_psr_flags(cpu, V_BIT_FLAG);
+    mos_alu_bit(cpu, mos_fetch_operand_data(cpu, instruction.mode, instruction.operand));
 }
 
+// BNE, BCC, BPL, BVC: branch when `flag` is clear
 void mos_branch_flag_clear(MOS_Cpu *cpu, MOS_Instruction instruction, MOS_StatusFlags flag)
 {
     uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    if (cpu->psr & flag) {
-        cpu->pc += data;
-    }
+    mos_branch(cpu, !mos_test_flag(cpu, flag), data);
 }
 
+// BEQ, BCS, BMI, BVS: branch when `flag` is set
 void mos_branch_flag_set(MOS_Cpu *cpu, MOS_Instruction instruction, MOS_StatusFlags flag)
 {
     uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    if (!(cpu->psr & flag)) {
-        cpu->pc += data;
-    }
+    mos_branch(cpu, mos_test_flag(cpu, flag), data);
 }
 
 void mos_decrement_regx(MOS_Cpu *cpu)
 {
-    cpu->regx--;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->regx == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (cpu->regx & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    cpu->regx = mos_alu_dec(cpu, cpu->regx);
 }
 
 void mos_decrement_regy(MOS_Cpu *cpu)
 {
-    cpu->regy--;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->regy == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (cpu->regy & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    cpu->regy = mos_alu_dec(cpu, cpu->regy);
 }
 
 void mos_decrement(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    uint8_t data = mos_cpu_read(cpu, loc);
-    mos_cpu_write(cpu, loc, --data); // Decrement
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (data == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (data & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    mos_cpu_write(cpu, loc, mos_alu_dec(cpu, mos_cpu_read(cpu, loc))); // Decrement
 }
 
 void mos_increment_regx(MOS_Cpu *cpu)
 {
-    cpu->regx++;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->regx == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (cpu->regx & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    cpu->regx = mos_alu_inc(cpu, cpu->regx);
 }
 
 void mos_increment_regy(MOS_Cpu *cpu)
 {
-    cpu->regy++;
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->regy == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (cpu->regy & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    cpu->regy = mos_alu_inc(cpu, cpu->regy);
 }
 
 void mos_increment(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    uint8_t data = mos_cpu_read(cpu, loc);
-    mos_cpu_write(cpu, loc, ++data); // Increment
-    mos_clear_psr_flags(cpu, Z_BIT_FLAG | N_BIT_FLAG);
-    if (data == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (data & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
+    mos_cpu_write(cpu, loc, mos_alu_inc(cpu, mos_cpu_read(cpu, loc))); // Increment
 }
 
 // asl on accumulator
 void mos_arithmetic_shift_left_racc(MOS_Cpu *cpu)
 {
-    uint8_t result = cpu->racc << 1; // mult
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->racc & N_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 7 (neg bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_alu_asl(cpu, cpu->racc);
 }
 
 // asl on memory
 void mos_arithmetic_shift_left_memory(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = data << 1; // mult
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (data & N_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 7 (neg bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    mos_cpu_write(cpu, loc, result);
+    mos_cpu_write(cpu, loc, mos_alu_asl(cpu, mos_cpu_read(cpu, loc)));
 }
 
 void mos_logical_shift_right_racc(MOS_Cpu *cpu)
 {
-    uint8_t result = cpu->racc >> 1; // div
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->racc & C_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 0
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_alu_lsr(cpu, cpu->racc);
 }
 
 void mos_logical_shift_right_memory(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = data >> 1; // div
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (data & C_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 0 (carry bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    mos_cpu_write(cpu, loc, result);
+    mos_cpu_write(cpu, loc, mos_alu_lsr(cpu, mos_cpu_read(cpu, loc)));
 }
 
 void mos_rotate_left_racc(MOS_Cpu *cpu)
 {
-    uint8_t result = cpu->racc << 1;
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->racc & N_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 7 (neg bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_alu_rol(cpu, cpu->racc);
 }
 
 void mos_rotate_left_memory(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = data << 1;
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (data & N_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 7 (neg bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    mos_cpu_write(cpu, loc, result);
+    mos_cpu_write(cpu, loc, mos_alu_rol(cpu, mos_cpu_read(cpu, loc)));
 }
 
 void mos_rotate_right_racc(MOS_Cpu *cpu)
 {
-    uint8_t result = cpu->racc >> 1;
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (cpu->racc & C_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 0 (carry bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
-    cpu->racc = result;
+    cpu->racc = mos_alu_ror(cpu, cpu->racc);
 }
 
 void mos_rotate_right_memory(MOS_Cpu *cpu, MOS_Instruction instruction)
 {
-    uint8_t data = mos_fetch_operand_data(cpu, instruction.mode, instruction.operand);
-    uint8_t result = data >> 1;
-    mos_clear_psr_flags(cpu, C_BIT_FLAG | Z_BIT_FLAG | N_BIT_FLAG);
-    if (data & C_BIT_FLAG) mos_set_psr_flags(cpu, C_BIT_FLAG); // Set to the contents of old bit 0 (carry bit)
-    if (result == 0) mos_set_psr_flags(cpu, Z_BIT_FLAG);
-    if (result & N_BIT_FLAG) mos_set_psr_flags(cpu, N_BIT_FLAG);
     uint16_t loc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
-    mos_cpu_write(cpu, loc, result);
+    mos_cpu_write(cpu, loc, mos_alu_ror(cpu, mos_cpu_read(cpu, loc)));
+}
+
+static uint16_t mos_read_vector(MOS_Cpu *cpu, uint16_t vector)
+{
+    uint8_t low_byte = mos_cpu_read(cpu, vector);
+    uint8_t high_byte = mos_cpu_read(cpu, vector + 1);
+    return mos_bytes_to_uint16_t(high_byte, low_byte);
+}
+
+// Pushes the pc high-byte, low-byte then the psr, with the break bit only
+// for BRK, and jumps through `vector` with interrupts disabled (and decimal
+// mode cleared on the 65C02)
+static void mos_interrupt_enter(MOS_Cpu *cpu, uint16_t return_pc, uint16_t vector, bool brk)
+{
+    mos_push_stack(cpu, return_pc >> 8);
+    mos_push_stack(cpu, return_pc & 0xFF);
+    mos_push_stack(cpu, mos_cpu_get_psr(cpu) | U_BIT_FLAG | (brk ? B_BIT_FLAG : 0));
+    mos_set_psr_flags(cpu, I_BIT_FLAG);
+    if (cpu->variant == MOS_VARIANT_65C02) mos_clear_psr_flags(cpu, D_BIT_FLAG);
+    cpu->pc = mos_read_vector(cpu, vector);
 }
 
+// pc is already past the opcode, BRK also skips the padding byte after it
 void mos_break(MOS_Cpu *cpu)
 {
-    mos_clear_psr_flags(cpu, B_BIT_FLAG);
-    mos_set_psr_flags(cpu, B_BIT_FLAG);
+    mos_interrupt_enter(cpu, cpu->pc + 1, MOS_IRQ_VECTOR, true);
+}
+
+void mos_return_from_interrupt(MOS_Cpu *cpu)
+{
+    mos_cpu_set_psr(cpu, (mos_pull_stack(cpu) & ~B_BIT_FLAG) | U_BIT_FLAG);
+    uint8_t low_byte = mos_pull_stack(cpu);
+    uint8_t high_byte = mos_pull_stack(cpu);
+    cpu->pc = mos_bytes_to_uint16_t(high_byte, low_byte);
+}
+
+// NOTE: Interrupts
+//
+// IRQ is level triggered and shared, every source holds its own bit of
+// irq_lines and the line is asserted while any bit is set. NMI is edge
+// triggered, asserting it latches nmi_pending until it is taken. Both only
+// set interrupt_pending, which mos_cpu_step tests before every instruction
+// and mos_cpu_run before every block, so a cpu nobody interrupts pays one
+// byte compare. A cached block stops early once an interrupt can be taken,
+// one raised inside a native block is taken once the block ends.
+
+static inline void mos_interrupt_update(MOS_Cpu *cpu)
+{
+    cpu->interrupt_pending = cpu->nmi_pending || cpu->irq_lines != 0;
+}
+
+// mos_cpu_interrupt would take something now
+static inline bool mos_interrupt_ready(const MOS_Cpu *cpu)
+{
+    return cpu->interrupt_pending && (cpu->nmi_pending || !mos_test_flag(cpu, I_BIT_FLAG));
+}
+
+// Asserts or releases IRQ `source`, one of 32
+void mos_cpu_set_irq(MOS_Cpu *cpu, uint8_t source, bool asserted)
+{
+    assert(source < 32);
+    if (asserted) {
+        cpu->irq_lines |= (uint32_t) 1 << source;
+    } else {
+        cpu->irq_lines &= ~((uint32_t) 1 << source);
+    }
+    mos_interrupt_update(cpu);
+}
+
+void mos_cpu_set_nmi(MOS_Cpu *cpu, bool asserted)
+{
+    if (asserted && !cpu->nmi_line) cpu->nmi_pending = true;
+    cpu->nmi_line = asserted;
+    mos_interrupt_update(cpu);
+}
+
+// Takes a latched NMI, or the IRQ when the I flag allows it, returns false if neither
+bool mos_cpu_interrupt(MOS_Cpu *cpu)
+{
+    uint16_t vector;
+    if (cpu->nmi_pending) {
+        cpu->nmi_pending = false;
+        vector = MOS_NMI_VECTOR;
+    } else if (cpu->irq_lines != 0 && !mos_test_flag(cpu, I_BIT_FLAG)) {
+        vector = MOS_IRQ_VECTOR;
+    } else {
+        return false;
+    }
+    mos_interrupt_enter(cpu, cpu->pc, vector, false);
+    cpu->cycles += MOS_INTERRUPT_CYCLES;
+    mos_interrupt_update(cpu);
+#ifdef MOS_PROFILE
+    if (cpu->profile != NULL) mos_profile_interrupt(cpu->profile, cpu->pc, MOS_INTERRUPT_CYCLES);
+#endif
+    return true;
+}
+
+// Does what the RESET line does, the registers other than sp are left alone
+void mos_cpu_reset(MOS_Cpu *cpu)
+{
+    cpu->sp -= 3; // the pushes run as reads
+    mos_set_psr_flags(cpu, I_BIT_FLAG);
+    if (cpu->variant == MOS_VARIANT_65C02) mos_clear_psr_flags(cpu, D_BIT_FLAG);
+    cpu->nmi_pending = false;
+    mos_interrupt_update(cpu);
+    cpu->pc = mos_read_vector(cpu, MOS_RESET_VECTOR);
+    cpu->cycles += MOS_INTERRUPT_CYCLES;
+}
+
+void mos_jump(MOS_Cpu *cpu, MOS_Instruction instruction)
+{
+    cpu->pc = mos_fetch_operand_location(cpu, instruction.mode, instruction.operand);
+}
+
+// pushes the address of the last byte of the JSR, RTS adds the one back
+void mos_jump_to_subroutine(MOS_Cpu *cpu, MOS_Instruction instruction)
+{
     uint8_t pc_high_byte, pc_low_byte;
-    mos_uint16_t_to_bytes(cpu->pc, &pc_high_byte, &pc_low_byte); // Split the Program Counter
-    mos_push_stack(cpu, pc_high_byte); // Push higher-byte first
-    mos_push_stack(cpu, pc_low_byte); // Push lower-byte second
-    mos_push_stack(cpu, cpu->psr); // Push the Process Status reg
-    // TODO: Make the Interrupt vector a const variable
-    cpu->pc = mos_cpu_read(cpu, mos_bytes_to_uint16_t(MOS_MAX_PAGES, MOS_MAX_OFFSET)); // load the Interrupt Vector into the Program Counter
-    printf("Program Interrupted\n");
+    mos_uint16_t_to_bytes(cpu->pc - 1, &pc_high_byte, &pc_low_byte);
+    mos_push_stack(cpu, pc_high_byte);
+    mos_push_stack(cpu, pc_low_byte);
+    mos_jump(cpu, instruction);
+}
+
+void mos_return_from_subroutine(MOS_Cpu *cpu)
+{
+    uint8_t low_byte = mos_pull_stack(cpu);
+    uint8_t high_byte = mos_pull_stack(cpu);
+    cpu->pc = mos_bytes_to_uint16_t(high_byte, low_byte) + 1;
 }
 
 bool mos_decode(MOS_Cpu *cpu, MOS_Instruction instruction)
@@ -725,11 +1127,11 @@ bool mos_decode(MOS_Cpu *cpu, MOS_Instruction instruction)
     case CPY: mos_compare_reg_with_data(cpu, instruction, cpu->regy); return true;
 
     case TSX: mos_transfer_stack_to_reg(cpu, &cpu->regx);             return true;
-    case TXS: mos_push_reg_to_stack(cpu, cpu->regx);                  return true;
+    case TXS: cpu->sp = cpu->regx;                                    return true;
     case PHA: mos_push_reg_to_stack(cpu, cpu->racc);                  return true;
-    case PHP: mos_push_reg_to_stack(cpu, cpu->psr);                   return true;
+    case PHP: mos_push_status(cpu);                                   return true;
     case PLA: mos_pull_reg_from_stack(cpu, &cpu->racc);               return true;
-    case PLP: mos_pull_reg_from_stack(cpu, &cpu->psr);                return true;
+    case PLP: mos_pull_status(cpu);                                   return true;
 
     case ORA: mos_logical_or(cpu, instruction);                       return true;
     case AND: mos_logical_and(cpu, instruction);                      return true;
@@ -796,11 +1198,16 @@ bool mos_decode(MOS_Cpu *cpu, MOS_Instruction instruction)
         return true;
     };
 
-    case RTI: MOS_UNIMPLEMENTED("RTI");
-    case RTS: MOS_UNIMPLEMENTED("RTS");
-    case JMP: MOS_UNIMPLEMENTED("JMP");
-    case JSR: MOS_UNIMPLEMENTED("JSR");
+    case RTI: mos_return_from_interrupt(cpu);                         return true;
+    case RTS: mos_return_from_subroutine(cpu);                        return true;
+    case JMP: mos_jump(cpu, instruction);                             return true;
+    case JSR: mos_jump_to_subroutine(cpu, instruction);               return true;
 
+    // mos_fetch_instruction decodes the documented NMOS set only
+    case SLO: case RLA: case SRE: case RRA: case SAX: case LAX: case DCP: case ISC:
+    case ANC: case ALR: case ARR: case ANE: case LXA: case SBX: case SHA: case SHX:
+    case SHY: case TAS: case LAS: case JAM:
+    case BRA: case PHX: case PHY: case PLX: case PLY: case STZ: case TRB: case TSB:
     case ERROR_FETCH_DATA:
     case ERROR_FETCH_LOCATION:
     default:
@@ -809,6 +1216,868 @@ bool mos_decode(MOS_Cpu *cpu, MOS_Instruction instruction)
     }
 }
 
+// The legacy decoder is the reference for the documented NMOS opcodes and
+// ignores the cpu variant, undocumented opcodes fetch as BRK
+MOS_Instruction mos_fetch_instruction(MOS_Cpu *cpu)
+{
+    MOS_Instruction inst = {0};
+    uint8_t data = mos_cpu_read(cpu, cpu->pc);
+    cpu->pc++;
+
+    MOS_OpcodeInfo info = opcode_matrix[data];
+    inst.opcode = info.opcode;
+    inst.mode   = info.mode;
+    cpu->cycles += info.cycles;
+    switch (inst.mode) {
+    case IMPL:
+    case ACCU: {
+        inst.operand.type = OPERAND_DATA; // ACCU data is the accumulator
+    } break;
+    case IMME:
+    case REL: {
+        inst.operand.data.data = mos_cpu_read(cpu, cpu->pc);
+        inst.operand.type = OPERAND_DATA;
+        cpu->pc++;
+    } break;
+    case ZP:
+    case ZPX:
+    case ZPY:
+    case INDX:
+    case INDY:
+    case ZPI: {
+        // one byte of page zero address
+        inst.operand.data.address = mos_cpu_read(cpu, cpu->pc);
+        inst.operand.type = OPERAND_ADDRESS;
+        cpu->pc++;
+    } break;
+    case ABS:
+    case ABSX:
+    case ABSY:
+    case IND:
+    case ABXI: {
+        uint8_t offset = mos_cpu_read(cpu, cpu->pc);
+        cpu->pc++;
+        uint8_t page = mos_cpu_read(cpu, cpu->pc);
+        cpu->pc++;
+        uint16_t abs = mos_bytes_to_uint16_t(page, offset);
+        inst.operand.data.address = abs;
+        inst.operand.type = OPERAND_ADDRESS;
+    } break;
+    }
+    return inst;
+}
+
+// NOTE: Dispatch table interpreter
+//
+// Every opcode byte gets its own handler which does the addressing and the
+// operation in one go, the operand bytes are fetched up front by
+// mos_cpu_step from the instruction length. The handlers are generated from
+// MOS_OPCODE_GRID below, the same grid opcode_matrix is built from.
+//
+// Each MOS_Variant has its own dispatch and opcode tables, all of them built
+// at compile time from the grids, so mos_cpu_init_variant only picks two
+// pointers and the variant costs nothing per instruction.
+
+// Byte-by-byte NMOS opcode grid, X(opcode, mode, base cycles) for official opcodes, U() for undocumented ones
+#define MOS_OPCODE_GRID(X, U)                                                                                                                                                                                                                                                  \
+    /* 0- */ X(BRK, IMPL, 7) X(ORA, INDX, 6) U(JAM, IMPL, 2) U(SLO, INDX, 8) U(NOP, ZP, 3)   X(ORA, ZP, 3)  X(ASL, ZP, 5)  U(SLO, ZP, 5)  X(PHP, IMPL, 3) X(ORA, IMME, 2) X(ASL, ACCU, 2) U(ANC, IMME, 2) U(NOP, ABS, 4)  X(ORA, ABS, 4)  X(ASL, ABS, 6)  U(SLO, ABS, 6)  \
+    /* 1- */ X(BPL, REL, 2)  X(ORA, INDY, 5) U(JAM, IMPL, 2) U(SLO, INDY, 8) U(NOP, ZPX, 4)  X(ORA, ZPX, 4) X(ASL, ZPX, 6) U(SLO, ZPX, 6) X(CLC, IMPL, 2) X(ORA, ABSY, 4) U(NOP, IMPL, 2) U(SLO, ABSY, 7) U(NOP, ABSX, 4) X(ORA, ABSX, 4) X(ASL, ABSX, 7) U(SLO, ABSX, 7) \
+    /* 2- */ X(JSR, ABS, 6)  X(AND, INDX, 6) U(JAM, IMPL, 2) U(RLA, INDX, 8) X(BIT, ZP, 3)   X(AND, ZP, 3)  X(ROL, ZP, 5)  U(RLA, ZP, 5)  X(PLP, IMPL, 4) X(AND, IMME, 2) X(ROL, ACCU, 2) U(ANC, IMME, 2) X(BIT, ABS, 4)  X(AND, ABS, 4)  X(ROL, ABS, 6)  U(RLA, ABS, 6)  \
+    /* 3- */ X(BMI, REL, 2)  X(AND, INDY, 5) U(JAM, IMPL, 2) U(RLA, INDY, 8) U(NOP, ZPX, 4)  X(AND, ZPX, 4) X(ROL, ZPX, 6) U(RLA, ZPX, 6) X(SEC, IMPL, 2) X(AND, ABSY, 4) U(NOP, IMPL, 2) U(RLA, ABSY, 7) U(NOP, ABSX, 4) X(AND, ABSX, 4) X(ROL, ABSX, 7) U(RLA, ABSX, 7) \
+    /* 4- */ X(RTI, IMPL, 6) X(EOR, INDX, 6) U(JAM, IMPL, 2) U(SRE, INDX, 8) U(NOP, ZP, 3)   X(EOR, ZP, 3)  X(LSR, ZP, 5)  U(SRE, ZP, 5)  X(PHA, IMPL, 3) X(EOR, IMME, 2) X(LSR, ACCU, 2) U(ALR, IMME, 2) X(JMP, ABS, 3)  X(EOR, ABS, 4)  X(LSR, ABS, 6)  U(SRE, ABS, 6)  \
+    /* 5- */ X(BVC, REL, 2)  X(EOR, INDY, 5) U(JAM, IMPL, 2) U(SRE, INDY, 8) U(NOP, ZPX, 4)  X(EOR, ZPX, 4) X(LSR, ZPX, 6) U(SRE, ZPX, 6) X(CLI, IMPL, 2) X(EOR, ABSY, 4) U(NOP, IMPL, 2) U(SRE, ABSY, 7) U(NOP, ABSX, 4) X(EOR, ABSX, 4) X(LSR, ABSX, 7) U(SRE, ABSX, 7) \
+    /* 6- */ X(RTS, IMPL, 6) X(ADC, INDX, 6) U(JAM, IMPL, 2) U(RRA, INDX, 8) U(NOP, ZP, 3)   X(ADC, ZP, 3)  X(ROR, ZP, 5)  U(RRA, ZP, 5)  X(PLA, IMPL, 4) X(ADC, IMME, 2) X(ROR, ACCU, 2) U(ARR, IMME, 2) X(JMP, IND, 5)  X(ADC, ABS, 4)  X(ROR, ABS, 6)  U(RRA, ABS, 6)  \
+    /* 7- */ X(BVS, REL, 2)  X(ADC, INDY, 5) U(JAM, IMPL, 2) U(RRA, INDY, 8) U(NOP, ZPX, 4)  X(ADC, ZPX, 4) X(ROR, ZPX, 6) U(RRA, ZPX, 6) X(SEI, IMPL, 2) X(ADC, ABSY, 4) U(NOP, IMPL, 2) U(RRA, ABSY, 7) U(NOP, ABSX, 4) X(ADC, ABSX, 4) X(ROR, ABSX, 7) U(RRA, ABSX, 7) \
+    /* 8- */ U(NOP, IMME, 2) X(STA, INDX, 6) U(NOP, IMME, 2) U(SAX, INDX, 6) X(STY, ZP, 3)   X(STA, ZP, 3)  X(STX, ZP, 3)  U(SAX, ZP, 3)  X(DEY, IMPL, 2) U(NOP, IMME, 2) X(TXA, IMPL, 2) U(ANE, IMME, 2) X(STY, ABS, 4)  X(STA, ABS, 4)  X(STX, ABS, 4)  U(SAX, ABS, 4)  \
+    /* 9- */ X(BCC, REL, 2)  X(STA, INDY, 6) U(JAM, IMPL, 2) U(SHA, INDY, 6) X(STY, ZPX, 4)  X(STA, ZPX, 4) X(STX, ZPY, 4) U(SAX, ZPY, 4) X(TYA, IMPL, 2) X(STA, ABSY, 5) X(TXS, IMPL, 2) U(TAS, ABSY, 5) U(SHY, ABSX, 5) X(STA, ABSX, 5) U(SHX, ABSY, 5) U(SHA, ABSY, 5) \
+    /* A- */ X(LDY, IMME, 2) X(LDA, INDX, 6) X(LDX, IMME, 2) U(LAX, INDX, 6) X(LDY, ZP, 3)   X(LDA, ZP, 3)  X(LDX, ZP, 3)  U(LAX, ZP, 3)  X(TAY, IMPL, 2) X(LDA, IMME, 2) X(TAX, IMPL, 2) U(LXA, IMME, 2) X(LDY, ABS, 4)  X(LDA, ABS, 4)  X(LDX, ABS, 4)  U(LAX, ABS, 4)  \
+    /* B- */ X(BCS, REL, 2)  X(LDA, INDY, 5) U(JAM, IMPL, 2) U(LAX, INDY, 5) X(LDY, ZPX, 4)  X(LDA, ZPX, 4) X(LDX, ZPY, 4) U(LAX, ZPY, 4) X(CLV, IMPL, 2) X(LDA, ABSY, 4) X(TSX, IMPL, 2) U(LAS, ABSY, 4) X(LDY, ABSX, 4) X(LDA, ABSX, 4) X(LDX, ABSY, 4) U(LAX, ABSY, 4) \
+    /* C- */ X(CPY, IMME, 2) X(CMP, INDX, 6) U(NOP, IMME, 2) U(DCP, INDX, 8) X(CPY, ZP, 3)   X(CMP, ZP, 3)  X(DEC, ZP, 5)  U(DCP, ZP, 5)  X(INY, IMPL, 2) X(CMP, IMME, 2) X(DEX, IMPL, 2) U(SBX, IMME, 2) X(CPY, ABS, 4)  X(CMP, ABS, 4)  X(DEC, ABS, 6)  U(DCP, ABS, 6)  \
+    /* D- */ X(BNE, REL, 2)  X(CMP, INDY, 5) U(JAM, IMPL, 2) U(DCP, INDY, 8) U(NOP, ZPX, 4)  X(CMP, ZPX, 4) X(DEC, ZPX, 6) U(DCP, ZPX, 6) X(CLD, IMPL, 2) X(CMP, ABSY, 4) U(NOP, IMPL, 2) U(DCP, ABSY, 7) U(NOP, ABSX, 4) X(CMP, ABSX, 4) X(DEC, ABSX, 7) U(DCP, ABSX, 7) \
+    /* E- */ X(CPX, IMME, 2) X(SBC, INDX, 6) U(NOP, IMME, 2) U(ISC, INDX, 8) X(CPX, ZP, 3)   X(SBC, ZP, 3)  X(INC, ZP, 5)  U(ISC, ZP, 5)  X(INX, IMPL, 2) X(SBC, IMME, 2) X(NOP, IMPL, 2) U(SBC, IMME, 2) X(CPX, ABS, 4)  X(SBC, ABS, 4)  X(INC, ABS, 6)  U(ISC, ABS, 6)  \
+    /* F- */ X(BEQ, REL, 2)  X(SBC, INDY, 5) U(JAM, IMPL, 2) U(ISC, INDY, 8) U(NOP, ZPX, 4)  X(SBC, ZPX, 4) X(INC, ZPX, 6) U(ISC, ZPX, 6) X(SED, IMPL, 2) X(SBC, ABSY, 4) U(NOP, IMPL, 2) U(ISC, ABSY, 7) U(NOP, ABSX, 4) X(SBC, ABSX, 4) X(INC, ABSX, 7) U(ISC, ABSX, 7)
+
+// Byte-by-byte 65C02 opcode grid, X() shares the NMOS handler and C() uses the _65C02 handler of an
+// opcode that behaves differently. The bit opcodes of the Rockwell and WDC parts (RMBx, SMBx, BBRx,
+// BBSx, WAI, STP) are left as the one byte NOPs of the original 65C02.
+#define MOS_OPCODE_GRID_65C02(X, C)                                                                                                                                                                                                                                            \
+    /* 0- */ X(BRK, IMPL, 7) X(ORA, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(TSB, ZP, 5)   X(ORA, ZP, 3)  X(ASL, ZP, 5)  X(NOP, IMPL, 1) X(PHP, IMPL, 3) X(ORA, IMME, 2) X(ASL, ACCU, 2) X(NOP, IMPL, 1) X(TSB, ABS, 6)  X(ORA, ABS, 4)  X(ASL, ABS, 6)  X(NOP, IMPL, 1) \
+    /* 1- */ X(BPL, REL, 2)  X(ORA, INDY, 5) X(ORA, ZPI, 5)  X(NOP, IMPL, 1) X(TRB, ZP, 5)   X(ORA, ZPX, 4) X(ASL, ZPX, 6) X(NOP, IMPL, 1) X(CLC, IMPL, 2) X(ORA, ABSY, 4) X(INC, ACCU, 2) X(NOP, IMPL, 1) X(TRB, ABS, 6)  X(ORA, ABSX, 4) C(ASL, ABSX, 6) X(NOP, IMPL, 1) \
+    /* 2- */ X(JSR, ABS, 6)  X(AND, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(BIT, ZP, 3)   X(AND, ZP, 3)  X(ROL, ZP, 5)  X(NOP, IMPL, 1) X(PLP, IMPL, 4) X(AND, IMME, 2) X(ROL, ACCU, 2) X(NOP, IMPL, 1) X(BIT, ABS, 4)  X(AND, ABS, 4)  X(ROL, ABS, 6)  X(NOP, IMPL, 1) \
+    /* 3- */ X(BMI, REL, 2)  X(AND, INDY, 5) X(AND, ZPI, 5)  X(NOP, IMPL, 1) X(BIT, ZPX, 4)  X(AND, ZPX, 4) X(ROL, ZPX, 6) X(NOP, IMPL, 1) X(SEC, IMPL, 2) X(AND, ABSY, 4) X(DEC, ACCU, 2) X(NOP, IMPL, 1) X(BIT, ABSX, 4) X(AND, ABSX, 4) C(ROL, ABSX, 6) X(NOP, IMPL, 1) \
+    /* 4- */ X(RTI, IMPL, 6) X(EOR, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(NOP, ZP, 3)   X(EOR, ZP, 3)  X(LSR, ZP, 5)  X(NOP, IMPL, 1) X(PHA, IMPL, 3) X(EOR, IMME, 2) X(LSR, ACCU, 2) X(NOP, IMPL, 1) X(JMP, ABS, 3)  X(EOR, ABS, 4)  X(LSR, ABS, 6)  X(NOP, IMPL, 1) \
+    /* 5- */ X(BVC, REL, 2)  X(EOR, INDY, 5) X(EOR, ZPI, 5)  X(NOP, IMPL, 1) X(NOP, ZPX, 4)  X(EOR, ZPX, 4) X(LSR, ZPX, 6) X(NOP, IMPL, 1) X(CLI, IMPL, 2) X(EOR, ABSY, 4) X(PHY, IMPL, 3) X(NOP, IMPL, 1) X(NOP, ABS, 8)  X(EOR, ABSX, 4) C(LSR, ABSX, 6) X(NOP, IMPL, 1) \
+    /* 6- */ X(RTS, IMPL, 6) X(ADC, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(STZ, ZP, 3)   X(ADC, ZP, 3)  X(ROR, ZP, 5)  X(NOP, IMPL, 1) X(PLA, IMPL, 4) X(ADC, IMME, 2) X(ROR, ACCU, 2) X(NOP, IMPL, 1) C(JMP, IND, 6)  X(ADC, ABS, 4)  X(ROR, ABS, 6)  X(NOP, IMPL, 1) \
+    /* 7- */ X(BVS, REL, 2)  X(ADC, INDY, 5) X(ADC, ZPI, 5)  X(NOP, IMPL, 1) X(STZ, ZPX, 4)  X(ADC, ZPX, 4) X(ROR, ZPX, 6) X(NOP, IMPL, 1) X(SEI, IMPL, 2) X(ADC, ABSY, 4) X(PLY, IMPL, 4) X(NOP, IMPL, 1) X(JMP, ABXI, 6) X(ADC, ABSX, 4) C(ROR, ABSX, 6) X(NOP, IMPL, 1) \
+    /* 8- */ X(BRA, REL, 2)  X(STA, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(STY, ZP, 3)   X(STA, ZP, 3)  X(STX, ZP, 3)  X(NOP, IMPL, 1) X(DEY, IMPL, 2) C(BIT, IMME, 2) X(TXA, IMPL, 2) X(NOP, IMPL, 1) X(STY, ABS, 4)  X(STA, ABS, 4)  X(STX, ABS, 4)  X(NOP, IMPL, 1) \
+    /* 9- */ X(BCC, REL, 2)  X(STA, INDY, 6) X(STA, ZPI, 5)  X(NOP, IMPL, 1) X(STY, ZPX, 4)  X(STA, ZPX, 4) X(STX, ZPY, 4) X(NOP, IMPL, 1) X(TYA, IMPL, 2) X(STA, ABSY, 5) X(TXS, IMPL, 2) X(NOP, IMPL, 1) X(STZ, ABS, 4)  X(STA, ABSX, 5) X(STZ, ABSX, 5) X(NOP, IMPL, 1) \
+    /* A- */ X(LDY, IMME, 2) X(LDA, INDX, 6) X(LDX, IMME, 2) X(NOP, IMPL, 1) X(LDY, ZP, 3)   X(LDA, ZP, 3)  X(LDX, ZP, 3)  X(NOP, IMPL, 1) X(TAY, IMPL, 2) X(LDA, IMME, 2) X(TAX, IMPL, 2) X(NOP, IMPL, 1) X(LDY, ABS, 4)  X(LDA, ABS, 4)  X(LDX, ABS, 4)  X(NOP, IMPL, 1) \
+    /* B- */ X(BCS, REL, 2)  X(LDA, INDY, 5) X(LDA, ZPI, 5)  X(NOP, IMPL, 1) X(LDY, ZPX, 4)  X(LDA, ZPX, 4) X(LDX, ZPY, 4) X(NOP, IMPL, 1) X(CLV, IMPL, 2) X(LDA, ABSY, 4) X(TSX, IMPL, 2) X(NOP, IMPL, 1) X(LDY, ABSX, 4) X(LDA, ABSX, 4) X(LDX, ABSY, 4) X(NOP, IMPL, 1) \
+    /* C- */ X(CPY, IMME, 2) X(CMP, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(CPY, ZP, 3)   X(CMP, ZP, 3)  X(DEC, ZP, 5)  X(NOP, IMPL, 1) X(INY, IMPL, 2) X(CMP, IMME, 2) X(DEX, IMPL, 2) X(NOP, IMPL, 1) X(CPY, ABS, 4)  X(CMP, ABS, 4)  X(DEC, ABS, 6)  X(NOP, IMPL, 1) \
+    /* D- */ X(BNE, REL, 2)  X(CMP, INDY, 5) X(CMP, ZPI, 5)  X(NOP, IMPL, 1) X(NOP, ZPX, 4)  X(CMP, ZPX, 4) X(DEC, ZPX, 6) X(NOP, IMPL, 1) X(CLD, IMPL, 2) X(CMP, ABSY, 4) X(PHX, IMPL, 3) X(NOP, IMPL, 1) X(NOP, ABS, 4)  X(CMP, ABSX, 4) X(DEC, ABSX, 7) X(NOP, IMPL, 1) \
+    /* E- */ X(CPX, IMME, 2) X(SBC, INDX, 6) X(NOP, IMME, 2) X(NOP, IMPL, 1) X(CPX, ZP, 3)   X(SBC, ZP, 3)  X(INC, ZP, 5)  X(NOP, IMPL, 1) X(INX, IMPL, 2) X(SBC, IMME, 2) X(NOP, IMPL, 2) X(NOP, IMPL, 1) X(CPX, ABS, 4)  X(SBC, ABS, 4)  X(INC, ABS, 6)  X(NOP, IMPL, 1) \
+    /* F- */ X(BEQ, REL, 2)  X(SBC, INDY, 5) X(SBC, ZPI, 5)  X(NOP, IMPL, 1) X(NOP, ZPX, 4)  X(SBC, ZPX, 4) X(INC, ZPX, 6) X(NOP, IMPL, 1) X(SED, IMPL, 2) X(SBC, ABSY, 4) X(PLX, IMPL, 4) X(NOP, IMPL, 1) X(NOP, ABS, 4)  X(SBC, ABSX, 4) X(INC, ABSX, 7) X(NOP, IMPL, 1)
+
+// Opcode and mode pairs only the undocumented NMOS opcodes use, one handler each
+#define MOS_UNDOCUMENTED_HANDLERS(X)                                                                             \
+    X(SLO, ZP) X(SLO, ZPX) X(SLO, ABS) X(SLO, ABSX) X(SLO, ABSY) X(SLO, INDX) X(SLO, INDY)                     \
+    X(RLA, ZP) X(RLA, ZPX) X(RLA, ABS) X(RLA, ABSX) X(RLA, ABSY) X(RLA, INDX) X(RLA, INDY)                     \
+    X(SRE, ZP) X(SRE, ZPX) X(SRE, ABS) X(SRE, ABSX) X(SRE, ABSY) X(SRE, INDX) X(SRE, INDY)                     \
+    X(RRA, ZP) X(RRA, ZPX) X(RRA, ABS) X(RRA, ABSX) X(RRA, ABSY) X(RRA, INDX) X(RRA, INDY)                     \
+    X(DCP, ZP) X(DCP, ZPX) X(DCP, ABS) X(DCP, ABSX) X(DCP, ABSY) X(DCP, INDX) X(DCP, INDY)                     \
+    X(ISC, ZP) X(ISC, ZPX) X(ISC, ABS) X(ISC, ABSX) X(ISC, ABSY) X(ISC, INDX) X(ISC, INDY)                     \
+    X(SAX, ZP) X(SAX, ZPY) X(SAX, ABS) X(SAX, INDX)                                                            \
+    X(LAX, ZP) X(LAX, ZPY) X(LAX, ABS) X(LAX, ABSY) X(LAX, INDX) X(LAX, INDY)                                  \
+    X(ANC, IMME) X(ALR, IMME) X(ARR, IMME) X(ANE, IMME) X(LXA, IMME) X(SBX, IMME)                              \
+    X(SHA, ABSY) X(SHA, INDY) X(SHX, ABSY) X(SHY, ABSX) X(TAS, ABSY) X(LAS, ABSY)                              \
+    X(NOP, IMME) X(NOP, ZP) X(NOP, ZPX) X(NOP, ABS) X(NOP, ABSX) X(JAM, IMPL)
+
+// Opcode and mode pairs only the 65C02 uses
+#define MOS_65C02_HANDLERS(X)                                                                                    \
+    X(ORA, ZPI) X(AND, ZPI) X(EOR, ZPI) X(ADC, ZPI) X(STA, ZPI) X(LDA, ZPI) X(CMP, ZPI) X(SBC, ZPI)            \
+    X(BIT, ZPX) X(BIT, ABSX) X(INC, ACCU) X(DEC, ACCU)                                                         \
+    X(STZ, ZP) X(STZ, ZPX) X(STZ, ABS) X(STZ, ABSX) X(TSB, ZP) X(TSB, ABS) X(TRB, ZP) X(TRB, ABS)              \
+    X(BRA, REL) X(PHX, IMPL) X(PHY, IMPL) X(PLX, IMPL) X(PLY, IMPL) X(JMP, ABXI)
+
+// Instruction length in bytes, opcode included
+#define MOS_LENGTH_IMPL 1
+#define MOS_LENGTH_ACCU 1
+#define MOS_LENGTH_IMME 2
+#define MOS_LENGTH_ZP   2
+#define MOS_LENGTH_ZPX  2
+#define MOS_LENGTH_ZPY  2
+#define MOS_LENGTH_REL  2
+#define MOS_LENGTH_ABS  3
+#define MOS_LENGTH_ABSX 3
+#define MOS_LENGTH_ABSY 3
+#define MOS_LENGTH_IND  3
+#define MOS_LENGTH_INDX 2
+#define MOS_LENGTH_INDY 2
+#define MOS_LENGTH_ZPI  2
+#define MOS_LENGTH_ABXI 3
+
+uint8_t mos_addr_mode_length(MOS_AddressingModes mode)
+{
+    switch (mode) {
+    case IMPL: return MOS_LENGTH_IMPL;
+    case ACCU: return MOS_LENGTH_ACCU;
+    case IMME: return MOS_LENGTH_IMME;
+    case ZP:   return MOS_LENGTH_ZP;
+    case ZPX:  return MOS_LENGTH_ZPX;
+    case ZPY:  return MOS_LENGTH_ZPY;
+    case REL:  return MOS_LENGTH_REL;
+    case ABS:  return MOS_LENGTH_ABS;
+    case ABSX: return MOS_LENGTH_ABSX;
+    case ABSY: return MOS_LENGTH_ABSY;
+    case IND:  return MOS_LENGTH_IND;
+    case INDX: return MOS_LENGTH_INDX;
+    case INDY: return MOS_LENGTH_INDY;
+    case ZPI:  return MOS_LENGTH_ZPI;
+    case ABXI: return MOS_LENGTH_ABXI;
+    default:   return 0;
+    }
+}
+
+// Effective address of each addressing mode, `operand` holds the raw operand bytes
+static inline uint16_t mos_address_ZP(MOS_Cpu *cpu, uint16_t operand)
+{
+    (void) cpu;
+    return operand & 0xFF;
+}
+
+static inline uint16_t mos_address_ZPX(MOS_Cpu *cpu, uint16_t operand)
+{
+    return (operand + cpu->regx) & 0xFF; // wraps around inside page zero
+}
+
+static inline uint16_t mos_address_ZPY(MOS_Cpu *cpu, uint16_t operand)
+{
+    return (operand + cpu->regy) & 0xFF;
+}
+
+static inline uint16_t mos_address_ABS(MOS_Cpu *cpu, uint16_t operand)
+{
+    (void) cpu;
+    return operand;
+}
+
+static inline uint16_t mos_address_ABSX(MOS_Cpu *cpu, uint16_t operand)
+{
+    return operand + cpu->regx;
+}
+
+static inline uint16_t mos_address_ABSY(MOS_Cpu *cpu, uint16_t operand)
+{
+    return operand + cpu->regy;
+}
+
+// JMP ($xxFF) fetches the high-byte from $xx00, the page never carries
+static inline uint16_t mos_address_IND(MOS_Cpu *cpu, uint16_t operand)
+{
+    uint16_t high = (operand & 0xFF00) | ((operand + 1) & 0xFF);
+    return mos_bytes_to_uint16_t(mos_cpu_read(cpu, high), mos_cpu_read(cpu, operand));
+}
+
+static inline uint16_t mos_address_INDX(MOS_Cpu *cpu, uint16_t operand)
+{
+    uint8_t pointer = operand + cpu->regx;
+    return mos_bytes_to_uint16_t(mos_cpu_read(cpu, (uint8_t)(pointer + 1)), mos_cpu_read(cpu, pointer));
+}
+
+static inline uint16_t mos_address_INDY(MOS_Cpu *cpu, uint16_t operand)
+{
+    return mos_indirect_y(cpu, operand & 0xFF, false);
+}
+
+// (zp) of the 65C02, INDY without the index
+static inline uint16_t mos_address_ZPI(MOS_Cpu *cpu, uint16_t operand)
+{
+    uint8_t pointer = operand;
+    return mos_bytes_to_uint16_t(mos_cpu_read(cpu, (uint8_t)(pointer + 1)), mos_cpu_read(cpu, pointer));
+}
+
+// JMP (abs,X) of the 65C02, the pointer carries into the next page
+static inline uint16_t mos_address_ABXI(MOS_Cpu *cpu, uint16_t operand)
+{
+    uint16_t pointer = operand + cpu->regx;
+    return mos_bytes_to_uint16_t(mos_cpu_read(cpu, pointer + 1), mos_cpu_read(cpu, pointer));
+}
+
+// Operand value of the read opcodes
+static inline uint8_t mos_read_IMME(MOS_Cpu *cpu, uint16_t operand)
+{
+    (void) cpu;
+    return operand;
+}
+
+#define MOS_DEFINE_READ(mode)                                           \
+    static inline uint8_t mos_read_##mode(MOS_Cpu *cpu, uint16_t operand) \
+    {                                                                   \
+        return mos_cpu_read(cpu, mos_address_##mode(cpu, operand));     \
+    }
+
+MOS_DEFINE_READ(ZP)
+MOS_DEFINE_READ(ZPX)
+MOS_DEFINE_READ(ZPY)
+MOS_DEFINE_READ(ABS)
+MOS_DEFINE_READ(INDX)
+MOS_DEFINE_READ(ZPI)
+
+// Indexed reads pay the page-cross cycle, stores and read-modify-write have it in their base
+static inline uint8_t mos_read_ABSX(MOS_Cpu *cpu, uint16_t operand)
+{
+    return mos_cpu_read(cpu, mos_absolute_x(cpu, operand, true));
+}
+
+static inline uint8_t mos_read_ABSY(MOS_Cpu *cpu, uint16_t operand)
+{
+    return mos_cpu_read(cpu, mos_absolute_y(cpu, operand, true));
+}
+
+static inline uint8_t mos_read_INDY(MOS_Cpu *cpu, uint16_t operand)
+{
+    return mos_cpu_read(cpu, mos_indirect_y(cpu, operand & 0xFF, true));
+}
+
+// Read-modify-write of the shift, rotate, increment and decrement opcodes
+typedef uint8_t (*MOS_Modify)(MOS_Cpu *, uint8_t);
+
+static inline void mos_modify_ACCU(MOS_Cpu *cpu, uint16_t operand, MOS_Modify modify)
+{
+    (void) operand;
+    cpu->racc = modify(cpu, cpu->racc);
+}
+
+#define MOS_DEFINE_MODIFY(mode)                                                       \
+    static inline void mos_modify_##mode(MOS_Cpu *cpu, uint16_t operand, MOS_Modify modify) \
+    {                                                                                 \
+        uint16_t loc = mos_address_##mode(cpu, operand);                              \
+        mos_cpu_write(cpu, loc, modify(cpu, mos_cpu_read(cpu, loc)));                 \
+    }
+
+MOS_DEFINE_MODIFY(ZP)
+MOS_DEFINE_MODIFY(ZPX)
+MOS_DEFINE_MODIFY(ABS)
+MOS_DEFINE_MODIFY(ABSX)
+
+// Single-value operations wrapped for the handler generators
+static inline void mos_alu_lda(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_update_nz(cpu, data); }
+static inline void mos_alu_ldx(MOS_Cpu *cpu, uint8_t data) { cpu->regx = mos_update_nz(cpu, data); }
+static inline void mos_alu_ldy(MOS_Cpu *cpu, uint8_t data) { cpu->regy = mos_update_nz(cpu, data); }
+static inline void mos_alu_cmp(MOS_Cpu *cpu, uint8_t data) { mos_alu_compare(cpu, cpu->racc, data); }
+static inline void mos_alu_cpx(MOS_Cpu *cpu, uint8_t data) { mos_alu_compare(cpu, cpu->regx, data); }
+static inline void mos_alu_cpy(MOS_Cpu *cpu, uint8_t data) { mos_alu_compare(cpu, cpu->regy, data); }
+static inline void mos_alu_and(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_update_nz(cpu, cpu->racc & data); }
+static inline void mos_alu_ora(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_update_nz(cpu, cpu->racc | data); }
+static inline void mos_alu_eor(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_update_nz(cpu, cpu->racc ^ data); }
+
+// NOTE: Undocumented NMOS operations
+//
+// ANE and LXA OR the accumulator with a value that depends on the chip and
+// its temperature before the AND, MOS_UNSTABLE_MAGIC is the usual choice.
+#define MOS_UNSTABLE_MAGIC 0xEE
+
+static inline void mos_alu_nop(MOS_Cpu *cpu, uint8_t data) { (void) cpu; (void) data; }
+static inline void mos_alu_lax(MOS_Cpu *cpu, uint8_t data) { cpu->racc = cpu->regx = mos_update_nz(cpu, data); }
+static inline void mos_alu_alr(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_alu_lsr(cpu, cpu->racc & data); }
+static inline void mos_alu_lxa(MOS_Cpu *cpu, uint8_t data) { cpu->racc = cpu->regx = mos_update_nz(cpu, (cpu->racc | MOS_UNSTABLE_MAGIC) & data); }
+static inline void mos_alu_ane(MOS_Cpu *cpu, uint8_t data) { cpu->racc = mos_update_nz(cpu, (cpu->racc | MOS_UNSTABLE_MAGIC) & cpu->regx & data); }
+static inline void mos_alu_las(MOS_Cpu *cpu, uint8_t data) { cpu->racc = cpu->regx = cpu->sp = mos_update_nz(cpu, cpu->sp & data); }
+
+// AND, then C is a copy of N
+static inline void mos_alu_anc(MOS_Cpu *cpu, uint8_t data)
+{
+    cpu->racc = mos_update_nz(cpu, cpu->racc & data);
+    cpu->flag_c = cpu->racc >> 7;
+}
+
+// AND then ROR A, C comes from bit 6 of the result and V from bit 6 ^ bit 5.
+// In decimal mode N, Z and V still see the rotated value, then each nibble
+// of A gets a BCD fix-up and C tells whether the high one got it
+static inline void mos_alu_arr(MOS_Cpu *cpu, uint8_t data)
+{
+    uint8_t value = cpu->racc & data;
+    uint8_t result = (value >> 1) | (cpu->flag_c << 7);
+    cpu->racc = mos_update_nz(cpu, result);
+    if (!(cpu->psr & D_BIT_FLAG)) {
+        cpu->flag_c = (result >> 6) & 1;
+        cpu->flag_v = ((result << 1) ^ (result << 2)) & 0x80;
+        return;
+    }
+    cpu->flag_v = (value ^ result) << 1;
+    if ((value & 0x0F) + (value & 0x01) > 0x05) {
+        cpu->racc = (cpu->racc & 0xF0) | ((cpu->racc + 0x06) & 0x0F);
+    }
+    cpu->flag_c = (value & 0xF0) + (value & 0x10) > 0x50;
+    if (cpu->flag_c) cpu->racc += 0x60;
+}
+
+// X = (A & X) - M, a compare that keeps the difference
+static inline void mos_alu_sbx(MOS_Cpu *cpu, uint8_t data)
+{
+    uint8_t value = cpu->racc & cpu->regx;
+    cpu->flag_c = value >= data;
+    cpu->regx = mos_update_nz(cpu, value - data);
+}
+
+// SHA, SHX, SHY and TAS store `value` & (high-byte of the base + 1), when
+// the index crosses a page that value also replaces the high-byte of the address
+static inline void mos_store_high(MOS_Cpu *cpu, uint16_t base, uint8_t index, uint8_t value)
+{
+    uint16_t addr = base + index;
+    value &= (base >> 8) + 1;
+    if (mos_page_crossed(base, addr)) addr = (value << 8) | (addr & 0xFF);
+    mos_cpu_write(cpu, addr, value);
+}
+
+#define MOS_HANDLER(op, mode) static void mos_handler_##op##_##mode(MOS_Cpu *cpu, uint16_t operand)
+
+#define MOS_READ_HANDLER(op, mode, alu)    MOS_HANDLER(op, mode) { alu(cpu, mos_read_##mode(cpu, operand)); }
+#define MOS_STORE_HANDLER(op, mode, value) MOS_HANDLER(op, mode) { mos_cpu_write(cpu, mos_address_##mode(cpu, operand), value); }
+#define MOS_MODIFY_HANDLER(op, mode, alu)  MOS_HANDLER(op, mode) { mos_modify_##mode(cpu, operand, alu); }
+#define MOS_BRANCH_HANDLER(op, mode, flag, set) \
+    MOS_HANDLER(op, mode) { mos_branch(cpu, mos_test_flag(cpu, flag) == (set), operand); }
+// Read-modify-write followed by an ALU operation on the written value, the undocumented SLO family
+#define MOS_COMBO_HANDLER(op, mode, modify, alu)                          \
+    MOS_HANDLER(op, mode)                                                 \
+    {                                                                     \
+        uint16_t loc = mos_address_##mode(cpu, operand);                  \
+        uint8_t data = modify(cpu, mos_cpu_read(cpu, loc));               \
+        mos_cpu_write(cpu, loc, data);                                    \
+        alu(cpu, data);                                                   \
+    }
+// TSB and TRB set Z from A & M, then set or clear the bits of A in memory
+#define MOS_TEST_BITS_HANDLER(op, mode, set)                                             \
+    MOS_HANDLER(op, mode)                                                                \
+    {                                                                                    \
+        uint16_t loc = mos_address_##mode(cpu, operand);                                 \
+        uint8_t data = mos_cpu_read(cpu, loc);                                           \
+        cpu->flag_z = data & cpu->racc;                                                  \
+        mos_cpu_write(cpu, loc, (set) ? data | cpu->racc : data & ~cpu->racc);           \
+    }
+// Opcodes without a generator get their handler written out below
+#define MOS_CUSTOM_HANDLER(op, mode)
+
+// How each opcode's handlers are generated
+#define MOS_KIND_LDA(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_lda)
+#define MOS_KIND_LDX(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_ldx)
+#define MOS_KIND_LDY(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_ldy)
+#define MOS_KIND_ADC(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_adc)
+#define MOS_KIND_SBC(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_sbc)
+#define MOS_KIND_CMP(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_cmp)
+#define MOS_KIND_CPX(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_cpx)
+#define MOS_KIND_CPY(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_cpy)
+#define MOS_KIND_AND(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_and)
+#define MOS_KIND_ORA(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_ora)
+#define MOS_KIND_EOR(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_eor)
+#define MOS_KIND_BIT(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_bit)
+
+#define MOS_KIND_STA(op, mode) MOS_STORE_HANDLER(op, mode, cpu->racc)
+#define MOS_KIND_STX(op, mode) MOS_STORE_HANDLER(op, mode, cpu->regx)
+#define MOS_KIND_STY(op, mode) MOS_STORE_HANDLER(op, mode, cpu->regy)
+
+#define MOS_KIND_ASL(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_asl)
+#define MOS_KIND_LSR(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_lsr)
+#define MOS_KIND_ROL(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_rol)
+#define MOS_KIND_ROR(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_ror)
+#define MOS_KIND_INC(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_inc)
+#define MOS_KIND_DEC(op, mode) MOS_MODIFY_HANDLER(op, mode, mos_alu_dec)
+
+#define MOS_KIND_BPL(op, mode) MOS_BRANCH_HANDLER(op, mode, N_BIT_FLAG, false)
+#define MOS_KIND_BMI(op, mode) MOS_BRANCH_HANDLER(op, mode, N_BIT_FLAG, true)
+#define MOS_KIND_BVC(op, mode) MOS_BRANCH_HANDLER(op, mode, V_BIT_FLAG, false)
+#define MOS_KIND_BVS(op, mode) MOS_BRANCH_HANDLER(op, mode, V_BIT_FLAG, true)
+#define MOS_KIND_BCC(op, mode) MOS_BRANCH_HANDLER(op, mode, C_BIT_FLAG, false)
+#define MOS_KIND_BCS(op, mode) MOS_BRANCH_HANDLER(op, mode, C_BIT_FLAG, true)
+#define MOS_KIND_BNE(op, mode) MOS_BRANCH_HANDLER(op, mode, Z_BIT_FLAG, false)
+#define MOS_KIND_BEQ(op, mode) MOS_BRANCH_HANDLER(op, mode, Z_BIT_FLAG, true)
+
+// NOP only needs writing out when implied, the other modes read their operand
+#define MOS_KIND_NOP(op, mode) MOS_KIND_NOP_##mode(op, mode)
+#define MOS_KIND_NOP_IMPL(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_NOP_IMME(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_nop)
+#define MOS_KIND_NOP_ZP(op, mode)   MOS_READ_HANDLER(op, mode, mos_alu_nop)
+#define MOS_KIND_NOP_ZPX(op, mode)  MOS_READ_HANDLER(op, mode, mos_alu_nop)
+#define MOS_KIND_NOP_ABS(op, mode)  MOS_READ_HANDLER(op, mode, mos_alu_nop)
+#define MOS_KIND_NOP_ABSX(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_nop)
+
+#define MOS_KIND_BRK(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_RTI(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_RTS(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_JMP(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_JSR(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_CLC(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_CLD(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_CLI(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_CLV(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_SEC(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_SED(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_SEI(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TAX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TAY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TXA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TYA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TSX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TXS(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PHA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PHP(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PLA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PLP(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_INX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_INY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_DEX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_DEY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+
+#define MOS_KIND_SLO(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_asl, mos_alu_ora)
+#define MOS_KIND_RLA(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_rol, mos_alu_and)
+#define MOS_KIND_SRE(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_lsr, mos_alu_eor)
+#define MOS_KIND_RRA(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_ror, mos_alu_adc)
+#define MOS_KIND_DCP(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_dec, mos_alu_cmp)
+#define MOS_KIND_ISC(op, mode) MOS_COMBO_HANDLER(op, mode, mos_alu_inc, mos_alu_sbc)
+#define MOS_KIND_SAX(op, mode) MOS_STORE_HANDLER(op, mode, cpu->racc & cpu->regx)
+#define MOS_KIND_LAX(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_lax)
+#define MOS_KIND_ANC(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_anc)
+#define MOS_KIND_ALR(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_alr)
+#define MOS_KIND_ARR(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_arr)
+#define MOS_KIND_ANE(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_ane)
+#define MOS_KIND_LXA(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_lxa)
+#define MOS_KIND_SBX(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_sbx)
+#define MOS_KIND_LAS(op, mode) MOS_READ_HANDLER(op, mode, mos_alu_las)
+#define MOS_KIND_SHA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_SHX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_SHY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_TAS(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_JAM(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+
+#define MOS_KIND_STZ(op, mode) MOS_STORE_HANDLER(op, mode, 0)
+#define MOS_KIND_TSB(op, mode) MOS_TEST_BITS_HANDLER(op, mode, true)
+#define MOS_KIND_TRB(op, mode) MOS_TEST_BITS_HANDLER(op, mode, false)
+#define MOS_KIND_BRA(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PHX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PHY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PLX(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+#define MOS_KIND_PLY(op, mode) MOS_CUSTOM_HANDLER(op, mode)
+
+#define MOS_GENERATE_HANDLER(op, mode, cycles) MOS_KIND_##op(op, mode)
+#define MOS_GENERATE_EXTRA(op, mode)           MOS_KIND_##op(op, mode)
+#define MOS_SKIP_UNDOCUMENTED(op, mode, cycles)
+
+MOS_OPCODE_GRID(MOS_GENERATE_HANDLER, MOS_SKIP_UNDOCUMENTED)
+MOS_UNDOCUMENTED_HANDLERS(MOS_GENERATE_EXTRA)
+MOS_65C02_HANDLERS(MOS_GENERATE_EXTRA)
+
+MOS_HANDLER(BRK, IMPL) { (void) operand; mos_break(cpu); }
+MOS_HANDLER(NOP, IMPL) { (void) cpu; (void) operand; }
+
+MOS_HANDLER(JMP, ABS) { cpu->pc = operand; }
+MOS_HANDLER(JMP, IND) { cpu->pc = mos_address_IND(cpu, operand); }
+
+// pushes the address of the last byte of the JSR, RTS adds the one back
+MOS_HANDLER(JSR, ABS)
+{
+    uint16_t ret = cpu->pc - 1;
+    mos_push_stack(cpu, ret >> 8);
+    mos_push_stack(cpu, ret & 0xFF);
+    cpu->pc = operand;
+}
+
+MOS_HANDLER(RTS, IMPL) { (void) operand; mos_return_from_subroutine(cpu); }
+
+MOS_HANDLER(RTI, IMPL) { (void) operand; mos_return_from_interrupt(cpu); }
+
+MOS_HANDLER(CLC, IMPL) { (void) operand; cpu->flag_c = 0; }
+MOS_HANDLER(CLD, IMPL) { (void) operand; mos_clear_psr_flags(cpu, D_BIT_FLAG); }
+MOS_HANDLER(CLI, IMPL) { (void) operand; mos_clear_psr_flags(cpu, I_BIT_FLAG); }
+MOS_HANDLER(CLV, IMPL) { (void) operand; cpu->flag_v = 0; }
+MOS_HANDLER(SEC, IMPL) { (void) operand; cpu->flag_c = 1; }
+MOS_HANDLER(SED, IMPL) { (void) operand; mos_set_psr_flags(cpu, D_BIT_FLAG); }
+MOS_HANDLER(SEI, IMPL) { (void) operand; mos_set_psr_flags(cpu, I_BIT_FLAG); }
+
+MOS_HANDLER(TAX, IMPL) { (void) operand; cpu->regx = mos_update_nz(cpu, cpu->racc); }
+MOS_HANDLER(TAY, IMPL) { (void) operand; cpu->regy = mos_update_nz(cpu, cpu->racc); }
+MOS_HANDLER(TXA, IMPL) { (void) operand; cpu->racc = mos_update_nz(cpu, cpu->regx); }
+MOS_HANDLER(TYA, IMPL) { (void) operand; cpu->racc = mos_update_nz(cpu, cpu->regy); }
+MOS_HANDLER(TSX, IMPL) { (void) operand; cpu->regx = mos_update_nz(cpu, cpu->sp); }
+MOS_HANDLER(TXS, IMPL) { (void) operand; cpu->sp = cpu->regx; }
+
+MOS_HANDLER(PHA, IMPL) { (void) operand; mos_push_stack(cpu, cpu->racc); }
+MOS_HANDLER(PHP, IMPL) { (void) operand; mos_push_status(cpu); }
+MOS_HANDLER(PLA, IMPL) { (void) operand; cpu->racc = mos_update_nz(cpu, mos_pull_stack(cpu)); }
+MOS_HANDLER(PLP, IMPL) { (void) operand; mos_pull_status(cpu); }
+
+MOS_HANDLER(INX, IMPL) { (void) operand; cpu->regx = mos_alu_inc(cpu, cpu->regx); }
+MOS_HANDLER(INY, IMPL) { (void) operand; cpu->regy = mos_alu_inc(cpu, cpu->regy); }
+MOS_HANDLER(DEX, IMPL) { (void) operand; cpu->regx = mos_alu_dec(cpu, cpu->regx); }
+MOS_HANDLER(DEY, IMPL) { (void) operand; cpu->regy = mos_alu_dec(cpu, cpu->regy); }
+
+// Undocumented NMOS
+MOS_HANDLER(SHA, ABSY) { mos_store_high(cpu, operand, cpu->regy, cpu->racc & cpu->regx); }
+MOS_HANDLER(SHA, INDY) { mos_store_high(cpu, mos_address_ZPI(cpu, operand), cpu->regy, cpu->racc & cpu->regx); }
+MOS_HANDLER(SHX, ABSY) { mos_store_high(cpu, operand, cpu->regy, cpu->regx); }
+MOS_HANDLER(SHY, ABSX) { mos_store_high(cpu, operand, cpu->regx, cpu->regy); }
+MOS_HANDLER(TAS, ABSY)
+{
+    cpu->sp = cpu->racc & cpu->regx;
+    mos_store_high(cpu, operand, cpu->regy, cpu->sp);
+}
+
+// pc stays on the JAM and the fault stops the cpu, as the lock up would
+MOS_HANDLER(JAM, IMPL)
+{
+    (void) operand;
+    cpu->pc -= MOS_LENGTH_IMPL;
+    mos_cpu_fault(cpu, MOS_FAULT_JAM, cpu->pc);
+}
+
+// 65C02
+MOS_HANDLER(BRA, REL)  { mos_branch(cpu, true, operand); }
+MOS_HANDLER(PHX, IMPL) { (void) operand; mos_push_stack(cpu, cpu->regx); }
+MOS_HANDLER(PHY, IMPL) { (void) operand; mos_push_stack(cpu, cpu->regy); }
+MOS_HANDLER(PLX, IMPL) { (void) operand; cpu->regx = mos_update_nz(cpu, mos_pull_stack(cpu)); }
+MOS_HANDLER(PLY, IMPL) { (void) operand; cpu->regy = mos_update_nz(cpu, mos_pull_stack(cpu)); }
+MOS_HANDLER(JMP, ABXI) { cpu->pc = mos_address_ABXI(cpu, operand); }
+
+// BIT #imm only sets Z, N and V are left alone
+MOS_HANDLER(BIT, IMME_65C02) { cpu->flag_z = cpu->racc & operand; }
+
+// the page wrap of JMP ($xxFF) is fixed, for one cycle more
+MOS_HANDLER(JMP, IND_65C02)
+{
+    cpu->pc = mos_bytes_to_uint16_t(mos_cpu_read(cpu, operand + 1), mos_cpu_read(cpu, operand));
+}
+
+// shifts and rotates with abs,X only pay the fix-up cycle when the index crosses a page
+#define MOS_MODIFY_65C02_HANDLER(op, alu)                                  \
+    MOS_HANDLER(op, ABSX_65C02)                                            \
+    {                                                                      \
+        uint16_t loc = mos_absolute_x(cpu, operand, true);                 \
+        mos_cpu_write(cpu, loc, alu(cpu, mos_cpu_read(cpu, loc)));         \
+    }
+
+MOS_MODIFY_65C02_HANDLER(ASL, mos_alu_asl)
+MOS_MODIFY_65C02_HANDLER(LSR, mos_alu_lsr)
+MOS_MODIFY_65C02_HANDLER(ROL, mos_alu_rol)
+MOS_MODIFY_65C02_HANDLER(ROR, mos_alu_ror)
+
+struct _mos_dispatch {
+    MOS_Handler handler;
+    uint8_t length;
+    uint8_t cycles; // base cycles, handlers add the page-cross and branch penalties
+};
+
+#define MOS_DISPATCH_ENTRY(op, mode, cycles) { mos_handler_##op##_##mode, MOS_LENGTH_##mode, cycles },
+#define MOS_DISPATCH_65C02(op, mode, cycles) { mos_handler_##op##_##mode##_65C02, MOS_LENGTH_##mode, cycles },
+// Undocumented opcodes decode as BRK on the plain NMOS variant, same as opcode_matrix
+#define MOS_DISPATCH_HOLE(op, mode, cycles)  { mos_handler_BRK_IMPL, MOS_LENGTH_IMPL, 7 },
+
+static const MOS_Dispatch mos_dispatch_nmos[UINT8_MAX + 1] = {
+    MOS_OPCODE_GRID(MOS_DISPATCH_ENTRY, MOS_DISPATCH_HOLE)
+};
+
+static const MOS_Dispatch mos_dispatch_nmos_illegal[UINT8_MAX + 1] = {
+    MOS_OPCODE_GRID(MOS_DISPATCH_ENTRY, MOS_DISPATCH_ENTRY)
+};
+
+static const MOS_Dispatch mos_dispatch_65c02[UINT8_MAX + 1] = {
+    MOS_OPCODE_GRID_65C02(MOS_DISPATCH_ENTRY, MOS_DISPATCH_65C02)
+};
+
+// Executes one instruction through the dispatch table, returns its opcode byte
+uint8_t mos_cpu_step(MOS_Cpu *cpu)
+{
+    if (cpu->cycles >= cpu->next_event) mos_scheduler_fire(cpu);
+    if (cpu->interrupt_pending) mos_cpu_interrupt(cpu);
+    uint8_t opcode = mos_cpu_read(cpu, cpu->pc);
+    const MOS_Dispatch *dispatch = &cpu->dispatch[opcode];
+
+    uint16_t operand = 0;
+    if (dispatch->length > 1) {
+        operand = mos_cpu_read(cpu, cpu->pc + 1);
+        if (dispatch->length > 2) operand |= mos_cpu_read(cpu, cpu->pc + 2) << 8;
+    }
+#ifdef MOS_PROFILE
+    uint16_t pc = cpu->pc;
+    uint64_t cycles = cpu->cycles;
+#endif
+    cpu->pc += dispatch->length;
+    cpu->cycles += dispatch->cycles;
+    dispatch->handler(cpu, operand);
+#ifdef MOS_PROFILE
+    if (cpu->profile != NULL) {
+        mos_profile_instruction(cpu->profile, pc, opcode, cpu->pc, cpu->cycles - cycles);
+    }
+#endif
+    return opcode;
+}
+
+// Runs whole instructions until at least `cycles` have elapsed or the cpu
+// faults, returns the cycles actually run which overshoots by at most one instruction.
+// Blocks stop at the next scheduled event so it fires on time.
+// A profiled or traced cpu only steps so every instruction is seen.
+// Recording or replaying I/O runs cached blocks but no native code, see mos_block_run.
+uint64_t mos_cpu_run(MOS_Cpu *cpu, uint64_t cycles)
+{
+    if (cpu->trace != NULL) return mos_trace_run(cpu, cycles);
+    uint64_t start = cpu->cycles;
+    uint64_t deadline = start + cycles;
+    bool blocks = cpu->cache != NULL && cpu->profile == NULL;
+    while (cpu->cycles < deadline && cpu->fault == MOS_FAULT_NONE) {
+        if (!blocks) {
+            mos_cpu_step(cpu);
+            continue;
+        }
+        if (cpu->cycles >= cpu->next_event) mos_scheduler_fire(cpu);
+        if (cpu->interrupt_pending) mos_cpu_interrupt(cpu);
+        uint64_t stop = cpu->next_event < deadline ? cpu->next_event : deadline;
+        if (!mos_block_run(cpu, stop)) {
+            mos_cpu_step(cpu);
+        }
+    }
+    return cpu->cycles - start;
+}
+
+// NOTE: Basic-block cache
+//
+// Straight-line runs of instructions are decoded once into a block keyed by
+// their start pc, and replayed from it by mos_cpu_run. A block never leaves
+// the page it starts in and only caches code from plain memory pages. While a
+// page holds cached blocks its write pointer is dropped from the page table so
+// every store to it goes through mos_cpu_write, which invalidates the blocks.
+
+#define MOS_BLOCK_CACHE_SLOTS 256 // direct mapped, must be a power of two
+#define MOS_BLOCK_MAX_LENGTH  16  // instructions per block
+#define MOS_JIT_THRESHOLD     16  // runs before a block is handed to the recompiler
+
+typedef struct _mos_decoded {
+    MOS_Handler handler;
+    uint16_t operand;
+    uint8_t length;
+    uint8_t cycles;
+} MOS_Decoded; // Pre-decoded instruction
+
+typedef struct _mos_block {
+    uint16_t start;    // pc of the first instruction
+    uint8_t  count;    // decoded instructions, zero for an empty slot
+    uint16_t hits;     // runs counted towards MOS_JIT_THRESHOLD
+    MOS_NativeBlock native; // recompiled block, NULL until it gets hot
+    MOS_Decoded code[MOS_BLOCK_MAX_LENGTH];
+} MOS_Block;
+
+struct _mos_block_cache {
+    MOS_Block blocks[MOS_BLOCK_CACHE_SLOTS];
+    uint16_t  code_pages[MOS_PAGE_COUNT]; // cached blocks living in each page
+    bool      invalidated; // a store hit cached code during the current block
+};
+
+bool mos_cpu_enable_block_cache(MOS_Cpu *cpu)
+{
+    if (cpu->cache != NULL) return true;
+    cpu->cache = calloc(1, sizeof(*cpu->cache));
+    if (cpu->cache == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for block cache Failed\n");
+        return false;
+    }
+    return true;
+}
+
+static bool mos_block_cache_holds(const MOS_Cpu *cpu, uint8_t page)
+{
+    return cpu->cache->code_pages[page] > 0;
+}
+
+static inline uint32_t mos_block_slot(uint16_t pc)
+{
+    return (pc ^ (pc >> 7)) & (MOS_BLOCK_CACHE_SLOTS - 1);
+}
+
+static void mos_block_drop(MOS_Cpu *cpu, MOS_Block *block)
+{
+    if (block->count == 0) return;
+    uint8_t page = block->start >> 8;
+    block->count = 0;
+    block->hits = 0;
+    block->native = NULL;
+    if (--cpu->cache->code_pages[page] == 0) {
+        mos_cpu_map_page(cpu, page); // give the page its write pointer back
+    }
+}
+
+void mos_block_cache_flush(MOS_Cpu *cpu)
+{
+    for (uint32_t i = 0; i < MOS_BLOCK_CACHE_SLOTS; ++i) {
+        mos_block_drop(cpu, &cpu->cache->blocks[i]);
+    }
+    cpu->cache->invalidated = true;
+}
+
+// Drops every block decoded from `page`
+void mos_block_cache_invalidate(MOS_Cpu *cpu, uint8_t page)
+{
+    MOS_BlockCache *cache = cpu->cache;
+    if (cache->code_pages[page] == 0) return;
+    for (uint32_t i = 0; i < MOS_BLOCK_CACHE_SLOTS && cache->code_pages[page] > 0; ++i) {
+        MOS_Block *block = &cache->blocks[i];
+        if (block->count > 0 && (block->start >> 8) == page) {
+            mos_block_drop(cpu, block);
+        }
+    }
+    cache->invalidated = true;
+}
+
+// Anything that may move pc somewhere else ends a block
+static bool mos_block_ends(MOS_OpcodeInfo info)
+{
+    return info.mode == REL || info.opcode == BRK || info.opcode == RTI ||
+        info.opcode == RTS || info.opcode == JMP || info.opcode == JSR || info.opcode == JAM;
+}
+
+// Decodes the block starting at `pc` into `block`, false if there is nothing to cache
+static bool mos_block_decode(MOS_Cpu *cpu, MOS_Block *block, uint16_t pc)
+{
+    uint8_t page = pc >> 8;
+    const uint8_t *memory = cpu->pages[page].read;
+    if (memory == NULL) return false; // never cache code behind device callbacks
+
+    mos_block_drop(cpu, block);
+    uint8_t count = 0;
+    uint32_t offset = pc & 0xFF;
+    while (count < MOS_BLOCK_MAX_LENGTH) {
+        uint8_t opcode = memory[offset];
+        const MOS_Dispatch *dispatch = &cpu->dispatch[opcode];
+        if (offset + dispatch->length > MOS_PAGE_SIZE) break; // operand spills into the next page
+
+        MOS_Decoded *decoded = &block->code[count++];
+        decoded->handler = dispatch->handler;
+        decoded->length  = dispatch->length;
+        decoded->cycles  = dispatch->cycles;
+        decoded->operand = 0;
+        if (dispatch->length > 1) decoded->operand = memory[offset + 1];
+        if (dispatch->length > 2) decoded->operand |= memory[offset + 2] << 8;
+
+        offset += dispatch->length;
+        if (mos_block_ends(cpu->opcodes[opcode]) || offset == MOS_PAGE_SIZE) break;
+    }
+    if (count == 0) return false;
+
+    block->start = pc;
+    block->count = count;
+    if (cpu->cache->code_pages[page]++ == 0) {
+        cpu->pages[page].write = NULL; // route stores through mos_cpu_write
+    }
+    return true;
+}
+
+// Store used by native blocks, false when it invalidated cached code or faulted
+bool mos_block_write(MOS_Cpu *cpu, uint16_t addr, uint8_t data)
+{
+    cpu->cache->invalidated = false;
+    mos_cpu_write(cpu, addr, data);
+    return !cpu->cache->invalidated && cpu->fault == MOS_FAULT_NONE;
+}
+
+static void mos_block_cache_drop_native(MOS_BlockCache *cache)
+{
+    for (uint32_t i = 0; i < MOS_BLOCK_CACHE_SLOTS; ++i) {
+        cache->blocks[i].native = NULL;
+        cache->blocks[i].hits = 0;
+    }
+}
+
+// Turns the recompiler off, cached blocks go back to being interpreted
+void mos_cpu_disable_jit(MOS_Cpu *cpu)
+{
+    if (cpu->jit == NULL) return;
+    mos_block_cache_drop_native(cpu->cache);
+    mos_jit_free(cpu->jit);
+    cpu->jit = NULL;
+}
+
+static MOS_NativeBlock mos_block_compile(MOS_Cpu *cpu, MOS_Block *block)
+{
+    if (!mos_jit_reserve(cpu->jit)) {
+        // out of code space, start over with only the blocks that are still hot
+        mos_block_cache_drop_native(cpu->cache);
+        mos_jit_reset(cpu->jit);
+    }
+    return mos_jit_compile(cpu->jit, cpu, block->start, block->count);
+}
+
+// Runs the cached block at pc, stopping early at `deadline`, when the block
+// invalidates itself or once an interrupt can be taken. Returns false when pc
+// is not cacheable
+bool mos_block_run(MOS_Cpu *cpu, uint64_t deadline)
+{
+    MOS_BlockCache *cache = cpu->cache;
+    MOS_Block *block = &cache->blocks[mos_block_slot(cpu->pc)];
+    if (block->count == 0 || block->start != cpu->pc) {
+        if (!mos_block_decode(cpu, block, cpu->pc)) return false;
+    }
+
+    // native code takes interrupts only at the end of the block, I/O replay
+    // needs them on the instruction mos_cpu_step would take them
+    bool native = cpu->jit != NULL && cpu->replay == NULL;
+    if (native && block->hits < MOS_JIT_THRESHOLD && ++block->hits == MOS_JIT_THRESHOLD) {
+        block->native = mos_block_compile(cpu, block);
+    }
+    if (native && block->native != NULL) {
+        uint64_t cycles = cpu->cycles;
+        block->native(cpu, deadline);
+        if (cpu->cycles != cycles) return true;
+        // the first instruction bailed out (decimal mode), interpret the block this time
+    }
+
+    cache->invalidated = false;
+    for (uint8_t i = 0; i < block->count; ++i) {
+        const MOS_Decoded *decoded = &block->code[i];
+        cpu->pc += decoded->length;
+        cpu->cycles += decoded->cycles;
+        decoded->handler(cpu, decoded->operand);
+        if (cache->invalidated || cpu->fault != MOS_FAULT_NONE || cpu->cycles >= deadline) break;
+        if (mos_interrupt_ready(cpu)) break;
+    }
+    return true;
+}
+
 const char *mos_addr_mode_as_cstr(MOS_AddressingModes mode)
 {
     switch (mode) {
@@ -825,75 +2094,77 @@ const char *mos_addr_mode_as_cstr(MOS_AddressingModes mode)
     case IND:  return "INDIRECT";
     case INDX: return "INDEXED_INDIRECT";
     case INDY: return "INDIRECT_INDEXED";
+    case ZPI:  return "ZERO_PAGE_INDIRECT";
+    case ABXI: return "ABSOLUTE_X_INDIRECT";
     default:   return NULL;
     }
 }
 
+const char *mos_fault_as_cstr(MOS_Fault fault)
+{
+    switch (fault) {
+    case MOS_FAULT_NONE:            return "NONE";
+    case MOS_FAULT_UNMAPPED_WRITE:  return "UNMAPPED_WRITE";
+    case MOS_FAULT_READONLY_WRITE:  return "READONLY_WRITE";
+    case MOS_FAULT_REPLAY_DIVERGED: return "REPLAY_DIVERGED";
+    case MOS_FAULT_JAM:             return "JAM";
+    default:                        return NULL;
+    }
+}
+
+#define MOS_MNEMONIC_CASE(op) case op: return #op;
+
 const char *mos_opcode_as_cstr(MOS_Opcode opcode)
 {
     switch (opcode) {
-    case BRK:                  return "BRK";
-    case NOP:                  return "NOP";
-    case RTI:                  return "RTI";
-    case RTS:                  return "RTS";
-    case JMP:                  return "JMP";
-    case JSR:                  return "JSR";
-    case ADC:                  return "ADC";
-    case SBC:                  return "SBC";
-    case CMP:                  return "CMP";
-    case CPX:                  return "CPX";
-    case CPY:                  return "CPY";
-    case LDA:                  return "LDA";
-    case LDY:                  return "LDY";
-    case LDX:                  return "LDX";
-    case STA:                  return "STA";
-    case STY:                  return "STY";
-    case STX:                  return "STX";
-    case CLC:                  return "CLC";
-    case CLV:                  return "CLV";
-    case CLI:                  return "CLI";
-    case CLD:                  return "CLD";
-    case SEC:                  return "SEC";
-    case SED:                  return "SED";
-    case SEI:                  return "SEI";
-    case ORA:                  return "ORA";
-    case AND:                  return "AND";
-    case EOR:                  return "EOR";
-    case BIT:                  return "BIT";
-    case TAX:                  return "TAX";
-    case TAY:                  return "TAY";
-    case TXA:                  return "TXA";
-    case TYA:                  return "TYA";
-    case TSX:                  return "TSX";
-    case TXS:                  return "TXS";
-    case PHA:                  return "PHA";
-    case PHP:                  return "PHP";
-    case PLA:                  return "PLA";
-    case PLP:                  return "PLP";
-    case INC:                  return "INC";
-    case INX:                  return "INX";
-    case INY:                  return "INY";
-    case DEX:                  return "DEX";
-    case DEY:                  return "DEY";
-    case DEC:                  return "DEC";
-    case BNE:                  return "BNE";
-    case BCC:                  return "BCC";
-    case BCS:                  return "BCS";
-    case BEQ:                  return "BEQ";
-    case BMI:                  return "BMI";
-    case BPL:                  return "BPL";
-    case BVC:                  return "BVC";
-    case BVS:                  return "BVS";
-    case ASL:                  return "ASL";
-    case LSR:                  return "LSR";
-    case ROL:                  return "ROL";
-    case ROR:                  return "ROR";
+    MOS_MNEMONICS(MOS_MNEMONIC_CASE)
     case ERROR_FETCH_DATA:     return "ERROR_FETCH_DATA";
     case ERROR_FETCH_LOCATION: return "ERROR_FETCH_LOCATION";
     default:                   return NULL;
     }
 }
 
+// NOTE: Mnemonic lookup
+//
+// A mnemonic is three letters, each packs into 5 bits with the case bit
+// dropped, so the 15-bit key indexes a table of opcode + 1 directly.
+#define MOS_MNEMONIC_KEYS (1 << 15)
+
+static uint8_t mos_mnemonic_table[MOS_MNEMONIC_KEYS];
+static pthread_once_t mos_mnemonic_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t mos_mnemonic_key(const char *text)
+{
+    return (text[0] & 0x1F) << 10 | (text[1] & 0x1F) << 5 | (text[2] & 0x1F);
+}
+
+#define MOS_MNEMONIC_ENTRY(op)                          \
+    assert(mos_mnemonic_table[mos_mnemonic_key(#op)] == 0); \
+    mos_mnemonic_table[mos_mnemonic_key(#op)] = op + 1;
+
+static void mos_mnemonic_build(void)
+{
+    MOS_MNEMONICS(MOS_MNEMONIC_ENTRY)
+}
+
+static inline bool mos_is_letter(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// Case-insensitive, false when the `len` bytes of `text` are not a mnemonic
+bool mos_opcode_from_mnemonic(const char *text, size_t len, MOS_Opcode *opcode)
+{
+    if (len != 3 || !mos_is_letter(text[0]) || !mos_is_letter(text[1]) || !mos_is_letter(text[2])) {
+        return false;
+    }
+    pthread_once(&mos_mnemonic_once, mos_mnemonic_build);
+    uint8_t entry = mos_mnemonic_table[mos_mnemonic_key(text)];
+    if (entry == 0) return false;
+    *opcode = entry - 1;
+    return true;
+}
+
 const char *mos_operand_type_as_cstr(MOS_OperandType type)
 {
     switch (type) {
@@ -903,22 +2174,67 @@ const char *mos_operand_type_as_cstr(MOS_OperandType type)
     }
 }
 
+const char *mos_variant_as_cstr(MOS_Variant variant)
+{
+    switch (variant) {
+    case MOS_VARIANT_NMOS:         return "nmos";
+    case MOS_VARIANT_NMOS_ILLEGAL: return "nmos-illegal";
+    case MOS_VARIANT_65C02:        return "65c02";
+    case MOS_VARIANT_COUNT:
+    default:                       return NULL;
+    }
+}
+
+// Parses a name printed by mos_variant_as_cstr
+bool mos_variant_from_cstr(const char *name, MOS_Variant *variant)
+{
+    for (uint32_t i = 0; i < MOS_VARIANT_COUNT; ++i) {
+        if (strcmp(name, mos_variant_as_cstr(i)) == 0) {
+            *variant = i;
+            return true;
+        }
+    }
+    fprintf(stderr, "ERROR: unknown cpu variant `%s`, expected nmos, nmos-illegal or 65c02\n", name);
+    return false;
+}
+
+#define MOS_MATRIX_ENTRY(op, mode, cycles) { op, mode, cycles },
+#define MOS_MATRIX_HOLE(op, mode, cycles)  { BRK, IMPL, 7 },
+
 MOS_OpcodeInfo opcode_matrix[UINT8_MAX + 1] = {
-    //-0                  -1          -2            -3              -4         -5         -6                 -7           -8          -9           -A              -B          -C          -D          -E          -F
-    {BRK, IMPL},  {ORA, INDX},        {0x00},        {0x00},        {0x00}, {ORA, ZP} ,  {ASL, ZP},      {0x00},  {PHP, IMPL}, {ORA, IMME},   {ASL, ACCU},        {0x00},      {0x00},  {ORA, ABS},   {ASL, ABS},    {0x00}, // 0-
-    {BPL, REL} ,  {ORA, INDY},        {0x00},        {0x00},        {0x00}, {ORA, ZPX}, {ASL, ZPX},      {0x00},  {CLC, IMPL}, {ORA, ABSY},        {0x00},        {0x00},      {0x00}, {ORA, ABSX},  {ASL, ABSX},    {0x00}, // 1-
-    {JSR, ABS} ,  {AND, INDX},        {0x00},        {0x00},     {BIT, ZP}, {AND, ZP} ,  {ROL, ZP},      {0x00},  {PLP, IMPL}, {AND, IMME},   {ROL, ACCU},        {0x00},  {BIT, ABS},  {AND, ABS},   {ROL, ABS},    {0x00}, // 2-
-    {BMI, REL} ,  {AND, INDY},        {0x00},        {0x00},        {0x00}, {AND, ZPX}, {ROL, ZPX},      {0x00},  {SEC, IMPL}, {AND, ABSY},        {0x00},        {0x00},      {0x00}, {AND, ABSX},  {ROL, ABSX},    {0x00}, // 3-
-    {RTI, IMPL},  {EOR, INDX},        {0x00},        {0x00},        {0x00}, {EOR, ZP} ,  {LSR, ZP},      {0x00},  {PHA, IMPL}, {EOR, IMME},    {LSR, ABS},        {0x00},  {JMP, ABS},  {EOR, ABS},   {LSR, ABS},    {0x00}, // 4-
-    {BVC, REL} ,  {EOR, INDY},        {0x00},        {0x00},        {0x00}, {EOR, ZPX}, {LSR, ZPX},      {0x00},  {CLI, IMPL}, {EOR, ABSY},        {0x00},        {0x00},      {0x00}, {EOR, ABSX},  {LSR, ABSX},    {0x00}, // 5-
-    {RTS, IMPL},  {ADC, INDX},        {0x00},        {0x00},        {0x00}, {ADC, ZP} ,  {ROR, ZP},      {0x00},  {PLA, IMPL}, {ADC, IMME},   {ROR, ACCU},        {0x00},  {JMP, IND},  {ADC, ABS},   {ROR, ABS},    {0x00}, // 6-
-    {BVS, REL} ,  {ADC, INDY},        {0x00},        {0x00},        {0x00}, {ADC, ZPX}, {ROR, ZPX},      {0x00},  {SEI, IMPL}, {ADC, ABSY},        {0x00},        {0x00},      {0x00}, {ADC, ABSX},  {ROR, ABSX},    {0x00}, // 7-
-         {0x00},  {STA, INDX},        {0x00},        {0x00},     {STY, ZP}, {STA, ZP} ,  {STX, ZP},      {0x00},  {DEY, IMPL},      {0x00},   {TXA, IMPL},        {0x00},  {STY, ABS},  {STA, ABS},   {STX, ABS},    {0x00}, // 8-
-    {BCC, REL} ,  {STA, INDY},        {0x00},        {0x00},    {STY, ZPX}, {STA, ZPX}, {STX, ZPY},      {0x00},  {TYA, IMPL}, {STA, ABSY},   {TXS, IMPL},        {0x00},      {0x00}, {STA, ABSX},       {0x00},    {0x00}, // 9-
-    {LDY, IMME},  {LDA, INDX},   {LDX, IMME},        {0x00},     {LDY, ZP}, {LDA, ZP} ,  {LDX, ZP},      {0x00},  {TAY, IMPL}, {LDA, IMME},   {TAX, IMPL},        {0x00},  {LDY, ABS},  {LDA, ABS},   {LDX, ABS},    {0x00}, // A-
-    {BCS, REL} ,  {LDA, INDY},        {0x00},        {0x00},    {LDY, ZPX}, {LDA, ZPX}, {LDX, ZPY},      {0x00},  {CLV, IMPL}, {LDA, ABSY},   {TSX, IMPL},        {0x00}, {LDY, ABSX}, {LDA, ABSX},  {LDX, ABSY},    {0x00}, // B-
-    {CPY, IMME},  {CMP, INDX},        {0x00},        {0x00},     {CPY, ZP}, {CMP, ZP} ,  {DEC, ZP},      {0x00},  {INY, IMPL}, {CMP, IMME},   {DEX, IMPL},        {0x00},  {CPY, ABS},  {CMP, ABS},   {DEC, ABS},    {0x00}, // C-
-    {BNE, REL} ,  {CMP, INDY},        {0x00},        {0x00},        {0x00}, {CMP, ZPX}, {DEC, ZPX},      {0x00},  {CLD, IMPL}, {CMP, ABSY},        {0x00},        {0x00},      {0x00}, {CMP, ABSX},  {DEC, ABSX},    {0x00}, // D-
-    {CPX, IMME},  {SBC, INDX},        {0x00},        {0x00},     {CPX, ZP}, {SBC, ZP} ,  {INC, ZP},      {0x00},  {INX, IMPL}, {SBC, IMME},   {NOP, IMPL},        {0x00},  {CPX, ABS},  {SBC, ABS},   {INC, ABS},    {0x00}, // E-
-    {BEQ, REL} ,  {SBC, INDY},        {0x00},        {0x00},        {0x00}, {SBC, ZPX}, {INC, ZPX},      {0x00},  {SED, IMPL}, {SBC, ABSY},        {0x00},        {0x00},      {0x00}, {SBC, ABSX},  {INC, ABSX},    {0x00}, // F-
+    MOS_OPCODE_GRID(MOS_MATRIX_ENTRY, MOS_MATRIX_HOLE)
+};
+
+static const MOS_OpcodeInfo mos_opcodes_nmos_illegal[UINT8_MAX + 1] = {
+    MOS_OPCODE_GRID(MOS_MATRIX_ENTRY, MOS_MATRIX_ENTRY)
 };
+
+static const MOS_OpcodeInfo mos_opcodes_65c02[UINT8_MAX + 1] = {
+    MOS_OPCODE_GRID_65C02(MOS_MATRIX_ENTRY, MOS_MATRIX_ENTRY)
+};
+
+const MOS_OpcodeInfo *mos_variant_opcodes(MOS_Variant variant)
+{
+    switch (variant) {
+    case MOS_VARIANT_NMOS:         return opcode_matrix;
+    case MOS_VARIANT_NMOS_ILLEGAL: return mos_opcodes_nmos_illegal;
+    case MOS_VARIANT_65C02:        return mos_opcodes_65c02;
+    case MOS_VARIANT_COUNT:
+    default:                       return NULL;
+    }
+}
+
+// Points the cpu at the tables of `variant`, the only place the variant is looked at when decoding
+static void mos_cpu_select_variant(MOS_Cpu *cpu, MOS_Variant variant)
+{
+    assert(variant < MOS_VARIANT_COUNT);
+    pthread_once(&mos_decimal_once, mos_decimal_build);
+    static const MOS_Dispatch *const dispatch[MOS_VARIANT_COUNT] = {
+        [MOS_VARIANT_NMOS]         = mos_dispatch_nmos,
+        [MOS_VARIANT_NMOS_ILLEGAL] = mos_dispatch_nmos_illegal,
+        [MOS_VARIANT_65C02]        = mos_dispatch_65c02,
+    };
+    cpu->variant = variant;
+    cpu->dispatch = dispatch[variant];
+    cpu->opcodes = mos_variant_opcodes(variant);
+}
@@ -5,6 +5,19 @@
 #define MOS_MAX_PAGES  UINT8_MAX
 #define MOS_ZERO_PAGE  0x00
 #define MOS_STACK_PAGE 0x01
+#define MOS_PAGE_COUNT 0x100
+#define MOS_PAGE_SIZE  0x100
+
+#define MOS_NMI_VECTOR   0xFFFA
+#define MOS_RESET_VECTOR 0xFFFC
+#define MOS_IRQ_VECTOR   0xFFFE // shared with BRK
+#define MOS_INTERRUPT_CYCLES 7
+
+// Image header written by mosasm --m65i and loaded by mosemu, see mosemu.c
+#define MOS_IMAGE_MAGIC       "M65I"
+#define MOS_IMAGE_VERSION     1
+#define MOS_IMAGE_HEADER_SIZE 10
+#define MOS_IMAGE_HAS_RESET   0x01
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,14 +42,75 @@ typedef struct _mos_mmap {
 
 typedef ARRAY(MOS_MMap) MOS_MMaps;
 
+// One slot per 6502 page, rebuilt whenever a MOS_MMap is registered.
+// Plain RAM/ROM pages carry host pointers so accesses skip the entry scan,
+// I/O pages dispatch through `entry`, and pages split between several
+// entries (or not mapped at all) leave everything NULL and fall back to a scan.
+typedef struct _mos_page {
+    uint8_t  *read;  // host memory of the page, NULL if reads need a callback
+    uint8_t  *write; // host memory of the page, NULL if writes need a callback
+    MOS_MMap *entry; // owning entry when it covers the whole page
+} MOS_Page;
+
+// Raised by the cpu instead of terminating the process, execution stops until it is cleared
+typedef enum _mos_fault {
+    MOS_FAULT_NONE = 0,
+    MOS_FAULT_UNMAPPED_WRITE, // store to an address no entry covers
+    MOS_FAULT_READONLY_WRITE, // store to a readonly entry
+    MOS_FAULT_REPLAY_DIVERGED, // device read the I/O log does not have next
+    MOS_FAULT_JAM,             // undocumented opcode that locks up an NMOS cpu
+} MOS_Fault;
+
+// Instruction set the cpu decodes, fixed by mos_cpu_init_variant
+typedef enum _mos_variant {
+    MOS_VARIANT_NMOS,         // documented NMOS opcodes, the others run as BRK
+    MOS_VARIANT_NMOS_ILLEGAL, // NMOS with the undocumented opcodes (LAX, SAX, DCP, ISC...)
+    MOS_VARIANT_65C02,        // CMOS 65C02, undefined opcodes are NOPs
+    MOS_VARIANT_COUNT,
+} MOS_Variant;
+
+typedef struct _mos_block_cache MOS_BlockCache;
+typedef struct _mos_jit MOS_Jit;
+typedef struct _mos_profile MOS_Profile;
+typedef struct _mos_cow MOS_Cow;
+typedef struct _mos_trace MOS_Trace;
+typedef struct _mos_replay MOS_Replay;
+typedef struct _mos_scheduler MOS_Scheduler;
+typedef struct _mos_dispatch MOS_Dispatch;
+typedef struct _mos_opcode_info MOS_OpcodeInfo;
+
 typedef struct _mos_cpu {
     uint8_t  regx; // Reg x
     uint8_t  regy; // Reg y
     uint8_t  racc; // Accumulator
     uint8_t  sp;   // Stack pointer
     uint16_t pc;   // Program Counter
-    uint8_t  psr;  // Process Status Reg
+    uint8_t  psr;  // Process Status Reg, read it through mos_cpu_get_psr
+    // N, Z, C and V are recorded as raw results and only folded into psr when read
+    uint8_t  flag_n; // bit 7 is N
+    uint8_t  flag_z; // Z is set while this is zero
+    uint8_t  flag_c; // 0 or 1
+    uint8_t  flag_v; // bit 7 is V
+    uint64_t cycles; // Elapsed clock cycles
+    MOS_Fault fault;     // first fault since it was last cleared
+    uint16_t fault_addr; // address that raised it
+    uint32_t irq_lines;     // IRQ sources holding the line, one bit each, level triggered
+    bool nmi_line;          // NMI input level, an NMI is latched when it gets asserted
+    bool nmi_pending;       // latched NMI not taken yet
+    bool interrupt_pending; // NMI latched or IRQ held, the only thing checked between instructions
+    uint64_t next_event;    // cycle the earliest scheduled event is due, UINT64_MAX when none
     MOS_MMaps entries;
+    MOS_Page  pages[MOS_PAGE_COUNT];
+    MOS_BlockCache *cache; // pre-decoded blocks, NULL when disabled
+    MOS_Jit *jit;          // native code for hot blocks, NULL when disabled
+    MOS_Profile *profile;  // execution counters, NULL when disabled or not built in
+    MOS_Cow *cow;          // pages shared with snapshots, NULL until the first one
+    MOS_Trace *trace;      // instruction trace recorder, NULL when disabled
+    MOS_Replay *replay;    // device read log being recorded or replayed, NULL when neither
+    MOS_Scheduler *scheduler; // timed device events, NULL until the first one
+    MOS_Variant variant;
+    const MOS_Dispatch *dispatch;  // handler table of the variant
+    const MOS_OpcodeInfo *opcodes; // opcode table of the variant
 } MOS_Cpu;
 
 typedef enum _mos_status_flags {
@@ -64,92 +138,56 @@ typedef enum _mos_addressing_modes {
     IND,  // INDIRECT
     INDX, // INDIRECT_X
     INDY, // INDIRECT_Y
+    ZPI,  // ZERO_PAGE_INDIRECT, 65C02 only
+    ABXI, // ABSOLUTE_X_INDIRECT, 65C02 JMP only
 } MOS_AddressingModes;
 
+// Every mnemonic in MOS_Opcode order, the enum, mos_opcode_as_cstr and
+// mos_opcode_from_mnemonic are generated from it
+#define MOS_MNEMONICS(X)                                                       \
+    /* System Functions */           X(BRK) X(NOP) X(RTI)                      \
+    /* Jump and calls */             X(RTS) X(JMP) X(JSR)                      \
+    /* Arithmetic */                 X(ADC) X(SBC) X(CMP) X(CPX) X(CPY)        \
+    /* Load Operations */            X(LDA) X(LDY) X(LDX)                      \
+    /* Store Operations */           X(STA) X(STY) X(STX)                      \
+    /* Clear Status Flag Changes */  X(CLC) X(CLV) X(CLI) X(CLD)               \
+    /* Set Status Flag Changes */    X(SEC) X(SED) X(SEI)                      \
+    /* Logical */                    X(ORA) X(AND) X(EOR) X(BIT)               \
+    /* Reg Transfers */              X(TAX) X(TAY) X(TXA) X(TYA)               \
+    /* Stack Operations */           X(TSX) X(TXS) X(PHA) X(PHP) X(PLA) X(PLP) \
+    /* Increments */                 X(INC) X(INX) X(INY)                      \
+    /* Decrements */                 X(DEX) X(DEY) X(DEC)                      \
+    /* Branches */                   X(BNE) X(BCC) X(BCS) X(BEQ)               \
+                                     X(BMI) X(BPL) X(BVC) X(BVS)               \
+    /* Shifts */                     X(ASL) X(LSR) X(ROL) X(ROR)               \
+    /* Undocumented NMOS */                                                    \
+    X(SLO) /* ASL then ORA */                                                  \
+    X(RLA) /* ROL then AND */                                                  \
+    X(SRE) /* LSR then EOR */                                                  \
+    X(RRA) /* ROR then ADC */                                                  \
+    X(SAX) /* store A & X */                                                   \
+    X(LAX) /* LDA and LDX */                                                   \
+    X(DCP) /* DEC then CMP */                                                  \
+    X(ISC) /* INC then SBC */                                                  \
+    X(ANC) /* AND, C = N */                                                    \
+    X(ALR) /* AND then LSR A */                                                \
+    X(ARR) /* AND then ROR A */                                                \
+    X(ANE) /* unstable A = (A | magic) & X & M */                              \
+    X(LXA) /* unstable A = X = (A | magic) & M */                              \
+    X(SBX) /* X = (A & X) - M */                                               \
+    X(SHA) /* store A & X & (high + 1) */                                      \
+    X(SHX) /* store X & (high + 1) */                                          \
+    X(SHY) /* store Y & (high + 1) */                                          \
+    X(TAS) /* SP = A & X then SHA */                                           \
+    X(LAS) /* A = X = SP = M & SP */                                           \
+    X(JAM) /* locks the cpu up */                                              \
+    /* 65C02 */                      X(BRA) X(PHX) X(PHY) X(PLX) X(PLY)        \
+                                     X(STZ) X(TRB) X(TSB)
+
+#define MOS_MNEMONIC_ENUM(op) op,
+
 typedef enum _mos_opcodes {
-    // System Functions
-    BRK,
-    NOP,
-    RTI,
-
-    // Jump and calls
-    RTS,
-    JMP,
-    JSR,
-
-    // Arithmetic
-    ADC,
-    SBC,
-    CMP,
-    CPX,
-    CPY,
-
-    // Load Operations
-    LDA,
-    LDY,
-    LDX,
-
-    // Store Operations
-    STA,
-    STY,
-    STX,
-
-    // Clear Status Flag Changes
-    CLC,
-    CLV,
-    CLI,
-    CLD,
-
-    // Set Status Flag Changes
-    SEC,
-    SED,
-    SEI,
-
-    // Logical
-    ORA,
-    AND,
-    EOR,
-    BIT,
-
-    // Reg Transfers
-    TAX,
-    TAY,
-    TXA,
-    TYA,
-
-    // Stack Operations
-    TSX,
-    TXS,
-    PHA,
-    PHP,
-    PLA,
-    PLP,
-
-    // Increments
-    INC,
-    INX,
-    INY,
-
-    // Decrements
-    DEX,
-    DEY,
-    DEC,
-
-    // Branches
-    BNE,
-    BCC,
-    BCS,
-    BEQ,
-    BMI,
-    BPL,
-    BVC,
-    BVS,
-
-    // Shifts
-    ASL,
-    LSR,
-    ROL,
-    ROR,
+    MOS_MNEMONICS(MOS_MNEMONIC_ENUM)
 
     // Error Values
     ERROR_FETCH_DATA,
@@ -177,18 +215,25 @@ typedef struct _mos_instruction {
     MOS_Operand operand;
 } MOS_Instruction;
 
-typedef struct _mos_opcode_info {
+struct _mos_opcode_info {
     MOS_Opcode opcode;
     MOS_AddressingModes mode;
-} MOS_OpcodeInfo;
+    uint8_t cycles; // base cycles, without page-cross and branch penalties
+};
 
-// Opcode/Mode matrix
+// Opcode/Mode matrix of the documented NMOS opcodes, a cpu decodes through its `opcodes`
 extern MOS_OpcodeInfo opcode_matrix[UINT8_MAX + 1];
+const MOS_OpcodeInfo *mos_variant_opcodes(MOS_Variant variant);
 
 // Functions Declarations
 const char *mos_addr_mode_as_cstr(MOS_AddressingModes mode);
 const char *mos_opcode_as_cstr(MOS_Opcode opcode);
+bool mos_opcode_from_mnemonic(const char *text, size_t len, MOS_Opcode *opcode);
+const char *mos_fault_as_cstr(MOS_Fault fault);
+const char *mos_variant_as_cstr(MOS_Variant variant);
+bool mos_variant_from_cstr(const char *name, MOS_Variant *variant);
 const char *mos_operand_type_as_cstr(MOS_OperandType type);
+uint8_t mos_addr_mode_length(MOS_AddressingModes mode);
 
 #define MOS_ARRAY_LEN(xs) (sizeof(xs) / sizeof(xs[0]))
 
@@ -230,15 +275,24 @@ const char *mos_operand_type_as_cstr(MOS_OperandType type);
     } while (0)
 
 MOS_Cpu mos_cpu_init(void);
+MOS_Cpu mos_cpu_init_variant(MOS_Variant variant);
+void mos_cpu_free(MOS_Cpu *cpu);
+void mos_cpu_map(MOS_Cpu *cpu, MOS_MMap map);
+void mos_cpu_map_page(MOS_Cpu *cpu, uint8_t page);
+void mos_cpu_map_pages(MOS_Cpu *cpu);
+MOS_MMap *mos_cpu_find_entry(MOS_Cpu *cpu, uint16_t addr);
 
 uint8_t mos_read_memory(void *device, uint16_t location);
 uint8_t mos_cpu_read(MOS_Cpu *cpu, uint16_t addr);
+void mos_cpu_fault(MOS_Cpu *cpu, MOS_Fault fault, uint16_t addr);
 void mos_write_memory(void *device, uint16_t location, uint8_t data);
 void mos_cpu_write(MOS_Cpu *cpu, uint16_t addr, uint8_t data);
 
 void mos_push_stack(MOS_Cpu *cpu, uint8_t value);
 uint8_t mos_pull_stack(MOS_Cpu *cpu);
 
+uint8_t mos_cpu_get_psr(const MOS_Cpu *cpu);
+void mos_cpu_set_psr(MOS_Cpu *cpu, uint8_t psr);
 void mos_set_psr_flags(MOS_Cpu *cpu, MOS_StatusFlags flags);
 void mos_clear_psr_flags(MOS_Cpu *cpu, MOS_StatusFlags flags);
 
@@ -259,6 +313,8 @@ void mos_compare_reg_with_data(MOS_Cpu *cpu, MOS_Instruction instruction, uint8_
 void mos_transfer_stack_to_reg(MOS_Cpu *cpu, uint8_t *data);
 void mos_push_reg_to_stack(MOS_Cpu *cpu, uint8_t reg_type);
 void mos_pull_reg_from_stack(MOS_Cpu *cpu, uint8_t *reg_type);
+void mos_push_status(MOS_Cpu *cpu);
+void mos_pull_status(MOS_Cpu *cpu);
 
 void mos_logical_and(MOS_Cpu *cpu, MOS_Instruction instruction);
 void mos_logical_xor(MOS_Cpu *cpu, MOS_Instruction instruction);
@@ -285,8 +341,133 @@ void mos_logical_shift_right_memory(MOS_Cpu *cpu, MOS_Instruction instruction);
 void mos_rotate_left_memory(MOS_Cpu *cpu, MOS_Instruction instruction);
 void mos_rotate_right_memory(MOS_Cpu *cpu, MOS_Instruction instruction);
 
+void mos_jump(MOS_Cpu *cpu, MOS_Instruction instruction);
+void mos_jump_to_subroutine(MOS_Cpu *cpu, MOS_Instruction instruction);
+void mos_return_from_subroutine(MOS_Cpu *cpu);
+
 void mos_break(MOS_Cpu *cpu);
+void mos_return_from_interrupt(MOS_Cpu *cpu);
 bool mos_decode(MOS_Cpu *cpu, MOS_Instruction instruction);
+MOS_Instruction mos_fetch_instruction(MOS_Cpu *cpu);
+
+// Dispatch table interpreter, one handler per opcode byte
+typedef void (*MOS_Handler)(MOS_Cpu *cpu, uint16_t operand);
+uint8_t mos_cpu_step(MOS_Cpu *cpu);
+uint64_t mos_cpu_run(MOS_Cpu *cpu, uint64_t cycles);
+
+// Interrupt inputs, taken between instructions by mos_cpu_step and mos_cpu_run
+void mos_cpu_set_irq(MOS_Cpu *cpu, uint8_t source, bool asserted);
+void mos_cpu_set_nmi(MOS_Cpu *cpu, bool asserted);
+bool mos_cpu_interrupt(MOS_Cpu *cpu);
+void mos_cpu_reset(MOS_Cpu *cpu);
+
+// Basic-block cache used by mos_cpu_run, invalidated by mos_cpu_write
+bool mos_cpu_enable_block_cache(MOS_Cpu *cpu);
+void mos_block_cache_flush(MOS_Cpu *cpu);
+void mos_block_cache_invalidate(MOS_Cpu *cpu, uint8_t page);
+bool mos_block_run(MOS_Cpu *cpu, uint64_t deadline);
+bool mos_block_write(MOS_Cpu *cpu, uint16_t addr, uint8_t data);
+
+// x86-64 recompiler for hot cached blocks, see mosjit.c
+typedef void (*MOS_NativeBlock)(MOS_Cpu *cpu, uint64_t deadline);
+bool mos_cpu_enable_jit(MOS_Cpu *cpu);
+void mos_cpu_disable_jit(MOS_Cpu *cpu);
+bool mos_jit_reserve(MOS_Jit *jit);
+void mos_jit_reset(MOS_Jit *jit);
+void mos_jit_free(MOS_Jit *jit);
+MOS_NativeBlock mos_jit_compile(MOS_Jit *jit, MOS_Cpu *cpu, uint16_t pc, uint8_t count);
+
+// Instruction profiler, only collects when built with -DMOS_PROFILE, see mosprof.c
+bool mos_cpu_enable_profile(MOS_Cpu *cpu);
+void mos_profile_instruction(MOS_Profile *profile, uint16_t pc, uint8_t opcode, uint16_t next_pc, uint64_t cycles);
+void mos_profile_interrupt(MOS_Profile *profile, uint16_t target, uint64_t cycles);
+void mos_profile_access(MOS_Profile *profile, uint32_t device, bool write);
+bool mos_profile_report(const MOS_Cpu *cpu, const char *file_path, uint32_t top);
+bool mos_profile_write_collapsed(const MOS_Cpu *cpu, const char *file_path);
+void mos_profile_free(MOS_Profile *profile);
+
+// Copy-on-write checkpoints of the registers and every plain memory page, see mossnap.c
+typedef struct _mos_snapshot MOS_Snapshot;
+MOS_Snapshot *mos_cpu_snapshot(MOS_Cpu *cpu);
+bool mos_cpu_restore(MOS_Cpu *cpu, const MOS_Snapshot *snapshot);
+void mos_cpu_sync_memory(MOS_Cpu *cpu);
+void mos_snapshot_free(MOS_Snapshot *snapshot);
+bool mos_snapshot_save(const MOS_Snapshot *snapshot, const char *file_path);
+MOS_Snapshot *mos_snapshot_load(const char *file_path);
+void mos_cow_map_page(const MOS_Cpu *cpu, uint8_t page, MOS_Page *slot);
+void mos_cow_touch(MOS_Cpu *cpu, uint8_t page);
+void mos_cow_forget(MOS_Cpu *cpu);
+void mos_cow_free(MOS_Cpu *cpu);
+
+// Execution trace recorder with a background writer, see mostrace.c for the format
+#define MOS_TRACE_VERSION 2
+
+typedef enum _mos_trace_flags {
+    MOS_TRACE_PC   = 0x01, // pc does not follow the previous instruction
+    MOS_TRACE_A    = 0x02,
+    MOS_TRACE_X    = 0x04,
+    MOS_TRACE_Y    = 0x08,
+    MOS_TRACE_SP   = 0x10,
+    MOS_TRACE_PSR  = 0x20,
+    MOS_TRACE_MORE = 0x40, // a second flags byte follows
+} MOS_TraceFlags;
+
+typedef enum _mos_trace_more_flags {
+    MOS_TRACE_KEYFRAME     = 0x01, // whole state and cycles, no instruction
+    MOS_TRACE_GAP          = 0x02, // keyframe after dropped instructions
+    MOS_TRACE_EXTRA_CYCLES = 0x04, // cycles beyond the opcode's base count
+    MOS_TRACE_WRITES       = 0x08, // stores made by the instruction
+} MOS_TraceMoreFlags;
+
+bool mos_cpu_enable_trace(MOS_Cpu *cpu, const char *file_path, uint32_t ring_size, bool drop_when_full);
+bool mos_trace_close(MOS_Cpu *cpu);
+uint8_t mos_trace_step(MOS_Cpu *cpu);
+uint64_t mos_trace_run(MOS_Cpu *cpu, uint64_t cycles);
+void mos_trace_write(MOS_Trace *trace, uint16_t addr, uint8_t data);
+
+// Record and replay of device reads, see mosreplay.c
+bool mos_cpu_record_io(MOS_Cpu *cpu, const char *file_path);
+bool mos_cpu_replay_io(MOS_Cpu *cpu, const char *file_path);
+bool mos_replay_close(MOS_Cpu *cpu);
+bool mos_mmap_is_device(const MOS_MMap *entry);
+uint8_t mos_replay_read(MOS_Cpu *cpu, MOS_MMap *entry, uint16_t addr);
+bool mos_replay_write(const MOS_Cpu *cpu);
+
+// Device callbacks keyed on the cycle count, see mossched.c
+#define MOS_EVENT_NONE UINT32_MAX
+typedef uint32_t MOS_EventId;
+typedef void (*MOS_EventCallback)(MOS_Cpu *cpu, void *device, uint64_t cycle);
+MOS_EventId mos_cpu_schedule(MOS_Cpu *cpu, uint64_t cycle, MOS_EventCallback callback, void *device);
+bool mos_cpu_cancel(MOS_Cpu *cpu, MOS_EventId id);
+void mos_scheduler_fire(MOS_Cpu *cpu);
+void mos_scheduler_free(MOS_Cpu *cpu);
+
+typedef struct _mos_timer MOS_Timer;
+MOS_Timer *mos_timer_new(MOS_Cpu *cpu, uint16_t addr, uint8_t irq_source);
+void mos_timer_free(MOS_Timer *timer);
+bool mos_timer_owns(const MOS_MMap *entry);
+
+// Bank switched windows over a backing store larger than 64K, see mosmapper.c
+typedef struct _mos_mapper MOS_Mapper;
+MOS_Mapper *mos_mapper_new(MOS_Cpu *cpu, uint8_t *memory, uint32_t size);
+int32_t mos_mapper_window(MOS_Mapper *mapper, uint16_t start_addr, uint32_t size, bool readonly);
+bool mos_mapper_control(MOS_Mapper *mapper, uint16_t addr, uint32_t window_index);
+void mos_mapper_switch(MOS_Mapper *mapper, uint32_t window_index, uint32_t bank);
+uint32_t mos_mapper_bank(const MOS_Mapper *mapper, uint32_t window_index);
+void mos_mapper_free(MOS_Mapper *mapper);
+uint8_t mos_mapper_read(void *device, uint16_t addr);
+void mos_mapper_write(void *device, uint16_t addr, uint8_t data);
+uint8_t *mos_mapper_page_memory(void *device, uint8_t page);
+bool mos_mapper_owns(const MOS_MMap *entry);
+uint32_t mos_mapper_entry_bank(const MOS_MMap *entry);
+void mos_mapper_entry_switch(const MOS_MMap *entry, uint32_t bank);
+
+// Lockstep engine running many lanes of one program with SIMD kernels, see moslockstep.c
+typedef struct _mos_lockstep MOS_Lockstep;
+MOS_Lockstep *mos_lockstep_new(uint32_t count);
+MOS_Cpu *mos_lockstep_cpu(MOS_Lockstep *ls, uint32_t lane);
+uint64_t mos_lockstep_run(MOS_Lockstep *ls, uint64_t cycles);
+void mos_lockstep_free(MOS_Lockstep *ls);
 
 void mos_uint16_t_to_bytes(uint16_t sixteen_bit, uint8_t *high_byte, uint8_t *low_byte);
 uint16_t mos_bytes_to_uint16_t(uint8_t a, uint8_t b);
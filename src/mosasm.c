@@ -1,5 +1,13 @@
 // Mos 6502 Assembler
+//
+// One statement a line: `label:`, an instruction or a directive, `;` starts a
+// comment. Operands are `$hex`, decimal or a label, written in the usual
+// syntax (#v, v, v,x, v,y, (v), (v,x), (v),y, a). Directives are `.org v`,
+// `.byte v, ...` and `.word v, ...`. The flat binary covers the lowest to the
+// highest address assembled, the listing shows each line with its bytes and
+// ends with the symbols.
 #include <errno.h>
+#include <stdarg.h>
 
 #include "./mos.h"
 
@@ -34,18 +42,6 @@ char *mos_read_file(const char *file_path, uint64_t *size)
     return buffer;
 }
 
-char *mos_strdup(char *src, uint64_t src_len)
-{
-    char *dest = (char *)malloc(sizeof(char)*src_len+1);
-    if (dest == NULL) {
-        fprintf(stderr, "ERROR: Memory Allocation For String Duplication failed\n");
-        return NULL;
-    }
-    strcpy(dest, src);
-    dest[src_len] = '\0';
-    return dest;
-}
-
 typedef enum _mos_token_type {
     MOS_TOKEN_EOF,
     MOS_TOKEN_OPERAND,
@@ -55,39 +51,45 @@ typedef enum _mos_token_type {
     MOS_TOKEN_LABEL,
     MOS_TOKEN_OPCODE,
     MOS_TOKEN_DIRECTIVE,
+    MOS_TOKEN_NEWLINE,
+    MOS_TOKEN_COMMA,
+    MOS_TOKEN_OPEN_PAREN,
+    MOS_TOKEN_CLOSE_PAREN,
 } MOS_TokenType;
 
+// Tokens are views into the lexer content, nothing is copied
 typedef struct _mos_token {
-    char *token;
-    uint64_t token_len;
     MOS_TokenType type;
-    uint64_t row, col; // for error reporting
+    uint64_t offset, len;
+    uint64_t row, col; // zero based, for error reporting
 } MOS_Token;
 
-typedef ARRAY(MOS_Token) MOS_Tokens;
-
 typedef struct _mos_lexer {
     const char *file_path; // path to source file
     char *content;
     uint64_t content_len;
     uint64_t lines;
+    uint64_t line_start; // offset of the current line, columns count from it
     uint64_t cursor;
-    uint64_t label_end; // store end of label
-    MOS_Tokens tokens; // store tokens of parsed file
+    MOS_TokenType previous[2]; // the last token and the one before, MOS_TOKEN_EOF for none
 } MOS_Lexer;
 
 const char *mos_token_type_as_cstr(MOS_TokenType type)
 {
     switch (type) {
-    case MOS_TOKEN_OPERAND:    return "MOS_TOKEN_OPERAND";
-    case MOS_TOKEN_IMMEDIATE:  return "MOS_TOKEN_IMMEDIATE";
-    case MOS_TOKEN_COMMENT:    return "MOS_TOKEN_COMMENT";
-    case MOS_TOKEN_IDENTIFIER: return "MOS_TOKEN_IDENTIFIER";
-    case MOS_TOKEN_LABEL:      return "MOS_TOKEN_LABEL";
-    case MOS_TOKEN_OPCODE:     return "MOS_TOKEN_OPCODE";
-    case MOS_TOKEN_DIRECTIVE:  return "MOS_TOKEN_DIRECTIVE";
-    case MOS_TOKEN_EOF:        return "MOS_TOKEN_EOF";
-    default:                   return NULL;
+    case MOS_TOKEN_OPERAND:     return "MOS_TOKEN_OPERAND";
+    case MOS_TOKEN_IMMEDIATE:   return "MOS_TOKEN_IMMEDIATE";
+    case MOS_TOKEN_COMMENT:     return "MOS_TOKEN_COMMENT";
+    case MOS_TOKEN_IDENTIFIER:  return "MOS_TOKEN_IDENTIFIER";
+    case MOS_TOKEN_LABEL:       return "MOS_TOKEN_LABEL";
+    case MOS_TOKEN_OPCODE:      return "MOS_TOKEN_OPCODE";
+    case MOS_TOKEN_DIRECTIVE:   return "MOS_TOKEN_DIRECTIVE";
+    case MOS_TOKEN_NEWLINE:     return "MOS_TOKEN_NEWLINE";
+    case MOS_TOKEN_COMMA:       return "MOS_TOKEN_COMMA";
+    case MOS_TOKEN_OPEN_PAREN:  return "MOS_TOKEN_OPEN_PAREN";
+    case MOS_TOKEN_CLOSE_PAREN: return "MOS_TOKEN_CLOSE_PAREN";
+    case MOS_TOKEN_EOF:         return "MOS_TOKEN_EOF";
+    default:                    return NULL;
     }
 }
 
@@ -114,10 +116,25 @@ bool mos_lexer_init(MOS_Lexer *lexer, const char *file_path)
     return true;
 }
 
+void mos_lexer_free(MOS_Lexer *lexer)
+{
+    free(lexer->content);
+}
+
+// Starts over from the first token
+void mos_lexer_rewind(MOS_Lexer *lexer)
+{
+    lexer->cursor = 0;
+    lexer->lines = 0;
+    lexer->line_start = 0;
+    lexer->previous[0] = lexer->previous[1] = MOS_TOKEN_EOF;
+}
+
 bool mos_lexer_is_space(const MOS_Lexer *lexer)
 {
     return lexer->content[lexer->cursor] == ' ' ||
-    lexer->content[lexer->cursor] == '\t';
+    lexer->content[lexer->cursor] == '\t' ||
+    lexer->content[lexer->cursor] == '\r';
 }
 
 bool mos_lexer_is_comment(const MOS_Lexer *lexer)
@@ -158,21 +175,33 @@ bool mos_lexer_is_immediate(const MOS_Lexer *lexer)
     return lexer->content[lexer->cursor] == '#';
 }
 
-MOS_Token mos_create_token(char *token, uint64_t len, MOS_TokenType type, uint64_t row, uint64_t col)
+bool mos_lexer_is_label_end(const MOS_Lexer *lexer)
 {
-    MOS_Token _token = {0}; // zero initialize
-    _token.token = mos_strdup(token, len);
-    _token.type = type;
-    _token.token_len = len;
-    _token.row = row;
-    _token.col = col - col + len;
-    return _token;
+    return lexer->content[lexer->cursor] == ':';
 }
 
-void mos_lexer_append_token(MOS_Lexer *lexer, MOS_Token token)
+bool mos_lexer_is_punctuation(const MOS_Lexer *lexer)
 {
-    assert(lexer != NULL);
-    array_append(&lexer->tokens, token);
+    return lexer->content[lexer->cursor] == ',' ||
+    lexer->content[lexer->cursor] == '(' ||
+    lexer->content[lexer->cursor] == ')';
+}
+
+// `len` bytes at `offset` on the current line
+MOS_Token mos_create_token(const MOS_Lexer *lexer, uint64_t offset, uint64_t len, MOS_TokenType type)
+{
+    MOS_Token token = {0}; // zero initialize
+    token.type = type;
+    token.offset = offset;
+    token.len = len;
+    token.row = lexer->lines;
+    token.col = offset - lexer->line_start;
+    return token;
+}
+
+static inline const char *mos_token_text(const MOS_Lexer *lexer, MOS_Token token)
+{
+    return lexer->content + token.offset;
 }
 
 char mos_lexer_get_char(MOS_Lexer *lexer)
@@ -181,192 +210,957 @@ char mos_lexer_get_char(MOS_Lexer *lexer)
     return lexer->content[lexer->cursor++];
 }
 
-#define char_to_cstr(x) ((char[2]){x, '\0'})
+bool mos_is_alpha(char x)
+{
+    return (x >= 'A' && x <= 'Z') || (x >= 'a' && x <= 'z') || (x == '_');
+}
 
-void mos_lexer_dump_tokens(const MOS_Lexer *lexer)
+// Type of the word at `start` up to the cursor, from its text and the tokens before it
+MOS_TokenType mos_lexer_classify_word(const MOS_Lexer *lexer, uint64_t start)
+{
+    const char *word = lexer->content + start;
+    uint64_t len = lexer->cursor - start;
+    // hex digits right after a `$` may start with a letter
+    bool hex = start > 0 && lexer->content[start - 1] == '$';
+    if (!hex && mos_is_alpha(word[0])) {
+        MOS_Opcode opcode;
+        if (mos_opcode_from_mnemonic(word, len, &opcode)) return MOS_TOKEN_OPCODE;
+        // right after a dot it names a directive, before a colon it defines a
+        // label, anything else refers to a symbol or a register
+        if (start > 0 && lexer->content[start - 1] == '.') return MOS_TOKEN_DIRECTIVE;
+        if (mos_lexer_is_label_end(lexer)) return MOS_TOKEN_LABEL;
+        return MOS_TOKEN_IDENTIFIER;
+    }
+    // `#` value or `#` `$` value
+    if (lexer->previous[0] == MOS_TOKEN_IMMEDIATE || lexer->previous[1] == MOS_TOKEN_IMMEDIATE) {
+        return MOS_TOKEN_IMMEDIATE;
+    }
+    return MOS_TOKEN_OPERAND;
+}
+
+bool mos_lexer_is_word_end(const MOS_Lexer *lexer)
+{
+    return mos_lexer_is_eof(lexer) || mos_lexer_is_newline(lexer) || mos_lexer_is_space(lexer) ||
+        mos_lexer_is_directive(lexer) || mos_lexer_is_immediate(lexer) || mos_lexer_is_operand(lexer) ||
+        mos_lexer_is_comment(lexer) || mos_lexer_is_label_end(lexer) || mos_lexer_is_punctuation(lexer);
+}
+
+static MOS_Token mos_lexer_emit(MOS_Lexer *lexer, uint64_t offset, uint64_t len, MOS_TokenType type)
+{
+    lexer->previous[1] = lexer->previous[0];
+    lexer->previous[0] = type;
+    return mos_create_token(lexer, offset, len, type);
+}
+
+// Lexes the next token on demand, nothing is buffered. Returns MOS_TOKEN_EOF
+// at the end of the content and keeps returning it.
+MOS_Token mos_lexer_get_token(MOS_Lexer *lexer)
 {
-    for (uint32_t i = 0; i < lexer->tokens.count; ++i) {
-        if (lexer->tokens.items[i].type == MOS_TOKEN_EOF) {
-            fprintf(stdout, "`\\0`(%s)\n", mos_token_type_as_cstr(lexer->tokens.items[i].type));
+    for (;;) {
+        if (mos_lexer_is_eof(lexer)) {
+            return mos_lexer_emit(lexer, lexer->cursor, 0, MOS_TOKEN_EOF);
+        } else if (mos_lexer_is_newline(lexer)) {
+            MOS_Token token = mos_lexer_emit(lexer, lexer->cursor, 1, MOS_TOKEN_NEWLINE);
+            lexer->cursor++; lexer->lines++;
+            lexer->line_start = lexer->cursor;
+            return token;
+        } else if (mos_lexer_is_space(lexer)) {
+            lexer->cursor++;
+        } else if (mos_lexer_is_directive(lexer) || mos_lexer_is_immediate(lexer) || mos_lexer_is_operand(lexer)) {
+            MOS_TokenType type = mos_lexer_is_directive(lexer) ? MOS_TOKEN_DIRECTIVE :
+                mos_lexer_is_immediate(lexer) ? MOS_TOKEN_IMMEDIATE : MOS_TOKEN_OPERAND;
+            lexer->cursor++;
+            return mos_lexer_emit(lexer, lexer->cursor - 1, 1, type);
+        } else if (mos_lexer_is_punctuation(lexer)) {
+            char c = mos_lexer_get_char(lexer);
+            MOS_TokenType type = c == ',' ? MOS_TOKEN_COMMA : c == '(' ? MOS_TOKEN_OPEN_PAREN : MOS_TOKEN_CLOSE_PAREN;
+            return mos_lexer_emit(lexer, lexer->cursor - 1, 1, type);
+        } else if (mos_lexer_is_comment(lexer)) {
+            uint64_t start = lexer->cursor;
+            while (!mos_lexer_is_newline(lexer) && !mos_lexer_is_eof(lexer)) lexer->cursor++;
+            return mos_lexer_emit(lexer, start, lexer->cursor - start, MOS_TOKEN_COMMENT);
+        } else if (mos_lexer_is_label_end(lexer)) {
+            // a colon that does not end a label
+            lexer->cursor++;
         } else {
-            fprintf(stdout, "%s(%s)\n", lexer->tokens.items[i].token, mos_token_type_as_cstr(lexer->tokens.items[i].type));
+            uint64_t start = lexer->cursor;
+            while (!mos_lexer_is_word_end(lexer)) lexer->cursor++;
+            uint64_t len = lexer->cursor - start;
+            MOS_TokenType type = mos_lexer_classify_word(lexer, start);
+            if (type == MOS_TOKEN_LABEL) lexer->cursor++; // the colon is not part of the name
+            return mos_lexer_emit(lexer, start, len, type);
         }
     }
 }
 
-char *mos_to_upper(char *buffer)
+// Prints every token, then rewinds the lexer for the parser
+void mos_lexer_dump_tokens(MOS_Lexer *lexer)
 {
-    char buf[256] = {0};
-    uint64_t n = strlen(buffer);
-    for (uint64_t i = 0; i < n; ++i) {
-        // assert the char we are receiving is lower case
-        // maybe the assert is too strict
-        // FIXED: resolved the assert
-        if (buffer[i] >= 'a' && buffer[i] <= 'z') {
-            buf[i] = buffer[i] - (97 - 65); // convert
+    MOS_Token token;
+    do {
+        token = mos_lexer_get_token(lexer);
+        if (token.type == MOS_TOKEN_EOF) {
+            fprintf(stdout, "`\\0`(%s)\n", mos_token_type_as_cstr(token.type));
+        } else if (token.type == MOS_TOKEN_NEWLINE) {
+            fprintf(stdout, "`\\n`(%s)\n", mos_token_type_as_cstr(token.type));
         } else {
-            buf[i] = buffer[i]; // do nothing
+            fprintf(stdout, "%.*s(%s)\n", (int) token.len, mos_token_text(lexer, token), mos_token_type_as_cstr(token.type));
         }
+    } while (token.type != MOS_TOKEN_EOF);
+    mos_lexer_rewind(lexer);
+}
+
+
+// NOTE: Symbol table
+//
+// The assembler makes a single pass. A symbol used before its label leaves
+// zeroes in the image and records a fixup, the fixups are patched once the
+// whole source is read. Symbols sit in an array in the order they are first
+// seen, an open addressing index maps a name to its array index + 1, so a
+// lookup hashes the name once however many labels there are. Names are
+// interned into an arena, copied once and freed with the table.
+
+#define MOS_ARENA_BLOCK_SIZE (64*1024)
+
+typedef struct _mos_arena_block {
+    struct _mos_arena_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} MOS_ArenaBlock;
+
+typedef struct _mos_arena {
+    MOS_ArenaBlock *blocks; // newest first
+} MOS_Arena;
+
+// NUL terminated copy of `len` bytes of `text`, lives until mos_arena_free
+char *mos_arena_strndup(MOS_Arena *arena, const char *text, size_t len)
+{
+    MOS_ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < len + 1) {
+        size_t capacity = len + 1 > MOS_ARENA_BLOCK_SIZE ? len + 1 : MOS_ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(*block) + capacity);
+        if (block == NULL) {
+            fprintf(stderr, "ERROR: Memory Allocation for arena Failed\n");
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->blocks = block;
     }
-    return mos_strdup(buf, n);
+    char *copy = block->data + block->used;
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+    return copy;
 }
 
-bool mos_is_alpha(char x)
+void mos_arena_free(MOS_Arena *arena)
 {
-    return (x >= 'A' && x <= 'Z') || (x >= 'a' && x <= 'z') || (x == '_');
+    MOS_ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        MOS_ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
 }
 
-bool mos_is_opcode(char *buf)
+typedef struct _mos_symbol {
+    const char *name; // interned
+    uint64_t len;
+    uint32_t hash;
+    uint16_t address;
+    bool defined;
+    uint64_t row, col; // of the label, or of the first use while undefined
+} MOS_Symbol;
+
+typedef ARRAY(MOS_Symbol) MOS_Symbols;
+
+typedef struct _mos_symbol_table {
+    MOS_Symbols symbols;
+    uint32_t *index;   // open addressing, name -> symbol index + 1
+    uint32_t capacity; // power of two, at least twice the symbol count
+    MOS_Arena names;
+} MOS_SymbolTable;
+
+bool mos_symbol_table_init(MOS_SymbolTable *table)
 {
-    const char *buffer = (const char*)mos_to_upper(buf);
-    const char *op_cstr[] = {
-        "BRK","NOP","RTI","RTS","JMP","JSR","ADC","SBC","CMP","CPX",
-        "CPY","LDA","LDY","LDX","STA","STY","STX","CLC","CLV","CLI",
-        "CLD","SEC","SED","SEI","ORA","AND","EOR","IT","TAX","TAY",
-        "TXA","TYA","TSX","TXS","PHA","PHP","PLA","PLP","INC","INX",
-        "INY","DEX","DEY","DEC","BNE","BCC","BCS","BEQ","BMI","BPL",
-        "BVC","BVS","ASL","LSR","ROL","ROR"
+    memset(table, 0, sizeof(*table));
+    table->capacity = 1024;
+    table->index = calloc(table->capacity, sizeof(*table->index));
+    if (table->index == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for symbol table Failed\n");
+        return false;
+    }
+    array_new(&table->symbols);
+    return true;
+}
+
+void mos_symbol_table_free(MOS_SymbolTable *table)
+{
+    array_delete(&table->symbols);
+    free(table->index);
+    mos_arena_free(&table->names);
+}
+
+// FNV-1a
+static inline uint32_t mos_symbol_hash(const char *name, uint64_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (uint64_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void mos_symbol_table_grow(MOS_SymbolTable *table)
+{
+    uint32_t capacity = table->capacity * 2;
+    uint32_t *index = calloc(capacity, sizeof(*index));
+    assert(index != NULL && "Memory Reallocation For symbol table Failed.");
+    for (uint32_t i = 0; i < table->symbols.count; ++i) {
+        uint32_t slot = table->symbols.items[i].hash & (capacity - 1);
+        while (index[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        index[slot] = i + 1;
+    }
+    free(table->index);
+    table->index = index;
+    table->capacity = capacity;
+}
+
+// Index of the symbol named by `token`, added undefined on first sight.
+// UINT32_MAX when the name could not be interned.
+uint32_t mos_symbol_table_intern(MOS_SymbolTable *table, const char *name, MOS_Token token)
+{
+    uint32_t hash = mos_symbol_hash(name, token.len);
+    uint32_t mask = table->capacity - 1;
+    uint32_t slot = hash & mask;
+    while (table->index[slot] != 0) {
+        uint32_t i = table->index[slot] - 1;
+        const MOS_Symbol *symbol = &table->symbols.items[i];
+        if (symbol->hash == hash && symbol->len == token.len && memcmp(symbol->name, name, token.len) == 0) {
+            return i;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    const char *interned = mos_arena_strndup(&table->names, name, token.len);
+    if (interned == NULL) return UINT32_MAX;
+    MOS_Symbol symbol = {
+        .name = interned,
+        .len = token.len,
+        .hash = hash,
+        .row = token.row,
+        .col = token.col,
     };
+    array_append(&table->symbols, symbol);
+    table->index[slot] = table->symbols.count;
+    if (table->symbols.count * 2 > table->capacity) mos_symbol_table_grow(table);
+    return table->symbols.count - 1;
+}
+
+typedef enum _mos_fixup_kind {
+    MOS_FIXUP_BYTE,     // zero page address or immediate
+    MOS_FIXUP_WORD,     // absolute address, little endian
+    MOS_FIXUP_RELATIVE, // branch offset from the next instruction
+} MOS_FixupKind;
+
+typedef struct _mos_fixup {
+    MOS_FixupKind kind;
+    uint32_t symbol;
+    uint16_t at;       // image address of the operand
+    uint64_t row, col; // of the use
+} MOS_Fixup;
+
+typedef ARRAY(MOS_Fixup) MOS_Fixups;
+
+// An operand as written, a number or a symbol
+typedef struct _mos_asm_value {
+    MOS_Token token;
+    uint32_t value;  // once known, numbers past 0xFFFF read as 0x10000
+    uint32_t symbol; // UINT32_MAX for a number
+    bool known;
+} MOS_AsmValue;
+
+// Bytes a statement emitted, for the listing
+typedef struct _mos_listing_entry {
+    uint16_t at;
+    uint32_t len;
+    uint64_t row;
+} MOS_ListingEntry;
+
+typedef ARRAY(MOS_ListingEntry) MOS_Listing;
 
-    uint64_t count = MOS_ARRAY_LEN(op_cstr);
-    for (uint64_t i = 0; i < count; ++i) {
-        if (strcmp(op_cstr[i], buffer) == 0) {
+#define MOS_ASM_FULL UINT32_MAX
+
+typedef struct _mos_assembler {
+    MOS_SymbolTable table;
+    MOS_Fixups fixups;
+    MOS_Listing listing;
+    uint16_t encoding[ERROR_FETCH_DATA][ABXI + 1]; // (opcode, mode) -> opcode byte + 1, 0 for none
+    uint32_t pc;        // location counter, MOS_ASM_FULL once the code ran past $FFFF
+    uint32_t low, high; // emitted addresses are in [low, high), empty while low >= high
+    uint32_t entry;     // first instruction, MOS_ASM_FULL before it
+    uint32_t errors;
+    uint8_t used[0x10000 / 8]; // one bit per emitted address
+    uint8_t image[0x10000];
+} MOS_Assembler;
+
+MOS_Assembler *mos_assembler_new(MOS_Variant variant)
+{
+    MOS_Assembler *as = calloc(1, sizeof(*as));
+    if (as == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for assembler Failed\n");
+        return NULL;
+    }
+    if (!mos_symbol_table_init(&as->table)) {
+        free(as);
+        return NULL;
+    }
+    array_new(&as->fixups);
+    array_new(&as->listing);
+    as->low = 0x10000;
+    as->entry = MOS_ASM_FULL;
+
+    // inverse of the opcode tables, the first byte of each (opcode, mode) wins:
+    // opcode_matrix holes decode as BRK, and the documented encodings go first
+    // so the variant's duplicate NOPs and SBC are never picked over them
+    const MOS_OpcodeInfo *tables[] = { opcode_matrix, mos_variant_opcodes(variant) };
+    for (uint32_t i = 0; i < MOS_ARRAY_LEN(tables); ++i) {
+        for (uint32_t byte = 0; byte <= UINT8_MAX; ++byte) {
+            const MOS_OpcodeInfo *info = &tables[i][byte];
+            if (as->encoding[info->opcode][info->mode] == 0) as->encoding[info->opcode][info->mode] = byte + 1;
+        }
+    }
+    return as;
+}
+
+void mos_assembler_free(MOS_Assembler *as)
+{
+    mos_symbol_table_free(&as->table);
+    array_delete(&as->fixups);
+    array_delete(&as->listing);
+    free(as);
+}
+
+static void mos_asm_report(MOS_Assembler *as, const char *file_path, uint64_t row, uint64_t col, const char *fmt, ...)
+{
+    fprintf(stderr, "%s:%llu:%llu: ", file_path, (unsigned long long) row + 1, (unsigned long long) col + 1);
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+    as->errors++;
+}
+
+// Writes `value` as the operand at `at`, false when it does not fit
+static bool mos_asm_patch(MOS_Assembler *as, MOS_FixupKind kind, uint16_t at, uint32_t value)
+{
+    switch (kind) {
+    case MOS_FIXUP_BYTE:
+        if (value > 0xFF) return false;
+        as->image[at] = value;
+        return true;
+    case MOS_FIXUP_WORD:
+        if (value > 0xFFFF) return false;
+        as->image[at] = value & 0xFF;
+        as->image[at + 1] = value >> 8;
+        return true;
+    case MOS_FIXUP_RELATIVE: {
+        int32_t offset = (int32_t) value - (at + 1);
+        if (offset < -128 || offset > 127) return false;
+        as->image[at] = (uint8_t) offset;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Writes a known `value` at `at` now, otherwise leaves it to a fixup
+static void mos_asm_operand(MOS_Assembler *as, const char *file_path, MOS_FixupKind kind, uint16_t at, MOS_AsmValue value)
+{
+    if (!value.known) {
+        MOS_Fixup fixup = {
+            .kind = kind,
+            .symbol = value.symbol,
+            .at = at,
+            .row = value.token.row,
+            .col = value.token.col,
+        };
+        array_append(&as->fixups, fixup);
+    } else if (!mos_asm_patch(as, kind, at, value.value)) {
+        mos_asm_report(as, file_path, value.token.row, value.token.col, "$%04X is out of range here", value.value);
+    }
+}
+
+// Patches every fixup once all the labels are known
+static void mos_asm_resolve(MOS_Assembler *as, const char *file_path)
+{
+    for (uint32_t i = 0; i < as->fixups.count; ++i) {
+        const MOS_Fixup *fixup = &as->fixups.items[i];
+        const MOS_Symbol *symbol = &as->table.symbols.items[fixup->symbol];
+        if (!symbol->defined) {
+            mos_asm_report(as, file_path, fixup->row, fixup->col, "undefined symbol `%s`", symbol->name);
+        } else if (!mos_asm_patch(as, fixup->kind, fixup->at, symbol->address)) {
+            mos_asm_report(as, file_path, fixup->row, fixup->col, "`%s` ($%04X) is out of range here",
+                           symbol->name, symbol->address);
+        }
+    }
+}
+
+// NOTE: Parser
+//
+// One statement per line: an optional `label:`, then a `.directive` or an
+// instruction, then an optional comment. Errors are reported with their
+// location and the rest of the line is skipped, so one run reports them all.
+
+typedef struct _mos_parser {
+    MOS_Lexer *lexer;
+    MOS_Assembler *as;
+    MOS_Token token; // next token to parse, never a comment
+} MOS_Parser;
+
+static void mos_parser_advance(MOS_Parser *parser)
+{
+    do {
+        parser->token = mos_lexer_get_token(parser->lexer);
+    } while (parser->token.type == MOS_TOKEN_COMMENT);
+}
+
+static inline bool mos_parser_at_line_end(const MOS_Parser *parser)
+{
+    return parser->token.type == MOS_TOKEN_NEWLINE || parser->token.type == MOS_TOKEN_EOF;
+}
+
+// Case insensitive match of the token text
+static bool mos_token_equals(const MOS_Lexer *lexer, MOS_Token token, const char *text)
+{
+    const char *word = mos_token_text(lexer, token);
+    for (uint64_t i = 0; i < token.len; ++i) {
+        if (text[i] == '\0' || (word[i] | 0x20) != (text[i] | 0x20)) return false;
+    }
+    return text[token.len] == '\0';
+}
+
+static void mos_parser_skip_line(MOS_Parser *parser)
+{
+    while (!mos_parser_at_line_end(parser)) mos_parser_advance(parser);
+}
+
+// Reports "expected `what`" at the current token and skips the rest of the line
+static void mos_parser_expected(MOS_Parser *parser, const char *what)
+{
+    MOS_Token token = parser->token;
+    const char *file_path = parser->lexer->file_path;
+    if (mos_parser_at_line_end(parser)) {
+        mos_asm_report(parser->as, file_path, token.row, token.col, "expected %s at the end of the line", what);
+    } else {
+        mos_asm_report(parser->as, file_path, token.row, token.col, "expected %s, got `%.*s`",
+                       what, (int) token.len, mos_token_text(parser->lexer, token));
+    }
+    mos_parser_skip_line(parser);
+}
+
+static bool mos_parse_number(const char *text, uint64_t len, uint32_t base, uint32_t *value)
+{
+    if (len == 0) return false;
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < len; ++i) {
+        char c = text[i];
+        uint32_t digit = (c >= '0' && c <= '9') ? (uint32_t) (c - '0') :
+            (c >= 'a' && c <= 'f') ? (uint32_t) (c - 'a' + 10) :
+            (c >= 'A' && c <= 'F') ? (uint32_t) (c - 'A' + 10) : base;
+        if (digit >= base) return false;
+        result = result*base + digit;
+        if (result > 0xFFFF) result = 0x10000;
+    }
+    *value = result;
+    return true;
+}
+
+// `$hex`, decimal or a symbol
+static bool mos_parse_value(MOS_Parser *parser, MOS_AsmValue *value)
+{
+    MOS_Lexer *lexer = parser->lexer;
+    MOS_Token token = parser->token;
+    *value = (MOS_AsmValue) { .token = token, .symbol = UINT32_MAX, .known = true };
+
+    if (token.type == MOS_TOKEN_IDENTIFIER) {
+        uint32_t symbol = mos_symbol_table_intern(&parser->as->table, mos_token_text(lexer, token), token);
+        if (symbol == UINT32_MAX) {
+            parser->as->errors++;
+            return false;
+        }
+        const MOS_Symbol *entry = &parser->as->table.symbols.items[symbol];
+        value->symbol = symbol;
+        value->known = entry->defined;
+        value->value = entry->address;
+        mos_parser_advance(parser);
+        return true;
+    }
+    if (token.type != MOS_TOKEN_OPERAND && token.type != MOS_TOKEN_IMMEDIATE) {
+        mos_parser_expected(parser, "a number or a symbol");
+        return false;
+    }
+
+    uint32_t base = 10;
+    if (token.len == 1 && mos_token_text(lexer, token)[0] == '$') {
+        base = 16;
+        mos_parser_advance(parser);
+        if (parser->token.type != MOS_TOKEN_OPERAND && parser->token.type != MOS_TOKEN_IMMEDIATE) {
+            mos_parser_expected(parser, "hex digits after `$`");
+            return false;
+        }
+    }
+    if (!mos_parse_number(mos_token_text(lexer, parser->token), parser->token.len, base, &value->value)) {
+        mos_parser_expected(parser, base == 16 ? "hex digits" : "a number");
+        return false;
+    }
+    mos_parser_advance(parser);
+    return true;
+}
+
+typedef enum _mos_operand_syntax {
+    MOS_SYNTAX_NONE,       // clc
+    MOS_SYNTAX_ACCU,       // asl a
+    MOS_SYNTAX_IMMEDIATE,  // lda #v
+    MOS_SYNTAX_DIRECT,     // lda v
+    MOS_SYNTAX_X,          // lda v,x
+    MOS_SYNTAX_Y,          // lda v,y
+    MOS_SYNTAX_INDIRECT,   // jmp (v)
+    MOS_SYNTAX_INDIRECT_X, // lda (v,x)
+    MOS_SYNTAX_INDIRECT_Y, // lda (v),y
+    MOS_SYNTAX_COUNT,
+} MOS_OperandSyntax;
+
+// Modes each syntax can encode, in order of preference
+static const struct {
+    uint8_t count;
+    MOS_AddressingModes modes[3];
+} mos_syntax_modes[MOS_SYNTAX_COUNT] = {
+    [MOS_SYNTAX_NONE]       = { 2, { IMPL, ACCU } },
+    [MOS_SYNTAX_ACCU]       = { 1, { ACCU } },
+    [MOS_SYNTAX_IMMEDIATE]  = { 1, { IMME } },
+    [MOS_SYNTAX_DIRECT]     = { 3, { REL, ZP, ABS } },
+    [MOS_SYNTAX_X]          = { 2, { ZPX, ABSX } },
+    [MOS_SYNTAX_Y]          = { 2, { ZPY, ABSY } },
+    [MOS_SYNTAX_INDIRECT]   = { 2, { ZPI, IND } },
+    [MOS_SYNTAX_INDIRECT_X] = { 2, { INDX, ABXI } },
+    [MOS_SYNTAX_INDIRECT_Y] = { 1, { INDY } },
+};
+
+static inline bool mos_parser_is_register(const MOS_Parser *parser, const char *name)
+{
+    return parser->token.type == MOS_TOKEN_IDENTIFIER && mos_token_equals(parser->lexer, parser->token, name);
+}
+
+// Expects `token_type` (and register `name` when given) and moves past it
+static bool mos_parser_expect(MOS_Parser *parser, MOS_TokenType type, const char *name, const char *what)
+{
+    if (parser->token.type != type || (name != NULL && !mos_parser_is_register(parser, name))) {
+        mos_parser_expected(parser, what);
+        return false;
+    }
+    mos_parser_advance(parser);
+    return true;
+}
+
+static bool mos_parse_operand(MOS_Parser *parser, MOS_OperandSyntax *syntax, MOS_AsmValue *value)
+{
+    *value = (MOS_AsmValue) { .token = parser->token, .symbol = UINT32_MAX, .known = true };
+    if (mos_parser_at_line_end(parser)) {
+        *syntax = MOS_SYNTAX_NONE;
+        return true;
+    }
+    if (mos_parser_is_register(parser, "A")) {
+        mos_parser_advance(parser);
+        *syntax = MOS_SYNTAX_ACCU;
+        return true;
+    }
+    if (parser->token.type == MOS_TOKEN_IMMEDIATE && mos_token_text(parser->lexer, parser->token)[0] == '#') {
+        mos_parser_advance(parser);
+        *syntax = MOS_SYNTAX_IMMEDIATE;
+        return mos_parse_value(parser, value);
+    }
+    if (parser->token.type == MOS_TOKEN_OPEN_PAREN) {
+        mos_parser_advance(parser);
+        if (!mos_parse_value(parser, value)) return false;
+        if (parser->token.type == MOS_TOKEN_COMMA) {
+            mos_parser_advance(parser);
+            *syntax = MOS_SYNTAX_INDIRECT_X;
+            return mos_parser_expect(parser, MOS_TOKEN_IDENTIFIER, "X", "`x`") &&
+                mos_parser_expect(parser, MOS_TOKEN_CLOSE_PAREN, NULL, "`)`");
+        }
+        if (!mos_parser_expect(parser, MOS_TOKEN_CLOSE_PAREN, NULL, "`)` or `,x)`")) return false;
+        if (parser->token.type != MOS_TOKEN_COMMA) {
+            *syntax = MOS_SYNTAX_INDIRECT;
             return true;
         }
+        mos_parser_advance(parser);
+        *syntax = MOS_SYNTAX_INDIRECT_Y;
+        return mos_parser_expect(parser, MOS_TOKEN_IDENTIFIER, "Y", "`y`");
     }
-    return false;
-}
-
-bool mos_lexer_process_token_after_whitespace(MOS_Lexer *lexer, uint64_t *cursor, char *buf)
-{
-    if (lexer == NULL) return false;
-    MOS_Token token = {0};
-    buf[*cursor] = '\0';
-    if (*cursor > 0) {
-        //fprintf(stderr, "TODO: len: %ld, %s not catogorised yet\n",*cursor, buf);
-        if (mos_is_alpha(buf[0])) {
-            if (mos_is_opcode(buf)) {
-                token = mos_create_token(buf, *cursor, MOS_TOKEN_OPCODE, lexer->lines, lexer->cursor);
-                mos_lexer_append_token(lexer, token);
-            } else {
-                // TODO: if last token processed was a dot then directive
-                // else label
-                if (lexer->tokens.items[lexer->tokens.count - 1].type == MOS_TOKEN_DIRECTIVE) {
-                    token = mos_create_token(buf, *cursor, MOS_TOKEN_DIRECTIVE, lexer->lines, lexer->cursor);
-                    mos_lexer_append_token(lexer, token);
-                } else {
-                    token = mos_create_token(buf, *cursor, MOS_TOKEN_LABEL, lexer->lines, lexer->cursor);
-                    mos_lexer_append_token(lexer, token);
-                }
-            }
+
+    if (!mos_parse_value(parser, value)) return false;
+    if (parser->token.type != MOS_TOKEN_COMMA) {
+        *syntax = MOS_SYNTAX_DIRECT;
+        return true;
+    }
+    mos_parser_advance(parser);
+    if (mos_parser_is_register(parser, "X")) {
+        *syntax = MOS_SYNTAX_X;
+    } else if (mos_parser_is_register(parser, "Y")) {
+        *syntax = MOS_SYNTAX_Y;
+    } else {
+        mos_parser_expected(parser, "`x` or `y`");
+        return false;
+    }
+    mos_parser_advance(parser);
+    return true;
+}
+
+// Claims `len` bytes at the location counter for the statement at `token`,
+// false (and the rest of the line skipped) when they do not fit
+static bool mos_asm_reserve(MOS_Parser *parser, MOS_Token token, uint32_t len, uint16_t *at)
+{
+    MOS_Assembler *as = parser->as;
+    const char *file_path = parser->lexer->file_path;
+    if (as->pc + len > 0x10000) {
+        mos_asm_report(as, file_path, token.row, token.col, "`%.*s` at $%04X runs past $FFFF",
+                       (int) token.len, mos_token_text(parser->lexer, token), as->pc);
+        as->pc = MOS_ASM_FULL;
+        mos_parser_skip_line(parser);
+        return false;
+    }
+    for (uint32_t addr = as->pc; addr < as->pc + len; ++addr) {
+        if (as->used[addr / 8] & (1 << (addr % 8))) {
+            mos_asm_report(as, file_path, token.row, token.col, "`%.*s` overlaps the code at $%04X",
+                           (int) token.len, mos_token_text(parser->lexer, token), addr);
+            as->pc += len; // keeps the labels after it where they would be
+            mos_parser_skip_line(parser);
+            return false;
+        }
+    }
+    for (uint32_t addr = as->pc; addr < as->pc + len; ++addr) as->used[addr / 8] |= 1 << (addr % 8);
+    if (as->pc < as->low) as->low = as->pc;
+    if (as->pc + len > as->high) as->high = as->pc + len;
+
+    // a data line emits one value at a time, they share its listing entry
+    MOS_ListingEntry *last = as->listing.count > 0 ? &as->listing.items[as->listing.count - 1] : NULL;
+    if (last != NULL && last->row == token.row && last->at + last->len == as->pc) {
+        last->len += len;
+    } else {
+        MOS_ListingEntry entry = { .at = as->pc, .len = len, .row = token.row };
+        array_append(&as->listing, entry);
+    }
+    *at = as->pc;
+    as->pc += len;
+    return true;
+}
+
+static void mos_parse_instruction(MOS_Parser *parser)
+{
+    MOS_Assembler *as = parser->as;
+    const char *file_path = parser->lexer->file_path;
+    MOS_Token token = parser->token;
+    MOS_Opcode opcode;
+    bool ok = mos_opcode_from_mnemonic(mos_token_text(parser->lexer, token), token.len, &opcode);
+    assert(ok && "the lexer only emits known mnemonics as opcodes");
+    (void) ok;
+    mos_parser_advance(parser);
+
+    MOS_OperandSyntax syntax;
+    MOS_AsmValue value;
+    if (!mos_parse_operand(parser, &syntax, &value)) return;
+
+    // The first mode the opcode has. A one byte operand is only taken while the
+    // value is known to fit, so a label defined later gets the absolute form.
+    // Modes that only come in one byte (zp,y for STX, (zp),y) take it anyway
+    // and the fixup checks the range.
+    bool encodable = false;
+    MOS_AddressingModes mode = IMPL;
+    uint16_t encoding = 0;
+    for (uint8_t pass = 0; pass < 2 && encoding == 0; ++pass) {
+        for (uint8_t i = 0; i < mos_syntax_modes[syntax].count && encoding == 0; ++i) {
+            mode = mos_syntax_modes[syntax].modes[i];
+            if (as->encoding[opcode][mode] == 0) continue;
+            encodable = true;
+            bool byte = mos_addr_mode_length(mode) == 2 && mode != REL;
+            if (byte && (value.known ? value.value > 0xFF : pass == 0)) continue;
+            encoding = as->encoding[opcode][mode];
+        }
+    }
+    if (encoding == 0) {
+        if (encodable) {
+            mos_asm_report(as, file_path, value.token.row, value.token.col, "operand of %s does not fit in a byte",
+                           mos_opcode_as_cstr(opcode));
         } else {
-            if (lexer->tokens.items[lexer->tokens.count - 2].type == MOS_TOKEN_IMMEDIATE) {
-                token = mos_create_token(buf, *cursor, MOS_TOKEN_IMMEDIATE, lexer->lines, lexer->cursor);
-                mos_lexer_append_token(lexer, token);
-            } else {
-                token = mos_create_token(buf, *cursor, MOS_TOKEN_OPERAND, lexer->lines, lexer->cursor);
-                mos_lexer_append_token(lexer, token);
-            }
+            mos_asm_report(as, file_path, token.row, token.col, "%s does not take this operand",
+                           mos_opcode_as_cstr(opcode));
+        }
+        return;
+    }
+
+    uint8_t length = mos_addr_mode_length(mode);
+    uint16_t at;
+    if (!mos_asm_reserve(parser, token, length, &at)) return;
+    if (as->entry == MOS_ASM_FULL) as->entry = at;
+    as->image[at] = encoding - 1;
+    if (length == 1) return;
+
+    MOS_FixupKind kind = mode == REL ? MOS_FIXUP_RELATIVE : length == 2 ? MOS_FIXUP_BYTE : MOS_FIXUP_WORD;
+    mos_asm_operand(as, file_path, kind, at + 1, value);
+}
+
+static void mos_parse_directive(MOS_Parser *parser)
+{
+    MOS_Assembler *as = parser->as;
+    mos_parser_advance(parser); // the dot
+    MOS_Token name = parser->token;
+    if (name.type != MOS_TOKEN_DIRECTIVE) {
+        mos_parser_expected(parser, "a directive name");
+        return;
+    }
+    mos_parser_advance(parser);
+
+    if (mos_token_equals(parser->lexer, name, "org")) {
+        MOS_AsmValue value;
+        if (!mos_parse_value(parser, &value)) return;
+        if (!value.known || value.value > 0xFFFF) {
+            mos_asm_report(as, parser->lexer->file_path, value.token.row, value.token.col,
+                           "`.org` needs an address known at this point");
+            return;
+        }
+        as->pc = value.value;
+    } else if (mos_token_equals(parser->lexer, name, "byte") || mos_token_equals(parser->lexer, name, "word")) {
+        // comma separated values, little endian words
+        MOS_FixupKind kind = mos_token_equals(parser->lexer, name, "byte") ? MOS_FIXUP_BYTE : MOS_FIXUP_WORD;
+        for (;;) {
+            MOS_AsmValue value;
+            uint16_t at;
+            if (!mos_parse_value(parser, &value)) return;
+            if (!mos_asm_reserve(parser, name, kind == MOS_FIXUP_BYTE ? 1 : 2, &at)) return;
+            mos_asm_operand(as, parser->lexer->file_path, kind, at, value);
+            if (parser->token.type != MOS_TOKEN_COMMA) break;
+            mos_parser_advance(parser);
+        }
+    } else {
+        mos_asm_report(as, parser->lexer->file_path, name.row, name.col, "unknown directive `.%.*s`",
+                       (int) name.len, mos_token_text(parser->lexer, name));
+        mos_parser_skip_line(parser);
+    }
+}
+
+static void mos_parse_label(MOS_Parser *parser)
+{
+    MOS_Assembler *as = parser->as;
+    MOS_Token token = parser->token;
+    mos_parser_advance(parser);
+
+    uint32_t index = mos_symbol_table_intern(&as->table, mos_token_text(parser->lexer, token), token);
+    if (index == UINT32_MAX) {
+        as->errors++;
+        return;
+    }
+    MOS_Symbol *symbol = &as->table.symbols.items[index];
+    if (symbol->defined) {
+        mos_asm_report(as, parser->lexer->file_path, token.row, token.col, "`%s` is already defined at %llu:%llu",
+                       symbol->name, (unsigned long long) symbol->row + 1, (unsigned long long) symbol->col + 1);
+        return;
+    }
+    if (as->pc > 0xFFFF) {
+        mos_asm_report(as, parser->lexer->file_path, token.row, token.col, "`%s` is past $FFFF", symbol->name);
+        return;
+    }
+    symbol->defined = true;
+    symbol->address = as->pc;
+    symbol->row = token.row;
+    symbol->col = token.col;
+}
+
+// Assembles the whole source into `as`, false if anything was reported
+bool mos_lexer_parse(MOS_Lexer *lexer, MOS_Assembler *as)
+{
+    MOS_Parser parser = { .lexer = lexer, .as = as };
+    mos_parser_advance(&parser);
+    while (parser.token.type != MOS_TOKEN_EOF && as->pc != MOS_ASM_FULL) {
+        if (parser.token.type == MOS_TOKEN_NEWLINE) {
+            mos_parser_advance(&parser);
+            continue;
         }
+        if (parser.token.type == MOS_TOKEN_LABEL) {
+            // the statement may follow on the same line
+            mos_parse_label(&parser);
+            continue;
+        }
+
+        if (parser.token.type == MOS_TOKEN_DIRECTIVE) {
+            mos_parse_directive(&parser);
+        } else if (parser.token.type == MOS_TOKEN_OPCODE) {
+            mos_parse_instruction(&parser);
+        } else {
+            mos_parser_expected(&parser, "a label, directive or instruction");
+        }
+        if (!mos_parser_at_line_end(&parser)) mos_parser_expected(&parser, "the end of the line");
     }
-    *cursor = 0;
+    // the rest of the source was not read, its labels would all look undefined
+    if (as->pc == MOS_ASM_FULL) return false;
+    mos_asm_resolve(as, lexer->file_path);
+    return as->errors == 0;
+}
+
+// NOTE: Output
+//
+// Each file is formatted into one buffer allocated up front for its
+// expected size and goes out with a single fwrite.
+
+typedef struct _mos_output {
+    char *data;
+    size_t count;
+    size_t capacity;
+} MOS_Output;
+
+static bool mos_output_init(MOS_Output *out, size_t capacity)
+{
+    out->data = malloc(capacity);
+    if (out->data == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for output Failed\n");
+        return false;
+    }
+    out->count = 0;
+    out->capacity = capacity;
     return true;
 }
 
-MOS_Token mos_lexer_get_token(MOS_Lexer *lexer)
+static void mos_output_grow(MOS_Output *out, size_t len)
+{
+    if (out->count + len <= out->capacity) return;
+    size_t capacity = out->capacity * 2 > out->count + len ? out->capacity * 2 : out->count + len;
+    out->data = realloc(out->data, capacity);
+    assert(out->data != NULL && "Memory Reallocation For output Failed.");
+    out->capacity = capacity;
+}
+
+static void mos_output_bytes(MOS_Output *out, const void *bytes, size_t len)
+{
+    mos_output_grow(out, len);
+    memcpy(out->data + out->count, bytes, len);
+    out->count += len;
+}
+
+static void mos_output_printf(MOS_Output *out, const char *fmt, ...)
 {
-    assert(lexer->tokens.count > 0);
-    MOS_Token token = lexer->tokens.items[0];
-    for (uint32_t i = 1; i < lexer->tokens.count; ++i) {
-        lexer->tokens.items[i - 1] = lexer->tokens.items[i]; // shift
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(out->data + out->count, out->capacity - out->count, fmt, args);
+    va_end(args);
+    assert(len >= 0);
+    if ((size_t) len >= out->capacity - out->count) {
+        mos_output_grow(out, len + 1);
+        va_start(args, fmt);
+        vsnprintf(out->data + out->count, out->capacity - out->count, fmt, args);
+        va_end(args);
     }
-    lexer->tokens.count--;
-    return token;
+    out->count += len;
 }
 
-bool mos_expect_token(MOS_Token token, MOS_TokenType type)
+static bool mos_output_write(MOS_Output *out, const char *file_path)
 {
-    return token.type == type;
+    FILE *fp = fopen(file_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        free(out->data);
+        return false;
+    }
+    bool ok = fwrite(out->data, 1, out->count, fp) == out->count;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) fprintf(stderr, "ERROR: Failed to write file `%s`\n", file_path);
+    free(out->data);
+    return ok;
 }
 
-typedef struct _mos_symbol {
-    const char    *symbol;
-    const uint64_t address;
-} MOS_Symbol;
+// The image from the lowest to the highest address emitted, gaps are zero.
+// `header` puts the M65I header in front, loading it where it was assembled
+// and starting at the first instruction.
+bool mos_asm_write_binary(const MOS_Assembler *as, const char *file_path, bool header)
+{
+    uint32_t low = as->low < as->high ? as->low : 0;
+    uint32_t size = as->low < as->high ? as->high - as->low : 0;
+    MOS_Output out;
+    if (!mos_output_init(&out, MOS_IMAGE_HEADER_SIZE + size)) return false;
+    if (header) {
+        uint16_t entry = as->entry == MOS_ASM_FULL ? low : as->entry;
+        uint8_t bytes[MOS_IMAGE_HEADER_SIZE] = {
+            'M', '6', '5', 'I', MOS_IMAGE_VERSION,
+            as->entry == MOS_ASM_FULL ? 0 : MOS_IMAGE_HAS_RESET,
+            low & 0xFF, low >> 8, entry & 0xFF, entry >> 8,
+        };
+        mos_output_bytes(&out, bytes, sizeof(bytes));
+    }
+    mos_output_bytes(&out, as->image + low, size);
+    return mos_output_write(&out, file_path);
+}
 
-typedef ARRAY(MOS_Symbol) MOS_SymbolTable;
-
-bool mos_lexer_parse(MOS_Lexer *lexer, MOS_SymbolTable *table)
-{
-    if (lexer == NULL) return false;
-    memset(table , 0, sizeof(MOS_SymbolTable)); // memset the table since we are filling it here
-
-    printf("BEGIN\n");
-    bool quit = false;
-    while (!quit) {
-        MOS_Token token = mos_lexer_get_token(lexer);
-        switch (token.type) {
-        case MOS_TOKEN_DIRECTIVE: {
-            MOS_Token g_token = mos_lexer_get_token(lexer);
-            if (mos_expect_token(g_token, MOS_TOKEN_DIRECTIVE)) {
-                //table->add(token);
-                printf("    DIRECTIVE");
-            } else {
-                fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(token.type), mos_token_type_as_cstr(g_token.type));
-                return false;
-            }
-        } break;
-        case MOS_TOKEN_OPERAND: {
-            MOS_Token g_token = mos_lexer_get_token(lexer);
-            if (mos_expect_token(g_token, MOS_TOKEN_OPERAND)) {
-                // add to symbol table
-                printf("    OPERAND\n");
-            } else {
-                fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(token.type), mos_token_type_as_cstr(g_token.type));
-            }
-        } break;
-        case MOS_TOKEN_IMMEDIATE: {
-            MOS_Token g_token = mos_lexer_get_token(lexer);
-            if (mos_expect_token(g_token, MOS_TOKEN_OPERAND)) {
-                g_token = mos_lexer_get_token(lexer);
-                if (mos_expect_token(g_token, MOS_TOKEN_IMMEDIATE)) {
-                    printf("    IMMEDIATE\n");
-                } else {
-                    fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(token.type), mos_token_type_as_cstr(g_token.type));
-                }
-            } else {
-                fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(token.type), mos_token_type_as_cstr(g_token.type));
-            }
-        } break;
-
-        case MOS_TOKEN_LABEL: {
-            if (mos_expect_token(token, MOS_TOKEN_LABEL)) {
-                // add to symbol table
-                printf("\nLABEL:\n");
-            } else {
-                fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(MOS_TOKEN_LABEL), mos_token_type_as_cstr(token.type));
-            }
+// Every source line with the address and bytes it assembled to, three bytes
+// a row, then the symbols in the order they were first seen
+bool mos_asm_write_listing(const MOS_Assembler *as, const MOS_Lexer *lexer, const char *file_path)
+{
+    MOS_Output out;
+    size_t estimate = lexer->content_len + (size_t) (lexer->lines + 1)*16 + (size_t) as->table.symbols.count*24;
+    if (!mos_output_init(&out, estimate + 1)) return false;
 
-        } break;
+    const char *content = lexer->content;
+    uint32_t entry = 0;
+    uint64_t row = 0;
+    for (uint64_t start = 0; start < lexer->content_len; ++row) {
+        uint64_t end = start;
+        while (end < lexer->content_len && content[end] != '\n') end++;
+        uint64_t len = end - start;
+        if (len > 0 && content[end - 1] == '\r') len--;
 
-        case MOS_TOKEN_OPCODE: {
-            if (mos_expect_token(token, MOS_TOKEN_OPCODE)) {
-                // add to symbol table
-                printf("    OPCODE ");
-            } else {
-                fprintf(stderr, "%s:%ld:%ld: Expected %s, got %s\n", lexer->file_path, token.row+1, token.col, mos_token_type_as_cstr(MOS_TOKEN_OPCODE), mos_token_type_as_cstr(token.type));
+        bool listed = false;
+        for (; entry < as->listing.count && as->listing.items[entry].row == row; ++entry) {
+            const MOS_ListingEntry *item = &as->listing.items[entry];
+            for (uint32_t i = 0; i < item->len; i += 3) {
+                char bytes[12] = {0};
+                int n = 0;
+                for (uint32_t j = i; j < item->len && j < i + 3; ++j) {
+                    n += snprintf(bytes + n, sizeof(bytes) - n, j == i ? "%02X" : " %02X", as->image[item->at + j]);
+                }
+                if (!listed) {
+                    mos_output_printf(&out, "%04X  %-8s  %.*s\n", item->at + i, bytes, (int) len, content + start);
+                    listed = true;
+                } else {
+                    mos_output_printf(&out, "%04X  %s\n", item->at + i, bytes);
+                }
             }
-        } break;
-
-        case MOS_TOKEN_EOF: quit = true; printf("    EOF\n"); break;
-        case MOS_TOKEN_IDENTIFIER: printf("IDENTIFIER\n"); break;
-        case MOS_TOKEN_COMMENT: printf("    COMMENT\n"); break;
-        default:
-            return false;
         }
+        if (!listed && len > 0) mos_output_printf(&out, "%16s%.*s\n", "", (int) len, content + start);
+        if (!listed && len == 0) mos_output_printf(&out, "\n");
+        start = end + 1;
     }
-    printf("\nEND\n");
-    return true;
+
+    mos_output_printf(&out, "\nSymbols:\n");
+    for (uint32_t i = 0; i < as->table.symbols.count; ++i) {
+        const MOS_Symbol *symbol = &as->table.symbols.items[i];
+        mos_output_printf(&out, "%04X  %s\n", symbol->address, symbol->name);
+    }
+    return mos_output_write(&out, file_path);
+}
+
+// `file_path` with its extension swapped for `extension`
+static void mos_asm_output_path(char *path, size_t size, const char *file_path, const char *extension)
+{
+    const char *base = strrchr(file_path, '/');
+    const char *dot = strrchr(base == NULL ? file_path : base, '.');
+    int len = dot == NULL || dot == base + 1 || dot == file_path ? (int) strlen(file_path) : (int) (dot - file_path);
+    snprintf(path, size, "%.*s%s", len, file_path, extension);
 }
 
 const char *mos_shift(int *argc, char ***argv)
@@ -378,79 +1172,76 @@ const char *mos_shift(int *argc, char ***argv)
     return result;
 }
 
-// Move this
-#define print_tok(tok) printf("%s\n", (tok)->token)
-
 void mos_usage(const char *program)
 {
     fprintf(stderr, "MOS 6502 Assembler\n");
-    fprintf(stderr, "USAGE: %s <file_path>\n", program);
+    fprintf(stderr, "USAGE: %s [--cpu nmos|nmos-illegal|65c02] [--m65i] [-o <binary>] [-l <listing>] [--tokens] <file_path>\n", program);
+    fprintf(stderr, "    --cpu       opcodes to accept, documented NMOS ones by default\n");
+    fprintf(stderr, "    --m65i      put the M65I header mosemu loads in front of the binary\n");
+    fprintf(stderr, "    -o          binary path, <file_path> with a .bin extension by default\n");
+    fprintf(stderr, "    -l          listing path, <file_path> with a .lst extension by default\n");
+    fprintf(stderr, "    --tokens    print every token before assembling\n");
 }
 
-// TODO: Provide details about the file in Usage
 int main(int argc, char **argv)
 {
     const char *program = mos_shift(&argc, &argv);
-    if (argc == 0) {
+    const char *file_path = NULL;
+    const char *binary_path = NULL;
+    const char *listing_path = NULL;
+    MOS_Variant variant = MOS_VARIANT_NMOS;
+    bool header = false;
+    bool tokens = false;
+    while (argc > 0) {
+        const char *arg = mos_shift(&argc, &argv);
+        if (strcmp(arg, "--cpu") == 0 && argc > 0) {
+            if (!mos_variant_from_cstr(mos_shift(&argc, &argv), &variant)) return 1;
+        } else if (strcmp(arg, "--m65i") == 0) {
+            header = true;
+        } else if (strcmp(arg, "-o") == 0 && argc > 0) {
+            binary_path = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "-l") == 0 && argc > 0) {
+            listing_path = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "--tokens") == 0) {
+            tokens = true;
+        } else if (arg[0] != '-' && file_path == NULL) {
+            file_path = arg;
+        } else {
+            mos_usage(program);
+            return 1;
+        }
+    }
+    if (file_path == NULL) {
         mos_usage(program);
         return 1;
     }
+    char default_binary[4096], default_listing[4096];
+    mos_asm_output_path(default_binary, sizeof(default_binary), file_path, ".bin");
+    mos_asm_output_path(default_listing, sizeof(default_listing), file_path, ".lst");
+    if (binary_path == NULL) binary_path = default_binary;
+    if (listing_path == NULL) listing_path = default_listing;
 
     MOS_Lexer lexer = {0};
-    const char *file_path = mos_shift(&argc, &argv);
     if (!mos_lexer_init(&lexer, file_path)) return 1;
+    if (tokens) mos_lexer_dump_tokens(&lexer);
 
-    char buf[256];
-    uint64_t cursor = 0;
-
-    MOS_Token token = {0};
-    while (!mos_lexer_is_eof(&lexer)) {
-        if (mos_lexer_is_newline(&lexer)) {
-            lexer.cursor++; lexer.lines++;
-            if (!mos_lexer_process_token_after_whitespace(&lexer, &cursor, buf)) return 1;
-        } else if (mos_lexer_is_space(&lexer)) {
-            lexer.cursor++;
-            if (!mos_lexer_process_token_after_whitespace(&lexer, &cursor, buf)) return 1;
-        } else if (mos_lexer_is_directive(&lexer)) {
-            char *directive = char_to_cstr(mos_lexer_get_char(&lexer));
-            token = mos_create_token(directive, 1, MOS_TOKEN_DIRECTIVE, lexer.lines, lexer.cursor);
-            mos_lexer_append_token(&lexer, token);
-        } else if (mos_lexer_is_immediate(&lexer)) {
-            char *imme = char_to_cstr(mos_lexer_get_char(&lexer));
-            token = mos_create_token(imme, 1, MOS_TOKEN_IMMEDIATE, lexer.lines, lexer.cursor);
-            mos_lexer_append_token(&lexer, token);
-        } else if (mos_lexer_is_operand(&lexer)) {
-            char *operand = char_to_cstr(mos_lexer_get_char(&lexer));
-            token = mos_create_token(operand, 1, MOS_TOKEN_OPERAND, lexer.lines, lexer.cursor);
-            mos_lexer_append_token(&lexer, token);
-        } else if (mos_lexer_is_comment(&lexer)) {
-            while (mos_lexer_peek(&lexer) != '\n' && !mos_lexer_is_eof(&lexer)) {
-                // for comment
-                buf[cursor++] = mos_lexer_get_char(&lexer);
-            }
-            buf[cursor] = '\0';
-            token = mos_create_token(buf, cursor, MOS_TOKEN_COMMENT, lexer.lines, lexer.cursor);
-            mos_lexer_append_token(&lexer, token);
-            cursor = 0;
-        } else if (mos_lexer_peek(&lexer) == ':') {
-            // end of the label
-            lexer.label_end = lexer.cursor++; // store and increment
-        } else {
-            buf[cursor++] = mos_lexer_get_char(&lexer);
+    MOS_Assembler *as = mos_assembler_new(variant);
+    if (as == NULL) {
+        mos_lexer_free(&lexer);
+        return 1;
+    }
+    bool ok = mos_lexer_parse(&lexer, as);
+    if (ok) {
+        ok = mos_asm_write_binary(as, binary_path, header) && mos_asm_write_listing(as, &lexer, listing_path);
+        if (ok && as->low < as->high) {
+            printf("%s: %u bytes at $%04X-$%04X\n", binary_path, as->high - as->low, as->low, as->high - 1);
+        } else if (ok) {
+            printf("%s: empty\n", binary_path);
         }
+    } else {
+        fprintf(stderr, "%u error%s\n", as->errors, as->errors == 1 ? "" : "s");
     }
-
-    // and last append the eof token
-    char *operand = char_to_cstr(mos_lexer_get_char(&lexer));
-    token = mos_create_token(operand, 1, MOS_TOKEN_EOF, lexer.lines, lexer.cursor);
-    mos_lexer_append_token(&lexer, token);
-
-    mos_lexer_dump_tokens(&lexer);
-    
-    MOS_SymbolTable table = {0};
-    if (!mos_lexer_parse(&lexer, &table)) return 1;
-
-    return 0;
+    mos_assembler_free(as);
+    mos_lexer_free(&lexer);
+    return ok ? 0 : 1;
 }
-
-// TODO: ERROR Reporting, locations and offsets
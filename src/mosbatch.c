@@ -0,0 +1,403 @@
+// Mos 6502 Batch Runner
+//
+// Runs every image listed in a manifest on its own MOS_Cpu. Jobs are split
+// evenly between the workers up front, a worker that runs dry steals half of
+// the jobs left in another worker's queue. Every worker owns its result buffer
+// and its 64K of guest ram, so the only shared state are the queue locks.
+//
+// Manifest lines are `<image> <load_addr> [start_pc] [max_cycles]`, numbers
+// in hex except max_cycles, `#` starts a comment. An image halts on BRK.
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./mos.h"
+
+#define MOS_BATCH_MAX_WORKERS    256
+#define MOS_BATCH_DEFAULT_CYCLES 100000000ULL
+#define MOS_BATCH_LINE_SIZE      4096
+
+typedef struct _mos_batch_job {
+    char *path;
+    uint16_t load_addr;
+    uint16_t start_pc;
+    uint64_t max_cycles;
+} MOS_BatchJob;
+
+typedef ARRAY(MOS_BatchJob) MOS_BatchJobs;
+
+typedef enum _mos_batch_status {
+    MOS_BATCH_HALTED,     // reached BRK
+    MOS_BATCH_TIMEOUT,    // ran out of cycles
+    MOS_BATCH_FAULT,      // the cpu faulted
+    MOS_BATCH_LOAD_ERROR, // image could not be loaded
+} MOS_BatchStatus;
+
+typedef struct _mos_batch_result {
+    uint32_t job;
+    MOS_BatchStatus status;
+    MOS_Fault fault;
+    uint16_t fault_addr;
+    uint64_t cycles;
+    uint8_t racc, regx, regy, sp, psr;
+    uint16_t pc;
+} MOS_BatchResult;
+
+typedef ARRAY(MOS_BatchResult) MOS_BatchResults;
+
+// Jobs [head, tail) of the manifest still waiting in a worker's queue
+typedef struct _mos_batch_queue {
+    pthread_mutex_t lock;
+    uint32_t head;
+    uint32_t tail;
+} MOS_BatchQueue;
+
+typedef struct _mos_batch MOS_Batch;
+
+typedef struct _mos_batch_worker {
+    pthread_t thread;
+    uint32_t id;
+    MOS_Batch *batch;
+    MOS_BatchQueue queue;
+    MOS_BatchResults results;
+    uint8_t ram[0x10000]; // reused by every job of this worker
+} MOS_BatchWorker;
+
+struct _mos_batch {
+    MOS_BatchJobs jobs;
+    MOS_BatchWorker *workers;
+    uint32_t worker_count;
+};
+
+const char *mos_batch_status_as_cstr(MOS_BatchStatus status)
+{
+    switch (status) {
+    case MOS_BATCH_HALTED:     return "HALTED";
+    case MOS_BATCH_TIMEOUT:    return "TIMEOUT";
+    case MOS_BATCH_FAULT:      return "FAULT";
+    case MOS_BATCH_LOAD_ERROR: return "LOAD_ERROR";
+    default:                   return NULL;
+    }
+}
+
+static bool mos_batch_parse_hex(const char *text, uint16_t *value)
+{
+    char *end = NULL;
+    unsigned long number = strtoul(text, &end, 16);
+    if (*end != '\0' || number > 0xFFFF) return false;
+    *value = (uint16_t) number;
+    return true;
+}
+
+bool mos_batch_load_manifest(MOS_BatchJobs *jobs, const char *file_path)
+{
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+
+    char line[MOS_BATCH_LINE_SIZE];
+    uint32_t lines = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lines++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char *fields[4] = {0};
+        uint32_t count = 0;
+        for (char *field = strtok(line, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n")) {
+            if (count == MOS_ARRAY_LEN(fields)) break;
+            fields[count++] = field;
+        }
+        if (count == 0) continue;
+
+        MOS_BatchJob job = {0};
+        job.max_cycles = MOS_BATCH_DEFAULT_CYCLES;
+        bool ok = count >= 2 && mos_batch_parse_hex(fields[1], &job.load_addr);
+        job.start_pc = job.load_addr;
+        if (ok && count >= 3) ok = mos_batch_parse_hex(fields[2], &job.start_pc);
+        if (ok && count >= 4) {
+            char *end = NULL;
+            job.max_cycles = strtoull(fields[3], &end, 10);
+            ok = *end == '\0';
+        }
+        if (!ok) {
+            fprintf(stderr, "ERROR: %s:%u: expected `<image> <load_addr> [start_pc] [max_cycles]`\n", file_path, lines);
+            fclose(fp);
+            return false;
+        }
+
+        job.path = strdup(fields[0]);
+        if (job.path == NULL) {
+            fprintf(stderr, "ERROR: Memory Allocation for job path Failed\n");
+            fclose(fp);
+            return false;
+        }
+        array_append(jobs, job);
+    }
+    fclose(fp);
+    return true;
+}
+
+// Copies the image into ram at the load address, anything past $FFFF is dropped
+static bool mos_batch_load_image(const MOS_BatchJob *job, uint8_t *ram)
+{
+    FILE *fp = fopen(job->path, "rb");
+    if (fp == NULL) return false;
+    fread(ram + job->load_addr, 1, 0x10000 - job->load_addr, fp);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static MOS_BatchResult mos_batch_run_job(MOS_BatchWorker *worker, uint32_t index)
+{
+    const MOS_BatchJob *job = &worker->batch->jobs.items[index];
+    MOS_BatchResult result = {0};
+    result.job = index;
+
+    memset(worker->ram, 0, sizeof(worker->ram));
+    if (!mos_batch_load_image(job, worker->ram)) {
+        result.status = MOS_BATCH_LOAD_ERROR;
+        return result;
+    }
+
+    MOS_Cpu cpu = mos_cpu_init();
+    MOS_MMap ram = {
+        .device = worker->ram,
+        .read = mos_read_memory,
+        .write = mos_write_memory,
+        .readonly = false,
+        .start_addr = 0X0000,
+        .end_addr = 0XFFFF,
+    };
+    mos_cpu_map(&cpu, ram);
+    cpu.pc = job->start_pc;
+
+    result.status = MOS_BATCH_TIMEOUT;
+    while (cpu.cycles < job->max_cycles) {
+        uint8_t opcode = mos_cpu_step(&cpu);
+        if (cpu.fault != MOS_FAULT_NONE) {
+            result.status = MOS_BATCH_FAULT;
+            break;
+        }
+        if (cpu.opcodes[opcode].opcode == BRK) {
+            result.status = MOS_BATCH_HALTED;
+            break;
+        }
+    }
+
+    result.fault = cpu.fault;
+    result.fault_addr = cpu.fault_addr;
+    result.cycles = cpu.cycles;
+    result.racc = cpu.racc;
+    result.regx = cpu.regx;
+    result.regy = cpu.regy;
+    result.sp = cpu.sp;
+    result.psr = mos_cpu_get_psr(&cpu);
+    result.pc = cpu.pc;
+    mos_cpu_free(&cpu);
+    return result;
+}
+
+// Takes the next job of the worker's own queue
+static bool mos_batch_pop(MOS_BatchQueue *queue, uint32_t *job)
+{
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail) {
+        *job = queue->head++;
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Moves the back half of some other worker's queue into the own, now empty, queue
+static bool mos_batch_steal(MOS_BatchWorker *worker)
+{
+    MOS_Batch *batch = worker->batch;
+    for (uint32_t i = 1; i < batch->worker_count; ++i) {
+        MOS_BatchQueue *victim = &batch->workers[(worker->id + i) % batch->worker_count].queue;
+
+        pthread_mutex_lock(&victim->lock);
+        uint32_t left = victim->tail - victim->head;
+        uint32_t tail = victim->tail;
+        uint32_t stolen = (left + 1) / 2;
+        victim->tail -= stolen;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (stolen > 0) {
+            pthread_mutex_lock(&worker->queue.lock);
+            worker->queue.head = tail - stolen;
+            worker->queue.tail = tail;
+            pthread_mutex_unlock(&worker->queue.lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *mos_batch_worker_main(void *arg)
+{
+    MOS_BatchWorker *worker = arg;
+    uint32_t job;
+    for (;;) {
+        if (!mos_batch_pop(&worker->queue, &job)) {
+            if (!mos_batch_steal(worker)) break; // jobs are only ever moved, so every queue is drained
+            continue;
+        }
+        MOS_BatchResult result = mos_batch_run_job(worker, job);
+        array_append(&worker->results, result);
+    }
+    return NULL;
+}
+
+static uint32_t mos_batch_default_workers(void)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) return 1;
+    if (cores > MOS_BATCH_MAX_WORKERS) return MOS_BATCH_MAX_WORKERS;
+    return (uint32_t) cores;
+}
+
+static double mos_batch_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Runs every job, `results` is indexed like the manifest
+bool mos_batch_run(MOS_Batch *batch, MOS_BatchResult *results)
+{
+    uint32_t job_count = batch->jobs.count;
+    if (batch->worker_count > job_count && job_count > 0) batch->worker_count = job_count;
+
+    batch->workers = calloc(batch->worker_count, sizeof(*batch->workers));
+    if (batch->workers == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for workers Failed\n");
+        return false;
+    }
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < batch->worker_count; ++i) {
+        MOS_BatchWorker *worker = &batch->workers[i];
+        worker->id = i;
+        worker->batch = batch;
+        worker->queue.head = (uint64_t) job_count * i / batch->worker_count;
+        worker->queue.tail = (uint64_t) job_count * (i + 1) / batch->worker_count;
+        pthread_mutex_init(&worker->queue.lock, NULL);
+        array_new(&worker->results);
+    }
+    for (uint32_t i = 0; i < batch->worker_count; ++i) {
+        MOS_BatchWorker *worker = &batch->workers[i];
+        if (pthread_create(&worker->thread, NULL, mos_batch_worker_main, worker) != 0) {
+            fprintf(stderr, "ERROR: Could not start worker %u, the others pick up its jobs\n", i);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) mos_batch_worker_main(&batch->workers[0]);
+    for (uint32_t i = 0; i < started; ++i) {
+        pthread_join(batch->workers[i].thread, NULL);
+    }
+
+    for (uint32_t i = 0; i < batch->worker_count; ++i) {
+        MOS_BatchWorker *worker = &batch->workers[i];
+        for (uint32_t j = 0; j < worker->results.count; ++j) {
+            results[worker->results.items[j].job] = worker->results.items[j];
+        }
+        array_delete(&worker->results);
+        pthread_mutex_destroy(&worker->queue.lock);
+    }
+    free(batch->workers);
+    batch->workers = NULL;
+    return true;
+}
+
+const char *mos_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    const char *result = **argv;
+    (*argv)++;
+    (*argc)--;
+    return result;
+}
+
+void mos_usage(const char *program)
+{
+    fprintf(stderr, "MOS 6502 Batch Runner\n");
+    fprintf(stderr, "USAGE: %s [-j <workers>] <manifest>\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = mos_shift(&argc, &argv);
+    MOS_Batch batch = {0};
+    batch.worker_count = mos_batch_default_workers();
+
+    const char *manifest = NULL;
+    while (argc > 0) {
+        const char *arg = mos_shift(&argc, &argv);
+        if (strcmp(arg, "-j") == 0 && argc > 0) {
+            int workers = atoi(mos_shift(&argc, &argv));
+            if (workers < 1 || workers > MOS_BATCH_MAX_WORKERS) {
+                fprintf(stderr, "ERROR: workers must be between 1 and %d\n", MOS_BATCH_MAX_WORKERS);
+                return 1;
+            }
+            batch.worker_count = workers;
+        } else if (manifest == NULL) {
+            manifest = arg;
+        } else {
+            mos_usage(program);
+            return 1;
+        }
+    }
+    if (manifest == NULL) {
+        mos_usage(program);
+        return 1;
+    }
+
+    array_new(&batch.jobs);
+    if (!mos_batch_load_manifest(&batch.jobs, manifest)) return 1;
+
+    MOS_BatchResult *results = calloc(batch.jobs.count + 1, sizeof(*results));
+    if (results == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for results Failed\n");
+        return 1;
+    }
+
+    double start = mos_batch_seconds();
+    if (!mos_batch_run(&batch, results)) return 1;
+    double elapsed = mos_batch_seconds() - start;
+
+    uint64_t total_cycles = 0;
+    uint32_t failed = 0;
+    printf("# image status cycles a x y sp psr pc fault\n");
+    for (uint32_t i = 0; i < batch.jobs.count; ++i) {
+        const MOS_BatchResult *result = &results[i];
+        printf("%s %s %llu %02X %02X %02X %02X %02X %04X",
+               batch.jobs.items[i].path, mos_batch_status_as_cstr(result->status),
+               (unsigned long long) result->cycles, result->racc, result->regx,
+               result->regy, result->sp, result->psr, result->pc);
+        if (result->status == MOS_BATCH_FAULT) {
+            printf(" %s@%04X", mos_fault_as_cstr(result->fault), result->fault_addr);
+        }
+        printf("\n");
+        total_cycles += result->cycles;
+        if (result->status != MOS_BATCH_HALTED) failed++;
+    }
+    fprintf(stderr, "%u jobs, %u workers, %u not halted, %llu cycles in %.3fs (%.1f MHz)\n",
+            batch.jobs.count, batch.worker_count, failed, (unsigned long long) total_cycles,
+            elapsed, elapsed > 0 ? total_cycles / elapsed / 1e6 : 0.0);
+
+    for (uint32_t i = 0; i < batch.jobs.count; ++i) free(batch.jobs.items[i].path);
+    array_delete(&batch.jobs);
+    free(results);
+    return failed != 0;
+}
@@ -0,0 +1,429 @@
+// Mos 6502 Benchmark Suite
+//
+// Runs a fixed set of 6502 workloads through every execution engine of the
+// core and reports host ns per emulated instruction, emulated MHz and the
+// heap allocations made while setting up and while running. Results go to
+// stdout as a table and, with -o, to a tab separated file that a later run
+// can be checked against with -b.
+//
+// Built by `make bench` with -O2 and linked with --wrap=malloc/calloc/realloc
+// so every allocation made by the core is counted.
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <time.h>
+
+#include "./mos.h"
+
+#define MOS_BENCH_DEFAULT_CYCLES    50000000ULL
+#define MOS_BENCH_DEFAULT_RUNS      3
+#define MOS_BENCH_DEFAULT_THRESHOLD 10.0 // percent of ns/inst before -b calls it a regression
+#define MOS_BENCH_ORIGIN            0x0200
+#define MOS_BENCH_LINE_SIZE         1024
+
+// NOTE: Allocation counting, the __real_ symbols come from the linker's --wrap
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static uint64_t mos_bench_allocs = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    mos_bench_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    mos_bench_allocs++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    mos_bench_allocs++;
+    return __real_realloc(ptr, size);
+}
+
+typedef struct _mos_bench_workload {
+    const char *name;
+    const uint8_t *code; // loaded at MOS_BENCH_ORIGIN, loops forever
+    uint32_t length;
+    void (*setup)(uint8_t *ram);
+} MOS_BenchWorkload;
+
+// Tight accumulator arithmetic, one counted loop
+static const uint8_t mos_bench_alu[] = {
+    0xA2, 0x00,       // $0200 LDX #$00
+    0x8A,             // $0202 TXA
+    0x69, 0x03,       //       ADC #$03
+    0x49, 0x5A,       //       EOR #$5A
+    0x0A,             //       ASL A
+    0x6A,             //       ROR A
+    0x29, 0x7F,       //       AND #$7F
+    0x09, 0x01,       //       ORA #$01
+    0xE9, 0x02,       //       SBC #$02
+    0xE8,             //       INX
+    0xD0, 0xF0,       //       BNE $0202
+    0x4C, 0x00, 0x02, //       JMP $0200
+};
+
+// A page through ($10),Y -> ($12),Y then a page through abs,X
+static const uint8_t mos_bench_memcpy[] = {
+    0xA0, 0x00,       // $0200 LDY #$00
+    0xB1, 0x10,       // $0202 LDA ($10),Y
+    0x91, 0x12,       //       STA ($12),Y
+    0xC8,             //       INY
+    0xD0, 0xF9,       //       BNE $0202
+    0xA2, 0x00,       //       LDX #$00
+    0xBD, 0x00, 0x30, // $020B LDA $3000,X
+    0x9D, 0x00, 0x40, //       STA $4000,X
+    0xE8,             //       INX
+    0xD0, 0xF7,       //       BNE $020B
+    0x4C, 0x00, 0x02, //       JMP $0200
+};
+
+// Data dependent branches driven by an 8-bit LFSR in $20
+static const uint8_t mos_bench_branch[] = {
+    0xA5, 0x20,       // $0200 LDA $20
+    0x0A,             //       ASL A
+    0x90, 0x02,       //       BCC $0207
+    0x49, 0x1D,       //       EOR #$1D
+    0x85, 0x20,       // $0207 STA $20
+    0x30, 0x03,       //       BMI $020E
+    0xE8,             //       INX
+    0xD0, 0xF2,       //       BNE $0200
+    0xC8,             // $020E INY
+    0xC0, 0x80,       //       CPY #$80
+    0xB0, 0xED,       //       BCS $0200
+    0x90, 0xEB,       //       BCC $0200
+};
+
+// Every indexed and indirect mode, including read-modify-write
+static const uint8_t mos_bench_indexed[] = {
+    0xA2, 0x00,       // $0200 LDX #$00
+    0xB5, 0x40,       // $0202 LDA $40,X
+    0x79, 0x00, 0x30, //       ADC $3000,Y
+    0x95, 0x40,       //       STA $40,X
+    0xA1, 0x60,       //       LDA ($60,X)
+    0x51, 0x62,       //       EOR ($62),Y
+    0x99, 0x00, 0x31, //       STA $3100,Y
+    0xF6, 0x40,       //       INC $40,X
+    0xDE, 0x00, 0x32, //       DEC $3200,X
+    0xC8,             //       INY
+    0xE8,             //       INX
+    0xE8,             //       INX
+    0xE0, 0x10,       //       CPX #$10
+    0xD0, 0xE6,       //       BNE $0202
+    0x4C, 0x00, 0x02, //       JMP $0200
+};
+
+static void mos_bench_setup_memcpy(uint8_t *ram)
+{
+    ram[0x10] = 0x00; ram[0x11] = 0x10; // source $1000
+    ram[0x12] = 0x00; ram[0x13] = 0x20; // destination $2000
+    for (uint32_t i = 0; i < 0x100; ++i) {
+        ram[0x1000 + i] = i * 7;
+        ram[0x3000 + i] = i ^ 0xA5;
+    }
+}
+
+static void mos_bench_setup_branch(uint8_t *ram)
+{
+    ram[0x20] = 0x01; // the LFSR never leaves zero once there
+}
+
+static void mos_bench_setup_indexed(uint8_t *ram)
+{
+    for (uint32_t i = 0x60; i < 0x80; i += 2) {
+        ram[i] = (i - 0x60) * 8;
+        ram[i + 1] = 0x30;
+    }
+    for (uint32_t i = 0; i < 0x300; ++i) ram[0x3000 + i] = i * 13;
+}
+
+static const MOS_BenchWorkload mos_bench_workloads[] = {
+    { "alu",     mos_bench_alu,     sizeof(mos_bench_alu),     NULL },
+    { "memcpy",  mos_bench_memcpy,  sizeof(mos_bench_memcpy),  mos_bench_setup_memcpy },
+    { "branch",  mos_bench_branch,  sizeof(mos_bench_branch),  mos_bench_setup_branch },
+    { "indexed", mos_bench_indexed, sizeof(mos_bench_indexed), mos_bench_setup_indexed },
+};
+
+typedef enum _mos_bench_engine {
+    MOS_BENCH_STEP,  // mos_cpu_step loop, also counts the instructions
+    MOS_BENCH_RUN,   // mos_cpu_run without a block cache
+    MOS_BENCH_CACHE, // mos_cpu_run with the block cache
+    MOS_BENCH_JIT,   // mos_cpu_run with the block cache and the recompiler
+} MOS_BenchEngine;
+
+#define MOS_BENCH_ENGINE_COUNT (MOS_BENCH_JIT + 1)
+
+const char *mos_bench_engine_as_cstr(MOS_BenchEngine engine)
+{
+    switch (engine) {
+    case MOS_BENCH_STEP:  return "step";
+    case MOS_BENCH_RUN:   return "run";
+    case MOS_BENCH_CACHE: return "cache";
+    case MOS_BENCH_JIT:   return "jit";
+    default:              return NULL;
+    }
+}
+
+typedef struct _mos_bench_result {
+    const char *workload;
+    MOS_BenchEngine engine;
+    uint64_t cycles;
+    uint64_t instructions;
+    double seconds;      // best of all runs
+    uint64_t setup_allocs;
+    uint64_t run_allocs;
+    uint64_t state;      // hash of the registers and ram, equal across engines
+} MOS_BenchResult;
+
+typedef ARRAY(MOS_BenchResult) MOS_BenchResults;
+
+static double mos_bench_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// FNV-1a over the visible cpu state and the whole address space
+static uint64_t mos_bench_hash(const MOS_Cpu *cpu, const uint8_t *ram)
+{
+    uint8_t regs[] = {
+        cpu->racc, cpu->regx, cpu->regy, cpu->sp, mos_cpu_get_psr(cpu), cpu->pc >> 8, cpu->pc & 0xFF,
+    };
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint32_t i = 0; i < MOS_ARRAY_LEN(regs); ++i) hash = (hash ^ regs[i]) * 1099511628211ULL;
+    for (uint32_t i = 0; i < 0x10000; ++i) hash = (hash ^ ram[i]) * 1099511628211ULL;
+    return hash ^ cpu->cycles;
+}
+
+// Runs one workload on one engine for `cycles`, returns false if the engine is not available
+static bool mos_bench_once(const MOS_BenchWorkload *workload, MOS_BenchEngine engine,
+                           uint64_t cycles, MOS_BenchResult *result)
+{
+    static uint8_t ram[0x10000];
+    memset(ram, 0, sizeof(ram));
+    memcpy(&ram[MOS_BENCH_ORIGIN], workload->code, workload->length);
+    if (workload->setup != NULL) workload->setup(ram);
+
+    uint64_t allocs = mos_bench_allocs;
+    MOS_Cpu cpu = mos_cpu_init();
+    MOS_MMap map = {
+        .device = ram,
+        .read = mos_read_memory,
+        .write = mos_write_memory,
+        .readonly = false,
+        .start_addr = 0x0000,
+        .end_addr = 0xFFFF,
+    };
+    mos_cpu_map(&cpu, map);
+    cpu.pc = MOS_BENCH_ORIGIN;
+
+    bool ok = true;
+    if (engine == MOS_BENCH_CACHE) ok = mos_cpu_enable_block_cache(&cpu);
+    if (engine == MOS_BENCH_JIT) ok = mos_cpu_enable_jit(&cpu);
+    if (!ok) {
+        mos_cpu_free(&cpu);
+        return false;
+    }
+    result->setup_allocs = mos_bench_allocs - allocs;
+
+    allocs = mos_bench_allocs;
+    uint64_t instructions = 0;
+    double start = mos_bench_seconds();
+    if (engine == MOS_BENCH_STEP) {
+        while (cpu.cycles < cycles) {
+            mos_cpu_step(&cpu);
+            instructions++;
+        }
+    } else {
+        mos_cpu_run(&cpu, cycles);
+    }
+    result->seconds = mos_bench_seconds() - start;
+    result->run_allocs = mos_bench_allocs - allocs;
+
+    result->workload = workload->name;
+    result->engine = engine;
+    result->cycles = cpu.cycles;
+    result->instructions = instructions;
+    result->state = mos_bench_hash(&cpu, ram);
+    mos_cpu_free(&cpu);
+    return true;
+}
+
+static double mos_bench_ns_per_inst(const MOS_BenchResult *result)
+{
+    return result->instructions > 0 ? result->seconds * 1e9 / result->instructions : 0.0;
+}
+
+static double mos_bench_mhz(const MOS_BenchResult *result)
+{
+    return result->seconds > 0 ? result->cycles / result->seconds / 1e6 : 0.0;
+}
+
+// Checks `results` against a file written by -o, returns the number of regressions
+static int mos_bench_compare(const MOS_BenchResults *results, const char *file_path, double threshold)
+{
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[MOS_BENCH_LINE_SIZE];
+    printf("\n%-8s %-6s %10s %10s %8s\n", "workload", "engine", "base", "now", "change");
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (line[0] == '#') continue;
+        char label[128], workload[64], engine[16];
+        double ns_per_inst;
+        if (sscanf(line, "%127s %63s %15s %*s %*s %lf", label, workload, engine, &ns_per_inst) != 4) continue;
+
+        for (uint32_t i = 0; i < results->count; ++i) {
+            const MOS_BenchResult *result = &results->items[i];
+            if (strcmp(result->workload, workload) != 0) continue;
+            if (strcmp(mos_bench_engine_as_cstr(result->engine), engine) != 0) continue;
+
+            double now = mos_bench_ns_per_inst(result);
+            double change = ns_per_inst > 0 ? (now - ns_per_inst) / ns_per_inst * 100.0 : 0.0;
+            bool regressed = change > threshold;
+            printf("%-8s %-6s %10.2f %10.2f %+7.1f%%%s\n", workload, engine, ns_per_inst, now, change,
+                   regressed ? " REGRESSION" : "");
+            if (regressed) regressions++;
+        }
+    }
+    fclose(fp);
+    return regressions;
+}
+
+static bool mos_bench_write(const MOS_BenchResults *results, const char *file_path, const char *label)
+{
+    FILE *fp = fopen(file_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+    fprintf(fp, "# label\tworkload\tengine\tcycles\tinstructions\tns_per_inst\tmhz\tsetup_allocs\trun_allocs\tstate\n");
+    for (uint32_t i = 0; i < results->count; ++i) {
+        const MOS_BenchResult *result = &results->items[i];
+        fprintf(fp, "%s\t%s\t%s\t%llu\t%llu\t%.3f\t%.2f\t%llu\t%llu\t%016llx\n", label,
+                result->workload, mos_bench_engine_as_cstr(result->engine),
+                (unsigned long long) result->cycles, (unsigned long long) result->instructions,
+                mos_bench_ns_per_inst(result), mos_bench_mhz(result),
+                (unsigned long long) result->setup_allocs, (unsigned long long) result->run_allocs,
+                (unsigned long long) result->state);
+    }
+    fclose(fp);
+    return true;
+}
+
+const char *mos_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    const char *result = **argv;
+    (*argv)++;
+    (*argc)--;
+    return result;
+}
+
+void mos_usage(const char *program)
+{
+    fprintf(stderr, "MOS 6502 Benchmark Suite\n");
+    fprintf(stderr, "USAGE: %s [-c <cycles>] [-r <runs>] [-l <label>] [-o <results>] [-b <baseline> [-t <percent>]]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = mos_shift(&argc, &argv);
+    uint64_t cycles = MOS_BENCH_DEFAULT_CYCLES;
+    uint32_t runs = MOS_BENCH_DEFAULT_RUNS;
+    double threshold = MOS_BENCH_DEFAULT_THRESHOLD;
+    const char *label = "-";
+    const char *output = NULL;
+    const char *baseline = NULL;
+
+    while (argc > 0) {
+        const char *arg = mos_shift(&argc, &argv);
+        if (strcmp(arg, "-c") == 0 && argc > 0) {
+            cycles = strtoull(mos_shift(&argc, &argv), NULL, 10);
+        } else if (strcmp(arg, "-r") == 0 && argc > 0) {
+            runs = atoi(mos_shift(&argc, &argv));
+        } else if (strcmp(arg, "-l") == 0 && argc > 0) {
+            label = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "-o") == 0 && argc > 0) {
+            output = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "-b") == 0 && argc > 0) {
+            baseline = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "-t") == 0 && argc > 0) {
+            threshold = atof(mos_shift(&argc, &argv));
+        } else {
+            mos_usage(program);
+            return 1;
+        }
+    }
+    if (cycles == 0 || runs == 0) {
+        mos_usage(program);
+        return 1;
+    }
+
+    MOS_BenchResults results;
+    array_new(&results);
+    bool diverged = false;
+
+    printf("%-8s %-6s %12s %12s %10s %10s %6s %6s\n",
+           "workload", "engine", "cycles", "insts", "ns/inst", "MHz", "setup", "allocs");
+    for (uint32_t w = 0; w < MOS_ARRAY_LEN(mos_bench_workloads); ++w) {
+        const MOS_BenchWorkload *workload = &mos_bench_workloads[w];
+        uint64_t instructions = 0;
+        uint64_t state = 0;
+        for (uint32_t e = 0; e < MOS_BENCH_ENGINE_COUNT; ++e) {
+            MOS_BenchResult best = {0};
+            bool available = true;
+            for (uint32_t r = 0; r < runs && available; ++r) {
+                MOS_BenchResult result = {0};
+                available = mos_bench_once(workload, e, cycles, &result);
+                if (available && (r == 0 || result.seconds < best.seconds)) best = result;
+            }
+            if (!available) {
+                fprintf(stderr, "%s: engine `%s` is not available, skipped\n",
+                        workload->name, mos_bench_engine_as_cstr(e));
+                continue;
+            }
+
+            // every engine runs the same instruction stream, the step engine counts it
+            if (e == MOS_BENCH_STEP) {
+                instructions = best.instructions;
+                state = best.state;
+            } else {
+                best.instructions = instructions;
+                if (best.state != state) {
+                    fprintf(stderr, "ERROR: %s: engine `%s` ended in a different state than `step`\n",
+                            workload->name, mos_bench_engine_as_cstr(e));
+                    diverged = true;
+                }
+            }
+
+            printf("%-8s %-6s %12llu %12llu %10.2f %10.2f %6llu %6llu\n", best.workload,
+                   mos_bench_engine_as_cstr(best.engine), (unsigned long long) best.cycles,
+                   (unsigned long long) best.instructions, mos_bench_ns_per_inst(&best), mos_bench_mhz(&best),
+                   (unsigned long long) best.setup_allocs, (unsigned long long) best.run_allocs);
+            array_append(&results, best);
+        }
+    }
+
+    int status = diverged ? 1 : 0;
+    if (output != NULL && !mos_bench_write(&results, output, label)) status = 1;
+    if (baseline != NULL) {
+        int regressions = mos_bench_compare(&results, baseline, threshold);
+        if (regressions != 0) status = 1;
+    }
+
+    array_delete(&results);
+    return status;
+}
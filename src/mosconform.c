@@ -0,0 +1,355 @@
+// Mos 6502 Conformance Runner
+//
+// Runs functional test ROMs headlessly on every execution engine. Test ROMs
+// such as Klaus Dormann's 6502_functional_test report through a trap: once
+// done they jump or branch to themselves forever, at the success address
+// when every test passed or right after the failing test otherwise. A ROM
+// passes when every engine that ran it trapped at the success address.
+//
+// Manifest lines are `<image> <load_addr> <start_pc> <success_pc> [max_cycles [timer_addr]]`,
+// numbers in hex except max_cycles, `#` starts a comment. The functional test
+// assembled with its default options is `6502_functional_test.bin 0 400 3469`.
+// With timer_addr an interval timer (mos_timer_new) is mapped there over the RAM.
+// -v runs every image on another cpu variant, the legacy decoder only knows
+// the documented NMOS opcodes and is skipped then.
+//
+// The cache and jit engines look for the trap between chunks of
+// mos_cpu_run, so their cycles and seconds include up to a chunk spent
+// spinning on it. Their cycles and minst/s are printed with a `~`, the
+// instruction count they are divided by is the step engine's.
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <time.h>
+
+#include "./mos.h"
+
+#define MOS_CONFORM_DEFAULT_CYCLES 200000000ULL
+#define MOS_CONFORM_CHUNK          10000  // cycles mos_cpu_run gets between two trap checks
+#define MOS_CONFORM_LINE_SIZE      4096
+
+typedef enum _mos_conform_engine {
+    MOS_CONFORM_DECODE, // mos_fetch_instruction and mos_decode
+    MOS_CONFORM_STEP,   // dispatch table, one mos_cpu_step at a time
+    MOS_CONFORM_CACHE,  // mos_cpu_run with the block cache
+    MOS_CONFORM_JIT,    // mos_cpu_run with the block cache and the recompiler
+    MOS_CONFORM_ENGINES,
+} MOS_ConformEngine;
+
+typedef enum _mos_conform_status {
+    MOS_CONFORM_PASS,       // trapped at the success address
+    MOS_CONFORM_FAIL,       // trapped anywhere else
+    MOS_CONFORM_TIMEOUT,    // ran out of cycles
+    MOS_CONFORM_FAULT,      // the cpu faulted
+    MOS_CONFORM_LOAD_ERROR, // image could not be loaded
+} MOS_ConformStatus;
+
+typedef struct _mos_conform_job {
+    char *path;
+    uint16_t load_addr;
+    uint16_t start_pc;
+    uint16_t success_pc;
+    uint64_t max_cycles;
+    bool has_timer;
+    uint16_t timer_addr;
+} MOS_ConformJob;
+
+typedef ARRAY(MOS_ConformJob) MOS_ConformJobs;
+
+typedef struct _mos_conform_result {
+    MOS_ConformStatus status;
+    uint16_t trap_pc;
+    uint64_t cycles;
+    uint64_t instructions; // only counted by the decode and step engines
+    double seconds;
+} MOS_ConformResult;
+
+const char *mos_conform_engine_as_cstr(MOS_ConformEngine engine)
+{
+    switch (engine) {
+    case MOS_CONFORM_DECODE:  return "decode";
+    case MOS_CONFORM_STEP:    return "step";
+    case MOS_CONFORM_CACHE:   return "cache";
+    case MOS_CONFORM_JIT:     return "jit";
+    case MOS_CONFORM_ENGINES:
+    default:                  return NULL;
+    }
+}
+
+const char *mos_conform_status_as_cstr(MOS_ConformStatus status)
+{
+    switch (status) {
+    case MOS_CONFORM_PASS:       return "PASS";
+    case MOS_CONFORM_FAIL:       return "FAIL";
+    case MOS_CONFORM_TIMEOUT:    return "TIMEOUT";
+    case MOS_CONFORM_FAULT:      return "FAULT";
+    case MOS_CONFORM_LOAD_ERROR: return "LOAD_ERROR";
+    default:                     return NULL;
+    }
+}
+
+static bool mos_conform_parse_hex(const char *text, uint16_t *value)
+{
+    char *end = NULL;
+    unsigned long number = strtoul(text, &end, 16);
+    if (*end != '\0' || number > 0xFFFF) return false;
+    *value = (uint16_t) number;
+    return true;
+}
+
+bool mos_conform_load_manifest(MOS_ConformJobs *jobs, const char *file_path)
+{
+    FILE *fp = fopen(file_path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+
+    char line[MOS_CONFORM_LINE_SIZE];
+    uint32_t lines = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lines++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char *fields[6] = {0};
+        uint32_t count = 0;
+        for (char *field = strtok(line, " \t\r\n"); field != NULL; field = strtok(NULL, " \t\r\n")) {
+            if (count == MOS_ARRAY_LEN(fields)) break;
+            fields[count++] = field;
+        }
+        if (count == 0) continue;
+
+        MOS_ConformJob job = {0};
+        job.max_cycles = MOS_CONFORM_DEFAULT_CYCLES;
+        bool ok = count >= 4 &&
+            mos_conform_parse_hex(fields[1], &job.load_addr) &&
+            mos_conform_parse_hex(fields[2], &job.start_pc) &&
+            mos_conform_parse_hex(fields[3], &job.success_pc);
+        if (ok && count >= 5) {
+            char *end = NULL;
+            job.max_cycles = strtoull(fields[4], &end, 10);
+            ok = *end == '\0';
+        }
+        if (ok && count >= 6) {
+            job.has_timer = true;
+            ok = mos_conform_parse_hex(fields[5], &job.timer_addr);
+        }
+        if (!ok) {
+            fprintf(stderr, "ERROR: %s:%u: expected `<image> <load_addr> <start_pc> <success_pc> [max_cycles [timer_addr]]`\n",
+                    file_path, lines);
+            fclose(fp);
+            return false;
+        }
+
+        job.path = strdup(fields[0]);
+        if (job.path == NULL) {
+            fprintf(stderr, "ERROR: Memory Allocation for job path Failed\n");
+            fclose(fp);
+            return false;
+        }
+        array_append(jobs, job);
+    }
+    fclose(fp);
+    return true;
+}
+
+// Copies the image into `image` at the load address, anything past $FFFF is dropped
+static bool mos_conform_load_image(const MOS_ConformJob *job, uint8_t *image)
+{
+    FILE *fp = fopen(job->path, "rb");
+    if (fp == NULL) return false;
+    memset(image, 0, 0x10000);
+    size_t size = fread(image + job->load_addr, 1, 0x10000 - job->load_addr, fp);
+    bool ok = size > 0 && !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static double mos_conform_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// One instruction of the legacy decoder, false once it traps
+static bool mos_conform_decode(MOS_Cpu *cpu)
+{
+    uint16_t pc = cpu->pc;
+    mos_decode(cpu, mos_fetch_instruction(cpu));
+    return cpu->pc != pc;
+}
+
+static bool mos_conform_step(MOS_Cpu *cpu)
+{
+    uint16_t pc = cpu->pc;
+    mos_cpu_step(cpu);
+    return cpu->pc != pc;
+}
+
+static MOS_ConformResult mos_conform_run(const MOS_ConformJob *job, MOS_ConformEngine engine, MOS_Variant variant, uint8_t *ram)
+{
+    MOS_ConformResult result = {0};
+    MOS_Cpu cpu = mos_cpu_init_variant(variant);
+    // the first entry mapped at an address wins, the timer goes in before the RAM
+    MOS_Timer *timer = NULL;
+    if (job->has_timer) {
+        timer = mos_timer_new(&cpu, job->timer_addr, 0);
+        if (timer == NULL) {
+            mos_cpu_free(&cpu);
+            result.status = MOS_CONFORM_LOAD_ERROR;
+            return result;
+        }
+    }
+    MOS_MMap map = {
+        .device = ram,
+        .read = mos_read_memory,
+        .write = mos_write_memory,
+        .readonly = false,
+        .start_addr = 0X0000,
+        .end_addr = 0XFFFF,
+    };
+    mos_cpu_map(&cpu, map);
+    if (engine == MOS_CONFORM_CACHE || engine == MOS_CONFORM_JIT) mos_cpu_enable_block_cache(&cpu);
+    if (engine == MOS_CONFORM_JIT) mos_cpu_enable_jit(&cpu);
+    cpu.pc = job->start_pc;
+
+    bool running = true;
+    double start = mos_conform_seconds();
+    while (running && cpu.cycles < job->max_cycles && cpu.fault == MOS_FAULT_NONE) {
+        switch (engine) {
+        case MOS_CONFORM_DECODE:
+            running = mos_conform_decode(&cpu);
+            result.instructions++;
+            break;
+        case MOS_CONFORM_STEP:
+            running = mos_conform_step(&cpu);
+            result.instructions++;
+            break;
+        case MOS_CONFORM_CACHE:
+        case MOS_CONFORM_JIT: {
+            // a trap is an instruction that does not move pc, one step tells
+            uint64_t chunk = job->max_cycles - cpu.cycles;
+            if (chunk > MOS_CONFORM_CHUNK) chunk = MOS_CONFORM_CHUNK;
+            mos_cpu_run(&cpu, chunk);
+            if (cpu.fault == MOS_FAULT_NONE) running = mos_conform_step(&cpu);
+        } break;
+        case MOS_CONFORM_ENGINES:
+        default:
+            MOS_UNREACHABLE("mos_conform_run");
+        }
+    }
+    result.seconds = mos_conform_seconds() - start;
+    result.cycles = cpu.cycles;
+    result.trap_pc = cpu.pc;
+
+    if (cpu.fault != MOS_FAULT_NONE) {
+        result.status = MOS_CONFORM_FAULT;
+    } else if (running) {
+        result.status = MOS_CONFORM_TIMEOUT;
+    } else {
+        result.status = cpu.pc == job->success_pc ? MOS_CONFORM_PASS : MOS_CONFORM_FAIL;
+    }
+    mos_cpu_free(&cpu);
+    mos_timer_free(timer);
+    return result;
+}
+
+const char *mos_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    const char *result = **argv;
+    (*argv)++;
+    (*argc)--;
+    return result;
+}
+
+void mos_usage(const char *program)
+{
+    fprintf(stderr, "MOS 6502 Conformance Runner\n");
+    fprintf(stderr, "USAGE: %s [-e decode|step|cache|jit] [-v nmos|nmos-illegal|65c02] <manifest>\n", program);
+    fprintf(stderr, "  -e  run one engine only, every engine runs by default\n");
+    fprintf(stderr, "  -v  cpu variant, nmos by default\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = mos_shift(&argc, &argv);
+    const char *manifest = NULL;
+    MOS_Variant variant = MOS_VARIANT_NMOS;
+    bool engines[MOS_CONFORM_ENGINES];
+    for (uint32_t i = 0; i < MOS_CONFORM_ENGINES; ++i) engines[i] = true;
+
+    while (argc > 0) {
+        const char *arg = mos_shift(&argc, &argv);
+        if (strcmp(arg, "-e") == 0 && argc > 0) {
+            const char *name = mos_shift(&argc, &argv);
+            bool found = false;
+            for (uint32_t i = 0; i < MOS_CONFORM_ENGINES; ++i) {
+                engines[i] = strcmp(name, mos_conform_engine_as_cstr(i)) == 0;
+                found |= engines[i];
+            }
+            if (!found) {
+                fprintf(stderr, "ERROR: unknown engine `%s`\n", name);
+                return 1;
+            }
+        } else if (strcmp(arg, "-v") == 0 && argc > 0) {
+            if (!mos_variant_from_cstr(mos_shift(&argc, &argv), &variant)) return 1;
+        } else if (manifest == NULL) {
+            manifest = arg;
+        } else {
+            mos_usage(program);
+            return 1;
+        }
+    }
+    if (manifest == NULL) {
+        mos_usage(program);
+        return 1;
+    }
+    if (variant != MOS_VARIANT_NMOS) engines[MOS_CONFORM_DECODE] = false;
+
+    MOS_ConformJobs jobs;
+    array_new(&jobs);
+    if (!mos_conform_load_manifest(&jobs, manifest)) return 1;
+
+    static uint8_t image[0x10000];
+    static uint8_t ram[0x10000];
+    uint32_t failed = 0;
+    printf("# image engine status trap_pc cycles instructions seconds minst/s\n");
+    for (uint32_t i = 0; i < jobs.count; ++i) {
+        const MOS_ConformJob *job = &jobs.items[i];
+        if (!mos_conform_load_image(job, image)) {
+            printf("%s - %s\n", job->path, mos_conform_status_as_cstr(MOS_CONFORM_LOAD_ERROR));
+            failed++;
+            continue;
+        }
+
+        // the engines without a counter run the same instructions as the step engine
+        uint64_t instructions = 0;
+        for (uint32_t engine = 0; engine < MOS_CONFORM_ENGINES; ++engine) {
+            if (!engines[engine]) continue;
+            memcpy(ram, image, sizeof(ram));
+            MOS_ConformResult result = mos_conform_run(job, engine, variant, ram);
+            if (result.instructions > 0) instructions = result.instructions;
+            uint64_t count = result.instructions > 0 ? result.instructions : instructions;
+            const char *approximate = result.instructions > 0 ? "" : "~";
+
+            printf("%s %s %s %04X %s%llu ", job->path, mos_conform_engine_as_cstr(engine),
+                   mos_conform_status_as_cstr(result.status), result.trap_pc,
+                   approximate, (unsigned long long) result.cycles);
+            if (count > 0) {
+                printf("%llu %.3f %s%.1f\n", (unsigned long long) count, result.seconds, approximate,
+                       result.seconds > 0 ? count / result.seconds / 1e6 : 0.0);
+            } else {
+                printf("- %.3f -\n", result.seconds);
+            }
+            if (result.status != MOS_CONFORM_PASS) failed++;
+        }
+    }
+    fprintf(stderr, "%u images, %u failed runs\n", jobs.count, failed);
+
+    for (uint32_t i = 0; i < jobs.count; ++i) free(jobs.items[i].path);
+    array_delete(&jobs);
+    return failed != 0;
+}
@@ -1,3 +1,19 @@
+// Mos 6502 Emulator
+//
+// Without images runs a small built-in demo. Otherwise every image is mapped
+// read-only straight from its file with mmap, so nothing is copied and
+// processes running the same ROM set share the page cache. 64K of ram fills
+// every address no image covers, the first image covering an address wins.
+//
+// An image is either raw bytes, loaded at `path@ADDR` or so it ends at $FFFF,
+// or starts with a header, all numbers little endian:
+//
+//   "M65I" version:u8 flags:u8 load_addr:u16 reset_vector:u16 payload...
+//
+// flags bit 0 means the reset vector is valid, otherwise the cpu starts from
+// the vector at $FFFC like the real chip. --cpu picks the variant, documented
+// NMOS opcodes only by default.
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -6,56 +22,139 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "./mos.h"
 
-MOS_Instruction mos_fetch_instruction(MOS_Cpu *cpu)
+typedef struct _mos_image {
+    const char *path;
+    void  *mapping;      // whole file, header included
+    size_t mapping_size;
+    uint16_t load_addr;
+    uint16_t reset_vector;
+    bool has_reset;
+} MOS_Image;
+
+typedef ARRAY(MOS_Image) MOS_Images;
+
+static bool mos_parse_hex(const char *text, uint16_t *value)
 {
-    MOS_Instruction inst = {0};
-    uint8_t data = mos_cpu_read(cpu, cpu->pc);
-    cpu->pc++;
-
-    MOS_OpcodeInfo info = opcode_matrix[data];
-    inst.opcode = info.opcode;
-    inst.mode   = info.mode;
-    switch (inst.mode) {
-    case IMPL:
-    case ACCU:
-        break;
-    case IMME: {
-        inst.operand.data.data = mos_cpu_read(cpu, cpu->pc);
-        inst.operand.type = OPERAND_DATA;
-        cpu->pc++;
-    } break;
-    case ZP:
-    case ZPX:
-    case ZPY:
-        break;
-    case REL: {
-        inst.operand.data.data = mos_cpu_read(cpu, cpu->pc);
-        inst.operand.type = OPERAND_DATA;
-        cpu->pc++;
-    } break;
-    case ABS: {
-        uint8_t offset = mos_cpu_read(cpu, cpu->pc);
-        cpu->pc++;
-        uint8_t page = mos_cpu_read(cpu, cpu->pc);
-        cpu->pc++;
-        uint16_t abs = mos_bytes_to_uint16_t(page, offset);
-        inst.operand.data.address = abs;
-        inst.operand.type = OPERAND_ADDRESS;
-    } break;
-    case ABSX:
-    case ABSY:
-    case IND:
-    case INDX:
-    case INDY:
-        break;
+    char *end = NULL;
+    unsigned long number = strtoul(text, &end, 16);
+    if (*text == '\0' || *end != '\0' || number > 0xFFFF) return false;
+    *value = (uint16_t) number;
+    return true;
+}
+
+// Maps `spec` (`path` or `path@ADDR`) read-only and registers it with `cpu`
+bool mos_map_image(MOS_Cpu *cpu, const char *spec, MOS_Image *image)
+{
+    memset(image, 0, sizeof(*image));
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", spec);
+    bool has_addr = false;
+    char *at = strrchr(path, '@');
+    if (at != NULL) {
+        *at = '\0';
+        if (!mos_parse_hex(at + 1, &image->load_addr)) {
+            fprintf(stderr, "ERROR: `%s`: expected `<image>[@<load_addr hex>]`\n", spec);
+            return false;
+        }
+        has_addr = true;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        path, strerror(errno));
+        return false;
     }
-    return inst;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "ERROR: file `%s` is empty or could not be read\n", path);
+        close(fd);
+        return false;
+    }
+    image->mapping_size = st.st_size;
+    image->mapping = mmap(NULL, image->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (image->mapping == MAP_FAILED) {
+        fprintf(stderr, "ERROR: file `%s` could not be mapped because of : %s\n",
+        path, strerror(errno));
+        image->mapping = NULL;
+        return false;
+    }
+    image->path = spec;
+
+    const uint8_t *bytes = image->mapping;
+    size_t offset = 0;
+    if (image->mapping_size >= MOS_IMAGE_HEADER_SIZE && memcmp(bytes, MOS_IMAGE_MAGIC, 4) == 0) {
+        if (bytes[4] != MOS_IMAGE_VERSION) {
+            fprintf(stderr, "ERROR: `%s` has unknown image version %u\n", path, bytes[4]);
+            return false;
+        }
+        image->has_reset = (bytes[5] & MOS_IMAGE_HAS_RESET) != 0;
+        if (!has_addr) image->load_addr = mos_bytes_to_uint16_t(bytes[7], bytes[6]);
+        image->reset_vector = mos_bytes_to_uint16_t(bytes[9], bytes[8]);
+        offset = MOS_IMAGE_HEADER_SIZE;
+    } else if (!has_addr) {
+        // raw ROMs sit at the top so they cover the vectors
+        image->load_addr = image->mapping_size <= 0x10000 ? 0x10000 - image->mapping_size : 0;
+    }
+
+    size_t size = image->mapping_size - offset;
+    if (size == 0 || image->load_addr + size > 0x10000) {
+        fprintf(stderr, "ERROR: `%s`: %zu bytes do not fit at 0x%04X\n", path, size, image->load_addr);
+        return false;
+    }
+
+    // mos_read_memory indexes the device with the full address, so the device
+    // points load_addr bytes before the payload and is only read inside it
+    MOS_MMap rom = {
+        .device = (void*)((uintptr_t) bytes + offset - image->load_addr),
+        .read = mos_read_memory,
+        .write = mos_write_memory,
+        .readonly = true,
+        .start_addr = image->load_addr,
+        .end_addr = image->load_addr + (size - 1),
+    };
+    mos_cpu_map(cpu, rom);
+    return true;
+}
+
+void mos_unmap_image(MOS_Image *image)
+{
+    if (image->mapping != NULL) munmap(image->mapping, image->mapping_size);
+    image->mapping = NULL;
+}
+
+// Steps until BRK or a fault, `max_cycles` of 0 means no limit
+static void mos_emu_run(MOS_Cpu *cpu, uint64_t max_cycles)
+{
+    while (max_cycles == 0 || cpu->cycles < max_cycles) {
+        uint8_t opcode = mos_trace_step(cpu); // plain mos_cpu_step unless tracing
+        if (cpu->opcodes[opcode].opcode == BRK) break;
+        if (cpu->fault != MOS_FAULT_NONE) {
+            fprintf(stderr, "MOS_Cpu FAULT: %s: 0x%04x\n", mos_fault_as_cstr(cpu->fault), cpu->fault_addr);
+            break;
+        }
+    }
+}
+
+static void mos_emu_profile(MOS_Cpu *cpu, const char *profile_prefix)
+{
+    if (profile_prefix == NULL) return;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.txt", profile_prefix);
+    mos_profile_report(cpu, path, 32);
+    snprintf(path, sizeof(path), "%s.folded", profile_prefix);
+    mos_profile_write_collapsed(cpu, path);
 }
 
-int main(void)
+static int mos_emu_demo(MOS_Variant variant, const char *profile_prefix, const char *trace_path)
 {
     uint8_t instructions[] = {
         0x18, // CLC
@@ -74,8 +173,8 @@ int main(void)
         0x00, // BRK
     };
 
-    MOS_Cpu cpu = mos_cpu_init();
-    uint8_t system_ram[0xFFFF] = {0};
+    MOS_Cpu cpu = mos_cpu_init_variant(variant);
+    static uint8_t system_ram[0x10000] = {0};
 
     MOS_MMap ram = {
         .device = system_ram,
@@ -86,7 +185,7 @@ int main(void)
         .end_addr = 0XFFFF,
     };
 
-    array_append(&cpu.entries, ram);
+    mos_cpu_map(&cpu, ram);
     mos_cpu_write(&cpu, mos_bytes_to_uint16_t(0x00, 0x00), 0xA);
     mos_cpu_write(&cpu, mos_bytes_to_uint16_t(0x00, 0x01), 0xA);
 
@@ -96,19 +195,117 @@ int main(void)
         printf("Inst: 0x%02X\n", instructions[i]);
     }
     cpu.pc = addr;
-    printf("PC: 0x%02X\n", cpu.pc);
-    while (1) {
-        MOS_Instruction inst = mos_fetch_instruction(&cpu);
-        if (!mos_decode(&cpu, inst)) return 1;
-        if (inst.opcode == BRK) break;
+    if ((profile_prefix != NULL && !mos_cpu_enable_profile(&cpu)) ||
+        (trace_path != NULL && !mos_cpu_enable_trace(&cpu, trace_path, 0, false))) {
+        mos_cpu_free(&cpu);
+        return 1;
     }
+    printf("PC: 0x%02X\n", cpu.pc);
+    mos_emu_run(&cpu, 0);
 
     uint8_t dat = mos_cpu_read(&cpu, mos_bytes_to_uint16_t(0x00, 0x02));
     printf("Result: 0X%X\n", dat);
 
     uint16_t pc = cpu.pc;
     printf("PC: 0x%02X\n", pc);
+    printf("Cycles: %llu\n", (unsigned long long) cpu.cycles);
+
+    mos_emu_profile(&cpu, profile_prefix);
+    bool ok = mos_trace_close(&cpu);
+    mos_cpu_free(&cpu);
+    return ok ? 0 : 1;
+}
+
+const char *mos_shift(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    const char *result = **argv;
+    (*argv)++;
+    (*argc)--;
+    return result;
+}
+
+void mos_usage(const char *program)
+{
+    fprintf(stderr, "MOS 6502 Emulator\n");
+    fprintf(stderr, "USAGE: %s [--cpu nmos|nmos-illegal|65c02] [--profile <prefix>] [--trace <file>] [-c <max_cycles>] [<image>[@<load_addr hex>] ...]\n", program);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = mos_shift(&argc, &argv);
+    // --profile <prefix> writes <prefix>.txt and <prefix>.folded, needs `make PROFILE=1`
+    const char *profile_prefix = NULL;
+    // --trace <file> records every instruction, print it with mostracedump
+    const char *trace_path = NULL;
+    MOS_Variant variant = MOS_VARIANT_NMOS;
+    uint64_t max_cycles = 0;
+    const char *specs[MOS_PAGE_COUNT];
+    uint32_t spec_count = 0;
+    while (argc > 0) {
+        const char *arg = mos_shift(&argc, &argv);
+        if (strcmp(arg, "--cpu") == 0 && argc > 0) {
+            if (!mos_variant_from_cstr(mos_shift(&argc, &argv), &variant)) return 1;
+        } else if (strcmp(arg, "--profile") == 0 && argc > 0) {
+            profile_prefix = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "--trace") == 0 && argc > 0) {
+            trace_path = mos_shift(&argc, &argv);
+        } else if (strcmp(arg, "-c") == 0 && argc > 0) {
+            max_cycles = strtoull(mos_shift(&argc, &argv), NULL, 10);
+        } else if (arg[0] != '-' && spec_count < MOS_ARRAY_LEN(specs)) {
+            specs[spec_count++] = arg;
+        } else {
+            mos_usage(program);
+            return 1;
+        }
+    }
+    if (spec_count == 0) return mos_emu_demo(variant, profile_prefix, trace_path);
+
+    MOS_Cpu cpu = mos_cpu_init_variant(variant);
+    MOS_Images images;
+    array_new(&images);
+    int status = 0;
+    for (uint32_t i = 0; i < spec_count && status == 0; ++i) {
+        MOS_Image image;
+        if (!mos_map_image(&cpu, specs[i], &image)) status = 1;
+        array_append(&images, image); // unmapped below even when it failed
+    }
+
+    static uint8_t system_ram[0x10000] = {0};
+    MOS_MMap ram = {
+        .device = system_ram,
+        .read = mos_read_memory,
+        .write = mos_write_memory,
+        .readonly = false,
+        .start_addr = 0X0000,
+        .end_addr = 0XFFFF,
+    };
+    mos_cpu_map(&cpu, ram);
+
+    if (status == 0 && profile_prefix != NULL && !mos_cpu_enable_profile(&cpu)) status = 1;
+    if (status == 0 && trace_path != NULL && !mos_cpu_enable_trace(&cpu, trace_path, 0, false)) status = 1;
+    if (status == 0) {
+        mos_cpu_reset(&cpu);
+        for (uint32_t i = 0; i < images.count; ++i) {
+            if (images.items[i].has_reset) {
+                cpu.pc = images.items[i].reset_vector;
+                break;
+            }
+        }
+
+        printf("PC: 0x%04X\n", cpu.pc);
+        mos_emu_run(&cpu, max_cycles);
+        printf("A: 0x%02X X: 0x%02X Y: 0x%02X SP: 0x%02X PSR: 0x%02X\n",
+               cpu.racc, cpu.regx, cpu.regy, cpu.sp, mos_cpu_get_psr(&cpu));
+        printf("PC: 0x%04X\n", cpu.pc);
+        printf("Cycles: %llu\n", (unsigned long long) cpu.cycles);
+        mos_emu_profile(&cpu, profile_prefix);
+        if (cpu.fault != MOS_FAULT_NONE) status = 1;
+        if (!mos_trace_close(&cpu)) status = 1;
+    }
 
-    array_delete(&cpu.entries);
-    return 0;
+    mos_cpu_free(&cpu);
+    for (uint32_t i = 0; i < images.count; ++i) mos_unmap_image(&images.items[i]);
+    array_delete(&images);
+    return status;
 }
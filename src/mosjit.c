@@ -0,0 +1,991 @@
+// Mos 6502 x86-64 recompiler
+//
+// Hot blocks from the block cache are translated to native code. For the
+// whole block the guest registers live in host registers, N and Z are kept
+// lazily as the last result byte and only folded into the psr when PHP or BIT
+// needs them, the block exit hands them back to flag_n and flag_z. Memory goes through the page table: plain
+// pages are accessed inline, I/O pages and pages holding cached code fall
+// back to mos_cpu_read/mos_block_write, so devices and self-modifying code
+// keep working. BRK, RTI, the opcodes only some variants have and ADC or SBC
+// in decimal mode are left to the interpreter.
+#define _DEFAULT_SOURCE
+#include <stddef.h>
+
+#include "./mos.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+#define MOS_JIT_CODE_SIZE  (1 << 20) // bytes of native code per cpu
+#define MOS_JIT_BLOCK_SIZE (16 << 10) // upper bound for one translated block
+#define MOS_JIT_MAX_EXITS  64
+
+struct _mos_jit {
+    uint8_t *code;
+    uint32_t used;
+};
+
+// Host registers
+enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8,  R9,  R10, R11, R12, R13, R14, R15,
+};
+
+// Guest state while a block runs, all callee-saved except the flags which the
+// slow paths save around their calls together with the R10/R11 temporaries
+#define MOS_JIT_CPU    RBX // MOS_Cpu *
+#define MOS_JIT_BUDGET R12 // cycles left until the deadline, signed
+#define MOS_JIT_A      R13
+#define MOS_JIT_X      R14
+#define MOS_JIT_Y      R15
+#define MOS_JIT_SP     RBP
+#define MOS_JIT_NZ     R8  // last result byte while the N and Z flags are lazy
+#define MOS_JIT_PSR    R9
+
+// x86 condition codes
+enum {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6,
+    CC_S = 0x8, CC_NS = 0x9, CC_LE = 0xE,
+};
+
+// Group-1 opcode extensions for 0x81
+enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+typedef struct _mos_jit_exit {
+    uint32_t site; // rel32 to patch
+    uint16_t pc;
+    bool lazy;
+} MOS_JitExit;
+
+typedef struct _mos_jit_emitter {
+    uint8_t *code;
+    uint32_t size;
+    uint32_t capacity;
+    bool overflow;
+    bool lazy;          // N and Z live in MOS_JIT_NZ
+    MOS_Variant variant;
+    MOS_JitExit exits[MOS_JIT_MAX_EXITS]; // out-of-line exits, emitted after the body
+    uint32_t exit_count;
+    uint32_t epilogue_sites[MOS_JIT_MAX_EXITS];
+    uint32_t epilogue_count;
+} MOS_JitEmitter;
+
+static void mos_emit8(MOS_JitEmitter *e, uint8_t byte)
+{
+    if (e->size < e->capacity) {
+        e->code[e->size] = byte;
+    } else {
+        e->overflow = true;
+    }
+    e->size++;
+}
+
+static void mos_emit32(MOS_JitEmitter *e, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) mos_emit8(e, value >> (8*i));
+}
+
+static void mos_emit64(MOS_JitEmitter *e, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) mos_emit8(e, value >> (8*i));
+}
+
+static void mos_emit_opcode(MOS_JitEmitter *e, uint32_t op)
+{
+    if (op > 0xFF) mos_emit8(e, op >> 8);
+    mos_emit8(e, op & 0xFF);
+}
+
+// `byte` forces a REX prefix so 4-7 encode spl/bpl/sil/dil instead of ah/ch/dh/bh
+static void mos_emit_rex(MOS_JitEmitter *e, bool w, int reg, int index, int base, bool byte)
+{
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | (((index >> 3) & 1) << 1) | ((base >> 3) & 1);
+    if (rex != 0x40 || byte) mos_emit8(e, rex);
+}
+
+// op reg, rm with both operands registers
+static void mos_emit_rr(MOS_JitEmitter *e, uint32_t op, bool w, bool byte, int reg, int rm)
+{
+    mos_emit_rex(e, w, reg, 0, rm, byte);
+    mos_emit_opcode(e, op);
+    mos_emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op reg, [base + index + disp32], index < 0 for none
+static void mos_emit_rm(MOS_JitEmitter *e, uint32_t op, bool w, bool byte, int reg, int base, int index, int32_t disp)
+{
+    mos_emit_rex(e, w, reg, index < 0 ? 0 : index, base, byte);
+    mos_emit_opcode(e, op);
+    if (index < 0 && (base & 7) != RSP) {
+        mos_emit8(e, 0x80 | ((reg & 7) << 3) | (base & 7));
+    } else {
+        mos_emit8(e, 0x80 | ((reg & 7) << 3) | 4);
+        mos_emit8(e, (((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+    }
+    mos_emit32(e, disp);
+}
+
+static void mos_emit_mov(MOS_JitEmitter *e, int dst, int src)   { mos_emit_rr(e, 0x89, false, false, src, dst); }
+static void mos_emit_mov64(MOS_JitEmitter *e, int dst, int src) { mos_emit_rr(e, 0x89, true, false, src, dst); }
+static void mos_emit_movzx8(MOS_JitEmitter *e, int dst, int src) { mos_emit_rr(e, 0x0FB6, false, true, dst, src); }
+
+static void mos_emit_mov_imm(MOS_JitEmitter *e, int dst, uint32_t imm)
+{
+    mos_emit_rex(e, false, 0, 0, dst, false);
+    mos_emit8(e, 0xB8 + (dst & 7));
+    mos_emit32(e, imm);
+}
+
+// add, or, and, sub, xor, cmp, test between two 32-bit registers
+enum { OP_ADD = 0x01, OP_OR = 0x09, OP_AND = 0x21, OP_SUB = 0x29, OP_XOR = 0x31, OP_CMP = 0x39, OP_TEST = 0x85 };
+
+static void mos_emit_alu(MOS_JitEmitter *e, uint32_t op, int dst, int src) { mos_emit_rr(e, op, false, false, src, dst); }
+
+static void mos_emit_alu_imm(MOS_JitEmitter *e, int ext, int dst, uint32_t imm)
+{
+    mos_emit_rr(e, 0x81, false, false, ext, dst);
+    mos_emit32(e, imm);
+}
+
+static void mos_emit_alu64_imm(MOS_JitEmitter *e, int ext, int dst, uint32_t imm)
+{
+    mos_emit_rr(e, 0x81, true, false, ext, dst);
+    mos_emit32(e, imm);
+}
+
+static void mos_emit_shl(MOS_JitEmitter *e, int dst, uint8_t n) { mos_emit_rr(e, 0xC1, false, false, 4, dst); mos_emit8(e, n); }
+static void mos_emit_shr(MOS_JitEmitter *e, int dst, uint8_t n) { mos_emit_rr(e, 0xC1, false, false, 5, dst); mos_emit8(e, n); }
+static void mos_emit_not(MOS_JitEmitter *e, int dst)            { mos_emit_rr(e, 0xF7, false, false, 2, dst); }
+static void mos_emit_test8(MOS_JitEmitter *e, int a, int b)     { mos_emit_rr(e, 0x84, false, true, b, a); }
+static void mos_emit_test64(MOS_JitEmitter *e, int a, int b)    { mos_emit_rr(e, 0x85, true, false, b, a); }
+
+static void mos_emit_test_imm(MOS_JitEmitter *e, int dst, uint32_t imm)
+{
+    mos_emit_rr(e, 0xF7, false, false, 0, dst);
+    mos_emit32(e, imm);
+}
+
+static void mos_emit_imul_imm(MOS_JitEmitter *e, int dst, int src, uint32_t imm)
+{
+    mos_emit_rr(e, 0x69, false, false, dst, src);
+    mos_emit32(e, imm);
+}
+
+// dst = condition ? 1 : 0
+static void mos_emit_setcc(MOS_JitEmitter *e, int cc, int dst)
+{
+    mos_emit_rr(e, 0x0F90 | cc, false, true, 0, dst);
+    mos_emit_movzx8(e, dst, dst);
+}
+
+static void mos_emit_push(MOS_JitEmitter *e, int reg)
+{
+    if (reg >= R8) mos_emit8(e, 0x41);
+    mos_emit8(e, 0x50 + (reg & 7));
+}
+
+static void mos_emit_pop(MOS_JitEmitter *e, int reg)
+{
+    if (reg >= R8) mos_emit8(e, 0x41);
+    mos_emit8(e, 0x58 + (reg & 7));
+}
+
+static uint32_t mos_emit_jcc(MOS_JitEmitter *e, int cc)
+{
+    mos_emit8(e, 0x0F);
+    mos_emit8(e, 0x80 | cc);
+    uint32_t site = e->size;
+    mos_emit32(e, 0);
+    return site;
+}
+
+static uint32_t mos_emit_jmp(MOS_JitEmitter *e)
+{
+    mos_emit8(e, 0xE9);
+    uint32_t site = e->size;
+    mos_emit32(e, 0);
+    return site;
+}
+
+// Points the rel32 at `site` to the current position
+static void mos_emit_patch(MOS_JitEmitter *e, uint32_t site)
+{
+    uint32_t rel = e->size - (site + 4);
+    if (site + 4 > e->capacity) return; // overflowed, the block is discarded anyway
+    for (int i = 0; i < 4; ++i) e->code[site + i] = rel >> (8*i);
+}
+
+static void mos_emit_call(MOS_JitEmitter *e, uint64_t function)
+{
+    mos_emit8(e, 0x48);
+    mos_emit8(e, 0xB8 + RAX);
+    mos_emit64(e, function); // mov rax, imm64
+    mos_emit8(e, 0xFF);
+    mos_emit8(e, 0xD0);      // call rax
+}
+
+#define MOS_CPU_FIELD(field) ((int32_t) offsetof(MOS_Cpu, field))
+#define MOS_PAGE_FIELD(field) ((int32_t) (offsetof(MOS_Cpu, pages) + offsetof(MOS_Page, field)))
+
+// Calls a memory helper with the flags and temporaries saved, the stack stays 16-byte aligned.
+// Devices and the replay log read cpu->cycles, so the clock is written back first
+static void mos_emit_helper(MOS_JitEmitter *e, uint64_t function)
+{
+    mos_emit_rm(e, 0x8B, true, false, RAX, RSP, -1, 0); // deadline pushed by the prologue
+    mos_emit_rr(e, 0x29, true, false, MOS_JIT_BUDGET, RAX); // sub rax, r12
+    mos_emit_rm(e, 0x89, true, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(cycles));
+    mos_emit_push(e, R8);
+    mos_emit_push(e, R9);
+    mos_emit_push(e, R10);
+    mos_emit_push(e, R11);
+    mos_emit_mov64(e, RDI, MOS_JIT_CPU);
+    mos_emit_call(e, function);
+    mos_emit_pop(e, R11);
+    mos_emit_pop(e, R10);
+    mos_emit_pop(e, R9);
+    mos_emit_pop(e, R8);
+}
+
+// Folds the lazy N and Z into the psr register
+static void mos_emit_materialize(MOS_JitEmitter *e)
+{
+    if (!e->lazy) return;
+    mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~(N_BIT_FLAG | Z_BIT_FLAG));
+    mos_emit_test8(e, MOS_JIT_NZ, MOS_JIT_NZ);
+    mos_emit_setcc(e, CC_E, RAX);
+    mos_emit_shl(e, RAX, 1); // Z_BIT_FLAG
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+    mos_emit_mov(e, RAX, MOS_JIT_NZ);
+    mos_emit_alu_imm(e, ALU_AND, RAX, N_BIT_FLAG);
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+    e->lazy = false;
+}
+
+// Leaves the block now, with pc either constant or taken from si when `pc` < 0
+static void mos_emit_exit(MOS_JitEmitter *e, int32_t pc)
+{
+    // the epilogue hands N and Z back as flag_n = r8 and flag_z = r10
+    if (e->lazy) {
+        mos_emit_mov(e, R10, MOS_JIT_NZ);
+    } else {
+        mos_emit_mov(e, MOS_JIT_NZ, MOS_JIT_PSR);
+        mos_emit_mov(e, R10, MOS_JIT_PSR);
+        mos_emit_alu_imm(e, ALU_AND, R10, Z_BIT_FLAG);
+        mos_emit_alu_imm(e, ALU_XOR, R10, Z_BIT_FLAG);
+    }
+    if (pc >= 0) {
+        mos_emit8(e, 0x66);
+        mos_emit_rm(e, 0xC7, false, false, 0, MOS_JIT_CPU, -1, MOS_CPU_FIELD(pc));
+        mos_emit8(e, pc & 0xFF);
+        mos_emit8(e, pc >> 8);
+    } else {
+        mos_emit8(e, 0x66);
+        mos_emit_rm(e, 0x89, false, false, RSI, MOS_JIT_CPU, -1, MOS_CPU_FIELD(pc));
+    }
+    if (e->epilogue_count < MOS_JIT_MAX_EXITS) {
+        e->epilogue_sites[e->epilogue_count++] = mos_emit_jmp(e);
+    } else {
+        e->overflow = true;
+    }
+}
+
+// Conditional exit to `pc`, emitted out of line after the block body
+static void mos_emit_exit_if(MOS_JitEmitter *e, int cc, uint16_t pc)
+{
+    if (e->exit_count == MOS_JIT_MAX_EXITS) {
+        e->overflow = true;
+        return;
+    }
+    MOS_JitExit *exit = &e->exits[e->exit_count++];
+    exit->site = mos_emit_jcc(e, cc);
+    exit->pc = pc;
+    exit->lazy = e->lazy;
+}
+
+// eax = guest byte at si
+static void mos_emit_load(MOS_JitEmitter *e)
+{
+    mos_emit_mov(e, RAX, RSI);
+    mos_emit_shr(e, RAX, 8);
+    mos_emit_imul_imm(e, RAX, RAX, sizeof(MOS_Page));
+    mos_emit_rm(e, 0x8B, true, false, RDX, MOS_JIT_CPU, RAX, MOS_PAGE_FIELD(read));
+    mos_emit_test64(e, RDX, RDX);
+    uint32_t slow = mos_emit_jcc(e, CC_E);
+    mos_emit_movzx8(e, RCX, RSI);
+    mos_emit_rm(e, 0x0FB6, false, false, RAX, RDX, RCX, 0);
+    uint32_t done = mos_emit_jmp(e);
+    mos_emit_patch(e, slow);
+    mos_emit_helper(e, (uint64_t)(uintptr_t) mos_cpu_read);
+    mos_emit_movzx8(e, RAX, RAX);
+    mos_emit_patch(e, done);
+}
+
+// guest byte at si = cl, leaves the block for `next_pc` when the store hit
+// cached code, a negative `next_pc` for instructions that end the block anyway
+static void mos_emit_store(MOS_JitEmitter *e, int32_t next_pc)
+{
+    mos_emit_mov(e, RAX, RSI);
+    mos_emit_shr(e, RAX, 8);
+    mos_emit_imul_imm(e, RAX, RAX, sizeof(MOS_Page));
+    mos_emit_rm(e, 0x8B, true, false, RDX, MOS_JIT_CPU, RAX, MOS_PAGE_FIELD(write));
+    mos_emit_test64(e, RDX, RDX);
+    uint32_t slow = mos_emit_jcc(e, CC_E);
+    mos_emit_movzx8(e, RAX, RSI);
+    mos_emit_rm(e, 0x88, false, true, RCX, RDX, RAX, 0);
+    uint32_t done = mos_emit_jmp(e);
+    mos_emit_patch(e, slow);
+    mos_emit_mov(e, RDX, RCX);
+    mos_emit_helper(e, (uint64_t)(uintptr_t) mos_block_write);
+    if (next_pc >= 0) {
+        mos_emit_test8(e, RAX, RAX);
+        mos_emit_exit_if(e, CC_E, next_pc);
+    }
+    mos_emit_patch(e, done);
+}
+
+// One extra cycle when si and `base` are on different pages
+static void mos_emit_page_penalty(MOS_JitEmitter *e, int base)
+{
+    mos_emit_mov(e, RAX, RSI);
+    mos_emit_alu(e, OP_XOR, RAX, base);
+    mos_emit_alu_imm(e, ALU_CMP, RAX, 0xFF);
+    uint32_t same = mos_emit_jcc(e, CC_BE);
+    mos_emit_alu64_imm(e, ALU_SUB, MOS_JIT_BUDGET, 1);
+    mos_emit_patch(e, same);
+}
+
+// si = effective address, `read` adds the page-cross penalty of indexed reads
+static void mos_emit_address(MOS_JitEmitter *e, MOS_AddressingModes mode, uint16_t operand, bool read)
+{
+    switch (mode) {
+    case ZP:
+    case ABS:
+        mos_emit_mov_imm(e, RSI, operand);
+        break;
+    case ZPX:
+    case ZPY:
+        mos_emit_mov(e, RSI, mode == ZPX ? MOS_JIT_X : MOS_JIT_Y);
+        mos_emit_alu_imm(e, ALU_ADD, RSI, operand);
+        mos_emit_alu_imm(e, ALU_AND, RSI, 0xFF);
+        break;
+    case ABSX:
+    case ABSY:
+        mos_emit_mov(e, RSI, mode == ABSX ? MOS_JIT_X : MOS_JIT_Y);
+        mos_emit_alu_imm(e, ALU_ADD, RSI, operand);
+        mos_emit_alu_imm(e, ALU_AND, RSI, 0xFFFF);
+        if (read) {
+            mos_emit_mov_imm(e, R11, operand);
+            mos_emit_page_penalty(e, R11);
+        }
+        break;
+    case INDX:
+        mos_emit_mov(e, RSI, MOS_JIT_X);
+        mos_emit_alu_imm(e, ALU_ADD, RSI, operand);
+        mos_emit_alu_imm(e, ALU_AND, RSI, 0xFF);
+        mos_emit_mov(e, R11, RSI);
+        mos_emit_load(e);
+        mos_emit_mov(e, R10, RAX);                   // low-byte
+        mos_emit_mov(e, RSI, R11);
+        mos_emit_alu_imm(e, ALU_ADD, RSI, 1);
+        mos_emit_alu_imm(e, ALU_AND, RSI, 0xFF);     // the pointer wraps inside page zero
+        mos_emit_load(e);
+        mos_emit_shl(e, RAX, 8);
+        mos_emit_alu(e, OP_OR, RAX, R10);
+        mos_emit_mov(e, RSI, RAX);
+        break;
+    case INDY:
+        mos_emit_mov_imm(e, RSI, operand & 0xFF);
+        mos_emit_load(e);
+        mos_emit_mov(e, R10, RAX);
+        mos_emit_mov_imm(e, RSI, (operand + 1) & 0xFF);
+        mos_emit_load(e);
+        mos_emit_shl(e, RAX, 8);
+        mos_emit_alu(e, OP_OR, RAX, R10);
+        mos_emit_mov(e, R11, RAX);                   // base address
+        mos_emit_mov(e, RSI, RAX);
+        mos_emit_alu(e, OP_ADD, RSI, MOS_JIT_Y);
+        mos_emit_alu_imm(e, ALU_AND, RSI, 0xFFFF);
+        if (read) mos_emit_page_penalty(e, R11);
+        break;
+    case IMPL:
+    case ACCU:
+    case IMME:
+    case REL:
+    case IND:
+    case ZPI:
+    case ABXI:
+    default:
+        MOS_UNREACHABLE("mos_emit_address");
+    }
+}
+
+// eax = operand value of a read opcode
+static void mos_emit_operand(MOS_JitEmitter *e, MOS_AddressingModes mode, uint16_t operand)
+{
+    if (mode == IMME) {
+        mos_emit_mov_imm(e, RAX, operand & 0xFF);
+        return;
+    }
+    mos_emit_address(e, mode, operand, true);
+    mos_emit_load(e);
+}
+
+// N and Z now follow `reg`
+static void mos_emit_set_nz(MOS_JitEmitter *e, int reg)
+{
+    mos_emit_mov(e, MOS_JIT_NZ, reg);
+    e->lazy = true;
+}
+
+// A = A + eax + C, shared by ADC and SBC
+static void mos_emit_add_with_carry(MOS_JitEmitter *e)
+{
+    mos_emit_mov(e, RCX, MOS_JIT_PSR);
+    mos_emit_alu_imm(e, ALU_AND, RCX, C_BIT_FLAG);
+    mos_emit_alu(e, OP_ADD, RCX, RAX);
+    mos_emit_alu(e, OP_ADD, RCX, MOS_JIT_A);        // raw sum
+    mos_emit_mov(e, RDX, MOS_JIT_A);
+    mos_emit_alu(e, OP_XOR, RDX, RAX);
+    mos_emit_not(e, RDX);
+    mos_emit_mov(e, RDI, MOS_JIT_A);
+    mos_emit_alu(e, OP_XOR, RDI, RCX);
+    mos_emit_alu(e, OP_AND, RDX, RDI);
+    mos_emit_alu_imm(e, ALU_AND, RDX, 0x80);
+    mos_emit_shr(e, RDX, 1);                        // V_BIT_FLAG
+    mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~(C_BIT_FLAG | V_BIT_FLAG));
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RDX);
+    mos_emit_mov(e, RDX, RCX);
+    mos_emit_shr(e, RDX, 8);                        // C_BIT_FLAG
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RDX);
+    mos_emit_movzx8(e, MOS_JIT_A, RCX);
+    mos_emit_set_nz(e, MOS_JIT_A);
+}
+
+static void mos_emit_compare(MOS_JitEmitter *e, int reg)
+{
+    mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~C_BIT_FLAG);
+    mos_emit_alu(e, OP_CMP, reg, RAX);
+    mos_emit_setcc(e, CC_AE, RCX);
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RCX);
+    mos_emit_mov(e, RCX, reg);
+    mos_emit_alu(e, OP_SUB, RCX, RAX);
+    mos_emit_movzx8(e, RCX, RCX);
+    mos_emit_set_nz(e, RCX);
+}
+
+// eax = shift, rotate, increment or decrement of eax
+static void mos_emit_modify(MOS_JitEmitter *e, MOS_Opcode opcode)
+{
+    switch (opcode) {
+    case ASL:
+    case ROL:
+        mos_emit_mov(e, RCX, MOS_JIT_PSR);
+        mos_emit_alu_imm(e, ALU_AND, RCX, C_BIT_FLAG);  // old carry
+        mos_emit_mov(e, RDX, RAX);
+        mos_emit_shr(e, RDX, 7);
+        mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~C_BIT_FLAG);
+        mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RDX);
+        mos_emit_shl(e, RAX, 1);
+        if (opcode == ROL) mos_emit_alu(e, OP_OR, RAX, RCX);
+        mos_emit_movzx8(e, RAX, RAX);
+        break;
+    case LSR:
+    case ROR:
+        mos_emit_mov(e, RCX, MOS_JIT_PSR);
+        mos_emit_alu_imm(e, ALU_AND, RCX, C_BIT_FLAG);
+        mos_emit_shl(e, RCX, 7);
+        mos_emit_mov(e, RDX, RAX);
+        mos_emit_alu_imm(e, ALU_AND, RDX, C_BIT_FLAG);
+        mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~C_BIT_FLAG);
+        mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RDX);
+        mos_emit_shr(e, RAX, 1);
+        if (opcode == ROR) mos_emit_alu(e, OP_OR, RAX, RCX);
+        break;
+    case INC:
+        mos_emit_alu_imm(e, ALU_ADD, RAX, 1);
+        mos_emit_movzx8(e, RAX, RAX);
+        break;
+    case DEC:
+        mos_emit_alu_imm(e, ALU_SUB, RAX, 1);
+        mos_emit_movzx8(e, RAX, RAX);
+        break;
+    case BRK: case NOP: case RTI: case RTS: case JMP: case JSR: case ADC: case SBC:
+    case CMP: case CPX: case CPY: case LDA: case LDY: case LDX: case STA: case STY:
+    case STX: case CLC: case CLV: case CLI: case CLD: case SEC: case SED: case SEI:
+    case ORA: case AND: case EOR: case BIT: case TAX: case TAY: case TXA: case TYA:
+    case TSX: case TXS: case PHA: case PHP: case PLA: case PLP: case INX: case INY:
+    case DEX: case DEY: case BNE: case BCC: case BCS: case BEQ: case BMI: case BPL:
+    case BVC: case BVS: case SLO: case RLA: case SRE: case RRA: case SAX: case LAX:
+    case DCP: case ISC: case ANC: case ALR: case ARR: case ANE: case LXA: case SBX:
+    case SHA: case SHX: case SHY: case TAS: case LAS: case JAM: case BRA: case PHX:
+    case PHY: case PLX: case PLY: case STZ: case TRB: case TSB:
+    case ERROR_FETCH_DATA: case ERROR_FETCH_LOCATION:
+    default:
+        MOS_UNREACHABLE("mos_emit_modify");
+    }
+    mos_emit_set_nz(e, RAX);
+}
+
+// reg = reg +/- 1 for INX, INY, DEX, DEY
+static void mos_emit_step_reg(MOS_JitEmitter *e, int reg, int ext)
+{
+    mos_emit_alu_imm(e, ext, reg, 1);
+    mos_emit_movzx8(e, reg, reg);
+    mos_emit_set_nz(e, reg);
+}
+
+static void mos_emit_transfer(MOS_JitEmitter *e, int dst, int src)
+{
+    mos_emit_mov(e, dst, src);
+    mos_emit_set_nz(e, dst);
+}
+
+// Stack pushes store at sp then decrement, sp is updated before the store may leave the block
+static void mos_emit_push_value(MOS_JitEmitter *e, int32_t next_pc)
+{
+    mos_emit_mov(e, RSI, MOS_JIT_SP);
+    mos_emit_alu_imm(e, ALU_OR, RSI, MOS_STACK_PAGE << 8);
+    mos_emit_alu_imm(e, ALU_SUB, MOS_JIT_SP, 1);
+    mos_emit_movzx8(e, MOS_JIT_SP, MOS_JIT_SP);
+    mos_emit_store(e, next_pc);
+}
+
+static void mos_emit_pull_value(MOS_JitEmitter *e)
+{
+    mos_emit_alu_imm(e, ALU_ADD, MOS_JIT_SP, 1);
+    mos_emit_movzx8(e, MOS_JIT_SP, MOS_JIT_SP);
+    mos_emit_mov(e, RSI, MOS_JIT_SP);
+    mos_emit_alu_imm(e, ALU_OR, RSI, MOS_STACK_PAGE << 8);
+    mos_emit_load(e);
+}
+
+// Taken branches cost one more cycle, two when the target is on another page
+static void mos_emit_branch(MOS_JitEmitter *e, MOS_StatusFlags flag, bool set, uint16_t next_pc, uint8_t offset)
+{
+    int cc_taken;
+    if (e->lazy && (flag == Z_BIT_FLAG || flag == N_BIT_FLAG)) {
+        mos_emit_test8(e, MOS_JIT_NZ, MOS_JIT_NZ);
+        if (flag == Z_BIT_FLAG) cc_taken = set ? CC_E : CC_NE;
+        else                    cc_taken = set ? CC_S : CC_NS;
+    } else {
+        // C and V are always current in the psr register
+        mos_emit_test_imm(e, MOS_JIT_PSR, flag);
+        cc_taken = set ? CC_NE : CC_E;
+    }
+    uint16_t target = next_pc + (int8_t) offset;
+    uint32_t not_taken = mos_emit_jcc(e, cc_taken ^ 1);
+    bool lazy = e->lazy;
+    mos_emit_alu64_imm(e, ALU_SUB, MOS_JIT_BUDGET, 1 + ((next_pc ^ target) > 0xFF));
+    mos_emit_exit(e, target);
+    mos_emit_patch(e, not_taken);
+    e->lazy = lazy;
+    mos_emit_exit(e, next_pc);
+}
+
+// The documented opcodes are translated whatever the variant, except BRK and
+// RTI, the undocumented NMOS ones and what the 65C02 added stay interpreted
+static bool mos_jit_translates(MOS_OpcodeInfo info)
+{
+    if (info.mode == ZPI || info.mode == ABXI) return false;
+    switch (info.opcode) {
+    case NOP: return info.mode == IMPL; // the undocumented NOPs read their operand
+    case BIT: return info.mode != IMME; // the 65C02 BIT #imm only sets Z
+
+    case RTS: case JMP: case JSR: case ADC: case SBC: case CMP: case CPX: case CPY:
+    case LDA: case LDY: case LDX: case STA: case STY: case STX: case CLC: case CLV:
+    case CLI: case CLD: case SEC: case SED: case SEI: case ORA: case AND: case EOR:
+    case TAX: case TAY: case TXA: case TYA: case TSX: case TXS: case PHA: case PHP:
+    case PLA: case PLP: case INC: case INX: case INY: case DEX: case DEY: case DEC:
+    case BNE: case BCC: case BCS: case BEQ: case BMI: case BPL: case BVC: case BVS:
+    case ASL: case LSR: case ROL: case ROR:
+        return true;
+
+    case BRK: case RTI: case SLO: case RLA: case SRE: case RRA: case SAX: case LAX:
+    case DCP: case ISC: case ANC: case ALR: case ARR: case ANE: case LXA: case SBX:
+    case SHA: case SHX: case SHY: case TAS: case LAS: case JAM: case BRA: case PHX:
+    case PHY: case PLX: case PLY: case STZ: case TRB: case TSB:
+    case ERROR_FETCH_DATA: case ERROR_FETCH_LOCATION:
+    default:
+        return false;
+    }
+}
+
+// Emits one instruction, returns false when it is left to the interpreter.
+// `*ends` is set when the instruction already left the block.
+static bool mos_emit_instruction(MOS_JitEmitter *e, MOS_OpcodeInfo info, uint16_t pc, uint16_t operand, bool *ends)
+{
+    uint16_t next_pc = pc + mos_addr_mode_length(info.mode);
+    *ends = false;
+    if (!mos_jit_translates(info)) return false;
+
+    if (info.opcode == ADC || info.opcode == SBC) {
+        // decimal mode is left to the interpreter, before this instruction is charged
+        mos_emit_test_imm(e, MOS_JIT_PSR, D_BIT_FLAG);
+        mos_emit_exit_if(e, CC_NE, pc);
+    }
+    mos_emit_alu64_imm(e, ALU_SUB, MOS_JIT_BUDGET, info.cycles);
+    switch (info.opcode) {
+    case LDA: mos_emit_operand(e, info.mode, operand); mos_emit_transfer(e, MOS_JIT_A, RAX); break;
+    case LDX: mos_emit_operand(e, info.mode, operand); mos_emit_transfer(e, MOS_JIT_X, RAX); break;
+    case LDY: mos_emit_operand(e, info.mode, operand); mos_emit_transfer(e, MOS_JIT_Y, RAX); break;
+
+    case STA: mos_emit_address(e, info.mode, operand, false); mos_emit_mov(e, RCX, MOS_JIT_A); mos_emit_store(e, next_pc); break;
+    case STX: mos_emit_address(e, info.mode, operand, false); mos_emit_mov(e, RCX, MOS_JIT_X); mos_emit_store(e, next_pc); break;
+    case STY: mos_emit_address(e, info.mode, operand, false); mos_emit_mov(e, RCX, MOS_JIT_Y); mos_emit_store(e, next_pc); break;
+
+    case ADC:
+        mos_emit_operand(e, info.mode, operand);
+        mos_emit_add_with_carry(e);
+        break;
+    case SBC:
+        mos_emit_operand(e, info.mode, operand);
+        mos_emit_alu_imm(e, ALU_XOR, RAX, 0xFF);
+        mos_emit_add_with_carry(e);
+        break;
+    case CMP: mos_emit_operand(e, info.mode, operand); mos_emit_compare(e, MOS_JIT_A); break;
+    case CPX: mos_emit_operand(e, info.mode, operand); mos_emit_compare(e, MOS_JIT_X); break;
+    case CPY: mos_emit_operand(e, info.mode, operand); mos_emit_compare(e, MOS_JIT_Y); break;
+
+    case AND: mos_emit_operand(e, info.mode, operand); mos_emit_alu(e, OP_AND, MOS_JIT_A, RAX); mos_emit_set_nz(e, MOS_JIT_A); break;
+    case ORA: mos_emit_operand(e, info.mode, operand); mos_emit_alu(e, OP_OR, MOS_JIT_A, RAX);  mos_emit_set_nz(e, MOS_JIT_A); break;
+    case EOR: mos_emit_operand(e, info.mode, operand); mos_emit_alu(e, OP_XOR, MOS_JIT_A, RAX); mos_emit_set_nz(e, MOS_JIT_A); break;
+    case BIT:
+        // N and V come from memory and Z from A & M, so they are set eagerly
+        mos_emit_operand(e, info.mode, operand);
+        e->lazy = false;
+        mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~(N_BIT_FLAG | V_BIT_FLAG | Z_BIT_FLAG));
+        mos_emit_mov(e, RCX, RAX);
+        mos_emit_alu_imm(e, ALU_AND, RCX, N_BIT_FLAG | V_BIT_FLAG);
+        mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RCX);
+        mos_emit_alu(e, OP_TEST, RAX, MOS_JIT_A);
+        mos_emit_setcc(e, CC_E, RCX);
+        mos_emit_shl(e, RCX, 1);
+        mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RCX);
+        break;
+
+    case ASL:
+    case LSR:
+    case ROL:
+    case ROR:
+    case INC:
+    case DEC:
+        if (info.mode == ACCU) {
+            mos_emit_mov(e, RAX, MOS_JIT_A);
+            mos_emit_modify(e, info.opcode);
+            mos_emit_mov(e, MOS_JIT_A, RAX);
+        } else {
+            // the 65C02 only pays the abs,X fix-up cycle of a shift or rotate on a page cross
+            bool penalty = e->variant == MOS_VARIANT_65C02 && info.mode == ABSX &&
+                info.opcode != INC && info.opcode != DEC;
+            mos_emit_address(e, info.mode, operand, penalty);
+            mos_emit_mov(e, R11, RSI);
+            mos_emit_load(e);
+            mos_emit_modify(e, info.opcode);
+            mos_emit_mov(e, RCX, RAX);
+            mos_emit_mov(e, RSI, R11);
+            mos_emit_store(e, next_pc);
+        }
+        break;
+
+    case CLC: mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~C_BIT_FLAG); break;
+    case CLD: mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~D_BIT_FLAG); break;
+    case CLI: mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~I_BIT_FLAG); break;
+    case CLV: mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~V_BIT_FLAG); break;
+    case SEC: mos_emit_alu_imm(e, ALU_OR, MOS_JIT_PSR, C_BIT_FLAG); break;
+    case SED: mos_emit_alu_imm(e, ALU_OR, MOS_JIT_PSR, D_BIT_FLAG); break;
+    case SEI: mos_emit_alu_imm(e, ALU_OR, MOS_JIT_PSR, I_BIT_FLAG); break;
+
+    case TAX: mos_emit_transfer(e, MOS_JIT_X, MOS_JIT_A); break;
+    case TAY: mos_emit_transfer(e, MOS_JIT_Y, MOS_JIT_A); break;
+    case TXA: mos_emit_transfer(e, MOS_JIT_A, MOS_JIT_X); break;
+    case TYA: mos_emit_transfer(e, MOS_JIT_A, MOS_JIT_Y); break;
+    case TSX: mos_emit_transfer(e, MOS_JIT_X, MOS_JIT_SP); break;
+    case TXS: mos_emit_mov(e, MOS_JIT_SP, MOS_JIT_X); break;
+
+    case INX: mos_emit_step_reg(e, MOS_JIT_X, ALU_ADD); break;
+    case INY: mos_emit_step_reg(e, MOS_JIT_Y, ALU_ADD); break;
+    case DEX: mos_emit_step_reg(e, MOS_JIT_X, ALU_SUB); break;
+    case DEY: mos_emit_step_reg(e, MOS_JIT_Y, ALU_SUB); break;
+
+    case PHA:
+        mos_emit_mov(e, RCX, MOS_JIT_A);
+        mos_emit_push_value(e, next_pc);
+        break;
+    case PHP:
+        mos_emit_materialize(e);
+        mos_emit_mov(e, RCX, MOS_JIT_PSR);
+        mos_emit_alu_imm(e, ALU_OR, RCX, B_BIT_FLAG | U_BIT_FLAG);
+        mos_emit_push_value(e, next_pc);
+        break;
+    case PLA:
+        mos_emit_pull_value(e);
+        mos_emit_transfer(e, MOS_JIT_A, RAX);
+        break;
+    case PLP:
+        mos_emit_pull_value(e);
+        e->lazy = false;
+        mos_emit_alu_imm(e, ALU_AND, RAX, (uint8_t) ~B_BIT_FLAG);
+        mos_emit_alu_imm(e, ALU_OR, RAX, U_BIT_FLAG);
+        mos_emit_mov(e, MOS_JIT_PSR, RAX);
+        break;
+
+    case NOP: break;
+
+    case BPL: mos_emit_branch(e, N_BIT_FLAG, false, next_pc, operand); *ends = true; break;
+    case BMI: mos_emit_branch(e, N_BIT_FLAG, true,  next_pc, operand); *ends = true; break;
+    case BVC: mos_emit_branch(e, V_BIT_FLAG, false, next_pc, operand); *ends = true; break;
+    case BVS: mos_emit_branch(e, V_BIT_FLAG, true,  next_pc, operand); *ends = true; break;
+    case BCC: mos_emit_branch(e, C_BIT_FLAG, false, next_pc, operand); *ends = true; break;
+    case BCS: mos_emit_branch(e, C_BIT_FLAG, true,  next_pc, operand); *ends = true; break;
+    case BNE: mos_emit_branch(e, Z_BIT_FLAG, false, next_pc, operand); *ends = true; break;
+    case BEQ: mos_emit_branch(e, Z_BIT_FLAG, true,  next_pc, operand); *ends = true; break;
+
+    case JMP:
+        if (info.mode == IND) {
+            // the high-byte of the pointer never carries into the next page, except on the 65C02
+            uint16_t high = (operand & 0xFF00) | ((operand + 1) & 0xFF);
+            if (e->variant == MOS_VARIANT_65C02) high = operand + 1;
+            mos_emit_mov_imm(e, RSI, operand);
+            mos_emit_load(e);
+            mos_emit_mov(e, R10, RAX);
+            mos_emit_mov_imm(e, RSI, high);
+            mos_emit_load(e);
+            mos_emit_shl(e, RAX, 8);
+            mos_emit_alu(e, OP_OR, RAX, R10);
+            mos_emit_mov(e, RSI, RAX);
+            mos_emit_exit(e, -1);
+        } else {
+            mos_emit_exit(e, operand);
+        }
+        *ends = true;
+        break;
+    case JSR:
+        // both bytes are pushed even when the first one hits cached code, the block ends right after
+        mos_emit_mov_imm(e, RCX, (uint16_t)(next_pc - 1) >> 8);
+        mos_emit_push_value(e, -1);
+        mos_emit_mov_imm(e, RCX, (uint16_t)(next_pc - 1) & 0xFF);
+        mos_emit_push_value(e, -1);
+        mos_emit_exit(e, operand);
+        *ends = true;
+        break;
+    case RTS:
+        mos_emit_pull_value(e);
+        mos_emit_mov(e, R10, RAX);
+        mos_emit_pull_value(e);
+        mos_emit_shl(e, RAX, 8);
+        mos_emit_alu(e, OP_OR, RAX, R10);
+        mos_emit_alu_imm(e, ALU_ADD, RAX, 1);
+        mos_emit_alu_imm(e, ALU_AND, RAX, 0xFFFF);
+        mos_emit_mov(e, RSI, RAX);
+        mos_emit_exit(e, -1);
+        *ends = true;
+        break;
+
+    case BRK: case RTI: case SLO: case RLA: case SRE: case RRA: case SAX: case LAX:
+    case DCP: case ISC: case ANC: case ALR: case ARR: case ANE: case LXA: case SBX:
+    case SHA: case SHX: case SHY: case TAS: case LAS: case JAM: case BRA: case PHX:
+    case PHY: case PLX: case PLY: case STZ: case TRB: case TSB:
+    case ERROR_FETCH_DATA: case ERROR_FETCH_LOCATION:
+    default:
+        MOS_UNREACHABLE("mos_emit_instruction");
+    }
+
+    if (!*ends) {
+        // the interpreter checks the deadline after every instruction
+        mos_emit_test64(e, MOS_JIT_BUDGET, MOS_JIT_BUDGET);
+        mos_emit_exit_if(e, CC_LE, next_pc);
+    }
+    return true;
+}
+
+static void mos_emit_prologue(MOS_JitEmitter *e)
+{
+    mos_emit_push(e, RBX);
+    mos_emit_push(e, RBP);
+    mos_emit_push(e, R12);
+    mos_emit_push(e, R13);
+    mos_emit_push(e, R14);
+    mos_emit_push(e, R15);
+    mos_emit_push(e, RSI); // deadline, also realigns the stack to 16 bytes
+    mos_emit_mov64(e, MOS_JIT_CPU, RDI);
+    mos_emit_mov64(e, MOS_JIT_BUDGET, RSI);
+    mos_emit_rm(e, 0x2B, true, false, MOS_JIT_BUDGET, MOS_JIT_CPU, -1, MOS_CPU_FIELD(cycles)); // sub r12, [cycles]
+    mos_emit_rm(e, 0x0FB6, false, false, MOS_JIT_A,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(racc));
+    mos_emit_rm(e, 0x0FB6, false, false, MOS_JIT_X,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(regx));
+    mos_emit_rm(e, 0x0FB6, false, false, MOS_JIT_Y,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(regy));
+    mos_emit_rm(e, 0x0FB6, false, false, MOS_JIT_SP,  MOS_JIT_CPU, -1, MOS_CPU_FIELD(sp));
+    mos_emit_rm(e, 0x0FB6, false, false, MOS_JIT_PSR, MOS_JIT_CPU, -1, MOS_CPU_FIELD(psr));
+
+    // fold the lazily recorded flags in, the block keeps the whole psr in a register
+    mos_emit_alu_imm(e, ALU_AND, MOS_JIT_PSR, (uint8_t) ~(N_BIT_FLAG | V_BIT_FLAG | Z_BIT_FLAG | C_BIT_FLAG));
+    mos_emit_rm(e, 0x0FB6, false, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_n));
+    mos_emit_alu_imm(e, ALU_AND, RAX, N_BIT_FLAG);
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+    mos_emit_rm(e, 0x0FB6, false, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_v));
+    mos_emit_shr(e, RAX, 1);
+    mos_emit_alu_imm(e, ALU_AND, RAX, V_BIT_FLAG);
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+    mos_emit_rm(e, 0x0FB6, false, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_c));
+    mos_emit_alu_imm(e, ALU_AND, RAX, C_BIT_FLAG);
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+    mos_emit_rm(e, 0x0FB6, false, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_z));
+    mos_emit_test8(e, RAX, RAX);
+    mos_emit_setcc(e, CC_E, RAX);
+    mos_emit_shl(e, RAX, 1); // Z_BIT_FLAG
+    mos_emit_alu(e, OP_OR, MOS_JIT_PSR, RAX);
+}
+
+static void mos_emit_epilogue(MOS_JitEmitter *e)
+{
+    for (uint32_t i = 0; i < e->epilogue_count; ++i) mos_emit_patch(e, e->epilogue_sites[i]);
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_A,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(racc));
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_X,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(regx));
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_Y,   MOS_JIT_CPU, -1, MOS_CPU_FIELD(regy));
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_SP,  MOS_JIT_CPU, -1, MOS_CPU_FIELD(sp));
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_PSR, MOS_JIT_CPU, -1, MOS_CPU_FIELD(psr));
+    mos_emit_rm(e, 0x88, false, true, MOS_JIT_NZ,  MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_n));
+    mos_emit_rm(e, 0x88, false, true, R10,         MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_z));
+    mos_emit_mov(e, RAX, MOS_JIT_PSR);
+    mos_emit_alu_imm(e, ALU_AND, RAX, C_BIT_FLAG);
+    mos_emit_rm(e, 0x88, false, true, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_c));
+    mos_emit_mov(e, RAX, MOS_JIT_PSR);
+    mos_emit_shl(e, RAX, 1);
+    mos_emit_rm(e, 0x88, false, true, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(flag_v));
+    mos_emit_pop(e, RAX);  // deadline
+    mos_emit_rr(e, 0x29, true, false, MOS_JIT_BUDGET, RAX); // sub rax, r12
+    mos_emit_rm(e, 0x89, true, false, RAX, MOS_JIT_CPU, -1, MOS_CPU_FIELD(cycles));
+    mos_emit_pop(e, R15);
+    mos_emit_pop(e, R14);
+    mos_emit_pop(e, R13);
+    mos_emit_pop(e, R12);
+    mos_emit_pop(e, RBP);
+    mos_emit_pop(e, RBX);
+    mos_emit8(e, 0xC3); // ret
+}
+
+bool mos_cpu_enable_jit(MOS_Cpu *cpu)
+{
+    if (cpu->jit != NULL) return true;
+    if (!mos_cpu_enable_block_cache(cpu)) return false;
+
+    MOS_Jit *jit = calloc(1, sizeof(*jit));
+    if (jit == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for JIT Failed\n");
+        return false;
+    }
+    void *code = mmap(NULL, MOS_JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Could not map JIT code buffer\n");
+        free(jit);
+        return false;
+    }
+    jit->code = code;
+    cpu->jit = jit;
+    return true;
+}
+
+bool mos_jit_reserve(MOS_Jit *jit)
+{
+    return MOS_JIT_CODE_SIZE - jit->used >= MOS_JIT_BLOCK_SIZE;
+}
+
+// Forgets every translated block, callers must drop their native pointers first
+void mos_jit_reset(MOS_Jit *jit)
+{
+    jit->used = 0;
+}
+
+void mos_jit_free(MOS_Jit *jit)
+{
+    if (jit == NULL) return;
+    munmap(jit->code, MOS_JIT_CODE_SIZE);
+    free(jit);
+}
+
+// Translates the `count` instructions at pc, NULL when not even the first one
+// could be translated. A translated prefix hands the rest back to the interpreter.
+MOS_NativeBlock mos_jit_compile(MOS_Jit *jit, MOS_Cpu *cpu, uint16_t pc, uint8_t count)
+{
+    const uint8_t *memory = cpu->pages[pc >> 8].read;
+    if (memory == NULL || !mos_jit_reserve(jit)) return NULL;
+
+    if (mprotect(jit->code, MOS_JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) return NULL;
+
+    MOS_JitEmitter *e = calloc(1, sizeof(*e));
+    if (e == NULL) return NULL;
+    e->code = jit->code + jit->used;
+    e->capacity = MOS_JIT_BLOCK_SIZE;
+    e->variant = cpu->variant;
+
+    mos_emit_prologue(e);
+    uint8_t compiled = 0;
+    bool ends = false;
+    uint16_t offset = pc & 0xFF;
+    for (uint8_t i = 0; i < count && !ends; ++i) {
+        MOS_OpcodeInfo info = cpu->opcodes[memory[offset]];
+        uint8_t length = mos_addr_mode_length(info.mode);
+        uint16_t operand = 0;
+        if (length > 1) operand = memory[offset + 1];
+        if (length > 2) operand |= memory[offset + 2] << 8;
+
+        if (!mos_emit_instruction(e, info, (pc & 0xFF00) | offset, operand, &ends)) break;
+        compiled++;
+        offset += length;
+    }
+    if (!ends) mos_emit_exit(e, (pc & 0xFF00) + offset);
+
+    for (uint32_t i = 0; i < e->exit_count; ++i) {
+        mos_emit_patch(e, e->exits[i].site);
+        e->lazy = e->exits[i].lazy;
+        mos_emit_exit(e, e->exits[i].pc);
+    }
+    mos_emit_epilogue(e);
+
+    MOS_NativeBlock native = NULL;
+    if (compiled > 0 && !e->overflow) {
+        native = (MOS_NativeBlock)(uintptr_t) e->code;
+        jit->used = (jit->used + e->size + 15) & ~15u;
+    }
+    free(e);
+
+    if (mprotect(jit->code, MOS_JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        // none of the translated blocks can run now, keep interpreting them
+        fprintf(stderr, "ERROR: Could not make JIT code executable, disabling the JIT\n");
+        mos_cpu_disable_jit(cpu);
+        return NULL;
+    }
+    return native;
+}
+
+#else // no recompiler on this host, mos_block_run keeps interpreting
+
+bool mos_cpu_enable_jit(MOS_Cpu *cpu)
+{
+    (void) cpu;
+    return false;
+}
+
+bool mos_jit_reserve(MOS_Jit *jit)
+{
+    (void) jit;
+    return false;
+}
+
+void mos_jit_reset(MOS_Jit *jit)
+{
+    (void) jit;
+}
+
+void mos_jit_free(MOS_Jit *jit)
+{
+    (void) jit;
+}
+
+MOS_NativeBlock mos_jit_compile(MOS_Jit *jit, MOS_Cpu *cpu, uint16_t pc, uint8_t count)
+{
+    (void) jit; (void) cpu; (void) pc; (void) count;
+    return NULL;
+}
+
+#endif
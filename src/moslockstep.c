@@ -0,0 +1,526 @@
+// Mos 6502 lockstep engine
+//
+// Runs many copies of one program side by side. While a run is in progress
+// the register files of all lanes are stored as arrays, one per register.
+// Each step executes the lowest pc among the lanes that are still running.
+// Every lane sitting on that pc with the same instruction bytes executes it
+// together, the others wait, so lanes that diverged on a branch meet again
+// once the stragglers catch up. Loads, transfers, register increments,
+// binary ADC, SBC, the logical opcodes and the compares run as SSE2 kernels over
+// all lanes with a group mask, flag opcodes and branches update the arrays
+// lane by lane. Everything else steps each lane through its own MOS_Cpu.
+// Operands are gathered one lane at a time through the lane's page table,
+// so every lane keeps its own memory map.
+#include "./mos.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define MOS_LOCKSTEP_SSE2 1
+#else
+#define MOS_LOCKSTEP_SSE2 0
+#endif
+
+#define MOS_LOCKSTEP_VECTOR 16 // lanes per kernel iteration, arrays are padded to it
+
+struct _mos_lockstep {
+    uint32_t count; // lanes
+    uint32_t width; // count rounded up to MOS_LOCKSTEP_VECTOR
+    MOS_Cpu *cpus;  // memory maps, and the lane state between runs
+
+    // register file of every lane, `width` entries each
+    uint8_t  *racc;
+    uint8_t  *regx;
+    uint8_t  *regy;
+    uint8_t  *sp;
+    uint8_t  *psr;
+    uint8_t  *flag_n;
+    uint8_t  *flag_z;
+    uint8_t  *flag_c;
+    uint8_t  *flag_v;
+    uint16_t *pc;
+    uint64_t *cycles;
+    uint64_t *deadline;
+
+    uint8_t  *running; // lanes that have not reached their deadline or faulted
+    uint8_t  *group; // 0xFF for the lanes executing the current step
+    uint8_t  *data;  // operand gathered for each lane of the group
+};
+
+MOS_Lockstep *mos_lockstep_new(uint32_t count)
+{
+    MOS_Lockstep *ls = calloc(1, sizeof(*ls));
+    if (ls == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for lockstep Failed\n");
+        return NULL;
+    }
+    ls->count = count;
+    ls->width = (count + MOS_LOCKSTEP_VECTOR - 1) / MOS_LOCKSTEP_VECTOR * MOS_LOCKSTEP_VECTOR;
+
+    ls->cpus = calloc(count, sizeof(*ls->cpus));
+    uint8_t **bytes[] = {
+        &ls->racc, &ls->regx, &ls->regy, &ls->sp, &ls->psr, &ls->flag_n,
+        &ls->flag_z, &ls->flag_c, &ls->flag_v, &ls->running, &ls->group, &ls->data,
+    };
+    bool ok = ls->cpus != NULL;
+    for (uint32_t i = 0; i < MOS_ARRAY_LEN(bytes); ++i) {
+        *bytes[i] = calloc(ls->width, 1);
+        ok = ok && *bytes[i] != NULL;
+    }
+    ls->pc = calloc(ls->width, sizeof(*ls->pc));
+    ls->cycles = calloc(ls->width, sizeof(*ls->cycles));
+    ls->deadline = calloc(ls->width, sizeof(*ls->deadline));
+    ok = ok && ls->pc != NULL && ls->cycles != NULL && ls->deadline != NULL;
+    if (!ok) {
+        fprintf(stderr, "ERROR: Memory Allocation for lockstep lanes Failed\n");
+        mos_lockstep_free(ls);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) ls->cpus[i] = mos_cpu_init();
+    return ls;
+}
+
+void mos_lockstep_free(MOS_Lockstep *ls)
+{
+    if (ls == NULL) return;
+    if (ls->cpus != NULL) {
+        for (uint32_t i = 0; i < ls->count; ++i) mos_cpu_free(&ls->cpus[i]);
+    }
+    free(ls->cpus);
+    free(ls->racc);   free(ls->regx);   free(ls->regy);   free(ls->sp);
+    free(ls->psr);    free(ls->flag_n); free(ls->flag_z); free(ls->flag_c);
+    free(ls->flag_v); free(ls->group);  free(ls->data);   free(ls->running);
+    free(ls->pc);     free(ls->cycles); free(ls->deadline);
+    free(ls);
+}
+
+// Lane state lives in its MOS_Cpu between runs, map memory and set registers through it
+MOS_Cpu *mos_lockstep_cpu(MOS_Lockstep *ls, uint32_t lane)
+{
+    assert(lane < ls->count);
+    return &ls->cpus[lane];
+}
+
+static void mos_lockstep_load_lane(MOS_Lockstep *ls, uint32_t lane)
+{
+    const MOS_Cpu *cpu = &ls->cpus[lane];
+    ls->racc[lane]   = cpu->racc;
+    ls->regx[lane]   = cpu->regx;
+    ls->regy[lane]   = cpu->regy;
+    ls->sp[lane]     = cpu->sp;
+    ls->psr[lane]    = cpu->psr;
+    ls->flag_n[lane] = cpu->flag_n;
+    ls->flag_z[lane] = cpu->flag_z;
+    ls->flag_c[lane] = cpu->flag_c;
+    ls->flag_v[lane] = cpu->flag_v;
+    ls->pc[lane]     = cpu->pc;
+    ls->cycles[lane] = cpu->cycles;
+}
+
+static void mos_lockstep_store_lane(MOS_Lockstep *ls, uint32_t lane)
+{
+    MOS_Cpu *cpu = &ls->cpus[lane];
+    cpu->racc   = ls->racc[lane];
+    cpu->regx   = ls->regx[lane];
+    cpu->regy   = ls->regy[lane];
+    cpu->sp     = ls->sp[lane];
+    cpu->psr    = ls->psr[lane];
+    cpu->flag_n = ls->flag_n[lane];
+    cpu->flag_z = ls->flag_z[lane];
+    cpu->flag_c = ls->flag_c[lane];
+    cpu->flag_v = ls->flag_v[lane];
+    cpu->pc     = ls->pc[lane];
+    cpu->cycles = ls->cycles[lane];
+}
+
+static inline void mos_lockstep_update_running(MOS_Lockstep *ls, uint32_t lane)
+{
+    bool running = ls->cycles[lane] < ls->deadline[lane] && ls->cpus[lane].fault == MOS_FAULT_NONE;
+    ls->running[lane] = running ? 0xFF : 0x00;
+}
+
+// Scheduled events and interrupts are taken lane by lane through the lane's MOS_Cpu
+static void mos_lockstep_interrupt(MOS_Lockstep *ls, uint32_t lane)
+{
+    MOS_Cpu *cpu = &ls->cpus[lane];
+    if (ls->cycles[lane] < cpu->next_event && !cpu->interrupt_pending) return;
+    mos_lockstep_store_lane(ls, lane);
+    if (cpu->cycles >= cpu->next_event) mos_scheduler_fire(cpu);
+    if (cpu->interrupt_pending) mos_cpu_interrupt(cpu);
+    mos_lockstep_load_lane(ls, lane);
+}
+
+// Page table fast path of mos_cpu_read, which lives in another translation unit.
+// Devices and the replay log read cpu->cycles, the slow path hands it the lane's clock
+static inline uint8_t mos_lockstep_read(MOS_Lockstep *ls, uint32_t lane, uint16_t addr)
+{
+    MOS_Cpu *cpu = &ls->cpus[lane];
+    const uint8_t *memory = cpu->pages[addr >> 8].read;
+    if (memory != NULL) return memory[addr & 0xFF];
+    cpu->cycles = ls->cycles[lane];
+    return mos_cpu_read(cpu, addr);
+}
+
+// Operand of a read opcode for one lane, indexed reads pay the page-cross cycle
+static uint8_t mos_lockstep_gather(MOS_Lockstep *ls, uint32_t lane, MOS_AddressingModes mode, uint16_t operand)
+{
+    uint16_t base, addr;
+    switch (mode) {
+    case IMME: return operand;
+    case ZP:   addr = operand; break;
+    case ZPX:  addr = (uint8_t)(operand + ls->regx[lane]); break;
+    case ZPY:  addr = (uint8_t)(operand + ls->regy[lane]); break;
+    case ABS:  addr = operand; break;
+    case ABSX:
+    case ABSY:
+        base = operand;
+        addr = base + (mode == ABSX ? ls->regx[lane] : ls->regy[lane]);
+        ls->cycles[lane] += (base ^ addr) > 0xFF;
+        break;
+    case INDX: {
+        uint8_t pointer = operand + ls->regx[lane];
+        addr = mos_bytes_to_uint16_t(mos_lockstep_read(ls, lane, (uint8_t)(pointer + 1)), mos_lockstep_read(ls, lane, pointer));
+    } break;
+    case INDY: {
+        uint8_t pointer = operand;
+        base = mos_bytes_to_uint16_t(mos_lockstep_read(ls, lane, (uint8_t)(pointer + 1)), mos_lockstep_read(ls, lane, pointer));
+        addr = base + ls->regy[lane];
+        ls->cycles[lane] += (base ^ addr) > 0xFF;
+    } break;
+    case ZPI: {
+        uint8_t pointer = operand;
+        addr = mos_bytes_to_uint16_t(mos_lockstep_read(ls, lane, (uint8_t)(pointer + 1)), mos_lockstep_read(ls, lane, pointer));
+    } break;
+    case IMPL:
+    case ACCU:
+    case REL:
+    case IND:
+    case ABXI:
+    default:
+        MOS_UNREACHABLE("mos_lockstep_gather");
+    }
+    return mos_lockstep_read(ls, lane, addr);
+}
+
+#if MOS_LOCKSTEP_SSE2
+#define MOS_LOAD(array, i) _mm_loadu_si128((const __m128i *)((array) + (i)))
+
+// array[i..i+15] = mask ? value : array
+static inline void mos_lockstep_blend(uint8_t *array, uint32_t i, __m128i value, __m128i mask)
+{
+    __m128i old = MOS_LOAD(array, i);
+    _mm_storeu_si128((__m128i *)(array + i), _mm_or_si128(_mm_and_si128(mask, value), _mm_andnot_si128(mask, old)));
+}
+#endif
+
+// reg, N, Z = data
+static void mos_lockstep_load(MOS_Lockstep *ls, uint8_t *reg)
+{
+    uint32_t i = 0;
+#if MOS_LOCKSTEP_SSE2
+    for (; i < ls->width; i += MOS_LOCKSTEP_VECTOR) {
+        __m128i mask = MOS_LOAD(ls->group, i);
+        __m128i data = MOS_LOAD(ls->data, i);
+        mos_lockstep_blend(reg, i, data, mask);
+        mos_lockstep_blend(ls->flag_n, i, data, mask);
+        mos_lockstep_blend(ls->flag_z, i, data, mask);
+    }
+#endif
+    for (; i < ls->width; ++i) {
+        if (!ls->group[i]) continue;
+        reg[i] = ls->flag_n[i] = ls->flag_z[i] = ls->data[i];
+    }
+}
+
+// A = A + data + C, SBC gathers the inverted operand
+static void mos_lockstep_adc(MOS_Lockstep *ls)
+{
+    uint32_t i = 0;
+#if MOS_LOCKSTEP_SSE2
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i < ls->width; i += MOS_LOCKSTEP_VECTOR) {
+        __m128i mask = MOS_LOAD(ls->group, i);
+        __m128i a = MOS_LOAD(ls->racc, i);
+        __m128i d = MOS_LOAD(ls->data, i);
+        __m128i sum = _mm_add_epi8(_mm_add_epi8(a, d), MOS_LOAD(ls->flag_c, i));
+        // carry out of bit 7 is the majority of a7, d7 and the carry into bit 7
+        __m128i carry = _mm_or_si128(_mm_and_si128(a, d), _mm_andnot_si128(sum, _mm_xor_si128(a, d)));
+        carry = _mm_and_si128(_mm_srli_epi16(carry, 7), one);
+        __m128i overflow = _mm_andnot_si128(_mm_xor_si128(a, d), _mm_xor_si128(a, sum));
+        mos_lockstep_blend(ls->racc, i, sum, mask);
+        mos_lockstep_blend(ls->flag_n, i, sum, mask);
+        mos_lockstep_blend(ls->flag_z, i, sum, mask);
+        mos_lockstep_blend(ls->flag_c, i, carry, mask);
+        mos_lockstep_blend(ls->flag_v, i, overflow, mask);
+    }
+#endif
+    for (; i < ls->width; ++i) {
+        if (!ls->group[i]) continue;
+        uint16_t raw = ls->racc[i] + ls->data[i] + ls->flag_c[i];
+        uint8_t result = raw;
+        ls->flag_c[i] = raw >> 8;
+        ls->flag_v[i] = ~(ls->racc[i] ^ ls->data[i]) & (ls->racc[i] ^ result);
+        ls->racc[i] = ls->flag_n[i] = ls->flag_z[i] = result;
+    }
+}
+
+// A = A op data for AND, ORA and EOR
+static void mos_lockstep_logical(MOS_Lockstep *ls, MOS_Opcode opcode)
+{
+    uint32_t i = 0;
+#if MOS_LOCKSTEP_SSE2
+    for (; i < ls->width; i += MOS_LOCKSTEP_VECTOR) {
+        __m128i mask = MOS_LOAD(ls->group, i);
+        __m128i a = MOS_LOAD(ls->racc, i);
+        __m128i d = MOS_LOAD(ls->data, i);
+        __m128i result = opcode == AND ? _mm_and_si128(a, d) : opcode == ORA ? _mm_or_si128(a, d) : _mm_xor_si128(a, d);
+        mos_lockstep_blend(ls->racc, i, result, mask);
+        mos_lockstep_blend(ls->flag_n, i, result, mask);
+        mos_lockstep_blend(ls->flag_z, i, result, mask);
+    }
+#endif
+    for (; i < ls->width; ++i) {
+        if (!ls->group[i]) continue;
+        uint8_t a = ls->racc[i], d = ls->data[i];
+        uint8_t result = opcode == AND ? a & d : opcode == ORA ? a | d : a ^ d;
+        ls->racc[i] = ls->flag_n[i] = ls->flag_z[i] = result;
+    }
+}
+
+// C = reg >= data, N, Z = reg - data
+static void mos_lockstep_compare(MOS_Lockstep *ls, const uint8_t *reg)
+{
+    uint32_t i = 0;
+#if MOS_LOCKSTEP_SSE2
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i < ls->width; i += MOS_LOCKSTEP_VECTOR) {
+        __m128i mask = MOS_LOAD(ls->group, i);
+        __m128i r = MOS_LOAD(reg, i);
+        __m128i d = MOS_LOAD(ls->data, i);
+        __m128i carry = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(r, d), r), one);
+        __m128i result = _mm_sub_epi8(r, d);
+        mos_lockstep_blend(ls->flag_c, i, carry, mask);
+        mos_lockstep_blend(ls->flag_n, i, result, mask);
+        mos_lockstep_blend(ls->flag_z, i, result, mask);
+    }
+#endif
+    for (; i < ls->width; ++i) {
+        if (!ls->group[i]) continue;
+        ls->flag_c[i] = reg[i] >= ls->data[i];
+        ls->flag_n[i] = ls->flag_z[i] = reg[i] - ls->data[i];
+    }
+}
+
+// Picks the lowest running pc and marks the lanes that execute it, returns the
+// size of the group and the leading lane through `leader`
+static uint32_t mos_lockstep_select(MOS_Lockstep *ls, uint32_t *leader)
+{
+    uint32_t lead = ls->count;
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (!ls->running[i]) continue;
+        if (lead == ls->count || ls->pc[i] < ls->pc[lead]) lead = i;
+    }
+    memset(ls->group, 0, ls->width);
+    if (lead == ls->count) return 0;
+
+    // lanes on the same pc only join when they also hold the same instruction bytes
+    MOS_Cpu *cpu = &ls->cpus[lead];
+    uint16_t pc = ls->pc[lead];
+    uint8_t code[3];
+    code[0] = mos_cpu_read(cpu, pc);
+    uint8_t length = mos_addr_mode_length(cpu->opcodes[code[0]].mode);
+    for (uint8_t k = 1; k < length; ++k) code[k] = mos_cpu_read(cpu, pc + k);
+
+    uint8_t offset = pc & 0xFF;
+    bool direct = offset + length <= MOS_PAGE_SIZE; // instruction does not straddle two pages
+    uint32_t size = 0;
+    for (uint32_t i = lead; i < ls->count; ++i) {
+        if (ls->pc[i] != pc || !ls->running[i]) continue;
+        const uint8_t *memory = ls->cpus[i].pages[pc >> 8].read;
+        bool same = true;
+        if (direct && memory != NULL) {
+            same = memcmp(memory + offset, code, length) == 0;
+        } else {
+            for (uint8_t k = 0; k < length && same; ++k) {
+                same = mos_cpu_read(&ls->cpus[i], pc + k) == code[k];
+            }
+        }
+        if (!same) continue;
+        ls->group[i] = 0xFF;
+        size++;
+    }
+    *leader = lead;
+    return size;
+}
+
+// Flag opcodes and branches read and write the flag arrays directly
+static bool mos_lockstep_flag(const MOS_Lockstep *ls, uint32_t lane, MOS_StatusFlags flag)
+{
+    if (flag == N_BIT_FLAG) return ls->flag_n[lane] & N_BIT_FLAG;
+    if (flag == V_BIT_FLAG) return ls->flag_v[lane] & N_BIT_FLAG;
+    if (flag == Z_BIT_FLAG) return ls->flag_z[lane] == 0;
+    return ls->flag_c[lane];
+}
+
+static void mos_lockstep_branch(MOS_Lockstep *ls, MOS_StatusFlags flag, bool set, uint8_t offset)
+{
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (!ls->group[i] || mos_lockstep_flag(ls, i, flag) != set) continue;
+        uint16_t target = ls->pc[i] + (int8_t) offset;
+        ls->cycles[i] += 1 + ((ls->pc[i] ^ target) > 0xFF);
+        ls->pc[i] = target;
+    }
+}
+
+static void mos_lockstep_set_psr(MOS_Lockstep *ls, MOS_StatusFlags flag, bool set)
+{
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (!ls->group[i]) continue;
+        if (flag == C_BIT_FLAG)      ls->flag_c[i] = set;
+        else if (flag == V_BIT_FLAG) ls->flag_v[i] = 0;
+        else if (set)                ls->psr[i] |= flag;
+        else                         ls->psr[i] &= ~flag;
+    }
+}
+
+// data = reg + delta for the transfers, increments and decrements
+static void mos_lockstep_from_reg(MOS_Lockstep *ls, const uint8_t *reg, uint8_t delta)
+{
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (ls->group[i]) ls->data[i] = reg[i] + delta;
+    }
+}
+
+// data = operand of a read opcode, SBC gathers the inverted operand
+static void mos_lockstep_from_memory(MOS_Lockstep *ls, MOS_OpcodeInfo info, uint16_t operand)
+{
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (!ls->group[i]) continue;
+        uint8_t data = mos_lockstep_gather(ls, i, info.mode, operand);
+        ls->data[i] = info.opcode == SBC ? (uint8_t) ~data : data;
+    }
+}
+
+// Any lane of the group in decimal mode
+static bool mos_lockstep_decimal(const MOS_Lockstep *ls)
+{
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        if (ls->group[i] && (ls->psr[i] & D_BIT_FLAG)) return true;
+    }
+    return false;
+}
+
+// Executes the group's instruction on the arrays, false when it needs a MOS_Cpu per lane
+static bool mos_lockstep_execute(MOS_Lockstep *ls, MOS_OpcodeInfo info, uint16_t operand)
+{
+    switch (info.opcode) {
+    case LDA: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_load(ls, ls->racc); return true;
+    case LDX: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_load(ls, ls->regx); return true;
+    case LDY: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_load(ls, ls->regy); return true;
+    case ADC:
+    case SBC:
+        if (mos_lockstep_decimal(ls)) return false; // the BCD tables live with mos_cpu_step
+        mos_lockstep_from_memory(ls, info, operand);
+        mos_lockstep_adc(ls);
+        return true;
+    case AND:
+    case ORA:
+    case EOR: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_logical(ls, info.opcode); return true;
+    case CMP: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_compare(ls, ls->racc); return true;
+    case CPX: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_compare(ls, ls->regx); return true;
+    case CPY: mos_lockstep_from_memory(ls, info, operand); mos_lockstep_compare(ls, ls->regy); return true;
+
+    case TAX: mos_lockstep_from_reg(ls, ls->racc, 0);    mos_lockstep_load(ls, ls->regx); return true;
+    case TAY: mos_lockstep_from_reg(ls, ls->racc, 0);    mos_lockstep_load(ls, ls->regy); return true;
+    case TXA: mos_lockstep_from_reg(ls, ls->regx, 0);    mos_lockstep_load(ls, ls->racc); return true;
+    case TYA: mos_lockstep_from_reg(ls, ls->regy, 0);    mos_lockstep_load(ls, ls->racc); return true;
+    case TSX: mos_lockstep_from_reg(ls, ls->sp, 0);      mos_lockstep_load(ls, ls->regx); return true;
+    case INX: mos_lockstep_from_reg(ls, ls->regx, 1);    mos_lockstep_load(ls, ls->regx); return true;
+    case INY: mos_lockstep_from_reg(ls, ls->regy, 1);    mos_lockstep_load(ls, ls->regy); return true;
+    case DEX: mos_lockstep_from_reg(ls, ls->regx, 0xFF); mos_lockstep_load(ls, ls->regx); return true;
+    case DEY: mos_lockstep_from_reg(ls, ls->regy, 0xFF); mos_lockstep_load(ls, ls->regy); return true;
+
+    case CLC: mos_lockstep_set_psr(ls, C_BIT_FLAG, false); return true;
+    case CLD: mos_lockstep_set_psr(ls, D_BIT_FLAG, false); return true;
+    case CLI: mos_lockstep_set_psr(ls, I_BIT_FLAG, false); return true;
+    case CLV: mos_lockstep_set_psr(ls, V_BIT_FLAG, false); return true;
+    case SEC: mos_lockstep_set_psr(ls, C_BIT_FLAG, true);  return true;
+    case SED: mos_lockstep_set_psr(ls, D_BIT_FLAG, true);  return true;
+    case SEI: mos_lockstep_set_psr(ls, I_BIT_FLAG, true);  return true;
+    case NOP: return info.mode == IMPL; // the undocumented NOPs read their operand
+
+    case BPL: mos_lockstep_branch(ls, N_BIT_FLAG, false, operand); return true;
+    case BMI: mos_lockstep_branch(ls, N_BIT_FLAG, true,  operand); return true;
+    case BVC: mos_lockstep_branch(ls, V_BIT_FLAG, false, operand); return true;
+    case BVS: mos_lockstep_branch(ls, V_BIT_FLAG, true,  operand); return true;
+    case BCC: mos_lockstep_branch(ls, C_BIT_FLAG, false, operand); return true;
+    case BCS: mos_lockstep_branch(ls, C_BIT_FLAG, true,  operand); return true;
+    case BNE: mos_lockstep_branch(ls, Z_BIT_FLAG, false, operand); return true;
+    case BEQ: mos_lockstep_branch(ls, Z_BIT_FLAG, true,  operand); return true;
+
+    case BRK: case RTI: case RTS: case JMP: case JSR: case STA: case STY: case STX:
+    case BIT: case TXS: case PHA: case PHP: case PLA: case PLP: case INC: case DEC:
+    case ASL: case LSR: case ROL: case ROR: case SLO: case RLA: case SRE: case RRA:
+    case SAX: case LAX: case DCP: case ISC: case ANC: case ALR: case ARR: case ANE:
+    case LXA: case SBX: case SHA: case SHX: case SHY: case TAS: case LAS: case JAM:
+    case BRA: case PHX: case PHY: case PLX: case PLY: case STZ: case TRB: case TSB:
+    case ERROR_FETCH_DATA: case ERROR_FETCH_LOCATION:
+    default:
+        return false;
+    }
+}
+
+// Runs every lane until it has run at least `cycles` more cycles or faulted,
+// returns the cycles run over all lanes
+uint64_t mos_lockstep_run(MOS_Lockstep *ls, uint64_t cycles)
+{
+    uint64_t start = 0;
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        mos_lockstep_load_lane(ls, i);
+        ls->deadline[i] = ls->cycles[i] + cycles;
+        mos_lockstep_interrupt(ls, i);
+        mos_lockstep_update_running(ls, i);
+        start += ls->cycles[i];
+    }
+
+    uint32_t leader;
+    while (mos_lockstep_select(ls, &leader) > 0) {
+        MOS_Cpu *cpu = &ls->cpus[leader];
+        uint16_t pc = ls->pc[leader];
+        MOS_OpcodeInfo info = cpu->opcodes[mos_cpu_read(cpu, pc)];
+        uint8_t length = mos_addr_mode_length(info.mode);
+        uint16_t operand = 0;
+        if (length > 1) operand = mos_cpu_read(cpu, pc + 1);
+        if (length > 2) operand |= mos_cpu_read(cpu, pc + 2) << 8;
+
+        // pc and the base cycles move first, like mos_cpu_step does before the handler
+        for (uint32_t i = leader; i < ls->count; ++i) {
+            if (!ls->group[i]) continue;
+            ls->pc[i] += length;
+            ls->cycles[i] += info.cycles;
+        }
+        if (!mos_lockstep_execute(ls, info, operand)) {
+            // stack, stores, jumps and read-modify-write run lane by lane
+            for (uint32_t i = leader; i < ls->count; ++i) {
+                if (!ls->group[i]) continue;
+                ls->pc[i] -= length;
+                ls->cycles[i] -= info.cycles;
+                mos_lockstep_store_lane(ls, i);
+                mos_cpu_step(&ls->cpus[i]);
+                mos_lockstep_load_lane(ls, i);
+            }
+        }
+        for (uint32_t i = leader; i < ls->count; ++i) {
+            if (!ls->group[i]) continue;
+            mos_lockstep_interrupt(ls, i);
+            mos_lockstep_update_running(ls, i);
+        }
+    }
+
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < ls->count; ++i) {
+        mos_lockstep_store_lane(ls, i);
+        end += ls->cycles[i];
+    }
+    return end - start;
+}
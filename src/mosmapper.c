@@ -0,0 +1,188 @@
+// Mos 6502 bank switching mapper
+//
+// A mapper owns a backing store larger than the address space and exposes it
+// through windows, page aligned ranges of the address space that each show
+// one window sized bank of the store. Writing a bank number to a window's
+// control register switches it by swapping the page table pointers of the
+// window's pages, the rest of the map is left alone.
+//
+// Windows and control registers are MOS_MMap entries, so they must be mapped
+// before any entry covering the same addresses (the first one wins). The
+// mapper keeps pointers into the cpu and must be freed after it.
+#include "./mos.h"
+
+#define MOS_MAPPER_MAX_WINDOWS 16
+
+typedef struct _mos_mapper_window {
+    MOS_Mapper *mapper;
+    uint16_t start_addr;
+    uint32_t size;       // bytes, a multiple of MOS_PAGE_SIZE
+    uint32_t bank;       // bank currently shown
+    uint32_t bank_count; // banks of this size in the backing store
+    uint8_t *base;       // first byte of the current bank
+    bool readonly;
+} MOS_MapperWindow;
+
+struct _mos_mapper {
+    MOS_Cpu *cpu;
+    uint8_t *memory; // backing store, owned by the caller
+    uint32_t size;
+    MOS_MapperWindow windows[MOS_MAPPER_MAX_WINDOWS]; // fixed so entries can point at them
+    uint32_t window_count;
+};
+
+MOS_Mapper *mos_mapper_new(MOS_Cpu *cpu, uint8_t *memory, uint32_t size)
+{
+    MOS_Mapper *mapper = calloc(1, sizeof(*mapper));
+    if (mapper == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for mapper Failed\n");
+        return NULL;
+    }
+    mapper->cpu = cpu;
+    mapper->memory = memory;
+    mapper->size = size;
+    return mapper;
+}
+
+void mos_mapper_free(MOS_Mapper *mapper)
+{
+    free(mapper);
+}
+
+uint8_t mos_mapper_read(void *device, uint16_t addr)
+{
+    const MOS_MapperWindow *window = device;
+    return window->base[addr - window->start_addr];
+}
+
+void mos_mapper_write(void *device, uint16_t addr, uint8_t data)
+{
+    MOS_MapperWindow *window = device;
+    window->base[addr - window->start_addr] = data;
+}
+
+// Host memory currently behind `page` of a window, used by mos_cpu_map_page
+uint8_t *mos_mapper_page_memory(void *device, uint8_t page)
+{
+    MOS_MapperWindow *window = device;
+    return window->base + (page*MOS_PAGE_SIZE - window->start_addr);
+}
+
+// Adds a window of `size` bytes at `start_addr` showing bank 0, returns its
+// index or -1. Both must be multiples of MOS_PAGE_SIZE.
+int32_t mos_mapper_window(MOS_Mapper *mapper, uint16_t start_addr, uint32_t size, bool readonly)
+{
+    if (start_addr % MOS_PAGE_SIZE != 0 || size == 0 || size % MOS_PAGE_SIZE != 0 ||
+        start_addr + size > 0x10000 || size > mapper->size) {
+        fprintf(stderr, "ERROR: mapper window of 0x%x bytes at 0x%04x is not page aligned or too large\n",
+                size, start_addr);
+        return -1;
+    }
+    if (mapper->window_count == MOS_MAPPER_MAX_WINDOWS) {
+        fprintf(stderr, "ERROR: a mapper has at most %d windows\n", MOS_MAPPER_MAX_WINDOWS);
+        return -1;
+    }
+
+    MOS_MapperWindow *window = &mapper->windows[mapper->window_count];
+    window->mapper = mapper;
+    window->start_addr = start_addr;
+    window->size = size;
+    window->bank = 0;
+    window->bank_count = mapper->size / size;
+    window->base = mapper->memory;
+    window->readonly = readonly;
+
+    MOS_MMap map = {
+        .device = window,
+        .read = mos_mapper_read,
+        .write = mos_mapper_write,
+        .readonly = readonly,
+        .start_addr = start_addr,
+        .end_addr = start_addr + (size - 1),
+    };
+    mos_cpu_map(mapper->cpu, map);
+    return mapper->window_count++;
+}
+
+// Shows `bank` (modulo the bank count) in `window`
+void mos_mapper_switch(MOS_Mapper *mapper, uint32_t window_index, uint32_t bank)
+{
+    assert(window_index < mapper->window_count);
+    MOS_MapperWindow *window = &mapper->windows[window_index];
+    bank %= window->bank_count;
+    if (bank == window->bank) return;
+    window->bank = bank;
+    window->base = mapper->memory + (size_t) bank*window->size;
+
+    MOS_Cpu *cpu = mapper->cpu;
+    uint32_t first = window->start_addr / MOS_PAGE_SIZE;
+    for (uint32_t page = first; page < first + window->size / MOS_PAGE_SIZE; ++page) {
+        MOS_Page *slot = &cpu->pages[page];
+        if (slot->entry == NULL || slot->entry->device != window) continue; // shadowed by another entry
+
+        // the old bank may hold cached code or pages shared with a snapshot,
+        // mos_cpu_map_page keeps stores slow where the cache, snapshots or trace need them
+        if (cpu->cow != NULL) mos_cow_touch(cpu, page);
+        if (cpu->cache != NULL) mos_block_cache_invalidate(cpu, page);
+        mos_cpu_map_page(cpu, page);
+    }
+}
+
+uint32_t mos_mapper_bank(const MOS_Mapper *mapper, uint32_t window_index)
+{
+    assert(window_index < mapper->window_count);
+    return mapper->windows[window_index].bank;
+}
+
+// Bank of the window behind a window entry, snapshots record it
+uint32_t mos_mapper_entry_bank(const MOS_MMap *entry)
+{
+    const MOS_MapperWindow *window = entry->device;
+    return window->bank;
+}
+
+void mos_mapper_entry_switch(const MOS_MMap *entry, uint32_t bank)
+{
+    MOS_MapperWindow *window = entry->device;
+    mos_mapper_switch(window->mapper, window - window->mapper->windows, bank);
+}
+
+static uint8_t mos_mapper_control_read(void *device, uint16_t addr)
+{
+    (void) addr;
+    const MOS_MapperWindow *window = device;
+    return (uint8_t) window->bank;
+}
+
+static void mos_mapper_control_write(void *device, uint16_t addr, uint8_t data)
+{
+    (void) addr;
+    MOS_MapperWindow *window = device;
+    mos_mapper_switch(window->mapper, window - window->mapper->windows, data);
+}
+
+// Mapper entries are deterministic, I/O replay leaves them alone
+bool mos_mapper_owns(const MOS_MMap *entry)
+{
+    return entry->read == mos_mapper_read || entry->read == mos_mapper_control_read;
+}
+
+// Maps a one byte control register at `addr`, writes select the bank of
+// `window_index` and reads return it
+bool mos_mapper_control(MOS_Mapper *mapper, uint16_t addr, uint32_t window_index)
+{
+    if (window_index >= mapper->window_count) {
+        fprintf(stderr, "ERROR: mapper has no window %u\n", window_index);
+        return false;
+    }
+    MOS_MMap map = {
+        .device = &mapper->windows[window_index],
+        .read = mos_mapper_control_read,
+        .write = mos_mapper_control_write,
+        .readonly = false,
+        .start_addr = addr,
+        .end_addr = addr,
+    };
+    mos_cpu_map(mapper->cpu, map);
+    return true;
+}
@@ -0,0 +1,349 @@
+// Mos 6502 instruction profiler
+//
+// Built into the core with -DMOS_PROFILE (make PROFILE=1), otherwise the hooks
+// in mos.c compile to nothing and mos_cpu_enable_profile refuses. Counts
+// executions and cycles per pc, per opcode and per addressing mode, bus
+// accesses per MOS_MMap entry, and cycles per call stack. The call stack
+// follows JSR/RTS and BRK or interrupts/RTI, for flamegraph tools.
+#include <errno.h>
+
+#include "./mos.h"
+
+#ifdef MOS_PROFILE
+
+#define MOS_PROFILE_MODES       (ABXI + 1)
+#define MOS_PROFILE_MAX_DEVICES 64  // later entries are counted with the last one
+#define MOS_PROFILE_MAX_DEPTH   128 // deeper calls are charged to the frame at the limit
+
+// One call stack, frames are identified by the address that was called
+typedef struct _mos_profile_frame {
+    uint32_t parent;
+    uint16_t target;
+    uint16_t depth;
+    uint64_t cycles; // spent in this frame itself
+} MOS_ProfileFrame;
+
+typedef ARRAY(MOS_ProfileFrame) MOS_ProfileFrames;
+
+struct _mos_profile {
+    const MOS_OpcodeInfo *opcodes; // of the cpu variant that is profiled
+    uint64_t pc_hits[0x10000];
+    uint64_t pc_cycles[0x10000];
+    uint8_t  pc_opcode[0x10000]; // last opcode executed at each pc
+    uint64_t opcode_hits[UINT8_MAX + 1];
+    uint64_t opcode_cycles[UINT8_MAX + 1];
+    uint64_t mode_hits[MOS_PROFILE_MODES];
+    uint64_t mode_cycles[MOS_PROFILE_MODES];
+    uint64_t device_reads[MOS_PROFILE_MAX_DEVICES + 1]; // the last slot counts unmapped accesses
+    uint64_t device_writes[MOS_PROFILE_MAX_DEVICES + 1];
+    uint64_t instructions;
+    uint64_t cycles;
+
+    MOS_ProfileFrames frames; // frame 0 is the root
+    uint32_t *children;       // open addressing, (parent, target) -> frame index + 1
+    uint32_t children_capacity;
+    uint32_t frame;           // current frame
+    uint32_t overflow;        // calls past MOS_PROFILE_MAX_DEPTH, their returns pop this before a frame
+};
+
+bool mos_cpu_enable_profile(MOS_Cpu *cpu)
+{
+    if (cpu->profile != NULL) return true;
+    MOS_Profile *profile = calloc(1, sizeof(*profile));
+    if (profile == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for profile Failed\n");
+        return false;
+    }
+    profile->children_capacity = 1024;
+    profile->children = calloc(profile->children_capacity, sizeof(*profile->children));
+    if (profile->children == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for profile Failed\n");
+        free(profile);
+        return false;
+    }
+    profile->opcodes = cpu->opcodes;
+    array_new(&profile->frames);
+    MOS_ProfileFrame root = {0};
+    array_append(&profile->frames, root);
+    cpu->profile = profile;
+    return true;
+}
+
+void mos_profile_free(MOS_Profile *profile)
+{
+    if (profile == NULL) return;
+    array_delete(&profile->frames);
+    free(profile->children);
+    free(profile);
+}
+
+static inline uint32_t mos_profile_hash(uint32_t parent, uint16_t target)
+{
+    return (parent * 2654435761u) ^ (target * 40503u);
+}
+
+static void mos_profile_grow_children(MOS_Profile *profile)
+{
+    uint32_t capacity = profile->children_capacity * 2;
+    uint32_t *children = calloc(capacity, sizeof(*children));
+    assert(children != NULL && "Memory Reallocation For profile Failed.");
+    for (uint32_t i = 1; i < profile->frames.count; ++i) {
+        const MOS_ProfileFrame *frame = &profile->frames.items[i];
+        uint32_t slot = mos_profile_hash(frame->parent, frame->target) & (capacity - 1);
+        while (children[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        children[slot] = i + 1;
+    }
+    free(profile->children);
+    profile->children = children;
+    profile->children_capacity = capacity;
+}
+
+// Frame for calling `target` from the current frame, created on first use
+static uint32_t mos_profile_call(MOS_Profile *profile, uint16_t target)
+{
+    uint32_t parent = profile->frame;
+    if (profile->frames.items[parent].depth >= MOS_PROFILE_MAX_DEPTH) {
+        profile->overflow++;
+        return parent;
+    }
+
+    uint32_t mask = profile->children_capacity - 1;
+    uint32_t slot = mos_profile_hash(parent, target) & mask;
+    while (profile->children[slot] != 0) {
+        uint32_t index = profile->children[slot] - 1;
+        const MOS_ProfileFrame *frame = &profile->frames.items[index];
+        if (frame->parent == parent && frame->target == target) return index;
+        slot = (slot + 1) & mask;
+    }
+
+    MOS_ProfileFrame frame = {
+        .parent = parent,
+        .target = target,
+        .depth = profile->frames.items[parent].depth + 1,
+    };
+    array_append(&profile->frames, frame);
+    profile->children[slot] = profile->frames.count;
+    if (profile->frames.count * 2 > profile->children_capacity) mos_profile_grow_children(profile);
+    return profile->frames.count - 1;
+}
+
+// Called by mos_cpu_step after every instruction
+void mos_profile_instruction(MOS_Profile *profile, uint16_t pc, uint8_t opcode, uint16_t next_pc, uint64_t cycles)
+{
+    MOS_OpcodeInfo info = profile->opcodes[opcode];
+    profile->instructions++;
+    profile->cycles += cycles;
+    profile->pc_hits[pc]++;
+    profile->pc_cycles[pc] += cycles;
+    profile->pc_opcode[pc] = opcode;
+    profile->opcode_hits[opcode]++;
+    profile->opcode_cycles[opcode] += cycles;
+    profile->mode_hits[info.mode]++;
+    profile->mode_cycles[info.mode] += cycles;
+    profile->frames.items[profile->frame].cycles += cycles;
+
+    if (info.opcode == JSR || info.opcode == BRK) {
+        profile->frame = mos_profile_call(profile, next_pc);
+    } else if (info.opcode == RTS || info.opcode == RTI) {
+        if (profile->overflow > 0) {
+            profile->overflow--;
+        } else if (profile->frame != 0) {
+            profile->frame = profile->frames.items[profile->frame].parent;
+        }
+    }
+}
+
+// Called by mos_cpu_interrupt once it jumped to the handler at `target`
+void mos_profile_interrupt(MOS_Profile *profile, uint16_t target, uint64_t cycles)
+{
+    profile->cycles += cycles;
+    profile->frames.items[profile->frame].cycles += cycles;
+    profile->frame = mos_profile_call(profile, target);
+}
+
+// Called by mos_cpu_read/mos_cpu_write, `device` is the MOS_MMap index or UINT32_MAX when unmapped
+void mos_profile_access(MOS_Profile *profile, uint32_t device, bool write)
+{
+    uint32_t slot = device < MOS_PROFILE_MAX_DEVICES ? device : MOS_PROFILE_MAX_DEVICES - 1;
+    if (device == UINT32_MAX) slot = MOS_PROFILE_MAX_DEVICES;
+    if (write) {
+        profile->device_writes[slot]++;
+    } else {
+        profile->device_reads[slot]++;
+    }
+}
+
+static const uint64_t *mos_profile_sort_key;
+
+// Descending by cycles, then ascending by index
+static int mos_profile_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    if (mos_profile_sort_key[x] != mos_profile_sort_key[y]) {
+        return mos_profile_sort_key[x] < mos_profile_sort_key[y] ? 1 : -1;
+    }
+    return x < y ? -1 : x > y;
+}
+
+// Indices of the non-zero `hits`, sorted by `cycles`
+static uint32_t mos_profile_sorted(const uint64_t *hits, const uint64_t *cycles, uint32_t count, uint32_t *order)
+{
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (hits[i] > 0) order[used++] = i;
+    }
+    // qsort has no context argument, reports are written from one thread at a time
+    mos_profile_sort_key = cycles;
+    qsort(order, used, sizeof(*order), mos_profile_compare);
+    return used;
+}
+
+static double mos_profile_percent(const MOS_Profile *profile, uint64_t cycles)
+{
+    return profile->cycles > 0 ? 100.0 * cycles / profile->cycles : 0.0;
+}
+
+// Writes the `top` hottest pcs followed by the opcode, addressing mode and device tables
+bool mos_profile_report(const MOS_Cpu *cpu, const char *file_path, uint32_t top)
+{
+    const MOS_Profile *profile = cpu->profile;
+    if (profile == NULL) return false;
+
+    FILE *fp = fopen(file_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+
+    uint32_t *order = malloc(0x10000 * sizeof(*order));
+    if (order == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for profile report Failed\n");
+        fclose(fp);
+        return false;
+    }
+
+    fprintf(fp, "# MOS 6502 profile: %llu instructions, %llu cycles\n",
+            (unsigned long long) profile->instructions, (unsigned long long) profile->cycles);
+
+    uint32_t used = mos_profile_sorted(profile->pc_hits, profile->pc_cycles, 0x10000, order);
+    fprintf(fp, "\n# hot spots\n%-6s %-4s %-18s %12s %14s %7s\n", "pc", "op", "mode", "hits", "cycles", "%");
+    for (uint32_t i = 0; i < used && i < top; ++i) {
+        uint32_t pc = order[i];
+        MOS_OpcodeInfo info = profile->opcodes[profile->pc_opcode[pc]];
+        fprintf(fp, "$%04X  %-4s %-18s %12llu %14llu %6.2f%%\n", pc,
+                mos_opcode_as_cstr(info.opcode), mos_addr_mode_as_cstr(info.mode),
+                (unsigned long long) profile->pc_hits[pc], (unsigned long long) profile->pc_cycles[pc],
+                mos_profile_percent(profile, profile->pc_cycles[pc]));
+    }
+
+    used = mos_profile_sorted(profile->opcode_hits, profile->opcode_cycles, UINT8_MAX + 1, order);
+    fprintf(fp, "\n# opcodes\n%-6s %-4s %-18s %12s %14s %7s\n", "byte", "op", "mode", "hits", "cycles", "%");
+    for (uint32_t i = 0; i < used; ++i) {
+        uint32_t opcode = order[i];
+        MOS_OpcodeInfo info = profile->opcodes[opcode];
+        fprintf(fp, "$%02X    %-4s %-18s %12llu %14llu %6.2f%%\n", opcode,
+                mos_opcode_as_cstr(info.opcode), mos_addr_mode_as_cstr(info.mode),
+                (unsigned long long) profile->opcode_hits[opcode], (unsigned long long) profile->opcode_cycles[opcode],
+                mos_profile_percent(profile, profile->opcode_cycles[opcode]));
+    }
+
+    used = mos_profile_sorted(profile->mode_hits, profile->mode_cycles, MOS_PROFILE_MODES, order);
+    fprintf(fp, "\n# addressing modes\n%-18s %12s %14s %7s\n", "mode", "hits", "cycles", "%");
+    for (uint32_t i = 0; i < used; ++i) {
+        uint32_t mode = order[i];
+        fprintf(fp, "%-18s %12llu %14llu %6.2f%%\n", mos_addr_mode_as_cstr(mode),
+                (unsigned long long) profile->mode_hits[mode], (unsigned long long) profile->mode_cycles[mode],
+                mos_profile_percent(profile, profile->mode_cycles[mode]));
+    }
+
+    fprintf(fp, "\n# devices\n%-6s %-11s %14s %14s\n", "entry", "range", "reads", "writes");
+    for (uint32_t i = 0; i <= MOS_PROFILE_MAX_DEVICES; ++i) {
+        if (profile->device_reads[i] == 0 && profile->device_writes[i] == 0) continue;
+        if (i == MOS_PROFILE_MAX_DEVICES) {
+            fprintf(fp, "%-6s %-11s", "-", "unmapped");
+        } else if (i < cpu->entries.count) {
+            const MOS_MMap *entry = &cpu->entries.items[i];
+            fprintf(fp, "%-6u $%04X-$%04X", i, entry->start_addr, entry->end_addr);
+        } else {
+            fprintf(fp, "%-6u %-11s", i, "?");
+        }
+        fprintf(fp, " %14llu %14llu\n", (unsigned long long) profile->device_reads[i],
+                (unsigned long long) profile->device_writes[i]);
+    }
+
+    free(order);
+    fclose(fp);
+    return true;
+}
+
+// One `root;$XXXX;$YYYY cycles` line per call stack, the collapsed format flamegraph.pl reads
+bool mos_profile_write_collapsed(const MOS_Cpu *cpu, const char *file_path)
+{
+    const MOS_Profile *profile = cpu->profile;
+    if (profile == NULL) return false;
+
+    FILE *fp = fopen(file_path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+
+    uint32_t stack[MOS_PROFILE_MAX_DEPTH + 1];
+    for (uint32_t i = 0; i < profile->frames.count; ++i) {
+        if (profile->frames.items[i].cycles == 0) continue;
+        uint32_t depth = 0;
+        for (uint32_t frame = i; frame != 0; frame = profile->frames.items[frame].parent) {
+            stack[depth++] = frame;
+        }
+        fprintf(fp, "root");
+        while (depth > 0) fprintf(fp, ";$%04X", profile->frames.items[stack[--depth]].target);
+        fprintf(fp, " %llu\n", (unsigned long long) profile->frames.items[i].cycles);
+    }
+    fclose(fp);
+    return true;
+}
+
+#else // the hooks in mos.c are compiled out
+
+bool mos_cpu_enable_profile(MOS_Cpu *cpu)
+{
+    (void) cpu;
+    fprintf(stderr, "ERROR: profiling is not built in, rebuild with `make PROFILE=1`\n");
+    return false;
+}
+
+void mos_profile_free(MOS_Profile *profile)
+{
+    (void) profile;
+}
+
+void mos_profile_instruction(MOS_Profile *profile, uint16_t pc, uint8_t opcode, uint16_t next_pc, uint64_t cycles)
+{
+    (void) profile; (void) pc; (void) opcode; (void) next_pc; (void) cycles;
+}
+
+void mos_profile_interrupt(MOS_Profile *profile, uint16_t target, uint64_t cycles)
+{
+    (void) profile; (void) target; (void) cycles;
+}
+
+void mos_profile_access(MOS_Profile *profile, uint32_t device, bool write)
+{
+    (void) profile; (void) device; (void) write;
+}
+
+bool mos_profile_report(const MOS_Cpu *cpu, const char *file_path, uint32_t top)
+{
+    (void) cpu; (void) file_path; (void) top;
+    return false;
+}
+
+bool mos_profile_write_collapsed(const MOS_Cpu *cpu, const char *file_path)
+{
+    (void) cpu; (void) file_path;
+    return false;
+}
+
+#endif
@@ -0,0 +1,206 @@
+// Mos 6502 I/O record and replay
+//
+// Recording logs the value and cycle of every read that reaches a device
+// callback, replaying hands those values back in the same order without
+// calling the devices, and drops the stores to them. Plain memory, mapper
+// windows and timers are deterministic and never logged: a timer sees the
+// same stores and fires its IRQ on the same scheduled cycle, so it stays
+// live during replay. A read at another address or cycle than the log says,
+// or past its end, raises MOS_FAULT_REPLAY_DIVERGED. mos_cpu_run keeps to
+// the interpreter while recording or replaying, stepping or running cached
+// blocks, so the cycle of every read is exact.
+//
+// The log starts with "M65R" version:u8, then one event per read:
+// cycle delta since the previous event as a LEB128 varint, addr:u16 little
+// endian and the value.
+#include <errno.h>
+
+#include "./mos.h"
+
+#define MOS_REPLAY_MAGIC      "M65R"
+#define MOS_REPLAY_VERSION    1
+#define MOS_REPLAY_FLUSH_SIZE (64*1024)
+#define MOS_REPLAY_MAX_EVENT  (10 + 2 + 1)
+
+typedef ARRAY(uint8_t) MOS_ReplayBytes;
+
+struct _mos_replay {
+    bool recording;
+    FILE *fp;              // log being written, NULL when replaying
+    MOS_ReplayBytes bytes; // pending output, or the whole log when replaying
+    uint32_t offset;       // next event when replaying
+    uint64_t last_cycle;
+    uint64_t events;
+};
+
+// Reads served by a device callback, the only ones that are logged
+bool mos_mmap_is_device(const MOS_MMap *entry)
+{
+    return entry->read != mos_read_memory && !mos_mapper_owns(entry) && !mos_timer_owns(entry);
+}
+
+static MOS_Replay *mos_replay_new(bool recording)
+{
+    MOS_Replay *replay = calloc(1, sizeof(*replay));
+    if (replay == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for replay Failed\n");
+        return NULL;
+    }
+    replay->recording = recording;
+    array_new(&replay->bytes);
+    return replay;
+}
+
+static void mos_replay_free(MOS_Replay *replay)
+{
+    array_delete(&replay->bytes);
+    free(replay);
+}
+
+static bool mos_replay_flush(MOS_Replay *replay)
+{
+    bool ok = fwrite(replay->bytes.items, 1, replay->bytes.count, replay->fp) == replay->bytes.count;
+    replay->bytes.count = 0;
+    return ok;
+}
+
+// Logs every device read of `cpu` into `file_path` until mos_replay_close
+bool mos_cpu_record_io(MOS_Cpu *cpu, const char *file_path)
+{
+    if (cpu->replay != NULL) {
+        fprintf(stderr, "ERROR: the cpu is already recording or replaying I/O\n");
+        return false;
+    }
+    MOS_Replay *replay = mos_replay_new(true);
+    if (replay == NULL) return false;
+
+    replay->fp = fopen(file_path, "wb");
+    if (replay->fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        mos_replay_free(replay);
+        return false;
+    }
+    for (uint32_t i = 0; i < 4; ++i) array_append(&replay->bytes, (uint8_t) MOS_REPLAY_MAGIC[i]);
+    array_append(&replay->bytes, (uint8_t) MOS_REPLAY_VERSION);
+    replay->last_cycle = cpu->cycles;
+    cpu->replay = replay;
+    return true;
+}
+
+// Feeds the reads logged in `file_path` back to `cpu`, which must start in
+// the state the recording started in
+bool mos_cpu_replay_io(MOS_Cpu *cpu, const char *file_path)
+{
+    if (cpu->replay != NULL) {
+        fprintf(stderr, "ERROR: the cpu is already recording or replaying I/O\n");
+        return false;
+    }
+    FILE *fp = fopen(file_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+    MOS_Replay *replay = mos_replay_new(false);
+    if (replay == NULL) {
+        fclose(fp);
+        return false;
+    }
+
+    uint8_t chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        for (size_t i = 0; i < count; ++i) array_append(&replay->bytes, chunk[i]);
+    }
+    fclose(fp);
+    if (replay->bytes.count < 5 || memcmp(replay->bytes.items, MOS_REPLAY_MAGIC, 4) != 0 ||
+        replay->bytes.items[4] != MOS_REPLAY_VERSION) {
+        fprintf(stderr, "ERROR: `%s` is not a version %d I/O log\n", file_path, MOS_REPLAY_VERSION);
+        mos_replay_free(replay);
+        return false;
+    }
+    replay->offset = 5;
+    replay->last_cycle = cpu->cycles;
+    cpu->replay = replay;
+    return true;
+}
+
+// Stops recording or replaying, false if the log could not be written
+bool mos_replay_close(MOS_Cpu *cpu)
+{
+    MOS_Replay *replay = cpu->replay;
+    if (replay == NULL) return true;
+    bool ok = true;
+    if (replay->recording) {
+        ok = mos_replay_flush(replay);
+        if (fclose(replay->fp) != 0) ok = false;
+        if (!ok) fprintf(stderr, "ERROR: writing the I/O log failed, it is incomplete\n");
+    } else if (replay->offset < replay->bytes.count) {
+        fprintf(stderr, "WARNING: replay stopped with %u bytes of the I/O log left\n",
+                replay->bytes.count - replay->offset);
+    }
+    mos_replay_free(replay);
+    cpu->replay = NULL;
+    return ok;
+}
+
+static uint8_t mos_replay_record(MOS_Cpu *cpu, MOS_Replay *replay, MOS_MMap *entry, uint16_t addr)
+{
+    uint8_t value = entry->read(entry->device, addr);
+
+    uint8_t event[MOS_REPLAY_MAX_EVENT];
+    uint32_t size = 0;
+    uint64_t delta = cpu->cycles - replay->last_cycle;
+    do {
+        event[size++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+        delta >>= 7;
+    } while (delta > 0);
+    event[size++] = addr & 0xFF;
+    event[size++] = addr >> 8;
+    event[size++] = value;
+    for (uint32_t i = 0; i < size; ++i) array_append(&replay->bytes, event[i]);
+
+    replay->last_cycle = cpu->cycles;
+    replay->events++;
+    if (replay->bytes.count >= MOS_REPLAY_FLUSH_SIZE && !mos_replay_flush(replay)) {
+        fprintf(stderr, "ERROR: writing the I/O log failed\n");
+    }
+    return value;
+}
+
+static uint8_t mos_replay_play(MOS_Cpu *cpu, MOS_Replay *replay, uint16_t addr)
+{
+    const uint8_t *bytes = replay->bytes.items;
+    uint32_t offset = replay->offset;
+    uint64_t delta = 0;
+    for (uint32_t shift = 0; offset < replay->bytes.count && shift < 64; shift += 7) {
+        uint8_t byte = bytes[offset++];
+        delta |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) break;
+    }
+    if (offset + 3 > replay->bytes.count ||
+        replay->last_cycle + delta != cpu->cycles ||
+        mos_bytes_to_uint16_t(bytes[offset + 1], bytes[offset]) != addr) {
+        mos_cpu_fault(cpu, MOS_FAULT_REPLAY_DIVERGED, addr);
+        return 0;
+    }
+    replay->offset = offset + 3;
+    replay->last_cycle = cpu->cycles;
+    replay->events++;
+    return bytes[offset + 2];
+}
+
+// Called by mos_cpu_read for reads served by a device callback
+uint8_t mos_replay_read(MOS_Cpu *cpu, MOS_MMap *entry, uint16_t addr)
+{
+    MOS_Replay *replay = cpu->replay;
+    if (replay->recording) return mos_replay_record(cpu, replay, entry, addr);
+    return mos_replay_play(cpu, replay, addr);
+}
+
+// Called by mos_cpu_write for stores to a device callback, false when the store is dropped
+bool mos_replay_write(const MOS_Cpu *cpu)
+{
+    return cpu->replay->recording;
+}
@@ -0,0 +1,306 @@
+// Mos 6502 event scheduler
+//
+// Devices that act at a given cycle (timers, video, serial) schedule a
+// callback instead of being polled. Events live in a binary min-heap keyed
+// on the cycle they are due, ties fire in the order they were scheduled.
+// The cpu only keeps the cycle of the earliest one in `next_event`:
+// mos_cpu_run hands it to the block runner as the deadline, and
+// mos_cpu_step compares it once per instruction, so any number of idle
+// devices cost nothing. Events fire between instructions, at most one
+// instruction (or one native block's last instruction) late, and the
+// callback is told the cycle it was due so periodic devices do not drift.
+//
+// mos_timer_new builds an interval timer on top of it, a MOS_MMap device
+// that raises an IRQ line when it expires.
+#include "./mos.h"
+
+typedef struct _mos_event {
+    uint64_t cycle;
+    uint64_t order; // scheduling order, breaks ties
+    MOS_EventCallback callback;
+    void *device;
+    MOS_EventId id;
+} MOS_Event;
+
+typedef ARRAY(MOS_Event) MOS_Events;
+typedef ARRAY(uint32_t) MOS_EventSlots;
+
+struct _mos_scheduler {
+    MOS_Events heap;
+    MOS_EventSlots slots;    // heap index of every id, UINT32_MAX when the id is free
+    MOS_EventSlots free_ids;
+    uint64_t order;
+};
+
+static MOS_Scheduler *mos_scheduler_new(void)
+{
+    MOS_Scheduler *scheduler = calloc(1, sizeof(*scheduler));
+    if (scheduler == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for scheduler Failed\n");
+        return NULL;
+    }
+    array_new(&scheduler->heap);
+    array_new(&scheduler->slots);
+    array_new(&scheduler->free_ids);
+    return scheduler;
+}
+
+void mos_scheduler_free(MOS_Cpu *cpu)
+{
+    MOS_Scheduler *scheduler = cpu->scheduler;
+    if (scheduler == NULL) return;
+    array_delete(&scheduler->heap);
+    array_delete(&scheduler->slots);
+    array_delete(&scheduler->free_ids);
+    free(scheduler);
+    cpu->scheduler = NULL;
+    cpu->next_event = UINT64_MAX;
+}
+
+static inline bool mos_event_before(const MOS_Event *a, const MOS_Event *b)
+{
+    return a->cycle < b->cycle || (a->cycle == b->cycle && a->order < b->order);
+}
+
+static inline void mos_event_place(MOS_Scheduler *scheduler, uint32_t index, MOS_Event event)
+{
+    scheduler->heap.items[index] = event;
+    scheduler->slots.items[event.id] = index;
+}
+
+static void mos_event_sift_up(MOS_Scheduler *scheduler, uint32_t index)
+{
+    MOS_Event event = scheduler->heap.items[index];
+    while (index > 0) {
+        uint32_t parent = (index - 1) / 2;
+        if (!mos_event_before(&event, &scheduler->heap.items[parent])) break;
+        mos_event_place(scheduler, index, scheduler->heap.items[parent]);
+        index = parent;
+    }
+    mos_event_place(scheduler, index, event);
+}
+
+static void mos_event_sift_down(MOS_Scheduler *scheduler, uint32_t index)
+{
+    MOS_Event event = scheduler->heap.items[index];
+    uint32_t count = scheduler->heap.count;
+    for (;;) {
+        uint32_t child = 2*index + 1;
+        if (child >= count) break;
+        if (child + 1 < count && mos_event_before(&scheduler->heap.items[child + 1], &scheduler->heap.items[child])) {
+            child++;
+        }
+        if (!mos_event_before(&scheduler->heap.items[child], &event)) break;
+        mos_event_place(scheduler, index, scheduler->heap.items[child]);
+        index = child;
+    }
+    mos_event_place(scheduler, index, event);
+}
+
+// Takes the event at heap `index` out and frees its id
+static void mos_event_remove(MOS_Scheduler *scheduler, uint32_t index)
+{
+    MOS_Event *heap = scheduler->heap.items;
+    MOS_EventId id = heap[index].id;
+    scheduler->slots.items[id] = UINT32_MAX;
+    array_append(&scheduler->free_ids, id);
+
+    uint32_t last = --scheduler->heap.count;
+    if (index == last) return;
+    mos_event_place(scheduler, index, heap[last]);
+    if (index > 0 && mos_event_before(&heap[index], &heap[(index - 1) / 2])) {
+        mos_event_sift_up(scheduler, index);
+    } else {
+        mos_event_sift_down(scheduler, index);
+    }
+}
+
+static inline void mos_scheduler_update(MOS_Cpu *cpu)
+{
+    const MOS_Scheduler *scheduler = cpu->scheduler;
+    cpu->next_event = scheduler->heap.count > 0 ? scheduler->heap.items[0].cycle : UINT64_MAX;
+}
+
+// Calls `callback` once cpu->cycles reaches `cycle`, returns an id for
+// mos_cpu_cancel that stays valid until the callback starts, or
+// MOS_EVENT_NONE if the scheduler could not be allocated
+MOS_EventId mos_cpu_schedule(MOS_Cpu *cpu, uint64_t cycle, MOS_EventCallback callback, void *device)
+{
+    if (cpu->scheduler == NULL) {
+        cpu->scheduler = mos_scheduler_new();
+        if (cpu->scheduler == NULL) return MOS_EVENT_NONE;
+    }
+    MOS_Scheduler *scheduler = cpu->scheduler;
+
+    MOS_EventId id;
+    if (scheduler->free_ids.count > 0) {
+        id = scheduler->free_ids.items[--scheduler->free_ids.count];
+    } else {
+        id = scheduler->slots.count;
+        array_append(&scheduler->slots, UINT32_MAX);
+    }
+    MOS_Event event = {
+        .cycle = cycle,
+        .order = scheduler->order++,
+        .callback = callback,
+        .device = device,
+        .id = id,
+    };
+    array_append(&scheduler->heap, event);
+    mos_event_sift_up(scheduler, scheduler->heap.count - 1);
+    mos_scheduler_update(cpu);
+    return id;
+}
+
+// Drops a pending event, false if it already fired or was cancelled
+bool mos_cpu_cancel(MOS_Cpu *cpu, MOS_EventId id)
+{
+    MOS_Scheduler *scheduler = cpu->scheduler;
+    if (scheduler == NULL || id >= scheduler->slots.count || scheduler->slots.items[id] == UINT32_MAX) {
+        return false;
+    }
+    mos_event_remove(scheduler, scheduler->slots.items[id]);
+    mos_scheduler_update(cpu);
+    return true;
+}
+
+// Fires every event due by cpu->cycles, callbacks may schedule more
+void mos_scheduler_fire(MOS_Cpu *cpu)
+{
+    MOS_Scheduler *scheduler = cpu->scheduler;
+    if (scheduler == NULL) {
+        cpu->next_event = UINT64_MAX;
+        return;
+    }
+    while (scheduler->heap.count > 0 && scheduler->heap.items[0].cycle <= cpu->cycles) {
+        MOS_Event event = scheduler->heap.items[0];
+        mos_event_remove(scheduler, 0);
+        mos_scheduler_update(cpu);
+        event.callback(cpu, event.device, event.cycle);
+    }
+    mos_scheduler_update(cpu);
+}
+
+// NOTE: Interval timer
+//
+// Four registers from the base address:
+//   +0 latch low byte, reads the low byte of the cycles left
+//   +1 latch high byte, writing it (re)starts the count, reads the high byte
+//   +2 control: bit 0 reloads the latch on expiry, bit 1 raises the IRQ
+//   +3 status: bit 7 once expired, reading it clears the bit and the IRQ
+// Nothing runs while it counts, the count is worked out from cpu->cycles.
+
+#define MOS_TIMER_CONTINUOUS 0x01
+#define MOS_TIMER_IRQ        0x02
+#define MOS_TIMER_EXPIRED    0x80
+
+struct _mos_timer {
+    MOS_Cpu *cpu;
+    uint16_t addr;
+    uint8_t  irq_source;
+    uint16_t latch;
+    uint8_t  control;
+    uint8_t  status;
+    uint64_t due;      // cycle of the next expiry
+    MOS_EventId event; // MOS_EVENT_NONE while stopped
+};
+
+static void mos_timer_expire(MOS_Cpu *cpu, void *device, uint64_t cycle)
+{
+    MOS_Timer *timer = device;
+    timer->event = MOS_EVENT_NONE;
+    timer->status |= MOS_TIMER_EXPIRED;
+    if (timer->control & MOS_TIMER_IRQ) mos_cpu_set_irq(cpu, timer->irq_source, true);
+    if ((timer->control & MOS_TIMER_CONTINUOUS) && timer->latch > 0) {
+        timer->due = cycle + timer->latch;
+        timer->event = mos_cpu_schedule(cpu, timer->due, mos_timer_expire, timer);
+    }
+}
+
+static uint8_t mos_timer_read(void *device, uint16_t addr)
+{
+    MOS_Timer *timer = device;
+    uint16_t left = 0;
+    if (timer->event != MOS_EVENT_NONE && timer->due > timer->cpu->cycles) {
+        uint64_t cycles = timer->due - timer->cpu->cycles;
+        left = cycles > UINT16_MAX ? UINT16_MAX : cycles;
+    }
+    switch (addr - timer->addr) {
+    case 0: return left & 0xFF;
+    case 1: return left >> 8;
+    case 2: return timer->control;
+    case 3: {
+        uint8_t status = timer->status;
+        timer->status &= ~MOS_TIMER_EXPIRED;
+        mos_cpu_set_irq(timer->cpu, timer->irq_source, false);
+        return status;
+    }
+    default: return 0;
+    }
+}
+
+static void mos_timer_write(void *device, uint16_t addr, uint8_t data)
+{
+    MOS_Timer *timer = device;
+    MOS_Cpu *cpu = timer->cpu;
+    switch (addr - timer->addr) {
+    case 0:
+        timer->latch = (timer->latch & 0xFF00) | data;
+        break;
+    case 1:
+        timer->latch = (timer->latch & 0x00FF) | data << 8;
+        if (timer->event != MOS_EVENT_NONE) mos_cpu_cancel(cpu, timer->event);
+        timer->event = MOS_EVENT_NONE;
+        if (timer->latch > 0) {
+            timer->due = cpu->cycles + timer->latch;
+            timer->event = mos_cpu_schedule(cpu, timer->due, mos_timer_expire, timer);
+        }
+        break;
+    case 2:
+        timer->control = data & (MOS_TIMER_CONTINUOUS | MOS_TIMER_IRQ);
+        if (!(timer->control & MOS_TIMER_IRQ)) mos_cpu_set_irq(cpu, timer->irq_source, false);
+        break;
+    default:
+        break;
+    }
+}
+
+// Timers only act on guest stores and scheduled cycles, so I/O replay keeps them live
+bool mos_timer_owns(const MOS_MMap *entry)
+{
+    return entry->read == mos_timer_read;
+}
+
+// Maps a stopped timer at `addr`..`addr`+3 driving IRQ `irq_source`, it must be freed after the cpu
+MOS_Timer *mos_timer_new(MOS_Cpu *cpu, uint16_t addr, uint8_t irq_source)
+{
+    if (addr > 0xFFFC || irq_source >= 32) {
+        fprintf(stderr, "ERROR: timer at 0x%04x on IRQ %u does not fit\n", addr, irq_source);
+        return NULL;
+    }
+    MOS_Timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for timer Failed\n");
+        return NULL;
+    }
+    timer->cpu = cpu;
+    timer->addr = addr;
+    timer->irq_source = irq_source;
+    timer->event = MOS_EVENT_NONE;
+
+    MOS_MMap map = {
+        .device = timer,
+        .read = mos_timer_read,
+        .write = mos_timer_write,
+        .readonly = false,
+        .start_addr = addr,
+        .end_addr = addr + 3,
+    };
+    mos_cpu_map(cpu, map);
+    return timer;
+}
+
+void mos_timer_free(MOS_Timer *timer)
+{
+    free(timer);
+}
@@ -0,0 +1,485 @@
+// Mos 6502 machine snapshots
+//
+// A snapshot holds the registers and one reference counted copy of every
+// plain memory page. Taking one only copies the pages written since the last
+// snapshot or restore, the others are already shared with it. Restoring
+// copies nothing: the page table reads straight from the snapshot's copy and
+// the page is written back to its device on the first store, through the
+// same write pointer trick the block cache uses. Pages split between several
+// entries are copied eagerly, device callbacks (I/O) and readonly entries
+// (ROMs, possibly mapped from a file) are not captured. Mapper windows are
+// captured like ram along with the bank each one shows, a restore switches
+// the banks back first so the pages land in the banks they were taken from.
+// Banks no window shows are the host's backing store and are not captured.
+// The NMI line and latch go with the registers, IRQ lines belong to the
+// devices holding them and are left as they are.
+//
+// The device memory of a page restored this way is stale until its first
+// store, hosts reading guest ram directly call mos_cpu_sync_memory first.
+// Hosts writing guest ram directly call mos_cpu_map_pages afterwards.
+// Reference counts are not atomic, a snapshot belongs to one thread.
+#include <errno.h>
+
+#include "./mos.h"
+
+#define MOS_SNAPSHOT_MAGIC   "M65S"
+#define MOS_SNAPSHOT_VERSION 3
+#define MOS_SNAPSHOT_BITMAP  (MOS_PAGE_COUNT / 8)
+#define MOS_SNAPSHOT_HEADER  (4 + 1 + 5 + 2 + 8 + 1 + 2 + 2 + 2*MOS_SNAPSHOT_BITMAP)
+
+typedef struct _mos_snapshot_page {
+    uint32_t refs;
+    uint8_t  data[MOS_PAGE_SIZE];
+} MOS_SnapshotPage;
+
+typedef struct _mos_snapshot_bank {
+    uint32_t entry; // index of the window entry in the memory map
+    uint32_t bank;
+} MOS_SnapshotBank;
+
+struct _mos_snapshot {
+    uint8_t  racc, regx, regy, sp, psr;
+    uint16_t pc;
+    uint64_t cycles;
+    MOS_Fault fault;
+    uint16_t fault_addr;
+    bool     nmi_line, nmi_pending;
+    MOS_SnapshotPage *pages[MOS_PAGE_COUNT]; // NULL where no ram was mapped
+    MOS_SnapshotBank *banks;                 // one per mapper window
+    uint32_t bank_count;
+};
+
+// Pages of a cpu whose contents are known to equal a snapshot page
+struct _mos_cow {
+    MOS_SnapshotPage *pages[MOS_PAGE_COUNT]; // NULL once the page was written
+    uint8_t *memory[MOS_PAGE_COUNT];         // device memory behind each tracked page
+    bool     stale[MOS_PAGE_COUNT];          // memory not written back yet, reads use pages[i]
+};
+
+static MOS_SnapshotPage *mos_snapshot_page_new(void)
+{
+    MOS_SnapshotPage *page = malloc(sizeof(*page));
+    if (page == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for snapshot page Failed\n");
+        return NULL;
+    }
+    page->refs = 1;
+    return page;
+}
+
+static MOS_SnapshotPage *mos_snapshot_page_ref(MOS_SnapshotPage *page)
+{
+    page->refs++;
+    return page;
+}
+
+static void mos_snapshot_page_release(MOS_SnapshotPage *page)
+{
+    if (page != NULL && --page->refs == 0) free(page);
+}
+
+static bool mos_cow_init(MOS_Cpu *cpu)
+{
+    if (cpu->cow != NULL) return true;
+    cpu->cow = calloc(1, sizeof(*cpu->cow));
+    if (cpu->cow == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for snapshot pages Failed\n");
+        return false;
+    }
+    return true;
+}
+
+// Called by mos_cpu_map_page, tracked pages take every store through mos_cpu_write
+void mos_cow_map_page(const MOS_Cpu *cpu, uint8_t page, MOS_Page *slot)
+{
+    const MOS_SnapshotPage *shared = cpu->cow->pages[page];
+    if (shared == NULL) return;
+    slot->write = NULL;
+    if (cpu->cow->stale[page]) slot->read = (uint8_t*) shared->data;
+}
+
+// Stops tracking `page` ahead of a store, writing the snapshot copy back if needed
+void mos_cow_touch(MOS_Cpu *cpu, uint8_t page)
+{
+    MOS_Cow *cow = cpu->cow;
+    if (cow->pages[page] == NULL) return;
+    if (cow->stale[page]) memcpy(cow->memory[page], cow->pages[page]->data, MOS_PAGE_SIZE);
+    mos_snapshot_page_release(cow->pages[page]);
+    cow->pages[page] = NULL;
+    cow->stale[page] = false;
+    mos_cpu_map_page(cpu, page);
+}
+
+// Writes every stale page back to its device, so the host can read guest ram directly
+void mos_cpu_sync_memory(MOS_Cpu *cpu)
+{
+    MOS_Cow *cow = cpu->cow;
+    if (cow == NULL) return;
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        if (!cow->stale[page]) continue;
+        memcpy(cow->memory[page], cow->pages[page]->data, MOS_PAGE_SIZE);
+        cow->stale[page] = false;
+        cpu->pages[page].read = cow->memory[page];
+    }
+}
+
+// Syncs and stops tracking every page, used when the memory map changes
+void mos_cow_forget(MOS_Cpu *cpu)
+{
+    mos_cpu_sync_memory(cpu);
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        mos_snapshot_page_release(cpu->cow->pages[page]);
+        cpu->cow->pages[page] = NULL;
+    }
+}
+
+void mos_cow_free(MOS_Cpu *cpu)
+{
+    if (cpu->cow == NULL) return;
+    mos_cow_forget(cpu);
+    free(cpu->cow);
+    cpu->cow = NULL;
+}
+
+// Writable plain memory entry owning `addr`, NULL for ROMs, device callbacks and unmapped addresses
+static MOS_MMap *mos_snapshot_ram_entry(MOS_Cpu *cpu, uint16_t addr)
+{
+    MOS_MMap *entry = mos_cpu_find_entry(cpu, addr);
+    if (entry == NULL || entry->read != mos_read_memory || entry->readonly) return NULL;
+    return entry;
+}
+
+// Copies the ram bytes of a page split between entries, NULL if it has none
+static MOS_SnapshotPage *mos_snapshot_split_page(MOS_Cpu *cpu, uint8_t page, bool *failed)
+{
+    MOS_SnapshotPage *copy = NULL;
+    for (uint32_t offset = 0; offset < MOS_PAGE_SIZE; ++offset) {
+        uint16_t addr = page*MOS_PAGE_SIZE + offset;
+        MOS_MMap *entry = mos_snapshot_ram_entry(cpu, addr);
+        if (entry == NULL) continue;
+        if (copy == NULL) {
+            copy = mos_snapshot_page_new();
+            if (copy == NULL) {
+                *failed = true;
+                return NULL;
+            }
+            memset(copy->data, 0, MOS_PAGE_SIZE);
+        }
+        copy->data[offset] = mos_read_memory(entry->device, addr);
+    }
+    return copy;
+}
+
+// Records the bank every mapper window shows
+static bool mos_snapshot_capture_banks(MOS_Cpu *cpu, MOS_Snapshot *snapshot)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < cpu->entries.count; ++i) {
+        if (cpu->entries.items[i].read == mos_mapper_read) count++;
+    }
+    if (count == 0) return true;
+    snapshot->banks = malloc(count*sizeof(*snapshot->banks));
+    if (snapshot->banks == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for snapshot banks Failed\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < cpu->entries.count; ++i) {
+        const MOS_MMap *entry = &cpu->entries.items[i];
+        if (entry->read != mos_mapper_read) continue;
+        MOS_SnapshotBank bank = { .entry = i, .bank = mos_mapper_entry_bank(entry) };
+        snapshot->banks[snapshot->bank_count++] = bank;
+    }
+    return true;
+}
+
+// Checkpoints `cpu`, only the pages written since the last snapshot or restore are copied
+MOS_Snapshot *mos_cpu_snapshot(MOS_Cpu *cpu)
+{
+    if (!mos_cow_init(cpu)) return NULL;
+    MOS_Snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for snapshot Failed\n");
+        return NULL;
+    }
+
+    if (!mos_snapshot_capture_banks(cpu, snapshot)) {
+        mos_snapshot_free(snapshot);
+        return NULL;
+    }
+
+    MOS_Cow *cow = cpu->cow;
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        if (cow->pages[page] != NULL) {
+            snapshot->pages[page] = mos_snapshot_page_ref(cow->pages[page]);
+            continue;
+        }
+
+        bool failed = false;
+        uint8_t *memory = cpu->pages[page].read;
+        if (memory != NULL && cpu->pages[page].entry->readonly) continue;
+        if (memory == NULL) {
+            snapshot->pages[page] = mos_snapshot_split_page(cpu, page, &failed);
+        } else {
+            MOS_SnapshotPage *copy = mos_snapshot_page_new();
+            if (copy != NULL) {
+                memcpy(copy->data, memory, MOS_PAGE_SIZE);
+                cow->pages[page] = copy;
+                cow->memory[page] = memory;
+                snapshot->pages[page] = mos_snapshot_page_ref(copy);
+                mos_cpu_map_page(cpu, page);
+            }
+            failed = copy == NULL;
+        }
+        if (failed) {
+            mos_snapshot_free(snapshot);
+            return NULL;
+        }
+    }
+
+    snapshot->racc = cpu->racc;
+    snapshot->regx = cpu->regx;
+    snapshot->regy = cpu->regy;
+    snapshot->sp   = cpu->sp;
+    snapshot->psr  = mos_cpu_get_psr(cpu);
+    snapshot->pc   = cpu->pc;
+    snapshot->cycles = cpu->cycles;
+    snapshot->fault  = cpu->fault;
+    snapshot->fault_addr = cpu->fault_addr;
+    snapshot->nmi_line    = cpu->nmi_line;
+    snapshot->nmi_pending = cpu->nmi_pending;
+    return snapshot;
+}
+
+// Puts `cpu` back into the state of `snapshot`, which may come from another
+// cpu with the same memory map (a fork). Memory is written back lazily.
+bool mos_cpu_restore(MOS_Cpu *cpu, const MOS_Snapshot *snapshot)
+{
+    if (!mos_cow_init(cpu)) return false;
+
+    // banks first: switching writes the stale pages of the current bank back
+    // to it, then the pages below go back into the banks they came from
+    for (uint32_t i = 0; i < snapshot->bank_count; ++i) {
+        const MOS_SnapshotBank *bank = &snapshot->banks[i];
+        if (bank->entry >= cpu->entries.count || cpu->entries.items[bank->entry].read != mos_mapper_read) {
+            fprintf(stderr, "ERROR: snapshot does not match the memory map, entry %u is not a mapper window\n",
+                    bank->entry);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < snapshot->bank_count; ++i) {
+        mos_mapper_entry_switch(&cpu->entries.items[snapshot->banks[i].entry], snapshot->banks[i].bank);
+    }
+
+    MOS_Cow *cow = cpu->cow;
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        MOS_SnapshotPage *shared = snapshot->pages[page];
+        if (shared == NULL) continue;
+        if (cow->pages[page] == shared) continue; // not written since
+
+        uint8_t *memory = cpu->pages[page].read;
+        if (memory == NULL) {
+            // split page, only its ram bytes go back
+            for (uint32_t offset = 0; offset < MOS_PAGE_SIZE; ++offset) {
+                uint16_t addr = page*MOS_PAGE_SIZE + offset;
+                MOS_MMap *entry = mos_snapshot_ram_entry(cpu, addr);
+                if (entry != NULL) mos_write_memory(entry->device, addr, shared->data[offset]);
+            }
+            continue;
+        }
+        if (cpu->pages[page].entry->readonly) continue;
+
+        if (cow->pages[page] != NULL) {
+            memory = cow->memory[page];
+            mos_snapshot_page_release(cow->pages[page]);
+        }
+        cow->pages[page] = mos_snapshot_page_ref(shared);
+        cow->memory[page] = memory;
+        cow->stale[page] = true;
+        if (cpu->cache != NULL) mos_block_cache_invalidate(cpu, page);
+        mos_cpu_map_page(cpu, page);
+    }
+
+    cpu->racc = snapshot->racc;
+    cpu->regx = snapshot->regx;
+    cpu->regy = snapshot->regy;
+    cpu->sp   = snapshot->sp;
+    mos_cpu_set_psr(cpu, snapshot->psr);
+    cpu->pc   = snapshot->pc;
+    cpu->cycles = snapshot->cycles;
+    cpu->fault  = snapshot->fault;
+    cpu->fault_addr = snapshot->fault_addr;
+    cpu->nmi_line    = snapshot->nmi_line;
+    cpu->nmi_pending = snapshot->nmi_pending;
+    cpu->interrupt_pending = cpu->nmi_pending || cpu->irq_lines != 0;
+    return true;
+}
+
+void mos_snapshot_free(MOS_Snapshot *snapshot)
+{
+    if (snapshot == NULL) return;
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        mos_snapshot_page_release(snapshot->pages[page]);
+    }
+    free(snapshot->banks);
+    free(snapshot);
+}
+
+// NOTE: On-disk format, all numbers little endian
+//
+//   "M65S" version:u8 a:u8 x:u8 y:u8 sp:u8 psr:u8 pc:u16 cycles:u64
+//   fault:u8 fault_addr:u16 nmi_line:u8 nmi_pending:u8
+//   mapped:bitmap[32] nonzero:bitmap[32]
+//   then 256 bytes for every page set in both bitmaps, in page order
+//   then banks:u32 and entry:u32 bank:u32 for every mapper window
+//
+// Mapped pages that are all zero take no space beyond their two bits.
+
+static uint8_t *mos_snapshot_put(uint8_t *out, uint64_t value, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; ++i) *out++ = (value >> (8*i)) & 0xFF;
+    return out;
+}
+
+static uint64_t mos_snapshot_get(const uint8_t **in, uint32_t bytes)
+{
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < bytes; ++i) value |= (uint64_t)(*in)[i] << (8*i);
+    *in += bytes;
+    return value;
+}
+
+static bool mos_snapshot_page_is_zero(const MOS_SnapshotPage *page)
+{
+    for (uint32_t i = 0; i < MOS_PAGE_SIZE; ++i) {
+        if (page->data[i] != 0) return false;
+    }
+    return true;
+}
+
+bool mos_snapshot_save(const MOS_Snapshot *snapshot, const char *file_path)
+{
+    uint8_t header[MOS_SNAPSHOT_HEADER] = {0};
+    uint8_t *out = header;
+    memcpy(out, MOS_SNAPSHOT_MAGIC, 4);
+    out += 4;
+    *out++ = MOS_SNAPSHOT_VERSION;
+    *out++ = snapshot->racc;
+    *out++ = snapshot->regx;
+    *out++ = snapshot->regy;
+    *out++ = snapshot->sp;
+    *out++ = snapshot->psr;
+    out = mos_snapshot_put(out, snapshot->pc, 2);
+    out = mos_snapshot_put(out, snapshot->cycles, 8);
+    *out++ = snapshot->fault;
+    out = mos_snapshot_put(out, snapshot->fault_addr, 2);
+    *out++ = snapshot->nmi_line;
+    *out++ = snapshot->nmi_pending;
+    uint8_t *mapped = out;
+    uint8_t *nonzero = out + MOS_SNAPSHOT_BITMAP;
+    for (uint32_t page = 0; page < MOS_PAGE_COUNT; ++page) {
+        if (snapshot->pages[page] == NULL) continue;
+        mapped[page / 8] |= 1 << (page % 8);
+        if (!mos_snapshot_page_is_zero(snapshot->pages[page])) nonzero[page / 8] |= 1 << (page % 8);
+    }
+
+    FILE *fp = fopen(file_path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+    bool ok = fwrite(header, sizeof(header), 1, fp) == 1;
+    for (uint32_t page = 0; ok && page < MOS_PAGE_COUNT; ++page) {
+        if ((nonzero[page / 8] >> (page % 8)) & 1) {
+            ok = fwrite(snapshot->pages[page]->data, MOS_PAGE_SIZE, 1, fp) == 1;
+        }
+    }
+    uint8_t bank[8];
+    mos_snapshot_put(bank, snapshot->bank_count, 4);
+    if (ok) ok = fwrite(bank, 4, 1, fp) == 1;
+    for (uint32_t i = 0; ok && i < snapshot->bank_count; ++i) {
+        mos_snapshot_put(mos_snapshot_put(bank, snapshot->banks[i].entry, 4), snapshot->banks[i].bank, 4);
+        ok = fwrite(bank, sizeof(bank), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0) ok = false;
+    if (!ok) fprintf(stderr, "ERROR: could not write snapshot `%s`\n", file_path);
+    return ok;
+}
+
+MOS_Snapshot *mos_snapshot_load(const char *file_path)
+{
+    FILE *fp = fopen(file_path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return NULL;
+    }
+
+    uint8_t header[MOS_SNAPSHOT_HEADER];
+    if (fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, MOS_SNAPSHOT_MAGIC, 4) != 0 ||
+        header[4] != MOS_SNAPSHOT_VERSION) {
+        fprintf(stderr, "ERROR: `%s` is not a version %d snapshot\n", file_path, MOS_SNAPSHOT_VERSION);
+        fclose(fp);
+        return NULL;
+    }
+
+    MOS_Snapshot *snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for snapshot Failed\n");
+        fclose(fp);
+        return NULL;
+    }
+    const uint8_t *in = header + 5;
+    snapshot->racc = *in++;
+    snapshot->regx = *in++;
+    snapshot->regy = *in++;
+    snapshot->sp   = *in++;
+    snapshot->psr  = *in++;
+    snapshot->pc   = mos_snapshot_get(&in, 2);
+    snapshot->cycles = mos_snapshot_get(&in, 8);
+    snapshot->fault  = *in++;
+    snapshot->fault_addr = mos_snapshot_get(&in, 2);
+    snapshot->nmi_line    = *in++ != 0;
+    snapshot->nmi_pending = *in++ != 0;
+    const uint8_t *mapped = in;
+    const uint8_t *nonzero = in + MOS_SNAPSHOT_BITMAP;
+
+    bool ok = mos_fault_as_cstr(snapshot->fault) != NULL;
+    for (uint32_t page = 0; ok && page < MOS_PAGE_COUNT; ++page) {
+        if (((mapped[page / 8] >> (page % 8)) & 1) == 0) continue;
+        MOS_SnapshotPage *copy = mos_snapshot_page_new();
+        if (copy == NULL) {
+            ok = false;
+            break;
+        }
+        snapshot->pages[page] = copy;
+        if ((nonzero[page / 8] >> (page % 8)) & 1) {
+            ok = fread(copy->data, MOS_PAGE_SIZE, 1, fp) == 1;
+        } else {
+            memset(copy->data, 0, MOS_PAGE_SIZE);
+        }
+    }
+    uint8_t bank[8];
+    const uint8_t *in_bank = bank;
+    if (ok) ok = fread(bank, 4, 1, fp) == 1;
+    uint32_t bank_count = ok ? mos_snapshot_get(&in_bank, 4) : 0;
+    if (ok && bank_count > 0) {
+        // a window is at least one page
+        snapshot->banks = bank_count <= MOS_PAGE_COUNT ? malloc(bank_count*sizeof(*snapshot->banks)) : NULL;
+        ok = snapshot->banks != NULL;
+    }
+    for (uint32_t i = 0; ok && i < bank_count; ++i) {
+        in_bank = bank;
+        ok = fread(bank, sizeof(bank), 1, fp) == 1;
+        snapshot->banks[i].entry = mos_snapshot_get(&in_bank, 4);
+        snapshot->banks[i].bank = mos_snapshot_get(&in_bank, 4);
+        snapshot->bank_count = i + 1;
+    }
+    fclose(fp);
+    if (!ok) {
+        fprintf(stderr, "ERROR: snapshot `%s` is truncated or corrupt\n", file_path);
+        mos_snapshot_free(snapshot);
+        return NULL;
+    }
+    return snapshot;
+}
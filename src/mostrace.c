@@ -0,0 +1,314 @@
+// Mos 6502 execution trace recorder
+//
+// Every instruction run through mos_trace_step (and mos_cpu_run while a trace
+// is enabled) is encoded into a small delta record and pushed into a single
+// producer / single consumer ring buffer. A writer thread drains the ring to
+// the file, so the emulator thread never touches the file itself. While
+// tracing, every page loses its write pointer so stores reach mos_cpu_write's
+// slow path, which hands them to the recorder; nothing is paid when tracing
+// is off.
+//
+// The file starts with "M65T" version:u8 variant:u8 (a MOS_Variant), then
+// records. A record starts with
+// a flags byte and, when MOS_TRACE_MORE is set, a second flags byte:
+//
+//   flags  [more] [pc:u16] [a] [x] [y] [sp] [psr] [cycles:u64] [lost:u64]
+//          [opcode operands... [extra_cycles] [count (addr:u16 value)*count]]
+//
+// Registers are the values after the instruction and only present when they
+// changed, pc is the address of the instruction and only present when it does
+// not follow the previous one. Keyframes carry the whole state and no
+// instruction, gaps count the instructions dropped by a full ring. Numbers
+// are little endian. mostracedump prints a trace.
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "./mos.h"
+
+#define MOS_TRACE_DEFAULT_RING        (4u << 20)
+#define MOS_TRACE_KEYFRAME_INTERVAL   4096 // records between keyframes so a reader can resync
+#define MOS_TRACE_MAX_WRITES          16   // stores a single instruction can make
+#define MOS_TRACE_MAX_KEYFRAME        (2 + 2 + 5 + 8 + 8) // flags, pc, registers, cycles, lost
+#define MOS_TRACE_MAX_INSTRUCTION     (2 + 2 + 5 + 3 + 1 + 1 + 3*MOS_TRACE_MAX_WRITES)
+#define MOS_TRACE_MAX_RECORD          (MOS_TRACE_MAX_KEYFRAME + MOS_TRACE_MAX_INSTRUCTION) // keyframe then instruction
+#define MOS_TRACE_WRITER_SLEEP_NS     1000000
+
+struct _mos_trace {
+    // producer side, only touched by the emulator thread
+    uint64_t head_cache; // producer's copy of head
+    uint64_t tail_cache; // last tail seen, refreshed when the ring looks full
+    uint16_t next_pc;    // pc the next record implies
+    uint8_t  racc, regx, regy, sp, psr;
+    uint32_t records;    // since the last keyframe
+    bool     keyframe;   // the next record must be preceded by a keyframe
+    uint64_t lost;       // instructions dropped since the last gap record
+    uint64_t dropped;    // total
+    bool     drop_when_full;
+    uint32_t write_count;
+    uint16_t write_addr[MOS_TRACE_MAX_WRITES];
+    uint8_t  write_data[MOS_TRACE_MAX_WRITES];
+
+    // shared, accessed with __atomic builtins
+    uint64_t head; // bytes published by the producer
+    uint64_t tail; // bytes consumed by the writer
+    bool     stop;
+    bool     failed; // the writer hit an I/O error
+
+    FILE *fp;
+    pthread_t writer;
+    uint8_t *ring;
+    uint32_t ring_mask;
+};
+
+static void *mos_trace_writer_main(void *arg)
+{
+    MOS_Trace *trace = arg;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = MOS_TRACE_WRITER_SLEEP_NS };
+    for (;;) {
+        bool stop = __atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = trace->tail;
+        if (head == tail) {
+            if (stop) break;
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // at most two runs, up to the end of the ring and from its start
+        uint32_t start = tail & trace->ring_mask;
+        uint64_t count = head - tail;
+        uint64_t first = trace->ring_mask + 1 - start;
+        if (first > count) first = count;
+        bool ok = fwrite(trace->ring + start, 1, first, trace->fp) == first;
+        if (ok && count > first) ok = fwrite(trace->ring, 1, count - first, trace->fp) == count - first;
+        if (!ok) __atomic_store_n(&trace->failed, true, __ATOMIC_RELEASE);
+        __atomic_store_n(&trace->tail, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Starts tracing into `file_path`, `ring_size` bytes (a power of two, 0 for the
+// default) are buffered. A full ring makes the cpu wait for the writer, or
+// with `drop_when_full` skip instructions and leave a gap record.
+bool mos_cpu_enable_trace(MOS_Cpu *cpu, const char *file_path, uint32_t ring_size, bool drop_when_full)
+{
+    if (cpu->trace != NULL) return true;
+    if (ring_size == 0) ring_size = MOS_TRACE_DEFAULT_RING;
+    if ((ring_size & (ring_size - 1)) != 0 || ring_size < 2*MOS_TRACE_MAX_RECORD) {
+        fprintf(stderr, "ERROR: trace ring size must be a power of two of at least %d bytes\n", 2*MOS_TRACE_MAX_RECORD);
+        return false;
+    }
+
+    MOS_Trace *trace = calloc(1, sizeof(*trace));
+    if (trace != NULL) trace->ring = malloc(ring_size);
+    if (trace == NULL || trace->ring == NULL) {
+        fprintf(stderr, "ERROR: Memory Allocation for trace Failed\n");
+        free(trace);
+        return false;
+    }
+    trace->ring_mask = ring_size - 1;
+    trace->drop_when_full = drop_when_full;
+    trace->keyframe = true;
+
+    trace->fp = fopen(file_path, "wb");
+    if (trace->fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        free(trace->ring);
+        free(trace);
+        return false;
+    }
+    const uint8_t header[6] = { 'M', '6', '5', 'T', MOS_TRACE_VERSION, cpu->variant };
+    if (fwrite(header, sizeof(header), 1, trace->fp) != 1 ||
+        pthread_create(&trace->writer, NULL, mos_trace_writer_main, trace) != 0) {
+        fprintf(stderr, "ERROR: could not start the trace writer for `%s`\n", file_path);
+        fclose(trace->fp);
+        free(trace->ring);
+        free(trace);
+        return false;
+    }
+
+    cpu->trace = trace;
+    mos_cpu_map_pages(cpu); // drop the write pointers
+    return true;
+}
+
+static uint8_t *mos_trace_keyframe(MOS_Trace *trace, uint8_t *out, const MOS_Cpu *cpu, uint16_t pc, uint64_t cycles);
+static bool mos_trace_reserve(MOS_Trace *trace, uint32_t size);
+static void mos_trace_publish(MOS_Trace *trace, const uint8_t *record, uint32_t size);
+
+// Drains the ring, stops the writer and closes the file, false if anything was lost to I/O errors
+bool mos_trace_close(MOS_Cpu *cpu)
+{
+    MOS_Trace *trace = cpu->trace;
+    if (trace == NULL) return true;
+    if (trace->lost > 0) {
+        // a last gap so the count of dropped instructions adds up
+        uint8_t record[MOS_TRACE_MAX_RECORD];
+        uint32_t size = mos_trace_keyframe(trace, record, cpu, cpu->pc, cpu->cycles) - record;
+        trace->drop_when_full = false;
+        mos_trace_reserve(trace, size);
+        mos_trace_publish(trace, record, size);
+    }
+    __atomic_store_n(&trace->stop, true, __ATOMIC_RELEASE);
+    pthread_join(trace->writer, NULL);
+
+    bool ok = !trace->failed;
+    if (fclose(trace->fp) != 0) ok = false;
+    if (!ok) fprintf(stderr, "ERROR: writing the trace failed, it is incomplete\n");
+    if (trace->dropped > 0) {
+        fprintf(stderr, "WARNING: trace dropped %llu instructions on a full ring\n",
+                (unsigned long long) trace->dropped);
+    }
+    free(trace->ring);
+    free(trace);
+    cpu->trace = NULL;
+    mos_cpu_map_pages(cpu); // give the write pointers back
+    return ok;
+}
+
+// Called by mos_cpu_write for every store while tracing
+void mos_trace_write(MOS_Trace *trace, uint16_t addr, uint8_t data)
+{
+    if (trace->write_count == MOS_TRACE_MAX_WRITES) return;
+    trace->write_addr[trace->write_count] = addr;
+    trace->write_data[trace->write_count] = data;
+    trace->write_count++;
+}
+
+static uint8_t *mos_trace_put(uint8_t *out, uint64_t value, uint32_t bytes)
+{
+    for (uint32_t i = 0; i < bytes; ++i) *out++ = (value >> (8*i)) & 0xFF;
+    return out;
+}
+
+// Reserves `size` bytes of ring, false when the ring is full and records are dropped
+static bool mos_trace_reserve(MOS_Trace *trace, uint32_t size)
+{
+    uint64_t capacity = (uint64_t) trace->ring_mask + 1;
+    while (trace->head_cache + size - trace->tail_cache > capacity) {
+        trace->tail_cache = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+        if (trace->head_cache + size - trace->tail_cache <= capacity) break;
+        if (trace->drop_when_full) return false;
+        sched_yield();
+    }
+    return true;
+}
+
+static void mos_trace_publish(MOS_Trace *trace, const uint8_t *record, uint32_t size)
+{
+    uint32_t start = trace->head_cache & trace->ring_mask;
+    uint32_t first = trace->ring_mask + 1 - start;
+    if (first > size) first = size;
+    memcpy(trace->ring + start, record, first);
+    memcpy(trace->ring, record + first, size - first);
+    trace->head_cache += size;
+    __atomic_store_n(&trace->head, trace->head_cache, __ATOMIC_RELEASE);
+}
+
+// Whole state before the instruction at `pc`, preceded by a gap if instructions were lost
+static uint8_t *mos_trace_keyframe(MOS_Trace *trace, uint8_t *out, const MOS_Cpu *cpu, uint16_t pc, uint64_t cycles)
+{
+    *out++ = MOS_TRACE_PC | MOS_TRACE_A | MOS_TRACE_X | MOS_TRACE_Y | MOS_TRACE_SP | MOS_TRACE_PSR | MOS_TRACE_MORE;
+    *out++ = MOS_TRACE_KEYFRAME | (trace->lost > 0 ? MOS_TRACE_GAP : 0);
+    out = mos_trace_put(out, pc, 2);
+    *out++ = trace->racc = cpu->racc;
+    *out++ = trace->regx = cpu->regx;
+    *out++ = trace->regy = cpu->regy;
+    *out++ = trace->sp   = cpu->sp;
+    *out++ = trace->psr  = mos_cpu_get_psr(cpu);
+    out = mos_trace_put(out, cycles, 8);
+    if (trace->lost > 0) out = mos_trace_put(out, trace->lost, 8);
+    trace->next_pc = pc;
+    return out;
+}
+
+// Executes one instruction like mos_cpu_step and records it
+uint8_t mos_trace_step(MOS_Cpu *cpu)
+{
+    MOS_Trace *trace = cpu->trace;
+    if (trace == NULL) return mos_cpu_step(cpu);
+
+    // the decoder only adds up opcode cycles, resync it after an interrupt
+    if (cpu->cycles >= cpu->next_event) mos_scheduler_fire(cpu);
+    if (cpu->interrupt_pending && mos_cpu_interrupt(cpu)) trace->keyframe = true;
+
+    // operand bytes are read up front, the instruction may overwrite them
+    uint16_t pc = cpu->pc;
+    uint8_t code[3];
+    code[0] = mos_cpu_read(cpu, pc);
+    MOS_OpcodeInfo info = cpu->opcodes[code[0]];
+    uint8_t length = mos_addr_mode_length(info.mode);
+    for (uint8_t i = 1; i < length; ++i) code[i] = mos_cpu_read(cpu, pc + i);
+
+    // a keyframe describes the state before the instruction
+    uint8_t record[MOS_TRACE_MAX_RECORD];
+    uint8_t *out = record;
+    bool keyframe = trace->keyframe || trace->records >= MOS_TRACE_KEYFRAME_INTERVAL;
+    if (keyframe) out = mos_trace_keyframe(trace, out, cpu, pc, cpu->cycles);
+
+    uint64_t cycles = cpu->cycles;
+    trace->write_count = 0;
+    uint8_t opcode = mos_cpu_step(cpu);
+    uint8_t extra = (uint8_t)(cpu->cycles - cycles - info.cycles);
+    uint8_t psr = mos_cpu_get_psr(cpu);
+
+    uint8_t *flags = out++;
+    uint8_t *more = NULL;
+    *flags = 0;
+    if (extra != 0 || trace->write_count > 0) {
+        *flags |= MOS_TRACE_MORE;
+        more = out++;
+        *more = (extra != 0 ? MOS_TRACE_EXTRA_CYCLES : 0) | (trace->write_count > 0 ? MOS_TRACE_WRITES : 0);
+    }
+    if (pc != trace->next_pc) {
+        *flags |= MOS_TRACE_PC;
+        out = mos_trace_put(out, pc, 2);
+    }
+    if (cpu->racc != trace->racc) { *flags |= MOS_TRACE_A;   *out++ = trace->racc = cpu->racc; }
+    if (cpu->regx != trace->regx) { *flags |= MOS_TRACE_X;   *out++ = trace->regx = cpu->regx; }
+    if (cpu->regy != trace->regy) { *flags |= MOS_TRACE_Y;   *out++ = trace->regy = cpu->regy; }
+    if (cpu->sp   != trace->sp)   { *flags |= MOS_TRACE_SP;  *out++ = trace->sp   = cpu->sp; }
+    if (psr       != trace->psr)  { *flags |= MOS_TRACE_PSR; *out++ = trace->psr  = psr; }
+    for (uint8_t i = 0; i < length; ++i) *out++ = code[i];
+    if (extra != 0) *out++ = extra;
+    if (trace->write_count > 0) {
+        *out++ = trace->write_count;
+        for (uint32_t i = 0; i < trace->write_count; ++i) {
+            out = mos_trace_put(out, trace->write_addr[i], 2);
+            *out++ = trace->write_data[i];
+        }
+    }
+    trace->next_pc = pc + length;
+
+    uint32_t size = out - record;
+    if (!mos_trace_reserve(trace, size)) {
+        // the decoder state is now behind, resync with a keyframe once there is room
+        trace->lost++;
+        trace->dropped++;
+        trace->keyframe = true;
+        return opcode;
+    }
+    mos_trace_publish(trace, record, size);
+    if (keyframe) {
+        trace->lost = 0;
+        trace->records = 0;
+        trace->keyframe = false;
+    }
+    trace->records++;
+    return opcode;
+}
+
+// mos_cpu_run while tracing
+uint64_t mos_trace_run(MOS_Cpu *cpu, uint64_t cycles)
+{
+    uint64_t start = cpu->cycles;
+    uint64_t deadline = start + cycles;
+    while (cpu->cycles < deadline && cpu->fault == MOS_FAULT_NONE) {
+        mos_trace_step(cpu);
+    }
+    return cpu->cycles - start;
+}
@@ -0,0 +1,151 @@
+// Mos 6502 Trace Dump
+//
+// Prints a trace written by the recorder in mostrace.c, one instruction per
+// line with the cycle count it started at, its bytes, the disassembly, the
+// registers after it and the stores it made.
+#include <errno.h>
+
+#include "./mos.h"
+
+typedef struct _mos_trace_reader {
+    FILE *fp;
+    bool eof;
+} MOS_TraceReader;
+
+static uint64_t mos_trace_get(MOS_TraceReader *reader, uint32_t bytes)
+{
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < bytes; ++i) {
+        int c = fgetc(reader->fp);
+        if (c == EOF) {
+            reader->eof = true;
+            return 0;
+        }
+        value |= (uint64_t) c << (8*i);
+    }
+    return value;
+}
+
+static void mos_trace_format_operand(char *text, size_t size, MOS_AddressingModes mode, const uint8_t *code, uint16_t pc)
+{
+    uint16_t word = mos_bytes_to_uint16_t(code[2], code[1]);
+    switch (mode) {
+    case IMPL: snprintf(text, size, "%s", "");                                  break;
+    case ACCU: snprintf(text, size, "A");                                       break;
+    case IMME: snprintf(text, size, "#$%02X", code[1]);                         break;
+    case ZP:   snprintf(text, size, "$%02X", code[1]);                          break;
+    case ZPX:  snprintf(text, size, "$%02X,X", code[1]);                        break;
+    case ZPY:  snprintf(text, size, "$%02X,Y", code[1]);                        break;
+    case REL:  snprintf(text, size, "$%04X", (uint16_t)(pc + 2 + (int8_t) code[1])); break;
+    case ABS:  snprintf(text, size, "$%04X", word);                             break;
+    case ABSX: snprintf(text, size, "$%04X,X", word);                           break;
+    case ABSY: snprintf(text, size, "$%04X,Y", word);                           break;
+    case IND:  snprintf(text, size, "($%04X)", word);                           break;
+    case INDX: snprintf(text, size, "($%02X,X)", code[1]);                      break;
+    case INDY: snprintf(text, size, "($%02X),Y", code[1]);                      break;
+    case ZPI:  snprintf(text, size, "($%02X)", code[1]);                        break;
+    case ABXI: snprintf(text, size, "($%04X,X)", word);                         break;
+    default:   snprintf(text, size, "?");                                       break;
+    }
+}
+
+bool mos_trace_dump(const char *file_path, FILE *out)
+{
+    MOS_TraceReader reader = {0};
+    reader.fp = fopen(file_path, "rb");
+    if (reader.fp == NULL) {
+        fprintf(stderr, "ERROR: file `%s` could not be opened because of : %s\n",
+        file_path, strerror(errno));
+        return false;
+    }
+
+    uint8_t header[6];
+    if (fread(header, sizeof(header), 1, reader.fp) != 1 || memcmp(header, "M65T", 4) != 0 ||
+        header[4] != MOS_TRACE_VERSION) {
+        fprintf(stderr, "ERROR: `%s` is not a version %d trace\n", file_path, MOS_TRACE_VERSION);
+        fclose(reader.fp);
+        return false;
+    }
+    if (header[5] >= MOS_VARIANT_COUNT) {
+        fprintf(stderr, "ERROR: `%s` was recorded on an unknown cpu variant %u\n", file_path, header[5]);
+        fclose(reader.fp);
+        return false;
+    }
+    const MOS_OpcodeInfo *opcodes = mos_variant_opcodes(header[5]);
+
+    uint16_t pc = 0;
+    uint8_t racc = 0, regx = 0, regy = 0, sp = 0, psr = 0;
+    uint64_t cycles = 0;
+    bool synced = false;
+    for (;;) {
+        int c = fgetc(reader.fp);
+        if (c == EOF) break;
+        uint8_t flags = c;
+        uint8_t more = (flags & MOS_TRACE_MORE) ? mos_trace_get(&reader, 1) : 0;
+        if (flags & MOS_TRACE_PC)  pc   = mos_trace_get(&reader, 2);
+        if (flags & MOS_TRACE_A)   racc = mos_trace_get(&reader, 1);
+        if (flags & MOS_TRACE_X)   regx = mos_trace_get(&reader, 1);
+        if (flags & MOS_TRACE_Y)   regy = mos_trace_get(&reader, 1);
+        if (flags & MOS_TRACE_SP)  sp   = mos_trace_get(&reader, 1);
+        if (flags & MOS_TRACE_PSR) psr  = mos_trace_get(&reader, 1);
+
+        if (more & MOS_TRACE_KEYFRAME) {
+            cycles = mos_trace_get(&reader, 8);
+            if (more & MOS_TRACE_GAP) {
+                uint64_t lost = mos_trace_get(&reader, 8);
+                fprintf(out, "; %llu instructions lost\n", (unsigned long long) lost);
+            }
+            synced = true;
+            if (reader.eof) break;
+            continue;
+        }
+        if (!synced) {
+            fprintf(stderr, "ERROR: `%s` does not start with a keyframe\n", file_path);
+            break;
+        }
+
+        uint8_t code[3] = {0};
+        code[0] = mos_trace_get(&reader, 1);
+        MOS_OpcodeInfo info = opcodes[code[0]];
+        uint8_t length = mos_addr_mode_length(info.mode);
+        for (uint8_t i = 1; i < length; ++i) code[i] = mos_trace_get(&reader, 1);
+        uint8_t extra = (more & MOS_TRACE_EXTRA_CYCLES) ? mos_trace_get(&reader, 1) : 0;
+        if (reader.eof) break;
+
+        char bytes[16], operand[16];
+        snprintf(bytes, sizeof(bytes), "%02X", code[0]);
+        for (uint8_t i = 1; i < length; ++i) snprintf(bytes + 3*i - 1, sizeof(bytes) - (3*i - 1), " %02X", code[i]);
+        mos_trace_format_operand(operand, sizeof(operand), info.mode, code, pc);
+        fprintf(out, "%10llu  $%04X  %-8s  %-3s %-9s  A=%02X X=%02X Y=%02X SP=%02X P=%02X",
+                (unsigned long long) cycles, pc, bytes, mos_opcode_as_cstr(info.opcode), operand,
+                racc, regx, regy, sp, psr);
+
+        if (more & MOS_TRACE_WRITES) {
+            uint8_t count = mos_trace_get(&reader, 1);
+            for (uint8_t i = 0; i < count && !reader.eof; ++i) {
+                uint16_t addr = mos_trace_get(&reader, 2);
+                uint8_t data = mos_trace_get(&reader, 1);
+                fprintf(out, "  [$%04X]=%02X", addr, data);
+            }
+        }
+        fprintf(out, "\n");
+
+        cycles += info.cycles + extra;
+        pc += length;
+    }
+
+    bool ok = !reader.eof;
+    if (!ok) fprintf(stderr, "ERROR: `%s` ends in the middle of a record\n", file_path);
+    fclose(reader.fp);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "MOS 6502 Trace Dump\n");
+        fprintf(stderr, "USAGE: %s <trace>\n", argv[0]);
+        return 1;
+    }
+    return mos_trace_dump(argv[1], stdout) ? 0 : 1;
+}